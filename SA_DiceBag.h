@@ -6,6 +6,11 @@
 
 #import <Foundation/Foundation.h>
 
+#import "SA_DiceRNG.h"
+#import "SA_DiceRollBuffer.h"
+
+@class SA_DiceEntropyPool;
+
 typedef NS_OPTIONS(NSUInteger, SA_DiceRollingOptions) {
 	SA_DiceRollingExplodingDice = 1 << 1
 };
@@ -14,26 +19,77 @@ typedef NS_OPTIONS(NSUInteger, SA_DiceRollingOptions) {
 #pragma mark SA_DiceBag class declaration
 /****************************************/
 
+/*
+ A dice bag rolls dice, using an SA_DiceRNG as its source of randomness (see
+ SA_DiceRNG.h). By default, each dice bag has its own xoshiro256** generator,
+ seeded from the system entropy source; a dice bag may instead be given an
+ explicit seed (for reproducible rolls), or any other generator.
+
+ A dice bag may also be given a counter-based generator (see SA_DiceRNG.h),
+ whose rolls are a function of its position alone; such a dice bag can report
+ its position (to be logged, say), and skip to any position at once (to roll
+ again exactly the dice that were rolled from there).
+
+ Finally, a dice bag may draw its random words from an entropy pool (see
+ SA_DiceEntropyPool.h), which generates them ahead of time, on a background
+ thread.
+ */
 @interface SA_DiceBag : NSObject
 
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The dice bag’s generator. Callers may use this with the SA_DiceRNG functions
+// directly (e.g., to roll dice into a buffer of their own).
+@property (readonly) SA_DiceRNG *randomNumberGenerator;
+
+// The position of the dice bag’s generator, if it is a counter-based one
+// (otherwise, all zeros).
+@property (readonly) SA_DiceRNGPosition position;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init;
+-(instancetype) initWithSeed:(uint64_t)seed;
+-(instancetype) initWithPosition:(SA_DiceRNGPosition)position;
+-(instancetype) initWithEntropyPool:(SA_DiceEntropyPool *)entropyPool;
+
+// If the given generator is pooled (see SA_DiceEntropyPool.h), the dice bag
+// takes it over (and detaches it from its pool when it is done with it); the
+// caller must not use it further.
+-(instancetype) initWithRandomNumberGenerator:(SA_DiceRNG)randomNumberGenerator NS_DESIGNATED_INITIALIZER;
+
 /****************************/
 #pragma mark - Public methods
 /****************************/
 
 -(NSUInteger) biggestPossibleDieSize;
 
+// Re-seeds the dice bag’s generator (as an xoshiro256** generator) with the
+// given seed. (A pooled generator is first detached from its pool; so is one
+// set to a position, below.)
+-(void) reseedWithSeed:(uint64_t)seed;
+
+// Sets the dice bag’s generator (as a counter-based generator) to the given
+// position. This takes constant time, however far the position is from the
+// current one.
+-(void) seekToPosition:(SA_DiceRNGPosition)position;
+
 // -------------
 // Regular dice.
 // -------------
 
 -(NSUInteger) rollDie:(NSUInteger)dieSize;
 
--(NSArray <NSNumber *> *) rollNumber:(NSUInteger)number
-							  ofDice:(NSUInteger)dieSize;
+-(SA_DiceRollBuffer *) rollNumber:(NSUInteger)number
+						   ofDice:(NSUInteger)dieSize;
 
--(NSArray <NSNumber *> *) rollNumber:(NSUInteger)number
-							  ofDice:(NSUInteger)dieSize
-						 withOptions:(SA_DiceRollingOptions)options;
+-(SA_DiceRollBuffer *) rollNumber:(NSUInteger)number
+						   ofDice:(NSUInteger)dieSize
+					  withOptions:(SA_DiceRollingOptions)options;
 
 // -----------
 // Fudge dice.
@@ -41,6 +97,6 @@ typedef NS_OPTIONS(NSUInteger, SA_DiceRollingOptions) {
 
 -(char) rollFudgeDie;
 
--(NSArray <NSNumber *> *) rollFudgeDice:(NSUInteger)number;
+-(SA_DiceRollBuffer *) rollFudgeDice:(NSUInteger)number;
 
 @end
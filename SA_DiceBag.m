@@ -5,93 +5,148 @@
 //  See LICENSE and README.md for more info.
 
 #import "SA_DiceBag.h"
-#import <GameplayKit/GameplayKit.h>
+
+#import "SA_DiceEntropyPool.h"
 
 /*******************************************/
 #pragma mark SA_DiceBag class implementation
 /*******************************************/
 
 @implementation SA_DiceBag {
-//	GKRandomSource *_randomSource;
+	SA_DiceRNG _rng;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(SA_DiceRNG *) randomNumberGenerator {
+	return &_rng;
+}
 
-	NSMutableDictionary <NSNumber *, GKRandomDistribution *> *_dice;
+-(SA_DiceRNGPosition) position {
+	return SA_DiceRNGGetPosition(&_rng);
 }
 
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
 -(instancetype) init {
-	if (!(self = [super init]))
-		return nil;
+	SA_DiceRNG rng;
+	SA_DiceRNGInitWithSystemEntropy(&rng);
+
+	return [self initWithRandomNumberGenerator:rng];
+}
+
+-(instancetype) initWithSeed:(uint64_t)seed {
+	SA_DiceRNG rng;
+	SA_DiceRNGInitWithSeed(&rng, seed);
+
+	return [self initWithRandomNumberGenerator:rng];
+}
+
+-(instancetype) initWithPosition:(SA_DiceRNGPosition)position {
+	SA_DiceRNG rng;
+	SA_DiceRNGInitWithPosition(&rng, position);
+
+	return [self initWithRandomNumberGenerator:rng];
+}
+
+-(instancetype) initWithEntropyPool:(SA_DiceEntropyPool *)entropyPool {
+	SA_DiceRNG rng;
+	SA_DiceRNGInitWithEntropyPool(&rng, entropyPool);
+
+	return [self initWithRandomNumberGenerator:rng];
+}
 
-//	_randomSource = [GKMersenneTwisterRandomSource new];
+-(instancetype) initWithRandomNumberGenerator:(SA_DiceRNG)randomNumberGenerator {
+	if (!(self = [super init])) {
+		SA_DiceRNGDetachFromEntropyPool(&randomNumberGenerator);
+		return nil;
+	}
 
-	_dice = [NSMutableDictionary dictionary];
+	_rng = randomNumberGenerator;
 
 	return self;
 }
 
+-(void) dealloc {
+	SA_DiceRNGDetachFromEntropyPool(&_rng);
+}
+
 /****************************/
 #pragma mark - Public methods
 /****************************/
 
 -(NSUInteger) biggestPossibleDieSize {
-	return NSUIntegerMax;
+	// Rolls are stored as signed integers (so that Fudge dice, and rolls of
+	// regular dice, can be handled uniformly).
+	return NSIntegerMax;
+}
+
+-(void) reseedWithSeed:(uint64_t)seed {
+	SA_DiceRNGDetachFromEntropyPool(&_rng);
+	SA_DiceRNGInitWithSeed(&_rng, seed);
+}
+
+-(void) seekToPosition:(SA_DiceRNGPosition)position {
+	SA_DiceRNGDetachFromEntropyPool(&_rng);
+	SA_DiceRNGInitWithPosition(&_rng, position);
 }
 
 -(NSUInteger) rollDie:(NSUInteger)dieSize {
-//	return [_randomSource nextIntWithUpperBound:dieSize] + 1;
-	return [[self dieOfSize:dieSize] nextInt];
+	return (NSUInteger) SA_DiceRNGUniform(&_rng, dieSize) + 1;
 }
 
--(NSArray <NSNumber *> *) rollNumber:(NSUInteger)number
-							  ofDice:(NSUInteger)dieSize {
+-(SA_DiceRollBuffer *) rollNumber:(NSUInteger)number
+						   ofDice:(NSUInteger)dieSize {
 	return [self rollNumber:number
 					 ofDice:dieSize
 				withOptions:0];
 }
 
--(NSArray <NSNumber *> *) rollNumber:(NSUInteger)number
-							  ofDice:(NSUInteger)dieSize
-						 withOptions:(SA_DiceRollingOptions)options {
-	NSMutableArray *rollsArray = [NSMutableArray arrayWithCapacity:number];
-
-	for (NSUInteger i = 0; i < number; i++) {
-		NSUInteger dieRoll;
-		do {
-			dieRoll = [self rollDie:dieSize];
-			[rollsArray addObject:@(dieRoll)];
-		} while (   options & SA_DiceRollingExplodingDice
-				 && dieSize > 1
-				 && dieRoll == dieSize);
+-(SA_DiceRollBuffer *) rollNumber:(NSUInteger)number
+						   ofDice:(NSUInteger)dieSize
+					  withOptions:(SA_DiceRollingOptions)options {
+	if (   options & SA_DiceRollingExplodingDice
+		&& dieSize > 1) {
+		// Each exploding die contributes one roll, plus one more for each
+		// time it comes up showing its maximum value; rather than rolling it
+		// again and again, we draw the number of explosions directly, and
+		// keep one compact record per die (see SA_DiceRollBuffer.h).
+		SA_DiceExplodedDie *dice = malloc(MAX(number, 1) * sizeof(SA_DiceExplodedDie));
+		for (NSUInteger i = 0; i < number; i++)
+			dice[i].explosionCount = SA_DiceRNGRollExplodingDie(&_rng, dieSize, &dice[i].finalRoll);
+
+		SA_DiceRollBuffer *buffer = [[SA_DiceRollBuffer alloc] initWithExplodedDice:dice
+																			   count:number
+																			 dieSize:dieSize];
+		free(dice);
+		return buffer;
 	}
 
-	return rollsArray;
-}
+	NSInteger *rolls = malloc(number * sizeof(NSInteger));
+	NSInteger sum = SA_DiceRNGRollDice(&_rng, dieSize, number, rolls);
 
--(char) rollFudgeDie {
-	NSInteger d3roll = [self rollDie:3];
-	return (char) (d3roll - 2);
+	return [[SA_DiceRollBuffer alloc] initByTakingValues:rolls
+												   count:number
+													 sum:sum];
 }
 
--(NSArray <NSNumber *> *) rollFudgeDice:(NSUInteger)number {
-	NSMutableArray *rollsArray = [NSMutableArray arrayWithCapacity:number];
-
-	for (NSUInteger i = 0; i < number; i++) {
-		[rollsArray addObject:@([self rollFudgeDie])];
-	}
-
-	return rollsArray;
+-(char) rollFudgeDie {
+	NSInteger fudgeRoll;
+	SA_DiceRNGRollFudgeDice(&_rng, 1, &fudgeRoll);
+	return (char) fudgeRoll;
 }
 
-/****************************/
-#pragma mark - Helper methods
-/****************************/
-
--(GKRandomDistribution *) dieOfSize:(NSUInteger) dieSize {
-	if (_dice[@(dieSize)] == nil)
-		_dice[@(dieSize)] = [[GKRandomDistribution alloc] initWithRandomSource:[GKMersenneTwisterRandomSource new]
-																   lowestValue:1
-																  highestValue:dieSize];
+-(SA_DiceRollBuffer *) rollFudgeDice:(NSUInteger)number {
+	NSInteger *rolls = malloc(number * sizeof(NSInteger));
+	NSInteger sum = SA_DiceRNGRollFudgeDice(&_rng, number, rolls);
 
-	return _dice[@(dieSize)];
+	return [[SA_DiceRollBuffer alloc] initByTakingValues:rolls
+												   count:number
+													 sum:sum];
 }
 
 @end
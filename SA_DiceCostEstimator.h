@@ -0,0 +1,120 @@
+//
+//  SA_DiceCostEstimator.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceProgram.h"
+
+@class SA_DiceEvaluator;
+
+/*
+ SA_DiceCostEstimator estimates, without rolling any dice, how much work
+ evaluating a die roll expression will take: the number of dice rolled, the
+ number of random words drawn, and the number of rolls recorded (in the
+ machine’s roll storage, and, so, in the result tree) - both in the worst
+ case and on average.
+
+ The estimate follows the expression tree, keeping track of the range and
+ the mean of the result of each sub-expression (so that, e.g., the number of
+ dice rolled by “(1d6)d20” is known to be at most 6, and 3.5 on average).
+ Die counts and die sizes are limited as the evaluator limits them (a roll
+ command whose die count or die size is certain to exceed the limits rolls
+ nothing at all); explosions are limited by maxExplosionCount, which is the
+ limit on the total for the whole expression, and which is therefore added
+ to the worst case once, however many exploding roll commands there are.
+ Random words rejected by Lemire’s method (see SA_DiceRNGUniform()) are not
+ counted; there are very few of them.
+
+ The worst-case cost of an expression is the worst-case number of random
+ words drawn, plus the worst-case number of rolls recorded. SA_DiceEvaluator
+ checks this against its maxCost limit before it rolls anything (see the
+ maxCost property of SA_DiceEvaluator), so that no single expression can
+ take more than a bounded amount of work, whatever the input.
+
+ An estimator may be used from multiple threads at once (as long as its
+ properties are not modified meanwhile).
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef struct {
+	// The number of dice rolled (not counting explosions).
+	double diceRolled;
+
+	// The number of random words drawn (including one for each explosion).
+	double randomWords;
+
+	// The number of rolls recorded (in the result tree, or for a ‘keep’
+	// modifier).
+	double rollsRecorded;
+} SA_DiceCostMeasures;
+
+typedef struct {
+	SA_DiceCostMeasures worstCase;
+	SA_DiceCostMeasures expected;
+} SA_DiceCost;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Returns the estimated cost of evaluating the given node of the given nodes
+// (see SA_DiceExpressionTree.h), with the limits and the sumsOnly mode of the
+// given environment (whose other fields are not used).
+SA_DiceCost SA_DiceCostOfNode(const SA_DiceExpressionNode *nodes,
+							  NSUInteger node,
+							  const SA_DiceProgramEnvironment *environment);
+
+// The cost that is checked against a limit: the number of random words
+// drawn, plus the number of rolls recorded.
+NS_INLINE double SA_DiceCostMeasuresTotal(SA_DiceCostMeasures measures) {
+	return measures.randomWords + measures.rollsRecorded;
+}
+
+/****************************************************/
+#pragma mark - SA_DiceCostEstimator class declaration
+/****************************************************/
+
+@interface SA_DiceCostEstimator : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The limits and the mode to estimate with (see SA_DiceEvaluator). The
+// defaults are those of a new SA_DiceEvaluator.
+@property NSUInteger maxDieCount;
+@property NSUInteger maxDieSize;
+@property NSUInteger maxExplosionCount;
+@property BOOL sumsOnly;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init;
+
+// Creates an estimator with the same limits and mode as the given evaluator.
+-(instancetype) initWithEvaluator:(SA_DiceEvaluator *)evaluator;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Returns the estimated cost of evaluating the given expression. (An
+// expression that is nil, or erroneous to begin with, costs nothing.)
+-(SA_DiceCost) costOfExpression:(SA_DiceExpression *)expression;
+
+// Returns YES if the worst-case cost of evaluating the given expression is
+// no greater than the given limit.
+-(BOOL) isExpression:(SA_DiceExpression *)expression
+		withinBudget:(NSUInteger)maxCost;
+
+@end
@@ -0,0 +1,409 @@
+//
+//  SA_DiceCostEstimator.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceCostEstimator.h"
+
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceSumSampler.h"
+
+#import <math.h>
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// What is known about the result of a sub-expression: the range and the mean
+// of its value; the number of rolls it generates (for roll commands, to which
+// a ‘keep’ modifier may be applied); whether it involves exploding dice (and
+// whether their rolls are stored individually); and the cost of evaluating
+// it. A sub-expression that is certain to be erroneous has no value (and
+// whatever it contains is not evaluated). The worst-case number of rolls does
+// not count explosions (see SA_DiceCostOfNode()).
+typedef struct {
+	BOOL fails;
+
+	double lowest;
+	double highest;
+	double mean;
+
+	double worstCaseRollCount;
+	double expectedRollCount;
+
+	BOOL explodes;
+	BOOL explosionsRecorded;
+
+	SA_DiceCost cost;
+} SA_DiceCostInfo;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Values outside this range cannot be results (evaluation fails with an
+// overflow error instead); clamping to it also keeps the arithmetic finite.
+NS_INLINE double SA_DiceCostClampValue(double value) {
+	return MIN(MAX(value, (double) NSIntegerMin), (double) NSIntegerMax);
+}
+
+NS_INLINE SA_DiceCostInfo SA_DiceCostInfoPoint(double value) {
+	return (SA_DiceCostInfo) { .lowest = value, .highest = value, .mean = value };
+}
+
+NS_INLINE void SA_DiceCostMeasuresAdd(SA_DiceCostMeasures *accumulator,
+									  SA_DiceCostMeasures measures) {
+	accumulator->diceRolled += measures.diceRolled;
+	accumulator->randomWords += measures.randomWords;
+	accumulator->rollsRecorded += measures.rollsRecorded;
+}
+
+// Adds the cost (and the facts about exploding dice) of a sub-expression to
+// that of its parent.
+NS_INLINE void SA_DiceCostInfoAddSubexpression(SA_DiceCostInfo *info,
+											   const SA_DiceCostInfo *subexpression) {
+	SA_DiceCostMeasuresAdd(&info->cost.worstCase, subexpression->cost.worstCase);
+	SA_DiceCostMeasuresAdd(&info->cost.expected, subexpression->cost.expected);
+	info->explodes = info->explodes || subexpression->explodes;
+	info->explosionsRecorded = info->explosionsRecorded || subexpression->explosionsRecorded;
+}
+
+// The number of random words drawn for the sum of the given (possibly
+// fractional) number of dice of the given (possibly fractional) size (both of
+// which are no greater than NSIntegerMax).
+static double SA_DiceCostSamplerWordCount(double dieSize,
+										  double count) {
+	return (double) SA_DiceSumSamplerWordCount((NSUInteger) round(dieSize), (NSUInteger) round(count));
+}
+
+// Returns what is known about the given sub-expression, from the given
+// results of estimating the nodes. (Nil sub-expressions have the value 0.)
+NS_INLINE SA_DiceCostInfo SA_DiceCostInfoOfOperand(const SA_DiceCostInfo *infos,
+												   NSUInteger index) {
+	return ((index == NSNotFound)
+			? SA_DiceCostInfoPoint(0.0)
+			: infos[index]);
+}
+
+static SA_DiceCostInfo SA_DiceCostOfSubexpression(const SA_DiceExpressionNode *nodes,
+												  NSUInteger index,
+												  const SA_DiceCostInfo *infos,
+												  const SA_DiceProgramEnvironment *environment,
+												  BOOL rollsNeeded);
+
+static SA_DiceCostInfo SA_DiceCostOfOperation(const SA_DiceExpressionNode *node,
+											  const SA_DiceCostInfo *infos) {
+	SA_DiceCostInfo left = SA_DiceCostInfoOfOperand(infos, node->leftOperand);
+	SA_DiceCostInfo right = SA_DiceCostInfoOfOperand(infos, node->rightOperand);
+
+	SA_DiceCostInfo info = { .fails = (left.fails || right.fails) };
+	SA_DiceCostInfoAddSubexpression(&info, &left);
+	SA_DiceCostInfoAddSubexpression(&info, &right);
+	if (info.fails)
+		return info;
+
+	switch (node->operator) {
+		case SA_DiceExpressionOperator_MINUS: {
+			info.lowest = left.lowest - right.highest;
+			info.highest = left.highest - right.lowest;
+			info.mean = left.mean - right.mean;
+			break;
+		}
+		case SA_DiceExpressionOperator_PLUS: {
+			info.lowest = left.lowest + right.lowest;
+			info.highest = left.highest + right.highest;
+			info.mean = left.mean + right.mean;
+			break;
+		}
+		case SA_DiceExpressionOperator_TIMES: {
+			double products[] = {
+				left.lowest * right.lowest,
+				left.lowest * right.highest,
+				left.highest * right.lowest,
+				left.highest * right.highest
+			};
+			info.lowest = MIN(MIN(products[0], products[1]), MIN(products[2], products[3]));
+			info.highest = MAX(MAX(products[0], products[1]), MAX(products[2], products[3]));
+			info.mean = left.mean * right.mean;
+			break;
+		}
+		default: {
+			info.fails = YES;
+			return info;
+		}
+	}
+
+	info.lowest = SA_DiceCostClampValue(info.lowest);
+	info.highest = SA_DiceCostClampValue(info.highest);
+	info.mean = MIN(MAX(info.mean, info.lowest), info.highest);
+
+	return info;
+}
+
+static SA_DiceCostInfo SA_DiceCostOfRollCommand(const SA_DiceExpressionNode *node,
+												const SA_DiceCostInfo *infos,
+												const SA_DiceProgramEnvironment *environment,
+												BOOL rollsNeeded) {
+	if (   node->rollCommand != SA_DiceExpressionRollCommand_SUM
+		&& node->rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING)
+		return (SA_DiceCostInfo) { .fails = YES };
+
+	// The die size of Fudge dice is not evaluated (a Fudge die is a d3,
+	// relabeled as −1, 0, and 1).
+	BOOL fudge = (node->dieType != SA_DiceExpressionDice_STANDARD);
+	SA_DiceCostInfo dieCount = SA_DiceCostInfoOfOperand(infos, node->dieCount);
+	SA_DiceCostInfo dieSize = (fudge
+							   ? SA_DiceCostInfoPoint(3.0)
+							   : SA_DiceCostInfoOfOperand(infos, node->dieSize));
+
+	SA_DiceCostInfo info = { .fails = (dieCount.fails || dieSize.fails) };
+	SA_DiceCostInfoAddSubexpression(&info, &dieCount);
+	SA_DiceCostInfoAddSubexpression(&info, &dieSize);
+	if (info.fails)
+		return info;
+
+	// Die counts and die sizes outside the limits make the roll command
+	// fail; if all possible values are outside them, nothing is rolled.
+	double lowestCount = MAX(dieCount.lowest, 0.0);
+	double highestCount = MIN(dieCount.highest, (double) environment->maxDieCount);
+	double lowestSize = MAX(dieSize.lowest, 1.0);
+	double highestSize = (fudge ? 3.0 : MIN(dieSize.highest, (double) environment->maxDieSize));
+	if (   lowestCount > highestCount
+		|| lowestSize > highestSize) {
+		info.fails = YES;
+		return info;
+	}
+	double count = MIN(MAX(dieCount.mean, lowestCount), highestCount);
+	double size = MIN(MAX(dieSize.mean, lowestSize), highestSize);
+
+	// The rolls are stored individually if a ‘keep’ modifier needs them;
+	// otherwise, unless only sums are asked for, one record is stored per die
+	// (see SA_DiceProgram.m).
+	BOOL rollsStored = (rollsNeeded || !environment->sumsOnly);
+	SA_DiceCostMeasures worstCase = { .diceRolled = highestCount };
+	SA_DiceCostMeasures expected = { .diceRolled = count };
+
+	if (   node->rollCommand == SA_DiceExpressionRollCommand_SUM_EXPLODING
+		&& !fudge
+		&& highestSize > 1.0) {
+		// Each die takes a word for each of its rolls; each explosion of a
+		// die of size s has probability 1/s, so a die explodes 1/(s − 1)
+		// times on average. (The worst-case explosions are added once, for
+		// the whole expression; see SA_DiceCostOfNode().)
+		double explosionCount = ((size > 1.0)
+								 ? MIN(count / (size - 1.0), (double) environment->maxExplosionCount)
+								 : 0.0);
+		double meanPerDie = ((size > 1.0)
+							  ? (size * (size + 1.0)) / (2.0 * (size - 1.0))
+							  : size);
+
+		worstCase.randomWords = highestCount;
+		expected.randomWords = count + explosionCount;
+		if (rollsStored) {
+			worstCase.rollsRecorded = highestCount;
+			expected.rollsRecorded = count + (rollsNeeded ? explosionCount : 0.0);
+		}
+
+		info.lowest = lowestCount;
+		info.highest = SA_DiceCostClampValue((highestCount + (double) environment->maxExplosionCount) * highestSize);
+		info.mean = MIN(count * meanPerDie, info.highest);
+		info.worstCaseRollCount = highestCount;
+		info.expectedRollCount = count + explosionCount;
+		info.explodes = YES;
+		info.explosionsRecorded = info.explosionsRecorded || rollsNeeded;
+	} else {
+		if (!rollsStored) {
+			worstCase.randomWords = SA_DiceCostSamplerWordCount(highestSize, highestCount);
+			expected.randomWords = SA_DiceCostSamplerWordCount(size, count);
+		} else {
+			worstCase.randomWords = highestCount;
+			worstCase.rollsRecorded = highestCount;
+			expected.randomWords = count;
+			expected.rollsRecorded = count;
+		}
+
+		if (fudge) {
+			info.lowest = -highestCount;
+			info.highest = highestCount;
+			info.mean = 0.0;
+		} else {
+			info.lowest = lowestCount;
+			info.highest = highestCount * highestSize;
+			info.mean = count * (size + 1.0) / 2.0;
+		}
+		info.worstCaseRollCount = highestCount;
+		info.expectedRollCount = count;
+	}
+
+	SA_DiceCostMeasuresAdd(&info.cost.worstCase, worstCase);
+	SA_DiceCostMeasuresAdd(&info.cost.expected, expected);
+
+	return info;
+}
+
+static SA_DiceCostInfo SA_DiceCostOfRollModifier(const SA_DiceExpressionNode *nodes,
+												 const SA_DiceExpressionNode *node,
+												 const SA_DiceCostInfo *infos,
+												 const SA_DiceProgramEnvironment *environment) {
+	if (   node->rollModifier != SA_DiceExpressionRollModifier_KEEP_HIGHEST
+		&& node->rollModifier != SA_DiceExpressionRollModifier_KEEP_LOWEST)
+		return (SA_DiceCostInfo) { .fails = YES };
+
+	// The ‘keep’ modifiers can only be applied to roll commands.
+	const SA_DiceExpressionNode *rollCommand = ((node->leftOperand != NSNotFound)
+												? &nodes[node->leftOperand]
+												: NULL);
+	if (   rollCommand == NULL
+		|| rollCommand->type != SA_DiceExpressionTerm_ROLL_COMMAND
+		|| (   rollCommand->rollCommand != SA_DiceExpressionRollCommand_SUM
+			&& rollCommand->rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING))
+		return (SA_DiceCostInfo) { .fails = YES };
+
+	// The rolls to keep from are stored individually; so the roll command is
+	// estimated again, as such. (This goes no deeper: its sub-expressions’
+	// estimates do not depend on it.)
+	SA_DiceCostInfo rolls = SA_DiceCostOfSubexpression(nodes, node->leftOperand, infos, environment, YES);
+	SA_DiceCostInfo keepCount = SA_DiceCostInfoOfOperand(infos, node->rightOperand);
+
+	SA_DiceCostInfo info = { .fails = (rolls.fails || keepCount.fails) };
+	SA_DiceCostInfoAddSubexpression(&info, &rolls);
+	SA_DiceCostInfoAddSubexpression(&info, &keepCount);
+	if (info.fails)
+		return info;
+
+	// The rolls are recorded again, in keep order. (If the keep count is
+	// certain to be negative, they are not.)
+	if (keepCount.highest >= 0.0) {
+		info.cost.worstCase.rollsRecorded += rolls.worstCaseRollCount;
+		info.cost.expected.rollsRecorded += rolls.expectedRollCount;
+	}
+
+	// The kept rolls are some of the rolls; their sum is between 0 (for no
+	// rolls kept) and the sum of all the rolls, or thereabouts.
+	double keptFraction = ((rolls.expectedRollCount > 0.0)
+						   ? MIN(MAX(keepCount.mean / rolls.expectedRollCount, 0.0), 1.0)
+						   : 0.0);
+	info.lowest = MIN(rolls.lowest, 0.0);
+	info.highest = MAX(rolls.highest, 0.0);
+	info.mean = rolls.mean * keptFraction;
+
+	return info;
+}
+
+// Estimates the given node, from the estimates of its sub-expressions (which
+// must already be in ‘infos’).
+static SA_DiceCostInfo SA_DiceCostOfSubexpression(const SA_DiceExpressionNode *nodes,
+												  NSUInteger index,
+												  const SA_DiceCostInfo *infos,
+												  const SA_DiceProgramEnvironment *environment,
+												  BOOL rollsNeeded) {
+	const SA_DiceExpressionNode *node = &nodes[index];
+
+	// An expression that is erroneous to begin with is not evaluated.
+	if (node->errorBitMask != 0)
+		return (SA_DiceCostInfo) { .fails = YES };
+
+	switch (node->type) {
+		case SA_DiceExpressionTerm_OPERATION:
+			return SA_DiceCostOfOperation(node, infos);
+		case SA_DiceExpressionTerm_ROLL_COMMAND:
+			return SA_DiceCostOfRollCommand(node, infos, environment, rollsNeeded);
+		case SA_DiceExpressionTerm_ROLL_MODIFIER:
+			return SA_DiceCostOfRollModifier(nodes, node, infos, environment);
+		case SA_DiceExpressionTerm_VALUE:
+		default:
+			return SA_DiceCostInfoPoint(node->hasValue ? (double) node->value : 0.0);
+	}
+}
+
+SA_DiceCost SA_DiceCostOfNode(const SA_DiceExpressionNode *nodes,
+							  NSUInteger node,
+							  const SA_DiceProgramEnvironment *environment) {
+	if (node == NSNotFound)
+		return (SA_DiceCost) { 0 };
+
+	// Nodes come after their sub-expressions, so the nodes up to the given
+	// one are estimated in order of index, each from the estimates of its
+	// sub-expressions, without recursing (a tree may be as deep as it has
+	// nodes). Nodes that are not evaluated are estimated too, but their
+	// estimates are never used.
+	SA_DiceCostInfo *infos = malloc((node + 1) * sizeof(SA_DiceCostInfo));
+	for (NSUInteger i = 0; i <= node; i++)
+		infos[i] = SA_DiceCostOfSubexpression(nodes, i, infos, environment, NO);
+	SA_DiceCostInfo info = infos[node];
+	free(infos);
+
+	// In the worst case, dice explode as many times as they may, each time
+	// taking a word; the rolls of each explosion are also recorded, if they
+	// are stored individually, and then recorded again, in keep order.
+	if (info.explodes) {
+		double maxExplosionCount = (double) environment->maxExplosionCount;
+		info.cost.worstCase.randomWords += maxExplosionCount;
+		if (info.explosionsRecorded)
+			info.cost.worstCase.rollsRecorded += 2.0 * maxExplosionCount;
+	}
+
+	return info.cost;
+}
+
+/*******************************************************/
+#pragma mark - SA_DiceCostEstimator class implementation
+/*******************************************************/
+
+@implementation SA_DiceCostEstimator
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithEvaluator:[SA_DiceEvaluator new]];
+}
+
+-(instancetype) initWithEvaluator:(SA_DiceEvaluator *)evaluator {
+	if (!(self = [super init]))
+		return nil;
+
+	_maxDieCount = evaluator.maxDieCount;
+	_maxDieSize = evaluator.maxDieSize;
+	_maxExplosionCount = evaluator.maxExplosionCount;
+	_sumsOnly = evaluator.sumsOnly;
+
+	return self;
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceCost) costOfExpression:(SA_DiceExpression *)expression {
+	if (expression == nil)
+		return (SA_DiceCost) { 0 };
+
+	// An unmodified view of a tree is estimated from the tree itself; any
+	// other expression is first flattened into a tree of its own.
+	SA_DiceExpressionTree *tree = expression.tree;
+	NSUInteger node = expression.treeNode;
+	if (tree == nil) {
+		tree = [SA_DiceExpressionTree treeWithExpression:expression];
+		node = tree.rootNode;
+	}
+
+	SA_DiceProgramEnvironment environment = {
+		.maxDieCount = _maxDieCount,
+		.maxDieSize = _maxDieSize,
+		.maxExplosionCount = _maxExplosionCount,
+		.sumsOnly = _sumsOnly,
+		.maxCost = NSUIntegerMax
+	};
+	return SA_DiceCostOfNode(tree.nodes, node, &environment);
+}
+
+-(BOOL) isExpression:(SA_DiceExpression *)expression
+		withinBudget:(NSUInteger)maxCost {
+	SA_DiceCost cost = [self costOfExpression:expression];
+	return (SA_DiceCostMeasuresTotal(cost.worstCase) <= (double) maxCost);
+}
+
+@end
@@ -0,0 +1,90 @@
+//
+//  SA_DiceDistribution.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+/*
+ An SA_DiceDistribution is the exact probability distribution of the result
+ of a die roll expression (see SA_DiceDistributionCalculator.h): the
+ probability of each possible result, and the probability that evaluating
+ the expression fails (i.e., that the evaluator reports errors).
+
+ All the statistics (minimum, maximum, mean, percentiles, etc.) describe the
+ result given that evaluation succeeds. (If evaluation always fails, they
+ are all 0.)
+
+ Distributions are immutable, and may be shared between threads.
+ */
+
+/*************************************************/
+#pragma mark SA_DiceDistribution class declaration
+/*************************************************/
+
+@interface SA_DiceDistribution : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The smallest and largest possible results.
+@property (readonly) NSInteger minimum;
+@property (readonly) NSInteger maximum;
+
+@property (readonly) double mean;
+@property (readonly) double variance;
+@property (readonly) double standardDeviation;
+
+// The probability that evaluation fails, and every error that it may fail
+// with.
+@property (readonly) double errorProbability;
+@property (readonly) SA_DiceExpressionError possibleErrors;
+
+// The probability of outcomes which the distribution does not account for:
+// exploding dice are followed only to a limited depth (see
+// SA_DiceDistributionCalculator), and the (very unlikely) outcomes in which
+// some die explodes more times than that are omitted.
+@property (readonly) double truncatedProbability;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates a distribution from the given probabilities (the probability of
+// each result from ‘minimum’ up; they need not sum to 1, but their sum, plus
+// the error probability, must be no more than 1). The probabilities are
+// copied.
+-(instancetype) initWithMinimum:(NSInteger)minimum
+				  probabilities:(const double *)probabilities
+						  count:(NSUInteger)count
+			   errorProbability:(double)errorProbability
+				 possibleErrors:(SA_DiceExpressionError)possibleErrors;
+
+// As above, but takes ownership of the given (malloc’d) probabilities buffer,
+// instead of copying it.
+-(instancetype) initByTakingProbabilities:(double *)probabilities
+									count:(NSUInteger)count
+								  minimum:(NSInteger)minimum
+						 errorProbability:(double)errorProbability
+						   possibleErrors:(SA_DiceExpressionError)possibleErrors NS_DESIGNATED_INITIALIZER;
+
+-(instancetype) init NS_UNAVAILABLE;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// The probability of the given result, and of a result no less than the
+// given value (given that evaluation succeeds).
+-(double) probabilityOfValue:(NSInteger)value;
+-(double) probabilityOfValueAtLeast:(NSInteger)value;
+
+// The smallest result which is at least as large as the given fraction
+// (between 0 and 1) of all results; e.g., 0.5 gives the median.
+-(NSInteger) percentile:(double)fraction;
+
+@end
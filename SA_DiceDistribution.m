@@ -0,0 +1,191 @@
+//
+//  SA_DiceDistribution.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceDistribution.h"
+
+/******************************************************/
+#pragma mark - SA_DiceDistribution class implementation
+/******************************************************/
+
+@implementation SA_DiceDistribution {
+	NSInteger _minimum;
+
+	// The (normalized) probability of each result from the minimum up, and
+	// the probability of a result no greater than each.
+	double *_probabilities;
+	double *_cumulativeProbabilities;
+	NSUInteger _count;
+
+	double _mean;
+	double _variance;
+	double _errorProbability;
+	double _truncatedProbability;
+	SA_DiceExpressionError _possibleErrors;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(NSInteger) minimum {
+	return _minimum;
+}
+
+-(NSInteger) maximum {
+	return (_count > 0) ? (_minimum + (NSInteger) (_count - 1)) : 0;
+}
+
+-(double) mean {
+	return _mean;
+}
+
+-(double) variance {
+	return _variance;
+}
+
+-(double) standardDeviation {
+	return sqrt(_variance);
+}
+
+-(double) errorProbability {
+	return _errorProbability;
+}
+
+-(SA_DiceExpressionError) possibleErrors {
+	return _possibleErrors;
+}
+
+-(double) truncatedProbability {
+	return _truncatedProbability;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) initWithMinimum:(NSInteger)minimum
+				  probabilities:(const double *)probabilities
+						  count:(NSUInteger)count
+			   errorProbability:(double)errorProbability
+				 possibleErrors:(SA_DiceExpressionError)possibleErrors {
+	double *probabilitiesCopy = malloc(MAX(count, 1) * sizeof(double));
+	if (count > 0)
+		memcpy(probabilitiesCopy, probabilities, count * sizeof(double));
+
+	return [self initByTakingProbabilities:probabilitiesCopy
+									 count:count
+								   minimum:minimum
+						  errorProbability:errorProbability
+							possibleErrors:possibleErrors];
+}
+
+-(instancetype) initByTakingProbabilities:(double *)probabilities
+									count:(NSUInteger)count
+								  minimum:(NSInteger)minimum
+						 errorProbability:(double)errorProbability
+						   possibleErrors:(SA_DiceExpressionError)possibleErrors {
+	if (!(self = [super init])) {
+		free(probabilities);
+		return nil;
+	}
+
+	// Drop impossible results from either end (so that the minimum and
+	// maximum are the smallest and largest possible results).
+	NSUInteger first = 0;
+	while (first < count && probabilities[first] <= 0.0)
+		first++;
+	while (count > first && probabilities[count - 1] <= 0.0)
+		count--;
+	count -= first;
+	if (first > 0)
+		memmove(probabilities, probabilities + first, count * sizeof(double));
+
+	_probabilities = probabilities;
+	_count = count;
+	_minimum = (count > 0) ? (minimum + (NSInteger) first) : 0;
+
+	double validProbability = 0.0;
+	for (NSUInteger i = 0; i < count; i++) {
+		if (probabilities[i] < 0.0)
+			probabilities[i] = 0.0;
+		validProbability += probabilities[i];
+	}
+
+	_errorProbability = MIN(MAX(errorProbability, 0.0), 1.0);
+	_truncatedProbability = MAX(1.0 - validProbability - _errorProbability, 0.0);
+	_possibleErrors = possibleErrors;
+
+	// Statistics are computed relative to the minimum, so that large offsets
+	// do not cost precision.
+	_cumulativeProbabilities = malloc(MAX(count, 1) * sizeof(double));
+	double cumulativeProbability = 0.0;
+	double offsetMean = 0.0;
+	for (NSUInteger i = 0; i < count; i++) {
+		probabilities[i] /= validProbability;
+		cumulativeProbability += probabilities[i];
+		_cumulativeProbabilities[i] = cumulativeProbability;
+		offsetMean += probabilities[i] * (double) i;
+	}
+	double variance = 0.0;
+	for (NSUInteger i = 0; i < count; i++)
+		variance += probabilities[i] * ((double) i - offsetMean) * ((double) i - offsetMean);
+
+	_mean = (count > 0) ? ((double) _minimum + offsetMean) : 0.0;
+	_variance = variance;
+
+	return self;
+}
+
+-(void) dealloc {
+	free(_probabilities);
+	free(_cumulativeProbabilities);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(double) probabilityOfValue:(NSInteger)value {
+	if (   _count == 0
+		|| value < _minimum
+		|| value > self.maximum)
+		return 0.0;
+
+	return _probabilities[(NSUInteger) (value - _minimum)];
+}
+
+-(double) probabilityOfValueAtLeast:(NSInteger)value {
+	if (   _count == 0
+		|| value > self.maximum)
+		return 0.0;
+	if (value <= _minimum)
+		return 1.0;
+
+	return MAX(1.0 - _cumulativeProbabilities[(NSUInteger) (value - _minimum) - 1], 0.0);
+}
+
+-(NSInteger) percentile:(double)fraction {
+	if (_count == 0)
+		return 0;
+
+	// Binary search for the first result whose cumulative probability
+	// reaches the given fraction. (Rounding may leave the last cumulative
+	// probability slightly short of 1, so the search is bounded.)
+	NSUInteger low = 0;
+	NSUInteger high = _count - 1;
+	while (low < high) {
+		NSUInteger middle = low + (high - low) / 2;
+		if (_cumulativeProbabilities[middle] < fraction) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return _minimum + (NSInteger) low;
+}
+
+@end
@@ -0,0 +1,85 @@
+//
+//  SA_DiceDistributionCalculator.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+@class SA_DiceDistribution;
+@class SA_DiceEvaluator;
+
+/*
+ SA_DiceDistributionCalculator computes the exact probability distribution
+ of the result of a die roll expression - without rolling any dice - taking
+ into account everything SA_DiceEvaluator would do when evaluating it
+ (including its errors, and its limits on die count and die size).
+
+ Sums of dice are computed by convolution (using the fast Fourier transform,
+ for large distributions; results so computed are accurate to about 10^-15,
+ so probabilities smaller than that are only approximate). ‘Keep highest’
+ and ‘keep lowest’ are computed from the distributions of order statistics.
+ Die counts, die sizes, and keep counts may themselves involve dice (as in
+ “5d6d10”), and are computed by conditioning on each of their possible
+ values. Exploding dice are followed to a limited depth (see the
+ explosionDepth property, below); the probability of outcomes beyond that is
+ reported as the distribution’s truncatedProbability.
+
+ Some expressions have distributions too large or too costly to compute
+ (e.g., the product of two sums of many large dice); for these, nil is
+ returned. The cost limits may be adjusted (see below).
+
+ A calculator may be used from multiple threads at once (as long as its
+ properties are not modified meanwhile).
+ */
+
+/***********************************************************/
+#pragma mark SA_DiceDistributionCalculator class declaration
+/***********************************************************/
+
+@interface SA_DiceDistributionCalculator : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The largest die count and die size allowed (see SA_DiceEvaluator); rolls
+// that exceed them are counted as errors, just as the evaluator would report
+// them. The defaults are those of a new SA_DiceEvaluator.
+@property NSUInteger maxDieCount;
+@property NSUInteger maxDieSize;
+
+// The number of times each exploding die is followed as it explodes. The
+// default is 16. (The evaluator’s limit on the total number of explosions -
+// see the maxExplosionCount property of SA_DiceEvaluator - is not modeled;
+// with its default value, the difference is negligible.)
+@property NSUInteger explosionDepth;
+
+// The largest number of distinct results any distribution (including
+// intermediate ones) may have. The default is 2^20.
+@property NSUInteger maxValueCount;
+
+// The largest number of (approximate) arithmetic operations a single
+// computation may take. The default is 2^30.
+@property NSUInteger maxOperationCount;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init;
+
+// Creates a calculator with the same limits as the given evaluator.
+-(instancetype) initWithEvaluator:(SA_DiceEvaluator *)evaluator;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Returns the distribution of the result of evaluating the given expression
+// (or nil, if computing it would exceed the cost limits).
+-(SA_DiceDistribution *) distributionOfExpression:(SA_DiceExpression *)expression;
+
+@end
@@ -0,0 +1,1009 @@
+//
+//  SA_DiceDistributionCalculator.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceDistributionCalculator.h"
+
+#import "SA_DiceDistribution.h"
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceProgram.h"
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+#define DEFAULT_EXPLOSION_DEPTH			16
+#define DEFAULT_MAX_VALUE_COUNT			(1 << 20)
+#define DEFAULT_MAX_OPERATION_COUNT		(1 << 30)
+
+// Convolutions smaller than this (in multiplications) are done directly;
+// larger ones (where both operands are longer than the minimum) use the FFT.
+#define FFT_THRESHOLD_PRODUCT			(1 << 15)
+#define FFT_THRESHOLD_MINIMUM_LENGTH	32
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+/*
+ A probability mass function: the probability of each result from the
+ minimum up (these need not sum to 1), plus the probability of failure (and
+ the errors it may involve). The probabilities missing from the total (i.e.,
+ 1, less the sum of the masses and the error mass) are those of outcomes not
+ followed (see ‘explosionDepth’).
+ */
+typedef struct {
+	NSInteger minimum;
+	NSUInteger count;
+	double *masses;
+
+	double errorMass;
+	SA_DiceExpressionError errors;
+} SA_DicePMF;
+
+// The limits of a single computation, and its remaining budget.
+typedef struct {
+	NSUInteger maxDieCount;
+	NSUInteger maxDieSize;
+	NSUInteger explosionDepth;
+	NSUInteger maxValueCount;
+	double remainingOperations;
+} SA_DiceDistributionContext;
+
+/****************************************/
+#pragma mark - Probability mass functions
+/****************************************/
+
+static void SA_DicePMFFree(SA_DicePMF *pmf) {
+	free(pmf->masses);
+	*pmf = (SA_DicePMF) { 0 };
+}
+
+// Accounts for the given number of operations; returns NO if the budget has
+// been exceeded.
+NS_INLINE BOOL SA_DiceDistributionCharge(SA_DiceDistributionContext *context,
+										 double operationCount) {
+	context->remainingOperations -= operationCount;
+	return (context->remainingOperations >= 0.0);
+}
+
+// Allocates (zeroed) masses for the given number of results (given as a
+// double, so that ranges too large to represent are caught, not wrapped);
+// returns NO if that is more than allowed.
+static BOOL SA_DicePMFAllocate(SA_DicePMF *pmf,
+							   NSInteger minimum,
+							   double count,
+							   SA_DiceDistributionContext *context) {
+	if (   count < 1.0
+		|| count > (double) context->maxValueCount
+		|| !SA_DiceDistributionCharge(context, count))
+		return NO;
+
+	pmf->minimum = minimum;
+	pmf->count = (NSUInteger) count;
+	pmf->masses = calloc(pmf->count, sizeof(double));
+
+	return YES;
+}
+
+static SA_DicePMF SA_DicePMFPoint(NSInteger value) {
+	SA_DicePMF pmf = { .minimum = value, .count = 1 };
+	pmf.masses = malloc(sizeof(double));
+	pmf.masses[0] = 1.0;
+
+	return pmf;
+}
+
+static SA_DicePMF SA_DicePMFFailure(SA_DiceExpressionError errors) {
+	return (SA_DicePMF) { .errorMass = 1.0, .errors = errors };
+}
+
+NS_INLINE NSInteger SA_DicePMFMaximum(const SA_DicePMF *pmf) {
+	return pmf->minimum + (NSInteger) (pmf->count - 1);
+}
+
+// Adds the given distribution’s masses, times the given weight, to the
+// accumulator (which grows to fit, as needed).
+static BOOL SA_DicePMFAddScaled(SA_DicePMF *accumulator,
+								const SA_DicePMF *pmf,
+								double weight,
+								SA_DiceDistributionContext *context) {
+	if (   pmf->count == 0
+		|| weight <= 0.0)
+		return YES;
+
+	if (accumulator->count == 0) {
+		if (!SA_DicePMFAllocate(accumulator, pmf->minimum, (double) pmf->count, context))
+			return NO;
+	} else if (   pmf->minimum < accumulator->minimum
+			   || SA_DicePMFMaximum(pmf) > SA_DicePMFMaximum(accumulator)) {
+		NSInteger minimum = MIN(pmf->minimum, accumulator->minimum);
+		NSInteger maximum = MAX(SA_DicePMFMaximum(pmf), SA_DicePMFMaximum(accumulator));
+		double count = (double) maximum - (double) minimum + 1.0;
+		if (   count > (double) context->maxValueCount
+			|| !SA_DiceDistributionCharge(context, count))
+			return NO;
+
+		double *masses = calloc((NSUInteger) count, sizeof(double));
+		memcpy(masses + (accumulator->minimum - minimum), accumulator->masses, accumulator->count * sizeof(double));
+		free(accumulator->masses);
+		accumulator->masses = masses;
+		accumulator->minimum = minimum;
+		accumulator->count = (NSUInteger) count;
+	}
+
+	if (!SA_DiceDistributionCharge(context, (double) pmf->count))
+		return NO;
+
+	double *masses = accumulator->masses + (pmf->minimum - accumulator->minimum);
+	for (NSUInteger i = 0; i < pmf->count; i++)
+		masses[i] += weight * pmf->masses[i];
+
+	return YES;
+}
+
+// Reverses the distribution of a result (i.e., gives that of its negation).
+// Only for results which cannot overflow when negated (such as dice).
+static void SA_DicePMFNegate(SA_DicePMF *pmf) {
+	if (pmf->count == 0)
+		return;
+
+	for (NSUInteger i = 0, j = pmf->count - 1; i < j; i++, j--) {
+		double mass = pmf->masses[i];
+		pmf->masses[i] = pmf->masses[j];
+		pmf->masses[j] = mass;
+	}
+	pmf->minimum = -SA_DicePMFMaximum(pmf);
+}
+
+// The probability that either of two independent sub-expressions fails.
+NS_INLINE double SA_DiceErrorMassOfEither(double leftErrorMass,
+										  double rightErrorMass) {
+	return leftErrorMass + rightErrorMass - (leftErrorMass * rightErrorMass);
+}
+
+/*******************************/
+#pragma mark - Convolution & FFT
+/*******************************/
+
+// In-place iterative radix-2 FFT (the length must be a power of 2). The
+// inverse transform is not scaled.
+static void SA_DiceFFT(double *real,
+					   double *imaginary,
+					   NSUInteger length,
+					   BOOL inverse) {
+	// Bit-reversal permutation.
+	for (NSUInteger i = 1, j = 0; i < length; i++) {
+		NSUInteger bit = length >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+
+		if (i < j) {
+			double swap = real[i];
+			real[i] = real[j];
+			real[j] = swap;
+			swap = imaginary[i];
+			imaginary[i] = imaginary[j];
+			imaginary[j] = swap;
+		}
+	}
+
+	for (NSUInteger blockLength = 2; blockLength <= length; blockLength <<= 1) {
+		NSUInteger halfBlockLength = blockLength / 2;
+		double angle = (inverse ? 2.0 : -2.0) * M_PI / (double) blockLength;
+		for (NSUInteger k = 0; k < halfBlockLength; k++) {
+			double twiddleReal = cos(angle * (double) k);
+			double twiddleImaginary = sin(angle * (double) k);
+			for (NSUInteger i = k; i < length; i += blockLength) {
+				NSUInteger j = i + halfBlockLength;
+				double productReal = (real[j] * twiddleReal) - (imaginary[j] * twiddleImaginary);
+				double productImaginary = (real[j] * twiddleImaginary) + (imaginary[j] * twiddleReal);
+				real[j] = real[i] - productReal;
+				imaginary[j] = imaginary[i] - productImaginary;
+				real[i] += productReal;
+				imaginary[i] += productImaginary;
+			}
+		}
+	}
+}
+
+// Writes the convolution of the two arrays (of length aCount + bCount − 1)
+// into the output, which must be zeroed.
+static BOOL SA_DiceConvolve(const double *a,
+							NSUInteger aCount,
+							const double *b,
+							NSUInteger bCount,
+							double *output,
+							SA_DiceDistributionContext *context) {
+	double product = (double) aCount * (double) bCount;
+	if (   product <= FFT_THRESHOLD_PRODUCT
+		|| MIN(aCount, bCount) <= FFT_THRESHOLD_MINIMUM_LENGTH) {
+		if (!SA_DiceDistributionCharge(context, product))
+			return NO;
+
+		for (NSUInteger i = 0; i < aCount; i++) {
+			if (a[i] == 0.0)
+				continue;
+			for (NSUInteger j = 0; j < bCount; j++)
+				output[i + j] += a[i] * b[j];
+		}
+		return YES;
+	}
+
+	NSUInteger outputCount = aCount + bCount - 1;
+	NSUInteger length = 1;
+	NSUInteger logLength = 0;
+	while (length < outputCount) {
+		length <<= 1;
+		logLength++;
+	}
+	if (!SA_DiceDistributionCharge(context, 3.0 * 5.0 * (double) length * (double) logLength))
+		return NO;
+
+	double *aReal = calloc(length, sizeof(double));
+	double *aImaginary = calloc(length, sizeof(double));
+	double *bReal = calloc(length, sizeof(double));
+	double *bImaginary = calloc(length, sizeof(double));
+	memcpy(aReal, a, aCount * sizeof(double));
+	memcpy(bReal, b, bCount * sizeof(double));
+
+	SA_DiceFFT(aReal, aImaginary, length, NO);
+	SA_DiceFFT(bReal, bImaginary, length, NO);
+	for (NSUInteger i = 0; i < length; i++) {
+		double real = (aReal[i] * bReal[i]) - (aImaginary[i] * bImaginary[i]);
+		double imaginary = (aReal[i] * bImaginary[i]) + (aImaginary[i] * bReal[i]);
+		aReal[i] = real;
+		aImaginary[i] = imaginary;
+	}
+	SA_DiceFFT(aReal, aImaginary, length, YES);
+
+	// Rounding leaves tiny (possibly negative) values where there should be
+	// none; negative ones, at least, can be discarded.
+	for (NSUInteger i = 0; i < outputCount; i++)
+		output[i] = MAX(aReal[i] / (double) length, 0.0);
+
+	free(aReal);
+	free(aImaginary);
+	free(bReal);
+	free(bImaginary);
+
+	return YES;
+}
+
+// The distribution of the sum of two independent results (ignoring errors;
+// for sums of dice, which cannot overflow).
+static BOOL SA_DicePMFConvolve(const SA_DicePMF *a,
+							   const SA_DicePMF *b,
+							   SA_DicePMF *result,
+							   SA_DiceDistributionContext *context) {
+	if (!SA_DicePMFAllocate(result, a->minimum + b->minimum, (double) a->count + (double) b->count - 1.0, context))
+		return NO;
+
+	return SA_DiceConvolve(a->masses, a->count, b->masses, b->count, result->masses, context);
+}
+
+// The distribution of the sum of the given number of independent copies of
+// the given result (by repeated squaring).
+static BOOL SA_DicePMFPower(const SA_DicePMF *base,
+							NSUInteger exponent,
+							SA_DicePMF *result,
+							SA_DiceDistributionContext *context) {
+	*result = SA_DicePMFPoint(0);
+	if (exponent == 0)
+		return YES;
+
+	SA_DicePMF square = { 0 }, next;
+	BOOL success = SA_DicePMFAddScaled(&square, base, 1.0, context);
+
+	while (success) {
+		if (exponent & 1) {
+			next = (SA_DicePMF) { 0 };
+			success = SA_DicePMFConvolve(result, &square, &next, context);
+			SA_DicePMFFree(result);
+			*result = next;
+		}
+		exponent >>= 1;
+		if (exponent == 0 || !success)
+			break;
+
+		next = (SA_DicePMF) { 0 };
+		success = SA_DicePMFConvolve(&square, &square, &next, context);
+		SA_DicePMFFree(&square);
+		square = next;
+	}
+
+	SA_DicePMFFree(&square);
+	return success;
+}
+
+/************************/
+#pragma mark - Arithmetic
+/************************/
+
+// The distribution of the result of applying the given operator to two
+// independent results, with errors exactly as the evaluator would report
+// them.
+static BOOL SA_DicePMFCombine(const SA_DicePMF *left,
+							  const SA_DicePMF *right,
+							  SA_DiceExpressionOperator operator,
+							  SA_DicePMF *result,
+							  SA_DiceDistributionContext *context) {
+	*result = (SA_DicePMF) {
+		.errorMass = SA_DiceErrorMassOfEither(left->errorMass, right->errorMass),
+		.errors = (left->errors | right->errors)
+	};
+	if (   left->count == 0
+		|| right->count == 0)
+		return YES;
+
+	if (   operator != SA_DiceExpressionOperator_PLUS
+		&& operator != SA_DiceExpressionOperator_MINUS
+		&& operator != SA_DiceExpressionOperator_TIMES) {
+		double leftMass = 0.0, rightMass = 0.0;
+		for (NSUInteger i = 0; i < left->count; i++)
+			leftMass += left->masses[i];
+		for (NSUInteger j = 0; j < right->count; j++)
+			rightMass += right->masses[j];
+		result->errorMass += leftMass * rightMass;
+		result->errors |= SA_DiceExpressionError_UNKNOWN_OPERATOR;
+		return YES;
+	}
+
+	// Addition and subtraction are monotonic, so if the extreme results
+	// cannot overflow, no result can; then the distribution of the result is
+	// a convolution.
+	if (operator != SA_DiceExpressionOperator_TIMES) {
+		SA_DiceExpressionError errors = 0;
+		NSInteger minimum, maximum;
+		if (operator == SA_DiceExpressionOperator_PLUS) {
+			minimum = SA_DiceProgramApplyOperator(operator, left->minimum, right->minimum, &errors);
+			maximum = SA_DiceProgramApplyOperator(operator, SA_DicePMFMaximum(left), SA_DicePMFMaximum(right), &errors);
+		} else {
+			minimum = SA_DiceProgramApplyOperator(operator, left->minimum, SA_DicePMFMaximum(right), &errors);
+			maximum = SA_DiceProgramApplyOperator(operator, SA_DicePMFMaximum(left), right->minimum, &errors);
+		}
+
+		if (errors == 0) {
+			if (!SA_DicePMFAllocate(result, minimum, (double) maximum - (double) minimum + 1.0, context))
+				return NO;
+
+			if (operator == SA_DiceExpressionOperator_PLUS)
+				return SA_DiceConvolve(left->masses, left->count, right->masses, right->count, result->masses, context);
+
+			double *reversed = malloc(right->count * sizeof(double));
+			for (NSUInteger j = 0; j < right->count; j++)
+				reversed[j] = right->masses[right->count - 1 - j];
+			BOOL success = SA_DiceConvolve(left->masses, left->count, reversed, right->count, result->masses, context);
+			free(reversed);
+			return success;
+		}
+	}
+
+	// Otherwise, every pair of results must be considered: once to find the
+	// range of the result, and again to fill it in.
+	if (!SA_DiceDistributionCharge(context, 2.0 * (double) left->count * (double) right->count))
+		return NO;
+
+	BOOL anyValid = NO;
+	NSInteger minimum = NSIntegerMax, maximum = NSIntegerMin;
+	for (NSUInteger i = 0; i < left->count; i++) {
+		if (left->masses[i] == 0.0)
+			continue;
+		for (NSUInteger j = 0; j < right->count; j++) {
+			if (right->masses[j] == 0.0)
+				continue;
+
+			SA_DiceExpressionError errors = 0;
+			NSInteger value = SA_DiceProgramApplyOperator(operator, left->minimum + (NSInteger) i, right->minimum + (NSInteger) j, &errors);
+			if (errors != 0) {
+				result->errorMass += left->masses[i] * right->masses[j];
+				result->errors |= errors;
+			} else {
+				anyValid = YES;
+				minimum = MIN(minimum, value);
+				maximum = MAX(maximum, value);
+			}
+		}
+	}
+	if (!anyValid)
+		return YES;
+
+	if (!SA_DicePMFAllocate(result, minimum, (double) maximum - (double) minimum + 1.0, context))
+		return NO;
+
+	for (NSUInteger i = 0; i < left->count; i++) {
+		if (left->masses[i] == 0.0)
+			continue;
+		for (NSUInteger j = 0; j < right->count; j++) {
+			if (right->masses[j] == 0.0)
+				continue;
+
+			SA_DiceExpressionError errors = 0;
+			NSInteger value = SA_DiceProgramApplyOperator(operator, left->minimum + (NSInteger) i, right->minimum + (NSInteger) j, &errors);
+			if (errors == 0)
+				result->masses[value - minimum] += left->masses[i] * right->masses[j];
+		}
+	}
+
+	return YES;
+}
+
+/******************/
+#pragma mark - Dice
+/******************/
+
+// The distribution of a single die (followed to the given depth, if it
+// explodes).
+static BOOL SA_DicePMFForDie(SA_DiceExpressionDieType dieType,
+							 BOOL exploding,
+							 NSUInteger dieSize,
+							 SA_DicePMF *die,
+							 SA_DiceDistributionContext *context) {
+	if (dieType == SA_DiceExpressionDice_FUDGE) {
+		if (!SA_DicePMFAllocate(die, -1, 3.0, context))
+			return NO;
+		die->masses[0] = die->masses[1] = die->masses[2] = 1.0 / 3.0;
+		return YES;
+	}
+
+	// A d1 does not explode (see SA_DiceProgram.m).
+	if (   !exploding
+		|| dieSize == 1) {
+		if (!SA_DicePMFAllocate(die, 1, (double) dieSize, context))
+			return NO;
+		for (NSUInteger i = 0; i < dieSize; i++)
+			die->masses[i] = 1.0 / (double) dieSize;
+		return YES;
+	}
+
+	// An exploding die that explodes k times shows (k × size) + r, with
+	// probability (1 / size)^(k + 1), for each r from 1 to size − 1.
+	NSUInteger depth = context->explosionDepth;
+	if (!SA_DicePMFAllocate(die, 1, ((double) depth + 1.0) * (double) dieSize - 1.0, context))
+		return NO;
+	double mass = 1.0 / (double) dieSize;
+	for (NSUInteger k = 0; k <= depth; k++) {
+		for (NSUInteger r = 1; r < dieSize; r++)
+			die->masses[(k * dieSize) + r - 1] = mass;
+		mass /= (double) dieSize;
+	}
+
+	return YES;
+}
+
+// The distribution of the sum of the highest ‘keepCount’ of ‘diceCount’
+// independent dice, each distributed as given.
+//
+// The dice are sorted (conceptually) by considering each possible value
+// from highest to lowest, and deciding how many of the dice not yet sorted
+// show it: given that none of them shows a higher value, that number is
+// binomially distributed. Once ‘keepCount’ dice have been sorted, the rest
+// do not matter.
+static BOOL SA_DicePMFKeepHighest(const SA_DicePMF *die,
+								  NSUInteger diceCount,
+								  NSUInteger keepCount,
+								  SA_DicePMF *result,
+								  SA_DiceDistributionContext *context) {
+	if (keepCount == 0) {
+		*result = SA_DicePMFPoint(0);
+		return YES;
+	}
+
+	// Kept sums are tracked as the sum of the kept dice’s offsets from the
+	// die’s minimum.
+	NSUInteger valueCount = die->count;
+	double span = ((double) keepCount * (double) (valueCount - 1)) + 1.0;
+	if (   span * (double) keepCount > (double) context->maxValueCount
+		|| !SA_DiceDistributionCharge(context, (double) valueCount * span * (double) keepCount * (double) keepCount))
+		return NO;
+	if (!SA_DicePMFAllocate(result, (NSInteger) keepCount * die->minimum, span, context))
+		return NO;
+
+	NSUInteger spanCount = (NSUInteger) span;
+	double *states = calloc(keepCount * spanCount, sizeof(double));
+	double *nextStates = calloc(keepCount * spanCount, sizeof(double));
+	double *logFactorials = malloc((diceCount + 1) * sizeof(double));
+	for (NSUInteger i = 0; i <= diceCount; i++)
+		logFactorials[i] = lgamma((double) i + 1.0);
+
+	double remainingMass = 0.0;
+	NSUInteger lowestIndex = NSNotFound;
+	for (NSUInteger v = 0; v < valueCount; v++) {
+		remainingMass += die->masses[v];
+		if (   lowestIndex == NSNotFound
+			&& die->masses[v] > 0.0)
+			lowestIndex = v;
+	}
+
+	states[0] = 1.0;
+	for (NSUInteger v = valueCount; v-- > 0; ) {
+		double mass = die->masses[v];
+		if (mass <= 0.0)
+			continue;
+
+		double q = (v == lowestIndex) ? 1.0 : MIN(mass / remainingMass, 1.0);
+		double logQ = log(q);
+		double logNotQ = log1p(-q);
+		remainingMass -= mass;
+
+		memset(nextStates, 0, keepCount * spanCount * sizeof(double));
+		for (NSUInteger m = 0; m < keepCount; m++) {
+			NSUInteger remainingDice = diceCount - m;
+			NSUInteger needed = keepCount - m;
+			for (NSUInteger s = 0; s <= m * (valueCount - 1); s++) {
+				double weight = states[(m * spanCount) + s];
+				if (weight == 0.0)
+					continue;
+
+				if (q >= 1.0) {
+					result->masses[s + (needed * v)] += weight;
+					continue;
+				}
+
+				double cumulative = 0.0;
+				for (NSUInteger c = 0; c < needed && c <= remainingDice; c++) {
+					double binomial = exp(logFactorials[remainingDice] - logFactorials[c] - logFactorials[remainingDice - c]
+										  + ((double) c * logQ) + ((double) (remainingDice - c) * logNotQ));
+					cumulative += binomial;
+					nextStates[((m + c) * spanCount) + s + (c * v)] += weight * binomial;
+				}
+				if (remainingDice >= needed)
+					result->masses[s + (needed * v)] += weight * MAX(1.0 - cumulative, 0.0);
+			}
+		}
+
+		double *swap = states;
+		states = nextStates;
+		nextStates = swap;
+	}
+
+	free(states);
+	free(nextStates);
+	free(logFactorials);
+
+	return YES;
+}
+
+static BOOL SA_DicePMFKeep(const SA_DicePMF *die,
+						   NSUInteger diceCount,
+						   NSUInteger keepCount,
+						   BOOL highest,
+						   SA_DicePMF *result,
+						   SA_DiceDistributionContext *context) {
+	if (highest)
+		return SA_DicePMFKeepHighest(die, diceCount, keepCount, result, context);
+
+	// The lowest dice are the negations of the highest negated dice.
+	SA_DicePMF negatedDie = { 0 };
+	if (!SA_DicePMFAddScaled(&negatedDie, die, 1.0, context))
+		return NO;
+	SA_DicePMFNegate(&negatedDie);
+
+	BOOL success = SA_DicePMFKeepHighest(&negatedDie, diceCount, keepCount, result, context);
+	SA_DicePMFNegate(result);
+	SA_DicePMFFree(&negatedDie);
+
+	return success;
+}
+
+// Adds, to the result, the distribution of keeping the given number of rolls
+// of exploding dice (times the given weight).
+//
+// Each roll of an exploding die is kept or not on its own (i.e., a die that
+// explodes contributes several rolls). So the rolls of n dice of size m are:
+// some number of m’s (one for each explosion, of which there are e in all),
+// and n rolls (the last roll of each die) uniformly distributed from 1 to
+// m − 1. The highest k rolls are then k m’s (if k ≤ e), or else e m’s plus the
+// highest k − e of the others; the lowest k rolls are the lowest k of the
+// others (if k ≤ n), or else all of them plus k − n m’s.
+static BOOL SA_DicePMFAddExplodingKeep(NSUInteger diceCount,
+									   NSUInteger dieSize,
+									   NSUInteger keepCount,
+									   BOOL highest,
+									   double weight,
+									   SA_DicePMF *result,
+									   SA_DiceDistributionContext *context) {
+	BOOL success = YES;
+
+	// The number of explosions of a single die is geometrically distributed
+	// (up to the explosion depth).
+	SA_DicePMF explosions = { 0 };
+	SA_DicePMF totalExplosions = { 0 };
+	SA_DicePMF lastRoll = { 0 };
+	success = (   SA_DicePMFAllocate(&explosions, 0, (double) context->explosionDepth + 1.0, context)
+			   && SA_DicePMFAllocate(&lastRoll, 1, (double) dieSize - 1.0, context));
+	if (success) {
+		double mass = ((double) dieSize - 1.0) / (double) dieSize;
+		for (NSUInteger k = 0; k < explosions.count; k++) {
+			explosions.masses[k] = mass;
+			mass /= (double) dieSize;
+		}
+		for (NSUInteger r = 0; r < lastRoll.count; r++)
+			lastRoll.masses[r] = 1.0 / (double) lastRoll.count;
+
+		success = SA_DicePMFPower(&explosions, diceCount, &totalExplosions, context);
+	}
+
+	// Distributions of the highest j last rolls, for each j (computed as
+	// needed), or of the lowest k (or all) last rolls.
+	SA_DicePMF *highestLastRolls = highest ? calloc(MIN(keepCount, diceCount) + 1, sizeof(SA_DicePMF)) : NULL;
+	SA_DicePMF lowestLastRolls = { 0 };
+	if (success && !highest) {
+		success = ((keepCount <= diceCount)
+				   ? SA_DicePMFKeep(&lastRoll, diceCount, keepCount, NO, &lowestLastRolls, context)
+				   : SA_DicePMFPower(&lastRoll, diceCount, &lowestLastRolls, context));
+	}
+
+	for (NSUInteger i = 0; success && i < totalExplosions.count; i++) {
+		double mass = totalExplosions.masses[i];
+		if (mass <= 0.0)
+			continue;
+
+		NSUInteger explosionCount = (NSUInteger) totalExplosions.minimum + i;
+		if (keepCount > diceCount + explosionCount) {
+			result->errorMass += weight * mass;
+			result->errors |= SA_DiceExpressionError_KEEP_COUNT_EXCEEDS_ROLL_COUNT;
+			continue;
+		}
+
+		NSInteger shift;
+		SA_DicePMF *kept;
+		SA_DicePMF point = { 0 };
+		if (highest) {
+			if (keepCount <= explosionCount) {
+				point = SA_DicePMFPoint((NSInteger) (keepCount * dieSize));
+				kept = &point;
+				shift = 0;
+			} else {
+				NSUInteger j = keepCount - explosionCount;
+				if (   highestLastRolls[j].count == 0
+					&& !SA_DicePMFKeep(&lastRoll, diceCount, j, YES, &highestLastRolls[j], context)) {
+					success = NO;
+					break;
+				}
+				kept = &highestLastRolls[j];
+				shift = (NSInteger) (explosionCount * dieSize);
+			}
+		} else {
+			kept = &lowestLastRolls;
+			shift = (keepCount <= diceCount) ? 0 : (NSInteger) ((keepCount - diceCount) * dieSize);
+		}
+
+		kept->minimum += shift;
+		success = SA_DicePMFAddScaled(result, kept, weight * mass, context);
+		kept->minimum -= shift;
+		SA_DicePMFFree(&point);
+	}
+
+	if (highestLastRolls != NULL) {
+		for (NSUInteger j = 0; j <= MIN(keepCount, diceCount); j++)
+			SA_DicePMFFree(&highestLastRolls[j]);
+		free(highestLastRolls);
+	}
+	SA_DicePMFFree(&lowestLastRolls);
+	SA_DicePMFFree(&totalExplosions);
+	SA_DicePMFFree(&explosions);
+	SA_DicePMFFree(&lastRoll);
+
+	return success;
+}
+
+// The errors the evaluator reports for a roll of the given number and size
+// of dice (see SA_DiceMachineRoll()).
+static SA_DiceExpressionError SA_DiceRollErrors(NSInteger dieCount,
+												NSInteger dieSize,
+												SA_DiceExpressionDieType dieType,
+												const SA_DiceDistributionContext *context) {
+	SA_DiceExpressionError errors = 0;
+	if (dieCount < 0) {
+		errors |= SA_DiceExpressionError_DIE_COUNT_NEGATIVE;
+	} else if ((NSUInteger) dieCount > context->maxDieCount) {
+		errors |= SA_DiceExpressionError_DIE_COUNT_EXCESSIVE;
+	}
+	if (dieType != SA_DiceExpressionDice_FUDGE) {
+		if (dieSize < 1) {
+			errors |= SA_DiceExpressionError_DIE_SIZE_INVALID;
+		} else if ((NSUInteger) dieSize > context->maxDieSize) {
+			errors |= SA_DiceExpressionError_DIE_SIZE_EXCESSIVE;
+		}
+	}
+
+	return errors;
+}
+
+/******************************/
+#pragma mark - Expression trees
+/******************************/
+
+static BOOL SA_DicePMFForExpression(SA_DiceExpression *expression,
+									SA_DicePMF *result,
+									SA_DiceDistributionContext *context);
+
+// The distributions of a roll command’s die count and die size. (The die
+// size of Fudge dice is not evaluated, so it is taken to be a constant.)
+static BOOL SA_DicePMFForRollParameters(SA_DiceExpression *rollCommand,
+										SA_DicePMF *dieCount,
+										SA_DicePMF *dieSize,
+										SA_DiceDistributionContext *context) {
+	if (!SA_DicePMFForExpression(rollCommand.dieCount, dieCount, context))
+		return NO;
+
+	if (rollCommand.dieType == SA_DiceExpressionDice_STANDARD)
+		return SA_DicePMFForExpression(rollCommand.dieSize, dieSize, context);
+
+	*dieSize = SA_DicePMFPoint(0);
+	return YES;
+}
+
+static BOOL SA_DicePMFForRollCommand(SA_DiceExpression *expression,
+									 SA_DicePMF *result,
+									 SA_DiceDistributionContext *context) {
+	SA_DicePMF dieCount = { 0 }, dieSize = { 0 };
+	BOOL success = SA_DicePMFForRollParameters(expression, &dieCount, &dieSize, context);
+
+	*result = (SA_DicePMF) {
+		.errorMass = SA_DiceErrorMassOfEither(dieCount.errorMass, dieSize.errorMass),
+		.errors = (dieCount.errors | dieSize.errors)
+	};
+
+	BOOL exploding = (expression.rollCommand == SA_DiceExpressionRollCommand_SUM_EXPLODING);
+	for (NSUInteger j = 0; success && j < dieSize.count; j++) {
+		if (dieSize.masses[j] == 0.0)
+			continue;
+
+		NSInteger size = dieSize.minimum + (NSInteger) j;
+		SA_DicePMF die = { 0 };
+		SA_DicePMF sum = SA_DicePMFPoint(0);
+		NSUInteger summedCount = 0;
+
+		// Die counts are considered in increasing order, so that the sum of
+		// each number of dice is built from the last.
+		for (NSUInteger i = 0; success && i < dieCount.count; i++) {
+			double weight = dieCount.masses[i] * dieSize.masses[j];
+			if (weight == 0.0)
+				continue;
+
+			NSInteger count = dieCount.minimum + (NSInteger) i;
+			SA_DiceExpressionError errors = SA_DiceRollErrors(count, size, expression.dieType, context);
+			if (errors != 0) {
+				result->errorMass += weight;
+				result->errors |= errors;
+				continue;
+			}
+
+			if (   die.count == 0
+				&& !(success = SA_DicePMFForDie(expression.dieType, exploding, (NSUInteger) size, &die, context)))
+				break;
+
+			if ((NSUInteger) count > summedCount) {
+				SA_DicePMF additionalDice = { 0 }, nextSum = { 0 };
+				success = (   SA_DicePMFPower(&die, (NSUInteger) count - summedCount, &additionalDice, context)
+						   && SA_DicePMFConvolve(&sum, &additionalDice, &nextSum, context));
+				SA_DicePMFFree(&additionalDice);
+				SA_DicePMFFree(&sum);
+				sum = nextSum;
+				summedCount = (NSUInteger) count;
+			}
+
+			success = success && SA_DicePMFAddScaled(result, &sum, weight, context);
+		}
+
+		SA_DicePMFFree(&sum);
+		SA_DicePMFFree(&die);
+	}
+
+	SA_DicePMFFree(&dieCount);
+	SA_DicePMFFree(&dieSize);
+
+	return success;
+}
+
+static BOOL SA_DicePMFForKeep(SA_DiceExpression *expression,
+							  SA_DicePMF *result,
+							  SA_DiceDistributionContext *context) {
+	SA_DiceExpression *rollCommand = expression.leftOperand;
+
+	// If the roll command is erroneous to begin with, the keep count is
+	// evaluated nonetheless (and its errors added).
+	if (rollCommand.errorBitMask != 0) {
+		SA_DicePMF keepCount = { 0 };
+		BOOL success = SA_DicePMFForExpression(expression.rightOperand, &keepCount, context);
+		*result = SA_DicePMFFailure(rollCommand.errorBitMask | keepCount.errors);
+		SA_DicePMFFree(&keepCount);
+		return success;
+	}
+
+	SA_DicePMF dieCount = { 0 }, dieSize = { 0 }, keepCount = { 0 };
+	BOOL success = (   SA_DicePMFForRollParameters(rollCommand, &dieCount, &dieSize, context)
+					&& SA_DicePMFForExpression(expression.rightOperand, &keepCount, context));
+
+	*result = (SA_DicePMF) {
+		.errorMass = SA_DiceErrorMassOfEither(SA_DiceErrorMassOfEither(dieCount.errorMass, dieSize.errorMass), keepCount.errorMass),
+		.errors = (dieCount.errors | dieSize.errors | keepCount.errors)
+	};
+
+	BOOL exploding = (rollCommand.rollCommand == SA_DiceExpressionRollCommand_SUM_EXPLODING);
+	BOOL highest = (expression.rollModifier == SA_DiceExpressionRollModifier_KEEP_HIGHEST);
+	for (NSUInteger j = 0; success && j < dieSize.count; j++) {
+		if (dieSize.masses[j] == 0.0)
+			continue;
+
+		NSInteger size = dieSize.minimum + (NSInteger) j;
+		SA_DicePMF die = { 0 };
+
+		for (NSUInteger i = 0; success && i < dieCount.count; i++) {
+			for (NSUInteger k = 0; success && k < keepCount.count; k++) {
+				double weight = dieCount.masses[i] * dieSize.masses[j] * keepCount.masses[k];
+				if (weight == 0.0)
+					continue;
+
+				NSInteger count = dieCount.minimum + (NSInteger) i;
+				NSInteger keep = keepCount.minimum + (NSInteger) k;
+				SA_DiceExpressionError errors = SA_DiceRollErrors(count, size, rollCommand.dieType, context);
+				if (   errors == 0
+					&& keep < 0)
+					errors = SA_DiceExpressionError_KEEP_COUNT_NEGATIVE;
+				if (errors != 0) {
+					result->errorMass += weight;
+					result->errors |= errors;
+					continue;
+				}
+
+				if (   exploding
+					&& rollCommand.dieType == SA_DiceExpressionDice_STANDARD
+					&& size > 1) {
+					success = SA_DicePMFAddExplodingKeep((NSUInteger) count, (NSUInteger) size, (NSUInteger) keep, highest, weight, result, context);
+					continue;
+				}
+
+				if (keep > count) {
+					result->errorMass += weight;
+					result->errors |= SA_DiceExpressionError_KEEP_COUNT_EXCEEDS_ROLL_COUNT;
+					continue;
+				}
+
+				if (   die.count == 0
+					&& !(success = SA_DicePMFForDie(rollCommand.dieType, NO, (NSUInteger) size, &die, context)))
+					break;
+
+				SA_DicePMF kept = { 0 };
+				success = (   SA_DicePMFKeep(&die, (NSUInteger) count, (NSUInteger) keep, highest, &kept, context)
+						   && SA_DicePMFAddScaled(result, &kept, weight, context));
+				SA_DicePMFFree(&kept);
+			}
+		}
+
+		SA_DicePMFFree(&die);
+	}
+
+	SA_DicePMFFree(&dieCount);
+	SA_DicePMFFree(&dieSize);
+	SA_DicePMFFree(&keepCount);
+
+	return success;
+}
+
+// Computes the distribution of the given expression’s result (with the same
+// checks, in the same order, as SA_DiceProgram); returns NO if that would
+// exceed the context’s limits.
+static BOOL SA_DicePMFForExpression(SA_DiceExpression *expression,
+									SA_DicePMF *result,
+									SA_DiceDistributionContext *context) {
+	*result = (SA_DicePMF) { 0 };
+
+	// A nil sub-expression has the value 0.
+	if (expression == nil) {
+		*result = SA_DicePMFPoint(0);
+		return YES;
+	}
+
+	// An expression that is erroneous to begin with is not evaluated.
+	if (expression.errorBitMask != 0) {
+		*result = SA_DicePMFFailure(expression.errorBitMask);
+		return YES;
+	}
+
+	switch (expression.type) {
+		case SA_DiceExpressionTerm_OPERATION: {
+			SA_DicePMF leftOperand = { 0 }, rightOperand = { 0 };
+			BOOL success = (   SA_DicePMFForExpression(expression.leftOperand, &leftOperand, context)
+							&& SA_DicePMFForExpression(expression.rightOperand, &rightOperand, context)
+							&& SA_DicePMFCombine(&leftOperand, &rightOperand, expression.operator, result, context));
+			SA_DicePMFFree(&leftOperand);
+			SA_DicePMFFree(&rightOperand);
+			return success;
+		}
+		case SA_DiceExpressionTerm_ROLL_COMMAND: {
+			if (   expression.rollCommand != SA_DiceExpressionRollCommand_SUM
+				&& expression.rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING) {
+				*result = SA_DicePMFFailure(SA_DiceExpressionError_UNKNOWN_ROLL_COMMAND);
+				return YES;
+			}
+
+			return SA_DicePMFForRollCommand(expression, result, context);
+		}
+		case SA_DiceExpressionTerm_ROLL_MODIFIER: {
+			if (   expression.rollModifier != SA_DiceExpressionRollModifier_KEEP_HIGHEST
+				&& expression.rollModifier != SA_DiceExpressionRollModifier_KEEP_LOWEST) {
+				*result = SA_DicePMFFailure(SA_DiceExpressionError_UNKNOWN_ROLL_MODIFIER);
+				return YES;
+			}
+
+			// The ‘keep’ modifiers can only be applied to roll commands.
+			if (   expression.leftOperand.type != SA_DiceExpressionTerm_ROLL_COMMAND
+				|| (   expression.leftOperand.rollCommand != SA_DiceExpressionRollCommand_SUM
+					&& expression.leftOperand.rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING)) {
+				*result = SA_DicePMFFailure(SA_DiceExpressionError_ROLL_MODIFIER_INAPPLICABLE);
+				return YES;
+			}
+
+			return SA_DicePMFForKeep(expression, result, context);
+		}
+		case SA_DiceExpressionTerm_VALUE:
+		default: {
+			*result = SA_DicePMFPoint(expression.value.integerValue);
+			return YES;
+		}
+	}
+}
+
+/****************************************************************/
+#pragma mark - SA_DiceDistributionCalculator class implementation
+/****************************************************************/
+
+@implementation SA_DiceDistributionCalculator
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithEvaluator:[SA_DiceEvaluator new]];
+}
+
+-(instancetype) initWithEvaluator:(SA_DiceEvaluator *)evaluator {
+	if (!(self = [super init]))
+		return nil;
+
+	_maxDieCount = evaluator.maxDieCount;
+	_maxDieSize = evaluator.maxDieSize;
+	_explosionDepth = DEFAULT_EXPLOSION_DEPTH;
+	_maxValueCount = DEFAULT_MAX_VALUE_COUNT;
+	_maxOperationCount = DEFAULT_MAX_OPERATION_COUNT;
+
+	return self;
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceDistribution *) distributionOfExpression:(SA_DiceExpression *)expression {
+	if (expression == nil)
+		return nil;
+
+	SA_DiceDistributionContext context = {
+		.maxDieCount = _maxDieCount,
+		.maxDieSize = _maxDieSize,
+		.explosionDepth = _explosionDepth,
+		.maxValueCount = MAX(_maxValueCount, 1),
+		.remainingOperations = (double) _maxOperationCount
+	};
+
+	SA_DicePMF pmf = { 0 };
+	if (!SA_DicePMFForExpression(expression, &pmf, &context)) {
+		SA_DicePMFFree(&pmf);
+		return nil;
+	}
+
+	return [[SA_DiceDistribution alloc] initByTakingProbabilities:pmf.masses
+															 count:pmf.count
+														   minimum:pmf.minimum
+												  errorProbability:pmf.errorMass
+													possibleErrors:pmf.errors];
+}
+
+@end
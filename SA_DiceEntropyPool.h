@@ -0,0 +1,112 @@
+//
+//  SA_DiceEntropyPool.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceRNG.h"
+
+@class SA_DiceEntropyPool;
+
+/*
+ An SA_DiceEntropyPool generates random words ahead of demand, on a
+ background thread, so that rolling dice need not wait for them to be
+ generated.
+
+ Each generator drawing from the pool (see SA_DiceRNGInitWithEntropyPool())
+ has a ring buffer of words of its own, which it reads without locking (a
+ generator is used by one thread at a time, and only the pool’s thread
+ writes to the buffer). When the words in a buffer run low (below the low
+ watermark), the pool’s thread is woken, and tops the buffer up (to the high
+ watermark); bounded integers (see SA_DiceRNGUniform()), dice, and bulk
+ draws (see SA_DiceRNGFillWords()) all read from the buffer. If a buffer
+ runs dry all the same (e.g., during a burst of very large rolls), the
+ generator does not wait, but generates the words it needs itself (with an
+ xoshiro256** generator of its own); each such word is counted as a miss.
+
+ The words in the buffers are generated by an xoshiro256** generator seeded
+ from the system entropy source (see SA_DiceRNG.h); so a pooled generator
+ cannot be seeded, and its rolls cannot be replayed. (An evaluator that is
+ auditing does not use its entropy pool; see SA_DiceEvaluator.h.)
+
+ A pool may be used from any number of threads at once. Its thread stops
+ when the pool is deallocated; generators still drawing from it then
+ generate their own words, once their buffers are empty.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// The default ring buffer capacity, and low and high watermarks (in words).
+#define SA_DICE_ENTROPY_POOL_DEFAULT_RING_CAPACITY	4096
+#define SA_DICE_ENTROPY_POOL_DEFAULT_LOW_WATERMARK	1024
+#define SA_DICE_ENTROPY_POOL_DEFAULT_HIGH_WATERMARK	4096
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Initializes the given generator to draw its words from a new ring buffer of
+// the given pool (filled at once, to the high watermark). The generator must
+// be detached from the pool (see below) before it is discarded or
+// initialized again; and it must not be copied (the copy would share its
+// ring buffer).
+void SA_DiceRNGInitWithEntropyPool(SA_DiceRNG *rng,
+								   SA_DiceEntropyPool *pool);
+
+// YES if the given generator draws its words from an entropy pool.
+BOOL SA_DiceRNGIsPooled(const SA_DiceRNG *rng);
+
+// Detaches the given generator from its entropy pool (and frees its ring
+// buffer); the generator then goes on generating words itself (as an
+// xoshiro256** generator). Does nothing if the generator is not pooled.
+void SA_DiceRNGDetachFromEntropyPool(SA_DiceRNG *rng);
+
+/**************************************************/
+#pragma mark - SA_DiceEntropyPool class declaration
+/**************************************************/
+
+@interface SA_DiceEntropyPool : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The capacity of each ring buffer, and the low and high watermarks (all in
+// words).
+@property (readonly) NSUInteger ringCapacity;
+@property (readonly) NSUInteger lowWatermark;
+@property (readonly) NSUInteger highWatermark;
+
+// The number of generators drawing from the pool.
+@property (readonly) NSUInteger ringCount;
+
+// The number of times a ring buffer has been topped up, and the number of
+// words generated to do so.
+@property (readonly) uint64_t refillCount;
+@property (readonly) uint64_t refilledWordCount;
+
+// The number of words drawn from ring buffers, and the number of words that
+// generators had to generate themselves (because their buffers were empty).
+@property (readonly) uint64_t pooledWordCount;
+@property (readonly) uint64_t missCount;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates a pool with the default capacity and watermarks.
+-(instancetype) init;
+
+// The capacity is rounded up to a power of two; the high watermark may be no
+// greater than the capacity (and is lowered to it if it is), and the low
+// watermark must be less than the high watermark (and is lowered to one less
+// than it, if it is not).
+-(instancetype) initWithRingCapacity:(NSUInteger)ringCapacity
+						lowWatermark:(NSUInteger)lowWatermark
+					   highWatermark:(NSUInteger)highWatermark NS_DESIGNATED_INITIALIZER;
+
+@end
@@ -0,0 +1,471 @@
+//
+//  SA_DiceEntropyPool.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceEntropyPool.h"
+
+#import <pthread.h>
+#import <stdatomic.h>
+
+/*
+ The pool’s state is kept in a reference-counted C structure (rather than in
+ the pool object itself), shared by the pool object, the refill thread, and
+ every ring buffer; so neither the thread nor the ring buffers keep the pool
+ object alive, and the state outlives the pool object for as long as either
+ needs it.
+
+ Each ring buffer has a single reader (its generator) and a single writer (the
+ refill thread). Its head (the index of the next word to be read) is written
+ only by the reader, and its tail (the index past the last word written) only
+ by the writer; both only ever increase (and are masked to index the
+ buffer), so the number of words in the buffer is always tail − head.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef struct SA_DiceEntropyPoolState SA_DiceEntropyPoolState;
+typedef struct SA_DiceEntropyRing SA_DiceEntropyRing;
+
+struct SA_DiceEntropyRing {
+	// Written by the reader.
+	_Atomic(uint64_t) head;
+	_Atomic(uint64_t) pooledWordCount;
+	_Atomic(uint64_t) missCount;
+
+	// Written by the writer (on a cache line of its own, so that reading and
+	// writing do not contend for one).
+	_Alignas(64) _Atomic(uint64_t) tail;
+
+	// Set by the reader when the words run low, and cleared by the writer
+	// before it tops the buffer up.
+	_Alignas(64) _Atomic(int) refillRequested;
+
+	// The reader’s own generator, for when the buffer is empty.
+	SA_DiceRNG fallbackRNG;
+
+	SA_DiceEntropyPoolState *state;
+	NSUInteger mask;
+	NSUInteger lowWatermark;
+
+	// Guarded by the state’s lock. (A ring that is detached while it is being
+	// topped up is freed by the refill thread, once it is done with it.)
+	BOOL refilling;
+	BOOL detached;
+	SA_DiceEntropyRing *nextRing;
+
+	uint64_t words[];
+};
+
+struct SA_DiceEntropyPoolState {
+	_Atomic(NSUInteger) referenceCount;
+
+	NSUInteger ringCapacity;
+	NSUInteger lowWatermark;
+	NSUInteger highWatermark;
+
+	// Used only by the refill thread.
+	SA_DiceRNG rng;
+
+	// Guards everything below.
+	pthread_mutex_t lock;
+	pthread_cond_t refillRequested;
+
+	BOOL closed;
+	BOOL refillPending;
+
+	SA_DiceEntropyRing *rings;
+	NSUInteger ringCount;
+
+	uint64_t refillCount;
+	uint64_t refilledWordCount;
+
+	// The counts of rings that have been freed.
+	uint64_t retiredPooledWordCount;
+	uint64_t retiredMissCount;
+};
+
+/**************************/
+#pragma mark - Shared state
+/**************************/
+
+static SA_DiceEntropyPoolState *SA_DiceEntropyPoolStateRetain(SA_DiceEntropyPoolState *state) {
+	atomic_fetch_add_explicit(&state->referenceCount, 1, memory_order_relaxed);
+	return state;
+}
+
+static void SA_DiceEntropyPoolStateRelease(SA_DiceEntropyPoolState *state) {
+	if (atomic_fetch_sub_explicit(&state->referenceCount, 1, memory_order_acq_rel) != 1)
+		return;
+
+	pthread_cond_destroy(&state->refillRequested);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+}
+
+// Removes the given ring from the state’s list, adds its counts to the
+// state’s, and frees it. (The lock must be held.)
+static void SA_DiceEntropyPoolStateFreeRing(SA_DiceEntropyPoolState *state,
+											SA_DiceEntropyRing *ring) {
+	for (SA_DiceEntropyRing **link = &state->rings; *link != NULL; link = &(*link)->nextRing) {
+		if (*link == ring) {
+			*link = ring->nextRing;
+			break;
+		}
+	}
+	state->ringCount--;
+
+	state->retiredPooledWordCount += atomic_load_explicit(&ring->pooledWordCount, memory_order_relaxed);
+	state->retiredMissCount += atomic_load_explicit(&ring->missCount, memory_order_relaxed);
+
+	free(ring);
+}
+
+/**************************/
+#pragma mark - Ring buffers
+/**************************/
+
+// Adds the given amount to a count that only the reader writes (so no atomic
+// read-modify-write is needed).
+NS_INLINE void SA_DiceEntropyRingCount(_Atomic(uint64_t) *count,
+									   uint64_t amount) {
+	atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Wakes the refill thread, unless the ring has already asked it to top the
+// ring up.
+static void SA_DiceEntropyRingRequestRefill(SA_DiceEntropyRing *ring) {
+	if (   atomic_load_explicit(&ring->refillRequested, memory_order_relaxed) != 0
+		|| atomic_exchange_explicit(&ring->refillRequested, 1, memory_order_relaxed) != 0)
+		return;
+
+	SA_DiceEntropyPoolState *state = ring->state;
+	pthread_mutex_lock(&state->lock);
+	state->refillPending = YES;
+	pthread_cond_signal(&state->refillRequested);
+	pthread_mutex_unlock(&state->lock);
+}
+
+static uint64_t SA_DiceEntropyRingNextWord(SA_DiceRNG *rng) {
+	SA_DiceEntropyRing *ring = rng->state.context;
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail) {
+		SA_DiceEntropyRingCount(&ring->missCount, 1);
+		SA_DiceEntropyRingRequestRefill(ring);
+		return SA_DiceRNGNextWord(&ring->fallbackRNG);
+	}
+
+	uint64_t word = ring->words[head & ring->mask];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	SA_DiceEntropyRingCount(&ring->pooledWordCount, 1);
+
+	if (tail - (head + 1) < ring->lowWatermark)
+		SA_DiceEntropyRingRequestRefill(ring);
+
+	return word;
+}
+
+static void SA_DiceEntropyRingFillWords(SA_DiceRNG *rng,
+										NSUInteger count,
+										uint64_t *words) {
+	SA_DiceEntropyRing *ring = rng->state.context;
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	NSUInteger pooledCount = (NSUInteger) MIN(tail - head, (uint64_t) count);
+
+	// The words are copied in (at most) two pieces: up to the end of the
+	// buffer, and from its start.
+	NSUInteger start = (NSUInteger) (head & ring->mask);
+	NSUInteger firstPieceCount = MIN(pooledCount, ring->mask + 1 - start);
+	memcpy(words, ring->words + start, firstPieceCount * sizeof(uint64_t));
+	memcpy(words + firstPieceCount, ring->words, (pooledCount - firstPieceCount) * sizeof(uint64_t));
+
+	atomic_store_explicit(&ring->head, head + pooledCount, memory_order_release);
+	SA_DiceEntropyRingCount(&ring->pooledWordCount, pooledCount);
+
+	if (pooledCount < count) {
+		SA_DiceRNGFillWords(&ring->fallbackRNG, count - pooledCount, words + pooledCount);
+		SA_DiceEntropyRingCount(&ring->missCount, count - pooledCount);
+	}
+
+	if (tail - (head + pooledCount) < ring->lowWatermark)
+		SA_DiceEntropyRingRequestRefill(ring);
+}
+
+// Tops the given ring up to the high watermark, with words from the given
+// generator; returns the number of words written. (Called only by the refill
+// thread, or by the reader before the ring is in use.)
+static NSUInteger SA_DiceEntropyRingRefill(SA_DiceEntropyRing *ring,
+										   SA_DiceRNG *rng,
+										   NSUInteger highWatermark) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - head >= highWatermark)
+		return 0;
+
+	NSUInteger count = (NSUInteger) (highWatermark - (tail - head));
+	NSUInteger start = (NSUInteger) (tail & ring->mask);
+	NSUInteger firstPieceCount = MIN(count, ring->mask + 1 - start);
+	SA_DiceRNGFillWords(rng, firstPieceCount, ring->words + start);
+	SA_DiceRNGFillWords(rng, count - firstPieceCount, ring->words);
+
+	atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+	return count;
+}
+
+/***************************/
+#pragma mark - Refill thread
+/***************************/
+
+static void *SA_DiceEntropyPoolRefillThread(void *argument) {
+	SA_DiceEntropyPoolState *state = argument;
+
+	SA_DiceEntropyRing **rings = NULL;
+	NSUInteger ringCapacity = 0;
+
+	pthread_mutex_lock(&state->lock);
+	while (YES) {
+		while (   !state->closed
+			   && !state->refillPending)
+			pthread_cond_wait(&state->refillRequested, &state->lock);
+		if (state->closed)
+			break;
+		state->refillPending = NO;
+
+		// Take the rings that asked to be topped up; they are topped up
+		// without the lock held, so that readers asking for more words are
+		// never kept waiting for long.
+		if (ringCapacity < state->ringCount) {
+			ringCapacity = state->ringCount;
+			rings = realloc(rings, ringCapacity * sizeof(SA_DiceEntropyRing *));
+		}
+		NSUInteger ringCount = 0;
+		for (SA_DiceEntropyRing *ring = state->rings; ring != NULL; ring = ring->nextRing) {
+			if (   !ring->detached
+				&& atomic_load_explicit(&ring->refillRequested, memory_order_relaxed) != 0) {
+				ring->refilling = YES;
+				rings[ringCount++] = ring;
+			}
+		}
+		pthread_mutex_unlock(&state->lock);
+
+		uint64_t refilledWordCount = 0;
+		for (NSUInteger i = 0; i < ringCount; i++) {
+			// The request is cleared first, so that a reader that runs low
+			// again while (or after) the ring is topped up asks again.
+			atomic_store_explicit(&rings[i]->refillRequested, 0, memory_order_relaxed);
+			refilledWordCount += SA_DiceEntropyRingRefill(rings[i], &state->rng, state->highWatermark);
+		}
+
+		pthread_mutex_lock(&state->lock);
+		state->refillCount += ringCount;
+		state->refilledWordCount += refilledWordCount;
+		for (NSUInteger i = 0; i < ringCount; i++) {
+			rings[i]->refilling = NO;
+			if (rings[i]->detached)
+				SA_DiceEntropyPoolStateFreeRing(state, rings[i]);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	free(rings);
+	SA_DiceEntropyPoolStateRelease(state);
+	return NULL;
+}
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+@interface SA_DiceEntropyPool ()
+
+-(SA_DiceEntropyPoolState *) state;
+
+@end
+
+void SA_DiceRNGInitWithEntropyPool(SA_DiceRNG *rng,
+								   SA_DiceEntropyPool *pool) {
+	SA_DiceEntropyPoolState *state = pool.state;
+
+	SA_DiceEntropyRing *ring = calloc(1, sizeof(SA_DiceEntropyRing) + (state->ringCapacity * sizeof(uint64_t)));
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->pooledWordCount, 0);
+	atomic_init(&ring->missCount, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->refillRequested, 0);
+	SA_DiceRNGInitWithSystemEntropy(&ring->fallbackRNG);
+	ring->state = SA_DiceEntropyPoolStateRetain(state);
+	ring->mask = state->ringCapacity - 1;
+	ring->lowWatermark = state->lowWatermark;
+
+	// The ring starts out full (with words from its own generator, since the
+	// pool’s generator belongs to the refill thread).
+	SA_DiceEntropyRingRefill(ring, &ring->fallbackRNG, state->highWatermark);
+
+	pthread_mutex_lock(&state->lock);
+	ring->nextRing = state->rings;
+	state->rings = ring;
+	state->ringCount++;
+	pthread_mutex_unlock(&state->lock);
+
+	SA_DiceRNGInitWithWordFunctions(rng, SA_DiceEntropyRingNextWord, SA_DiceEntropyRingFillWords, ring);
+}
+
+BOOL SA_DiceRNGIsPooled(const SA_DiceRNG *rng) {
+	return (rng->nextWord == SA_DiceEntropyRingNextWord);
+}
+
+void SA_DiceRNGDetachFromEntropyPool(SA_DiceRNG *rng) {
+	if (!SA_DiceRNGIsPooled(rng))
+		return;
+
+	SA_DiceEntropyRing *ring = rng->state.context;
+	SA_DiceEntropyPoolState *state = ring->state;
+
+	// The generator carries on with the ring’s own generator.
+	*rng = ring->fallbackRNG;
+
+	pthread_mutex_lock(&state->lock);
+	if (ring->refilling) {
+		ring->detached = YES;
+	} else {
+		SA_DiceEntropyPoolStateFreeRing(state, ring);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	SA_DiceEntropyPoolStateRelease(state);
+}
+
+/*****************************************************/
+#pragma mark - SA_DiceEntropyPool class implementation
+/*****************************************************/
+
+@implementation SA_DiceEntropyPool {
+	SA_DiceEntropyPoolState *_state;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(SA_DiceEntropyPoolState *) state {
+	return _state;
+}
+
+-(NSUInteger) ringCapacity {
+	return _state->ringCapacity;
+}
+
+-(NSUInteger) lowWatermark {
+	return _state->lowWatermark;
+}
+
+-(NSUInteger) highWatermark {
+	return _state->highWatermark;
+}
+
+-(NSUInteger) ringCount {
+	pthread_mutex_lock(&_state->lock);
+	NSUInteger ringCount = _state->ringCount;
+	pthread_mutex_unlock(&_state->lock);
+
+	return ringCount;
+}
+
+-(uint64_t) refillCount {
+	pthread_mutex_lock(&_state->lock);
+	uint64_t refillCount = _state->refillCount;
+	pthread_mutex_unlock(&_state->lock);
+
+	return refillCount;
+}
+
+-(uint64_t) refilledWordCount {
+	pthread_mutex_lock(&_state->lock);
+	uint64_t refilledWordCount = _state->refilledWordCount;
+	pthread_mutex_unlock(&_state->lock);
+
+	return refilledWordCount;
+}
+
+-(uint64_t) pooledWordCount {
+	pthread_mutex_lock(&_state->lock);
+	uint64_t pooledWordCount = _state->retiredPooledWordCount;
+	for (SA_DiceEntropyRing *ring = _state->rings; ring != NULL; ring = ring->nextRing)
+		pooledWordCount += atomic_load_explicit(&ring->pooledWordCount, memory_order_relaxed);
+	pthread_mutex_unlock(&_state->lock);
+
+	return pooledWordCount;
+}
+
+-(uint64_t) missCount {
+	pthread_mutex_lock(&_state->lock);
+	uint64_t missCount = _state->retiredMissCount;
+	for (SA_DiceEntropyRing *ring = _state->rings; ring != NULL; ring = ring->nextRing)
+		missCount += atomic_load_explicit(&ring->missCount, memory_order_relaxed);
+	pthread_mutex_unlock(&_state->lock);
+
+	return missCount;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithRingCapacity:SA_DICE_ENTROPY_POOL_DEFAULT_RING_CAPACITY
+						 lowWatermark:SA_DICE_ENTROPY_POOL_DEFAULT_LOW_WATERMARK
+						highWatermark:SA_DICE_ENTROPY_POOL_DEFAULT_HIGH_WATERMARK];
+}
+
+-(instancetype) initWithRingCapacity:(NSUInteger)ringCapacity
+						lowWatermark:(NSUInteger)lowWatermark
+					   highWatermark:(NSUInteger)highWatermark {
+	if (!(self = [super init]))
+		return nil;
+
+	NSUInteger capacity = 2;
+	while (capacity < ringCapacity)
+		capacity *= 2;
+	highWatermark = MAX(MIN(highWatermark, capacity), 1);
+	lowWatermark = MIN(lowWatermark, highWatermark - 1);
+
+	_state = calloc(1, sizeof(SA_DiceEntropyPoolState));
+	atomic_init(&_state->referenceCount, 1);
+	_state->ringCapacity = capacity;
+	_state->lowWatermark = lowWatermark;
+	_state->highWatermark = highWatermark;
+	SA_DiceRNGInitWithSystemEntropy(&_state->rng);
+	pthread_mutex_init(&_state->lock, NULL);
+	pthread_cond_init(&_state->refillRequested, NULL);
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	if (pthread_create(&thread, &attributes, SA_DiceEntropyPoolRefillThread, SA_DiceEntropyPoolStateRetain(_state)) != 0) {
+		// Without a thread, generators simply generate their own words, once
+		// their buffers are empty.
+		SA_DiceEntropyPoolStateRelease(_state);
+	}
+	pthread_attr_destroy(&attributes);
+
+	return self;
+}
+
+-(void) dealloc {
+	pthread_mutex_lock(&_state->lock);
+	_state->closed = YES;
+	pthread_cond_signal(&_state->refillRequested);
+	pthread_mutex_unlock(&_state->lock);
+
+	SA_DiceEntropyPoolStateRelease(_state);
+}
+
+@end
@@ -6,13 +6,43 @@
 
 #import <Foundation/Foundation.h>
 
+#import "SA_DiceExpression.h"
+#import "SA_DiceRNG.h"
+
 @class SA_DiceBag;
-@class SA_DiceExpression;
+@class SA_DiceEntropyPool;
+@class SA_DiceMetrics;
+@class SA_DiceProgram;
+@class SA_DiceRanking;
+
+// See the traceHandler property.
+typedef void (^SA_DiceEvaluatorTraceHandler)(SA_DiceExpression *node);
+
+// See -startAuditingWithKey:handler:.
+typedef void (^SA_DiceEvaluatorAuditHandler)(NSString *inputString, SA_DiceRNGPosition position);
 
 /************************************************/
 #pragma mark SA_DiceEvaluator class declaration
 /************************************************/
 
+/*
+ An evaluator may be shared by any number of threads, and used by all of
+ them at once: each evaluation runs with its own stack machine and generator
+ (see SA_DiceProgram.h), taken from a pool the evaluator keeps, and sees the
+ limits (maxDieCount, maxDieSize, maxExplosionCount, and maxCost), the
+ sumsOnly mode, the metrics, and the trace handler as they were when it
+ began, even if they are changed meanwhile.
+
+ While auditing (see -startAuditingWithKey:handler:), each of the pooled
+ generators is a counter-based one (see SA_DiceRNG.h), with the audit key,
+ and a stream of its own; so an evaluation’s rolls are determined entirely by
+ the position of its generator when it began, and the log of an evaluation
+ need hold only its input string and that position (three integers). Given
+ these, -replayResultOfExpression:fromPosition: regenerates exactly the same
+ rolls and result, at the cost of one evaluation (however many evaluations
+ came before it). Replaying requires the same limits and the same sumsOnly
+ mode as the evaluation being replayed.
+ */
 @interface SA_DiceEvaluator : NSObject
 
 /************************/
@@ -22,10 +52,117 @@
 @property NSUInteger maxDieCount;
 @property NSUInteger maxDieSize;
 
+// The largest total number of times dice may explode in the evaluation of
+// one expression; past this, the evaluation fails (with the error
+// SA_DiceExpressionError_EXPLOSION_COUNT_EXCESSIVE). The default is 100,000.
+@property NSUInteger maxExplosionCount;
+
+// The largest worst-case cost of evaluating one expression (the number of
+// random words drawn, plus the number of rolls recorded, as estimated from
+// the expression before anything is rolled; see SA_DiceCostEstimator.h). An
+// expression that might cost more is not evaluated at all, but fails (with
+// the error SA_DiceExpressionError_COST_EXCESSIVE) - so that no expression,
+// however it nests and chains its roll commands, can take more than a
+// bounded amount of work. NSUIntegerMax means no limit. The default is
+// 1,000,000.
+@property NSUInteger maxCost;
+
+// If YES, roll commands generate only their sums, not their individual rolls
+// (except where a ‘keep’ modifier needs them); result trees then have no
+// rolls for such roll commands. Sums of many dice are drawn directly from
+// their exact distributions (see SA_DiceSumSampler.h), at a cost which grows
+// only very slowly with the number of dice; so, in this mode, maxDieCount may
+// be raised into the millions. This is meant for callers that need only the
+// results (e.g., with SA_DiceFormatterBehaviorSimple). The default is NO.
+@property BOOL sumsOnly;
+
+// If set, every evaluation is recorded in the given metrics (see
+// SA_DiceMetrics.h): its latency (including compilation, for
+// -resultOfExpression:), the errors in its result, and the number of dice
+// rolled and of explosions. The default is nil.
+@property SA_DiceMetrics *metrics;
+
+// If set, this is called by -resultOfExpression: and -resultOfProgram:, on
+// the evaluating thread, once for each sub-expression that was evaluated
+// (sub-expressions before the expressions that contain them), with that
+// sub-expression of the result tree (its result, errors, and rolls filled in).
+// (-valueOfProgram:errors: keeps no per-node results, and does not call it.)
+// The default is nil.
+@property (copy) SA_DiceEvaluatorTraceHandler traceHandler;
+
+// If set, each of the pooled generators draws its random words from the given
+// entropy pool (see SA_DiceEntropyPool.h), which generates them ahead of
+// time, on a background thread; so evaluations spend no time generating them
+// (unless they draw words faster than the pool can supply them). While
+// auditing, the pool is not used. The default is nil.
+@property SA_DiceEntropyPool *entropyPool;
+
+// YES between -startAuditingWithKey:handler: and -stopAuditing.
+@property (readonly, getter=isAuditing) BOOL auditing;
+
 /****************************/
 #pragma mark - Public methods
 /****************************/
 
 -(SA_DiceExpression *) resultOfExpression:(SA_DiceExpression *)expression;
 
+// Runs a compiled expression (see SA_DiceProgram.h), and returns the result
+// tree (exactly as -resultOfExpression: would, for the expression the program
+// was compiled from). Evaluating the same expression many times is much
+// cheaper this way.
+-(SA_DiceExpression *) resultOfProgram:(SA_DiceProgram *)program;
+
+// Runs each of the given compiled expressions, in order, and returns their
+// result trees (in the same order), exactly as -resultOfProgram: would. All
+// of them run with one stack machine and generator, taken from the pool once
+// (and with the same settings), so this is cheaper than running them one by
+// one. Each is still traced, audited, and recorded in the metrics
+// separately.
+-(NSArray <SA_DiceExpression *> *) resultsOfPrograms:(NSArray <SA_DiceProgram *> *)programs;
+
+// Runs each of the given compiled expressions (as -resultsOfPrograms: does),
+// and ranks their results, highest or lowest first (see SA_DiceRanking.h).
+-(SA_DiceRanking *) rankingOfPrograms:(NSArray <SA_DiceProgram *> *)programs
+						 highestFirst:(BOOL)highestFirst;
+
+// Runs the given compiled expression once for each of the given bonuses (a C
+// array of ‘count’ bonuses), adds each bonus to its result, and ranks the
+// sums, highest or lowest first (see SA_DiceRanking.h). Returns nil if the
+// program is nil.
+-(SA_DiceRanking *) rankingOfProgram:(SA_DiceProgram *)program
+						 withBonuses:(const NSInteger *)bonuses
+							   count:(NSUInteger)count
+						highestFirst:(BOOL)highestFirst;
+
+// Runs a compiled expression, and returns only its result (and its errors,
+// by reference; if there are any, the result is meaningless), without
+// building a result tree. This allocates no memory.
+-(NSInteger) valueOfProgram:(SA_DiceProgram *)program
+					 errors:(SA_DiceExpressionError *)errors;
+
+// Starts auditing: from now on, each evaluation rolls its dice with a
+// counter-based generator keyed with the given key, and, once it is done,
+// calls the given handler (on the evaluating thread) with the input string
+// of the evaluated expression, and the position of the generator when the
+// evaluation began. Each generator has a stream of its own, and starts at
+// counter 0; so no two evaluations (while auditing with the same key) roll
+// the same numbers. (The evaluator’s dice bag is not used while auditing.)
+// NOTE: Do not audit with the same key twice; use a new (random) key each
+// time auditing is started.
+-(void) startAuditingWithKey:(uint64_t)key
+					 handler:(SA_DiceEvaluatorAuditHandler)handler;
+
+// Stops auditing; evaluations go back to rolling with the evaluator’s dice
+// bag (or with generators seeded from system entropy).
+-(void) stopAuditing;
+
+// Evaluates the given expression (or compiled expression) with a generator
+// started at the given position (as passed to an audit handler), and returns
+// the result tree. The pooled generators are not used (nor disturbed); the
+// evaluation is not traced, audited, nor recorded in the metrics.
+-(SA_DiceExpression *) replayResultOfExpression:(SA_DiceExpression *)expression
+								   fromPosition:(SA_DiceRNGPosition)position;
+-(SA_DiceExpression *) replayResultOfProgram:(SA_DiceProgram *)program
+								fromPosition:(SA_DiceRNGPosition)position;
+
 @end
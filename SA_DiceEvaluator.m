@@ -7,18 +7,56 @@
 #import "SA_DiceEvaluator.h"
 
 #import "SA_DiceBag.h"
+#import "SA_DiceEntropyPool.h"
 #import "SA_DiceParser.h"
 #import "SA_DiceExpression.h"
-#import "SA_DiceExpressionStringConstants.h"
+#import "SA_DiceMetrics.h"
+#import "SA_DiceProgram.h"
+#import "SA_DiceRanking.h"
 
 #import "SA_Utility.h"
 
+#import <pthread.h>
+
 /**************************/
 #pragma mark Defined values
 /**************************/
 
-#define DEFAULT_MAX_DIE_COUNT	 1000	// One thousand
-#define DEFAULT_MAX_DIE_SIZE	10000	// Ten thousand
+#define DEFAULT_MAX_DIE_COUNT		  1000	// One thousand
+#define DEFAULT_MAX_DIE_SIZE		 10000	// Ten thousand
+#define DEFAULT_MAX_EXPLOSION_COUNT	100000	// One hundred thousand
+#define DEFAULT_MAX_COST			1000000	// One million
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+/*
+ Everything one evaluation needs that may not be shared with another
+ evaluation running at the same time: a stack machine, and a generator.
+
+ An evaluator keeps a pool of these; each evaluation takes one from the pool
+ (creating a new one only if all are in use, i.e. only if the evaluator is
+ being used by more threads at once than ever before), and returns it when
+ done. The first one created rolls dice with the evaluator’s own dice bag;
+ the others have generators of their own. (While auditing, every context has
+ a counter-based generator of its own, whose stream is the context’s index;
+ see -startAuditingWithKey:handler:. Otherwise, if the evaluator has an
+ entropy pool, every context has a generator of its own, drawing from it.)
+ */
+typedef struct SA_DiceEvaluatorContext {
+	SA_DiceMachine *machine;
+	SA_DiceRNG *rng;
+	SA_DiceRNG ownRNG;
+
+	// The order in which the context was created (from 0).
+	NSUInteger index;
+
+	// The audit generation (see below) for which the generator was set up.
+	NSUInteger auditGeneration;
+
+	struct SA_DiceEvaluatorContext *nextIdleContext;
+} SA_DiceEvaluatorContext;
 
 /***************************************************/
 #pragma mark - SA_DiceEvaluator class implementation
@@ -27,8 +65,28 @@
 @implementation SA_DiceEvaluator {
 	SA_DiceBag *_diceBag;
 
+	// Guards the pool of contexts, the limits, the mode, the metrics, the
+	// trace handler, the entropy pool, and the audit settings.
+	pthread_mutex_t _lock;
+	SA_DiceEvaluatorContext *_idleContexts;
+	NSUInteger _contextCount;
+
 	NSUInteger _maxDieCount;
 	NSUInteger _maxDieSize;
+	NSUInteger _maxExplosionCount;
+	NSUInteger _maxCost;
+	BOOL _sumsOnly;
+
+	SA_DiceMetrics *_metrics;
+	SA_DiceEvaluatorTraceHandler _traceHandler;
+	SA_DiceEntropyPool *_entropyPool;
+
+	// Incremented whenever auditing is started or stopped (or the entropy
+	// pool is changed, while not auditing), so that each context’s generator
+	// is set up anew when it is next used.
+	NSUInteger _auditGeneration;
+	uint64_t _auditKey;
+	SA_DiceEvaluatorAuditHandler _auditHandler;
 }
 
 /************************/
@@ -36,20 +94,29 @@
 /************************/
 
 -(NSUInteger) maxDieCount {
-	return _maxDieCount;
+	pthread_mutex_lock(&_lock);
+	NSUInteger maxDieCount = _maxDieCount;
+	pthread_mutex_unlock(&_lock);
+	return maxDieCount;
 }
 -(void) setMaxDieCount:(NSUInteger)maxDieCount {
-	if (maxDieCount > (NSUIntegerMax / _maxDieSize)) {
-		_maxDieCount = NSUIntegerMax / _maxDieSize;
+	pthread_mutex_lock(&_lock);
+	if (maxDieCount > (NSIntegerMax / _maxDieSize)) {
+		_maxDieCount = NSIntegerMax / _maxDieSize;
 	} else {
 		_maxDieCount = maxDieCount;
 	}
+	pthread_mutex_unlock(&_lock);
 }
 
 -(NSUInteger) maxDieSize {
-	return _maxDieSize;
+	pthread_mutex_lock(&_lock);
+	NSUInteger maxDieSize = _maxDieSize;
+	pthread_mutex_unlock(&_lock);
+	return maxDieSize;
 }
 -(void) setMaxDieSize:(NSUInteger)maxDieSize {
+	pthread_mutex_lock(&_lock);
 	if (   maxDieSize > [_diceBag biggestPossibleDieSize]
 		|| maxDieSize > (NSIntegerMax / _maxDieCount)) {
 		_maxDieSize = (([_diceBag biggestPossibleDieSize] < (NSIntegerMax / _maxDieCount))
@@ -58,6 +125,93 @@
 	} else {
 		_maxDieSize = maxDieSize;
 	}
+	pthread_mutex_unlock(&_lock);
+}
+
+-(NSUInteger) maxExplosionCount {
+	pthread_mutex_lock(&_lock);
+	NSUInteger maxExplosionCount = _maxExplosionCount;
+	pthread_mutex_unlock(&_lock);
+	return maxExplosionCount;
+}
+-(void) setMaxExplosionCount:(NSUInteger)maxExplosionCount {
+	pthread_mutex_lock(&_lock);
+	_maxExplosionCount = maxExplosionCount;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(NSUInteger) maxCost {
+	pthread_mutex_lock(&_lock);
+	NSUInteger maxCost = _maxCost;
+	pthread_mutex_unlock(&_lock);
+	return maxCost;
+}
+-(void) setMaxCost:(NSUInteger)maxCost {
+	pthread_mutex_lock(&_lock);
+	_maxCost = maxCost;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(BOOL) sumsOnly {
+	pthread_mutex_lock(&_lock);
+	BOOL sumsOnly = _sumsOnly;
+	pthread_mutex_unlock(&_lock);
+	return sumsOnly;
+}
+-(void) setSumsOnly:(BOOL)sumsOnly {
+	pthread_mutex_lock(&_lock);
+	_sumsOnly = sumsOnly;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(SA_DiceMetrics *) metrics {
+	pthread_mutex_lock(&_lock);
+	SA_DiceMetrics *metrics = _metrics;
+	pthread_mutex_unlock(&_lock);
+	return metrics;
+}
+-(void) setMetrics:(SA_DiceMetrics *)metrics {
+	pthread_mutex_lock(&_lock);
+	_metrics = metrics;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(SA_DiceEvaluatorTraceHandler) traceHandler {
+	pthread_mutex_lock(&_lock);
+	SA_DiceEvaluatorTraceHandler traceHandler = _traceHandler;
+	pthread_mutex_unlock(&_lock);
+	return traceHandler;
+}
+-(void) setTraceHandler:(SA_DiceEvaluatorTraceHandler)traceHandler {
+	traceHandler = [traceHandler copy];
+	pthread_mutex_lock(&_lock);
+	_traceHandler = traceHandler;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(SA_DiceEntropyPool *) entropyPool {
+	pthread_mutex_lock(&_lock);
+	SA_DiceEntropyPool *entropyPool = _entropyPool;
+	pthread_mutex_unlock(&_lock);
+	return entropyPool;
+}
+-(void) setEntropyPool:(SA_DiceEntropyPool *)entropyPool {
+	pthread_mutex_lock(&_lock);
+	_entropyPool = entropyPool;
+	// While auditing, the pool is not used; and setting the generators up
+	// anew would start them over from counter 0, rolling again numbers that
+	// were already rolled. (They are set up anew, with the new pool, when
+	// auditing stops.)
+	if (_auditHandler == nil)
+		_auditGeneration++;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(BOOL) isAuditing {
+	pthread_mutex_lock(&_lock);
+	BOOL auditing = (_auditHandler != nil);
+	pthread_mutex_unlock(&_lock);
+	return auditing;
 }
 
 /**************************/
@@ -70,12 +224,28 @@
 
 	_maxDieCount = DEFAULT_MAX_DIE_COUNT;
 	_maxDieSize = DEFAULT_MAX_DIE_SIZE;
+	_maxExplosionCount = DEFAULT_MAX_EXPLOSION_COUNT;
+	_maxCost = DEFAULT_MAX_COST;
 
 	_diceBag = [SA_DiceBag new];
+	pthread_mutex_init(&_lock, NULL);
 
 	return self;
 }
 
+-(void) dealloc {
+	// No evaluation can be in progress, so every context is idle.
+	while (_idleContexts != NULL) {
+		SA_DiceEvaluatorContext *context = _idleContexts;
+		_idleContexts = context->nextIdleContext;
+		SA_DiceRNGDetachFromEntropyPool(&context->ownRNG);
+		SA_DiceMachineDestroy(context->machine);
+		free(context);
+	}
+
+	pthread_mutex_destroy(&_lock);
+}
+
 /****************************/
 #pragma mark - Public methods
 /****************************/
@@ -83,15 +253,15 @@
 // TODO: Possibly refuse to evaluate an expression that’s already evaluated?
 // (i.e., it has a  ...  .result?? .value??)
 -(SA_DiceExpression *) resultOfExpression:(SA_DiceExpression *)expression {
-	// Check to see if the expression is erroneous (i.e. the parser has judged
-	// that it is malformed, etc.). If so, decline to evaluate the expression;
-	// return (a copy of) it, unchanged.
-	if (expression.errorBitMask != 0) {
-		return [expression copy];
-	}
-	
+	if (expression == nil)
+		return nil;
+
 	/*
-	 NOTE: Even if an expression is not erroneous (i.e. if it has no syntax 
+	 NOTE: If the expression is erroneous (i.e. the parser has judged that it
+	 is malformed, etc.), we decline to evaluate it, and return (a copy of) it,
+	 unchanged.
+
+	 Even if an expression is not erroneous (i.e. if it has no syntax
 	 errors), it may still not be possible to evaluate it. For example, ‘5d0’ 
 	 is a perfectly well-formed die string, and will yield an expression tree 
 	 as follows:
@@ -112,316 +282,318 @@
 	 If we encounter such an illegal expression, we add an appropriate error to 
 	 the -[errorBitMask]. We are not required to set a value (-[value] property)
 	 in such a case.
+
+	 Expressions are evaluated by compiling them into a program for a stack
+	 machine (see SA_DiceProgram.h), and running it. (If the expression is an
+	 unmodified view of a parsed tree, the tree is compiled as it is, without
+	 being copied.)
 	 */
+	return [self resultOfProgram:nil
+					orExpression:expression];
+}
 
-	switch (expression.type) {
-		case SA_DiceExpressionTerm_OPERATION: {
-			return [self resultOfExpressionDescribingOperation:expression];
-			break;
-		}
-		case SA_DiceExpressionTerm_ROLL_COMMAND: {
-			return [self resultOfExpressionDescribingRollCommand:expression];
-			break;
-		}
-		case SA_DiceExpressionTerm_ROLL_MODIFIER: {
-			return [self resultOfExpressionDescribingRollModifier:expression];
-			break;
-		}
-		case SA_DiceExpressionTerm_VALUE:
-		default: {
-			return [self resultOfExpressionDescribingValue:expression];
-			break;
-		}
+-(SA_DiceExpression *) resultOfProgram:(SA_DiceProgram *)program {
+	return [self resultOfProgram:program
+					orExpression:nil];
+}
+
+-(NSArray <SA_DiceExpression *> *) resultsOfPrograms:(NSArray <SA_DiceProgram *> *)programs {
+	NSUInteger programCount = programs.count;
+	if (programCount == 0)
+		return @[];
+
+	SA_DiceProgramEnvironment environment;
+	SA_DiceMetrics *metrics;
+	SA_DiceEvaluatorTraceHandler traceHandler;
+	SA_DiceEvaluatorAuditHandler auditHandler;
+	SA_DiceEvaluatorContext *context = [self acquireContextWithEnvironment:&environment
+																   metrics:&metrics
+															  traceHandler:&traceHandler
+															  auditHandler:&auditHandler];
+
+	NSMutableArray <SA_DiceExpression *> *results = [NSMutableArray arrayWithCapacity:programCount];
+	SA_DiceRNGPosition *auditPositions = ((auditHandler != nil)
+										  ? malloc(programCount * sizeof(SA_DiceRNGPosition))
+										  : NULL);
+	for (NSUInteger i = 0; i < programCount; i++) {
+		SA_DiceProgram *program = programs[i];
+		uint64_t startTime = (metrics != nil) ? SA_DiceMetricsCurrentTime() : 0;
+		if (auditPositions != NULL)
+			auditPositions[i] = SA_DiceRNGGetPosition(context->rng);
+
+		SA_DiceExpressionError errors = 0;
+		[program runOnMachine:context->machine
+				  environment:&environment
+			 recordResultTree:YES
+					   errors:&errors];
+		[results addObject:[program resultTreeFromMachine:context->machine
+											 traceHandler:traceHandler]];
+
+		if (metrics != nil)
+			[self recordEvaluationOnMachine:context->machine
+								  startTime:startTime
+									 errors:errors
+								  inMetrics:metrics];
+	}
+
+	[self relinquishContext:context];
+
+	// (The audit handler is called only once the context is back in the
+	// pool, as it is for single evaluations.)
+	if (auditPositions != NULL) {
+		for (NSUInteger i = 0; i < programCount; i++)
+			auditHandler(programs[i].expression.inputString, auditPositions[i]);
+		free(auditPositions);
 	}
+
+	return results;
+}
+
+-(SA_DiceRanking *) rankingOfPrograms:(NSArray <SA_DiceProgram *> *)programs
+						 highestFirst:(BOOL)highestFirst {
+	return [[SA_DiceRanking alloc] initWithResults:[self resultsOfPrograms:programs]
+										   bonuses:NULL
+									  highestFirst:highestFirst];
+}
+
+-(SA_DiceRanking *) rankingOfProgram:(SA_DiceProgram *)program
+						 withBonuses:(const NSInteger *)bonuses
+							   count:(NSUInteger)count
+						highestFirst:(BOOL)highestFirst {
+	if (program == nil)
+		return nil;
+
+	// The same program, run once per bonus (the bonuses are added only when
+	// the results are ranked).
+	NSMutableArray <SA_DiceProgram *> *programs = [NSMutableArray arrayWithCapacity:count];
+	for (NSUInteger i = 0; i < count; i++)
+		[programs addObject:program];
+
+	return [[SA_DiceRanking alloc] initWithResults:[self resultsOfPrograms:programs]
+										   bonuses:bonuses
+									  highestFirst:highestFirst];
+}
+
+-(NSInteger) valueOfProgram:(SA_DiceProgram *)program
+					 errors:(SA_DiceExpressionError *)errors {
+	SA_DiceProgramEnvironment environment;
+	SA_DiceMetrics *metrics;
+	SA_DiceEvaluatorAuditHandler auditHandler;
+	SA_DiceEvaluatorContext *context = [self acquireContextWithEnvironment:&environment
+																   metrics:&metrics
+															  traceHandler:NULL
+															  auditHandler:&auditHandler];
+	uint64_t startTime = (metrics != nil) ? SA_DiceMetricsCurrentTime() : 0;
+	SA_DiceRNGPosition auditPosition = ((auditHandler != nil)
+										? SA_DiceRNGGetPosition(context->rng)
+										: (SA_DiceRNGPosition) { 0 });
+
+	SA_DiceExpressionError runErrors = 0;
+	NSInteger value = [program runOnMachine:context->machine
+								environment:&environment
+						   recordResultTree:NO
+									 errors:&runErrors];
+
+	if (metrics != nil)
+		[self recordEvaluationOnMachine:context->machine
+							  startTime:startTime
+								 errors:runErrors
+							  inMetrics:metrics];
+
+	[self relinquishContext:context];
+
+	if (errors != NULL)
+		*errors = runErrors;
+
+	if (auditHandler != nil)
+		auditHandler(program.expression.inputString, auditPosition);
+
+	return value;
+}
+
+-(void) startAuditingWithKey:(uint64_t)key
+					 handler:(SA_DiceEvaluatorAuditHandler)handler {
+	handler = [handler copy];
+	pthread_mutex_lock(&_lock);
+	_auditKey = key;
+	_auditHandler = handler;
+	_auditGeneration++;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(void) stopAuditing {
+	pthread_mutex_lock(&_lock);
+	_auditHandler = nil;
+	_auditGeneration++;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(SA_DiceExpression *) replayResultOfExpression:(SA_DiceExpression *)expression
+								   fromPosition:(SA_DiceRNGPosition)position {
+	if (expression == nil)
+		return nil;
+
+	return [self replayResultOfProgram:[[SA_DiceProgram alloc] initWithExpression:expression]
+						  fromPosition:position];
+}
+
+-(SA_DiceExpression *) replayResultOfProgram:(SA_DiceProgram *)program
+								fromPosition:(SA_DiceRNGPosition)position {
+	// Replaying needs none of the pooled contexts (and does not disturb
+	// their generators): only a generator started at the given position.
+	SA_DiceRNG rng;
+	SA_DiceRNGInitWithPosition(&rng, position);
+
+	SA_DiceProgramEnvironment environment;
+	pthread_mutex_lock(&_lock);
+	[self getEnvironment:&environment
+				 withRNG:&rng];
+	pthread_mutex_unlock(&_lock);
+
+	SA_DiceMachine *machine = SA_DiceMachineCreate();
+	[program runOnMachine:machine
+			  environment:&environment
+		 recordResultTree:YES
+				   errors:NULL];
+	SA_DiceExpression *result = [program resultTreeFromMachine:machine];
+	SA_DiceMachineDestroy(machine);
+
+	return result;
 }
 
 /****************************/
 #pragma mark - Helper methods
 /****************************/
 
--(SA_DiceExpression *) resultOfExpressionDescribingValue:(SA_DiceExpression *)expression {
-	SA_DiceExpression *result = [expression copy];
-	
-	result.result = result.value;
-	
+// Runs the given program, or (if it is nil) compiles the given expression
+// and runs that; in the latter case, compilation is measured as part of the
+// evaluation.
+-(SA_DiceExpression *) resultOfProgram:(SA_DiceProgram *)program
+						  orExpression:(SA_DiceExpression *)expression {
+	SA_DiceProgramEnvironment environment;
+	SA_DiceMetrics *metrics;
+	SA_DiceEvaluatorTraceHandler traceHandler;
+	SA_DiceEvaluatorAuditHandler auditHandler;
+	SA_DiceEvaluatorContext *context = [self acquireContextWithEnvironment:&environment
+																   metrics:&metrics
+															  traceHandler:&traceHandler
+															  auditHandler:&auditHandler];
+	uint64_t startTime = (metrics != nil) ? SA_DiceMetricsCurrentTime() : 0;
+	SA_DiceRNGPosition auditPosition = ((auditHandler != nil)
+										? SA_DiceRNGGetPosition(context->rng)
+										: (SA_DiceRNGPosition) { 0 });
+
+	if (program == nil)
+		program = [[SA_DiceProgram alloc] initWithExpression:expression];
+
+	SA_DiceExpressionError errors = 0;
+	[program runOnMachine:context->machine
+			  environment:&environment
+		 recordResultTree:YES
+				   errors:&errors];
+	SA_DiceExpression *result = [program resultTreeFromMachine:context->machine
+												  traceHandler:traceHandler];
+
+	if (metrics != nil)
+		[self recordEvaluationOnMachine:context->machine
+							  startTime:startTime
+								 errors:errors
+							  inMetrics:metrics];
+
+	[self relinquishContext:context];
+
+	if (auditHandler != nil)
+		auditHandler((expression ?: program.expression).inputString, auditPosition);
+
 	return result;
 }
 
--(SA_DiceExpression *) resultOfExpressionDescribingRollCommand:(SA_DiceExpression *)expression {
-	SA_DiceExpression *result = [expression copy];
-
-	// For now, only sum and exploding sum (i.e., sum but with exploding dice)
-	// are supported. Other sorts of roll commands may be added later.
-	switch (result.rollCommand) {
-		case SA_DiceExpressionRollCommand_SUM:
-		case SA_DiceExpressionRollCommand_SUM_EXPLODING: {
-			// First, recursively evaluate the expressions that represent the
-			// die count and (for standard dice) the die size.
-			result.dieCount = [self resultOfExpression:result.dieCount];
-			if (result.dieType == SA_DiceExpressionDice_STANDARD)
-				result.dieSize = [self resultOfExpression:result.dieSize];
-
-			// Evaluating those expressions may have generated an error(s);
-			// propagate any errors up to the current term.
-			result.errorBitMask |= result.dieCount.errorBitMask;
-			if (result.dieType == SA_DiceExpressionDice_STANDARD)
-				result.errorBitMask |= result.dieSize.errorBitMask;
-
-			// If indeed we’ve turned up errors, return.
-			if (result.errorBitMask != 0)
-				return result;
-
-			// Evaluating the two sub-expressions didn’t generate errors; this means
-			// that we have successfully generated values for both the die count and
-			// (for standard dice) the die size...
-			NSInteger dieCount = result.dieCount.result.integerValue;
-			NSInteger dieSize = 0;
-			if (result.dieType == SA_DiceExpressionDice_STANDARD)
-				dieSize = result.dieSize.result.integerValue;
-
-			// ... but, the resulting values of the expressions may make it
-			// impossible to evaluate the roll command. Check to see whether the die
-			// count and die size have legal values.
-			if (dieCount < 0) {
-				result.errorBitMask |= SA_DiceExpressionError_DIE_COUNT_NEGATIVE;
-			} else if (dieCount > _maxDieCount) {
-				result.errorBitMask |= SA_DiceExpressionError_DIE_COUNT_EXCESSIVE;
-			}
-
-			// Die type only matters for standard dice, not for Fudge dice.
-			if (result.dieType == SA_DiceExpressionDice_STANDARD) {
-				if (dieSize < 1) {
-					result.errorBitMask |= SA_DiceExpressionError_DIE_SIZE_INVALID;
-				} else if (dieSize > _maxDieSize) {
-					result.errorBitMask |= SA_DiceExpressionError_DIE_SIZE_EXCESSIVE;
-				}
-			}
-
-			// If indeed the die count or die size fall outside of their allowed
-			// ranges, return.
-			if (result.errorBitMask != 0)
-				return result;
-
-			// The die count and die size have legal values. We can safely roll the
-			// requisite number of dice, and take the sum of the rolls (if needed).
-			// NOTE: _maxDieSize is guaranteed to be no greater than the largest die
-			// size that the SA_DiceBag can roll (this is enforced by the setter
-			// method for the maxDieSize property), so we need not check to see
-			// if the return value of rollDie: or rollNumber:ofDice: is valid.
-			// We are also guaranteed that the product of _maxDieCount and
-			// _maxDieSize is no greater than the largest unsigned value that can be
-			// stored by whatever numeric type we specify simple value terms (terms
-			// of type SA_DiceExpressionTerm_VALUE) to contain (likewise enforced
-			// by the setters for both maxDieSize and maxDieCount), therefore we
-			// need not worry about overflow here.
-			if (dieCount == 0) {
-				result.result = @(0);
-				result.rolls = @[];
-			} else {
-				NSArray *rolls;
-				if (result.dieType == SA_DiceExpressionDice_STANDARD) {
-					SA_DiceRollingOptions options = (result.rollCommand == SA_DiceExpressionRollCommand_SUM_EXPLODING) ? SA_DiceRollingExplodingDice : 0;
-					rolls = [_diceBag rollNumber:dieCount
-										  ofDice:dieSize
-									 withOptions:options];
-				} else if (result.dieType == SA_DiceExpressionDice_FUDGE) {
-					rolls = [_diceBag rollFudgeDice:dieCount];
-				}
-
-				result.result = [rolls valueForKeyPath:@"@sum.self"];
-				result.rolls = rolls;
-			}
-
-			break;
-		}
-		default: {
-			result.errorBitMask |= SA_DiceExpressionError_UNKNOWN_ROLL_COMMAND;
+-(void) recordEvaluationOnMachine:(SA_DiceMachine *)machine
+						startTime:(uint64_t)startTime
+						   errors:(SA_DiceExpressionError)errors
+						inMetrics:(SA_DiceMetrics *)metrics {
+	[metrics recordStage:SA_DiceMetricsStage_EVALUATE
+				duration:(SA_DiceMetricsCurrentTime() - startTime)
+				  errors:errors];
+	[metrics recordDiceRolled:SA_DiceMachineDiceRolledCount(machine)
+				   explosions:SA_DiceMachineExplosionCount(machine)];
+}
+
+// Takes an idle context from the pool (or creates one), and fills in the
+// environment for an evaluation with it, and the metrics, trace handler, and
+// audit handler to use (if any; the trace handler is not returned if NULL is
+// passed), so that the whole evaluation sees the same settings, even if they
+// are changed meanwhile.
+-(SA_DiceEvaluatorContext *) acquireContextWithEnvironment:(SA_DiceProgramEnvironment *)environment
+												   metrics:(SA_DiceMetrics * __strong *)metrics
+											  traceHandler:(SA_DiceEvaluatorTraceHandler __strong *)traceHandler
+											  auditHandler:(SA_DiceEvaluatorAuditHandler __strong *)auditHandler {
+	pthread_mutex_lock(&_lock);
+
+	SA_DiceEvaluatorContext *context = _idleContexts;
+	if (context != NULL) {
+		_idleContexts = context->nextIdleContext;
+	} else {
+		context = calloc(1, sizeof(SA_DiceEvaluatorContext));
+		context->machine = SA_DiceMachineCreate();
+		context->index = _contextCount++;
+		context->auditGeneration = NSUIntegerMax;
+	}
 
-			break;
+	// Set up the context’s generator, if auditing has been started or stopped
+	// (or the entropy pool changed) since it was last used (or if it is new).
+	if (context->auditGeneration != _auditGeneration) {
+		SA_DiceRNGDetachFromEntropyPool(&context->ownRNG);
+		if (_auditHandler != nil) {
+			SA_DiceRNGInitWithPosition(&context->ownRNG, (SA_DiceRNGPosition) {
+				.key = _auditKey,
+				.stream = context->index,
+				.counter = 0
+			});
+			context->rng = &context->ownRNG;
+		} else if (_entropyPool != nil) {
+			SA_DiceRNGInitWithEntropyPool(&context->ownRNG, _entropyPool);
+			context->rng = &context->ownRNG;
+		} else if (context->index == 0) {
+			context->rng = _diceBag.randomNumberGenerator;
+		} else {
+			SA_DiceRNGInitWithSystemEntropy(&context->ownRNG);
+			context->rng = &context->ownRNG;
 		}
+		context->auditGeneration = _auditGeneration;
 	}
 
-	return result;
-}
+	[self getEnvironment:environment
+				 withRNG:context->rng];
+	*metrics = _metrics;
+	if (traceHandler != NULL)
+		*traceHandler = _traceHandler;
+	*auditHandler = _auditHandler;
 
--(SA_DiceExpression *) resultOfExpressionDescribingRollModifier:(SA_DiceExpression *)expression {
-	SA_DiceExpression *result = [expression copy];
-
-	switch (result.rollModifier) {
-		case SA_DiceExpressionRollModifier_KEEP_HIGHEST:
-		case SA_DiceExpressionRollModifier_KEEP_LOWEST: {
-			// These roll modifiers takes the highest, or the lowest, N rolls
-			// out of all the rolls generated by a roll command, discarding the
-			// rest, and summing the kept ones.
-
-			// First, check if the left-hand operand is a roll command (and
-			// specifically, a simple sum; though this latter requirement may
-			// be dropped later).
-			// TODO: re-evaluate this ^
-			// If the left-hand operand is not a roll-and-sum, then the KEEP
-			// modifier cannot be applied to it. In that case, we add an error
-			// and return the result without evaluating.
-			if (   result.leftOperand.type != SA_DiceExpressionTerm_ROLL_COMMAND
-				|| (   result.leftOperand.rollCommand != SA_DiceExpressionRollCommand_SUM
-					&& result.leftOperand.rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING)
-				) {
-				result.errorBitMask |= SA_DiceExpressionError_ROLL_MODIFIER_INAPPLICABLE;
-				return result;
-			}
-
-			// We now know the left-hand operand is a roll command. Recursively
-			// evaluate the expressions that represent the roll command and the
-			// modifier value (the right-hand operand).
-			result.leftOperand = [self resultOfExpression:result.leftOperand];
-			result.rightOperand = [self resultOfExpression:result.rightOperand];
-
-			// Evaluating the operands may have generated an error(s); propagate any
-			// errors up to the current term.
-			result.errorBitMask |= result.leftOperand.errorBitMask;
-			result.errorBitMask |= result.rightOperand.errorBitMask;
-
-			// If indeed we’ve turned up errors, return.
-			if (result.errorBitMask != 0)
-				return result;
-
-			// Evaluating the operands didn’t generate any errors; this means
-			// that on the left hand we have a set of rolls (as well as a
-			// result, which we are ignoring), and on the right hand we have a
-			// result, which specifies how many rolls to keep.
-			NSArray <NSNumber *> *rolls = result.leftOperand.rolls;
-			NSNumber *keepHowMany = result.rightOperand.result;
-
-			// However, it is now possible that the “keep how many” value
-			// exceeds the number of rolls, which would make the expression
-			// incoherent. If so, add an error and return.
-			if (keepHowMany.unsignedIntegerValue > rolls.count) {
-				result.errorBitMask |= SA_DiceExpressionError_KEEP_COUNT_EXCEEDS_ROLL_COUNT;
-				return result;
-			}
-
-			// It is also possible that the “keep how many” value is negative.
-			// This, too, would make the expression incoherent. Likewise, add
-			// an error and return.
-			if (keepHowMany < 0) {
-				result.errorBitMask |= SA_DiceExpressionError_KEEP_COUNT_NEGATIVE;
-				return result;
-			}
-
-			// We sort the rolls array...
-			BOOL sortAscending = (result.rollModifier == SA_DiceExpressionRollModifier_KEEP_LOWEST);
-			result.rolls = [rolls sortedArrayUsingDescriptors:@[ [NSSortDescriptor sortDescriptorWithKey:@"integerValue"
-																							   ascending:sortAscending] ]];
-
-			// And the ‘result’ property of the result expression is the sum of
-			// the first <keepHowMany> elements of the sorted rolls array.
-			result.result = [[result.rolls subarrayWithRange:NSRangeMake(0, keepHowMany.unsignedIntegerValue)] valueForKeyPath:@"@sum.self"];
-
-			break;
-		}
-		default: {
-			result.errorBitMask |= SA_DiceExpressionError_UNKNOWN_ROLL_MODIFIER;
+	pthread_mutex_unlock(&_lock);
 
-			break;
-		}
-	}
-	
-	return result;
+	return context;
 }
 
--(SA_DiceExpression *) resultOfExpressionDescribingOperation:(SA_DiceExpression *)expression {
-	SA_DiceExpression *result = [expression copy];
-	
-	// First, recursively evaluate the expressions that represent the 
-	// left-hand-side and right-hand-side operands.
-	result.leftOperand = [self resultOfExpression:result.leftOperand];
-	result.rightOperand = [self resultOfExpression:result.rightOperand];
-	
-	// Evaluating the operands may have generated an error(s); propagate any
-	// errors up to the current term.
-	result.errorBitMask |= result.leftOperand.errorBitMask;
-	result.errorBitMask |= result.rightOperand.errorBitMask;
-
-	// If indeed we’ve turned up errors, return.
-	if (result.errorBitMask != 0)
-		return result;
-
-	// Evaluating the operands didn’t generate any errors. We have valid
-	// operands.
-	NSInteger leftOperand = result.leftOperand.result.integerValue;
-	NSInteger rightOperand = result.rightOperand.result.integerValue;
-
-	switch (result.operator) {
-		case SA_DiceExpressionOperator_MINUS: {
-			// First, we check for possible overflow...
-			if (   leftOperand > 0
-				&& rightOperand < 0
-				&& (NSIntegerMax + rightOperand) < leftOperand) {
-				result.errorBitMask |= SA_DiceExpressionError_INTEGER_OVERFLOW_SUBTRACTION;
-				break;
-			} else if (   leftOperand < 0
-					   && rightOperand > 0
-					   && (NSIntegerMin + rightOperand) > leftOperand) {
-				result.errorBitMask |= SA_DiceExpressionError_INTEGER_UNDERFLOW_SUBTRACTION;
-				break;
-			}
-
-			// No overflow will occur. We can perform the subtraction operation.
-			result.result = @(leftOperand - rightOperand);
-			break;
-		}
-		case SA_DiceExpressionOperator_PLUS: {
-			// First, we check for possible overflow...
-			if (   rightOperand > 0
-				&& leftOperand > 0
-				&& (NSIntegerMax - rightOperand) < leftOperand) {
-				result.errorBitMask |= SA_DiceExpressionError_INTEGER_OVERFLOW_ADDITION;
-				break;
-			} else if (   rightOperand < 0
-					   && leftOperand < 0
-					   && (NSIntegerMin - rightOperand) > leftOperand) {
-				result.errorBitMask |= SA_DiceExpressionError_INTEGER_UNDERFLOW_ADDITION;
-				break;
-			}
-
-			// No overflow will occur. We can perform the addition operation.
-			result.result = @(leftOperand + rightOperand);
-			break;
-		}
-		case SA_DiceExpressionOperator_TIMES: {
-			// First, we check for possible overflow...
-			if (   (   leftOperand == NSIntegerMin
-					&& (   rightOperand != 0
-						|| rightOperand != 1 ))
-				|| (   rightOperand == NSIntegerMin
-					&& (   leftOperand != 0
-						|| leftOperand != 1 ))
-				|| (   leftOperand != 0
-					&& ((NSIntegerMax / ABS(leftOperand)) < rightOperand))
-				) {
-				if (   (   leftOperand > 0
-						&& rightOperand > 0)
-					|| (   leftOperand < 0
-						&& rightOperand < 0)) {
-					result.errorBitMask |= SA_DiceExpressionError_INTEGER_OVERFLOW_MULTIPLICATION;
-				} else {
-					result.errorBitMask |= SA_DiceExpressionError_INTEGER_UNDERFLOW_MULTIPLICATION;
-				}
-				break;
-			}
-
-			// No overflow will occur. We can perform the multiplication operation.
-			result.result = @(leftOperand * rightOperand);
-			break;
-		}
-		default: {
-			// We add the appropriate error. We do not set a value for the
-			// result property.
-			result.errorBitMask |= SA_DiceExpressionError_UNKNOWN_OPERATOR;
-			break;
-		}
-	}
+// Fills in the environment for an evaluation with the given generator. (The
+// lock must be held.)
+-(void) getEnvironment:(SA_DiceProgramEnvironment *)environment
+			   withRNG:(SA_DiceRNG *)rng {
+	*environment = (SA_DiceProgramEnvironment) {
+		.rng = rng,
+		.maxDieCount = _maxDieCount,
+		.maxDieSize = _maxDieSize,
+		.maxExplosionCount = _maxExplosionCount,
+		.sumsOnly = _sumsOnly,
+		.maxCost = _maxCost
+	};
+}
 
-	return result;
+-(void) relinquishContext:(SA_DiceEvaluatorContext *)context {
+	pthread_mutex_lock(&_lock);
+	context->nextIdleContext = _idleContexts;
+	_idleContexts = context;
+	pthread_mutex_unlock(&_lock);
 }
 
 @end
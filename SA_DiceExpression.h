@@ -6,6 +6,8 @@
 
 #import <Foundation/Foundation.h>
 
+#import "SA_DiceRollBuffer.h"
+
 /***********************/
 #pragma mark Definitions
 /***********************/
@@ -66,7 +68,9 @@ typedef NS_OPTIONS(NSUInteger, SA_DiceExpressionError) {
 	SA_DiceExpressionError_INTEGER_OVERFLOW_MULTIPLICATION		= 1 << 16 ,
 	SA_DiceExpressionError_INTEGER_UNDERFLOW_MULTIPLICATION		= 1 << 17 ,
 	SA_DiceExpressionError_KEEP_COUNT_EXCEEDS_ROLL_COUNT			= 1 << 18 ,
-	SA_DiceExpressionError_KEEP_COUNT_NEGATIVE					= 1 << 19
+	SA_DiceExpressionError_KEEP_COUNT_NEGATIVE					= 1 << 19 ,
+	SA_DiceExpressionError_EXPLOSION_COUNT_EXCESSIVE			= 1 << 20 ,
+	SA_DiceExpressionError_COST_EXCESSIVE						= 1 << 21
 };
 
 /***********************/
@@ -82,6 +86,9 @@ NSString *NSStringFromSA_DiceExpressionRollModifier(SA_DiceExpressionRollModifie
 NSString *NSStringFromSA_DiceExpressionError(SA_DiceExpressionError error);
 
 @class SA_DiceExpression;
+@class SA_DiceExpressionResults;
+@class SA_DiceExpressionTree;
+
 NSComparisonResult compareEvaluatedExpressionsByResult(SA_DiceExpression *expression1,
 													   SA_DiceExpression *expression2);
 NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *expression1,
@@ -91,6 +98,15 @@ NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *
 #pragma mark - SA_DiceExpression class declaration
 /*************************************************/
 
+/*
+ An expression may be a view of a node of an immutable expression tree (and
+ of the results of evaluating it, if any) - as are those returned by the
+ parser and by the evaluator. A view reads its attributes from the tree, and
+ creates its sub-expressions (also views) only as they are asked for. Views
+ may be modified like any other expression; a view that is modified takes on
+ a copy of its attributes, and stops being a view (the tree itself is never
+ modified). See SA_DiceExpressionTree.h.
+ */
 @interface SA_DiceExpression : NSObject <NSCopying>
 
 /************************/
@@ -138,8 +154,34 @@ NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *
 // Evaluated expressions (of any type).
 @property (nonatomic, strong) NSNumber *result;
 
-// Evaluated expressions of type SA_DiceExpressionTerm_ROLL_COMMAND.
-@property (nonatomic, strong) NSArray <NSNumber *> *rolls;
+// Evaluated expressions of type SA_DiceExpressionTerm_ROLL_COMMAND (and
+// SA_DiceExpressionTerm_ROLL_MODIFIER). An SA_DiceRollBuffer is an
+// NSArray <NSNumber *>, so this may also be treated as an array of rolls.
+@property (nonatomic, strong) SA_DiceRollBuffer *rolls;
+
+/*===================================================================
+ The following properties pertain to views of expression trees only.
+ */
+
+// The tree of which the expression is a view, and the index of its node; or
+// nil and NSNotFound, if it is not a view (or if it, or any of its
+// sub-expressions, has been modified).
+@property (readonly) SA_DiceExpressionTree *tree;
+@property (readonly) NSUInteger treeNode;
+
+// The results of evaluating the tree, or nil if there are none (or if the
+// expression is not a view, as above).
+@property (readonly) SA_DiceExpressionResults *results;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates a view of the given node of the given tree, with the given results
+// of evaluating the tree (or with none, if nil).
+-(instancetype) initWithTree:(SA_DiceExpressionTree *)tree
+						node:(NSUInteger)node
+					 results:(SA_DiceExpressionResults *)results;
 
 /****************************/
 #pragma mark - Public methods
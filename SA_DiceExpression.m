@@ -6,8 +6,11 @@
 
 #import "SA_DiceExpression.h"
 
+#import "SA_DiceExpressionTree.h"
 #import "SA_DiceFormatter.h"
 
+#import <stdatomic.h>
+
 /*********************/
 #pragma mark Functions
 /*********************/
@@ -73,7 +76,9 @@ NSString *NSStringFromSA_DiceExpressionError(SA_DiceExpressionError error) {
 												@(SA_DiceExpressionError_INTEGER_OVERFLOW_MULTIPLICATION)		: @"SA_DB_ERROR_INTEGER_OVERFLOW_MULTIPLICATION",
 												@(SA_DiceExpressionError_INTEGER_UNDERFLOW_MULTIPLICATION)		: @"SA_DB_ERROR_INTEGER_UNDERFLOW_MULTIPLICATION",
 												@(SA_DiceExpressionError_KEEP_COUNT_EXCEEDS_ROLL_COUNT)			: @"SA_DB_ERROR_KEEP_COUNT_EXCEEDS_ROLL_COUNT",
-												@(SA_DiceExpressionError_KEEP_COUNT_NEGATIVE)					: @"SA_DB_ERROR_KEEP_COUNT_NEGATIVE"
+												@(SA_DiceExpressionError_KEEP_COUNT_NEGATIVE)					: @"SA_DB_ERROR_KEEP_COUNT_NEGATIVE",
+												@(SA_DiceExpressionError_EXPLOSION_COUNT_EXCESSIVE)				: @"SA_DB_ERROR_EXPLOSION_COUNT_EXCESSIVE",
+												@(SA_DiceExpressionError_COST_EXCESSIVE)						: @"SA_DB_ERROR_COST_EXCESSIVE"
 												};
 	});
 
@@ -111,11 +116,262 @@ NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *
 
 }
 
+// Installs the given object (retained) in the given slot, unless another
+// thread has already installed one there; returns whichever is installed.
+static id SA_DiceExpressionInstall(_Atomic(void *) *slot,
+								   id object) {
+	void *retainedObject = (__bridge_retained void *) object;
+	void *installedObject = NULL;
+	if (atomic_compare_exchange_strong(slot, &installedObject, retainedObject))
+		return object;
+
+	(void) (__bridge_transfer id) retainedObject;
+	return (__bridge id) installedObject;
+}
+
+// Replaces the object in the given slot (releasing the old one, if any).
+static void SA_DiceExpressionStore(_Atomic(void *) *slot,
+								   id object) {
+	void *oldObject = atomic_exchange(slot, (__bridge_retained void *) object);
+	if (oldObject != NULL)
+		(void) (__bridge_transfer id) oldObject;
+}
+
 /****************************************************/
 #pragma mark - SA_DiceExpression class implementation
 /****************************************************/
 
-@implementation SA_DiceExpression
+@implementation SA_DiceExpression {
+	// The tree of which the expression is a view (and its node, and the
+	// results of evaluating the tree, if any); nil if the expression is not a
+	// view. The attributes of a view are read from the tree; those of other
+	// expressions are kept in the ivars below.
+	SA_DiceExpressionTree *_tree;
+	NSUInteger _treeNode;
+	const SA_DiceExpressionNode *_node;
+	SA_DiceExpressionResults *_results;
+	const SA_DiceExpressionNodeResult *_nodeResult;
+
+	SA_DiceExpressionTermType _type;
+	SA_DiceExpressionOperator _operator;
+	SA_DiceExpressionRollCommand _rollCommand;
+	SA_DiceExpressionDieType _dieType;
+	SA_DiceExpressionRollModifier _rollModifier;
+	NSNumber *_value;
+	SA_DiceExpressionError _errorBitMask;
+	NSString *_inputString;
+	NSAttributedString *_attributedInputString;
+	NSNumber *_result;
+
+	// Sub-expressions and rolls (retained). Those of a view are created when
+	// they are first asked for, and installed atomically, so that a view may
+	// be read by any number of threads at once.
+	_Atomic(void *) _leftOperand;
+	_Atomic(void *) _rightOperand;
+	_Atomic(void *) _dieCount;
+	_Atomic(void *) _dieSize;
+	_Atomic(void *) _rolls;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(SA_DiceExpressionTermType) type {
+	return (_tree != nil) ? (SA_DiceExpressionTermType) _node->type : _type;
+}
+-(void) setType:(SA_DiceExpressionTermType)type {
+	[self detachFromTree];
+	_type = type;
+}
+
+-(SA_DiceExpressionOperator) operator {
+	return (_tree != nil) ? (SA_DiceExpressionOperator) _node->operator : _operator;
+}
+-(void) setOperator:(SA_DiceExpressionOperator)operator {
+	[self detachFromTree];
+	_operator = operator;
+}
+
+-(SA_DiceExpression *) leftOperand {
+	return [self subExpressionInSlot:&_leftOperand
+							  ofNode:((_tree != nil) ? _node->leftOperand : NSNotFound)];
+}
+-(void) setLeftOperand:(SA_DiceExpression *)leftOperand {
+	[self detachFromTree];
+	SA_DiceExpressionStore(&_leftOperand, leftOperand);
+}
+
+-(SA_DiceExpression *) rightOperand {
+	return [self subExpressionInSlot:&_rightOperand
+							  ofNode:((_tree != nil) ? _node->rightOperand : NSNotFound)];
+}
+-(void) setRightOperand:(SA_DiceExpression *)rightOperand {
+	[self detachFromTree];
+	SA_DiceExpressionStore(&_rightOperand, rightOperand);
+}
+
+-(SA_DiceExpressionRollCommand) rollCommand {
+	return (_tree != nil) ? (SA_DiceExpressionRollCommand) _node->rollCommand : _rollCommand;
+}
+-(void) setRollCommand:(SA_DiceExpressionRollCommand)rollCommand {
+	[self detachFromTree];
+	_rollCommand = rollCommand;
+}
+
+-(SA_DiceExpression *) dieCount {
+	return [self subExpressionInSlot:&_dieCount
+							  ofNode:((_tree != nil) ? _node->dieCount : NSNotFound)];
+}
+-(void) setDieCount:(SA_DiceExpression *)dieCount {
+	[self detachFromTree];
+	SA_DiceExpressionStore(&_dieCount, dieCount);
+}
+
+-(SA_DiceExpression *) dieSize {
+	return [self subExpressionInSlot:&_dieSize
+							  ofNode:((_tree != nil) ? _node->dieSize : NSNotFound)];
+}
+-(void) setDieSize:(SA_DiceExpression *)dieSize {
+	[self detachFromTree];
+	SA_DiceExpressionStore(&_dieSize, dieSize);
+}
+
+-(SA_DiceExpressionDieType) dieType {
+	return (_tree != nil) ? (SA_DiceExpressionDieType) _node->dieType : _dieType;
+}
+-(void) setDieType:(SA_DiceExpressionDieType)dieType {
+	[self detachFromTree];
+	_dieType = dieType;
+}
+
+-(SA_DiceExpressionRollModifier) rollModifier {
+	return (_tree != nil) ? (SA_DiceExpressionRollModifier) _node->rollModifier : _rollModifier;
+}
+-(void) setRollModifier:(SA_DiceExpressionRollModifier)rollModifier {
+	[self detachFromTree];
+	_rollModifier = rollModifier;
+}
+
+-(NSNumber *) value {
+	if (_tree == nil)
+		return _value;
+
+	return _node->hasValue ? @(_node->value) : nil;
+}
+-(void) setValue:(NSNumber *)value {
+	[self detachFromTree];
+	_value = value;
+}
+
+-(SA_DiceExpressionError) errorBitMask {
+	if (_tree == nil)
+		return _errorBitMask;
+
+	return _node->errorBitMask | ((_nodeResult != NULL) ? _nodeResult->errors : 0);
+}
+-(void) setErrorBitMask:(SA_DiceExpressionError)errorBitMask {
+	[self detachFromTree];
+	_errorBitMask = errorBitMask;
+}
+
+-(NSString *) inputString {
+	return (_tree != nil) ? [_tree inputStringOfNode:_treeNode] : _inputString;
+}
+-(void) setInputString:(NSString *)inputString {
+	[self detachFromTree];
+	_inputString = [inputString copy];
+}
+
+-(NSAttributedString *) attributedInputString {
+	return (_tree != nil) ? nil : _attributedInputString;
+}
+-(void) setAttributedInputString:(NSAttributedString *)attributedInputString {
+	[self detachFromTree];
+	_attributedInputString = [attributedInputString copy];
+}
+
+-(NSNumber *) result {
+	if (_tree == nil)
+		return _result;
+
+	if (   _nodeResult == NULL
+		|| _nodeResult->status == SA_DiceExpressionNodeStatus_UNEVALUATED)
+		return nil;
+
+	switch (_node->type) {
+		case SA_DiceExpressionTerm_OPERATION:
+		case SA_DiceExpressionTerm_ROLL_COMMAND:
+		case SA_DiceExpressionTerm_ROLL_MODIFIER:
+			return _nodeResult->hasResult ? @(_nodeResult->value) : nil;
+		case SA_DiceExpressionTerm_VALUE:
+		default:
+			return self.value;
+	}
+}
+-(void) setResult:(NSNumber *)result {
+	[self detachFromTree];
+	_result = result;
+}
+
+-(SA_DiceRollBuffer *) rolls {
+	void *rolls = atomic_load(&_rolls);
+	if (rolls != NULL)
+		return (__bridge SA_DiceRollBuffer *) rolls;
+
+	if (   _nodeResult == NULL
+		|| !_nodeResult->hasRolls)
+		return nil;
+
+	return SA_DiceExpressionInstall(&_rolls, [_results rollsOfNode:_treeNode]);
+}
+-(void) setRolls:(SA_DiceRollBuffer *)rolls {
+	[self detachFromTree];
+	SA_DiceExpressionStore(&_rolls, rolls);
+}
+
+-(SA_DiceExpressionTree *) tree {
+	return [self isUnmodifiedView] ? _tree : nil;
+}
+
+-(NSUInteger) treeNode {
+	return [self isUnmodifiedView] ? _treeNode : NSNotFound;
+}
+
+-(SA_DiceExpressionResults *) results {
+	return [self isUnmodifiedView] ? _results : nil;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) initWithTree:(SA_DiceExpressionTree *)tree
+						node:(NSUInteger)node
+					 results:(SA_DiceExpressionResults *)results {
+	if (!(self = [super init]))
+		return nil;
+
+	_tree = tree;
+	_treeNode = node;
+	_node = &tree.nodes[node];
+	_results = results;
+	_nodeResult = (results != nil) ? &results.nodeResults[node] : NULL;
+
+	return self;
+}
+
+-(void) dealloc {
+	SA_DiceExpressionStore(&_leftOperand, nil);
+	SA_DiceExpressionStore(&_rightOperand, nil);
+	SA_DiceExpressionStore(&_dieCount, nil);
+	SA_DiceExpressionStore(&_dieSize, nil);
+	SA_DiceExpressionStore(&_rolls, nil);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
 
 +(SA_DiceExpression *) expressionByJoiningExpression:(SA_DiceExpression *)leftHandExpression
 										toExpression:(SA_DiceExpression *)rightHandExpression
@@ -181,6 +437,23 @@ NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *
 /*******************************/
 
 -(instancetype) copyWithZone:(NSZone *)zone {
+	// A copy of a view is another view of the same node. Sub-expressions that
+	// have been asked for may have been modified since, and so are copied;
+	// the rest are still views.
+	if (_tree != nil) {
+		SA_DiceExpression *copy = [[SA_DiceExpression alloc] initWithTree:_tree
+																	 node:_treeNode
+																  results:_results];
+
+		SA_DiceExpressionStore(&copy->_leftOperand, [(__bridge SA_DiceExpression *) atomic_load(&_leftOperand) copy]);
+		SA_DiceExpressionStore(&copy->_rightOperand, [(__bridge SA_DiceExpression *) atomic_load(&_rightOperand) copy]);
+		SA_DiceExpressionStore(&copy->_dieCount, [(__bridge SA_DiceExpression *) atomic_load(&_dieCount) copy]);
+		SA_DiceExpressionStore(&copy->_dieSize, [(__bridge SA_DiceExpression *) atomic_load(&_dieSize) copy]);
+		SA_DiceExpressionStore(&copy->_rolls, (__bridge SA_DiceRollBuffer *) atomic_load(&_rolls));
+
+		return copy;
+	}
+
 	SA_DiceExpression *copy = [SA_DiceExpression new];
 
 	copy.type = _type;
@@ -188,12 +461,12 @@ NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *
 	copy.errorBitMask = _errorBitMask;
 
 	copy.operator = _operator;
-	copy.leftOperand = [_leftOperand copy];
-	copy.rightOperand = [_rightOperand copy];
+	copy.leftOperand = [self.leftOperand copy];
+	copy.rightOperand = [self.rightOperand copy];
 
 	copy.rollCommand = _rollCommand;
-	copy.dieCount = [_dieCount copy];
-	copy.dieSize = [_dieSize copy];
+	copy.dieCount = [self.dieCount copy];
+	copy.dieSize = [self.dieSize copy];
 	copy.dieType = _dieType;
 
 	copy.rollModifier = _rollModifier;
@@ -205,9 +478,79 @@ NSComparisonResult compareEvaluatedExpressionsByAttemptBonus(SA_DiceExpression *
 
 	copy.result = _result;
 
-	copy.rolls = _rolls;
+	copy.rolls = self.rolls;
 
 	return copy;
 }
 
+/****************************/
+#pragma mark - Helper methods
+/****************************/
+
+// Returns the sub-expression in the given slot; if there is none yet, and the
+// expression is a view, the sub-expression is a view of the given node (if
+// any), which is created and installed now.
+-(SA_DiceExpression *) subExpressionInSlot:(_Atomic(void *) *)slot
+									ofNode:(NSUInteger)node {
+	void *subExpression = atomic_load(slot);
+	if (subExpression != NULL)
+		return (__bridge SA_DiceExpression *) subExpression;
+
+	if (   _tree == nil
+		|| node == NSNotFound)
+		return nil;
+
+	return SA_DiceExpressionInstall(slot, [[SA_DiceExpression alloc] initWithTree:_tree
+																			 node:node
+																		  results:_results]);
+}
+
+// Gives the expression its own copy of all its attributes (so that it may be
+// modified); it is then no longer a view. (Its sub-expressions are created,
+// if they have not been yet, but remain views.)
+-(void) detachFromTree {
+	if (_tree == nil)
+		return;
+
+	[self leftOperand];
+	[self rightOperand];
+	[self dieCount];
+	[self dieSize];
+	[self rolls];
+
+	_type = self.type;
+	_operator = self.operator;
+	_rollCommand = self.rollCommand;
+	_dieType = self.dieType;
+	_rollModifier = self.rollModifier;
+	_value = self.value;
+	_errorBitMask = self.errorBitMask;
+	_inputString = self.inputString;
+	_result = self.result;
+
+	_tree = nil;
+	_treeNode = NSNotFound;
+	_node = NULL;
+	_results = nil;
+	_nodeResult = NULL;
+}
+
+// YES if the expression is a view, and so are all of its sub-expressions that
+// have been created. (Those that have not been created cannot have been
+// modified.)
+-(BOOL) isUnmodifiedView {
+	if (_tree == nil)
+		return NO;
+
+	_Atomic(void *) *slots[] = { &_leftOperand, &_rightOperand, &_dieCount, &_dieSize };
+	for (NSUInteger i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+		void *subExpression = atomic_load(slots[i]);
+		if (   subExpression != NULL
+			&& ![(__bridge SA_DiceExpression *) subExpression isUnmodifiedView])
+			return NO;
+	}
+
+	return YES;
+}
+
 @end
@@ -0,0 +1,135 @@
+//
+//  SA_DiceExpressionArchive.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+/*
+ An SA_DiceExpressionArchive is a compact binary encoding of an expression
+ (usually an evaluated one): the expression tree as a flat table of nodes
+ (as in SA_DiceExpressionTree), the results of each node (if any), with
+ their rolls, and the error bits - in a few bytes per node, and a byte or
+ two per roll, with no objects at all. Archives are meant for keeping
+ expressions around for a long time (e.g., in a roll history; see
+ SA_DiceRollHistory.h) without keeping trees of objects around.
+
+ The root’s result and errors, and the source string, are kept at the start
+ of the encoding, and may be read without decoding the tree; the tree is
+ decoded (into a new SA_DiceExpressionTree, with its results) only when the
+ expression itself is asked for. (SA_DiceFormatter asks for it only if it
+ needs more than the result; see -[SA_DiceFormatter stringFromArchive:].)
+
+ THE ENCODING (VERSION 1)
+
+ All integers are variable-length (“varints”: 7 bits per byte, least
+ significant first, the high bit set on every byte but the last); signed
+ integers are zigzag-encoded first (0, −1, 1, −2, … as 0, 1, 2, 3, …).
+
+	byte	version (1)
+	byte	flags: 0x01 if there are results, 0x02 if the root has a result
+	varint	the root’s errors (those of its node and of its result, combined)
+	signed	the root’s result (only if it has one)
+	varint	the source string’s length (in bytes), followed by the source
+			string (in UTF-8)
+	varint	the number of nodes, followed by the nodes (see below), each
+			after its sub-expressions (the root is the last node)
+	...		the node results (if there are any), in the same order
+
+ Each node is encoded as:
+
+	5 bytes	the type, operator, roll command, die type, and roll modifier
+	byte	flags: 0x01 if it has a value, 0x02 if it has an input string
+	signed	the value (only if it has one)
+	varint	the errors
+	4 ×		the left operand, right operand, die count, and die size, each
+	varint	as the distance back to its node (or 0 if there is none)
+	2 ×		the input string, as a range (location and length) of the
+	varint	source string, in UTF-16 units (only if it has an input string)
+
+ Each node result is encoded as:
+
+	byte	flags: 0x01 if the node was evaluated, 0x02 if it has a result,
+			0x04 if it has rolls
+	varint	the errors
+	signed	the result (only if it has one)
+	varint	the size of the dice, if the rolls are those of exploding dice,
+			or 0 (only if it has rolls)
+	varint	the number of rolls (or of exploding dice), followed by the
+			rolls (signed), or by the exploding dice (each as a varint
+			explosion count, and a signed final roll); only if it has rolls
+
+ Archives are immutable, and may be shared between threads.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// The version of the encoding written by this version of the library.
+#define SA_DICE_EXPRESSION_ARCHIVE_VERSION 1
+
+// The largest number of rolls (counting each explosion of an exploding die as
+// a roll) that a decoded expression may have; an encoding with more is
+// treated as malformed.
+#define SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT (1 << 24)
+
+/********************************************************/
+#pragma mark - SA_DiceExpressionArchive class declaration
+/********************************************************/
+
+@interface SA_DiceExpressionArchive : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The encoded bytes.
+@property (readonly) NSData *data;
+
+// The version of the encoding.
+@property (readonly) uint8_t version;
+
+// The string of which the nodes’ input strings are ranges (for a parsed
+// expression, the roll string it was parsed from). Each call returns a new
+// string.
+@property (readonly) NSString *source;
+
+// The result and errors of the root (read without decoding the tree). The
+// result is nil if the expression was not evaluated, or failed.
+@property (readonly) NSNumber *result;
+@property (readonly) SA_DiceExpressionError errorBitMask;
+
+// YES if the archived expression has results (i.e., was evaluated).
+@property (readonly) BOOL hasResults;
+
+// The number of nodes in the archived tree.
+@property (readonly) NSUInteger nodeCount;
+
+// The archived expression: a view of the root of a newly decoded tree (with
+// its results, if any); or nil, if the archive is of an empty tree, or if
+// its contents are malformed (including any node attribute out of range, or
+// more than SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT rolls). Each call
+// decodes the tree anew.
+@property (readonly) SA_DiceExpression *expression;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Encodes the given expression (which is flattened first, if it is not a
+// view of the root of a tree). Returns nil if the expression is nil.
+-(instancetype) initWithExpression:(SA_DiceExpression *)expression;
+
+// Creates an archive from the given encoded bytes (which are not copied, if
+// the data is immutable), checking the version, and reading the root’s
+// result, errors, and the node count. Returns nil if the bytes are not an
+// archive of a known version, or are too short.
+-(instancetype) initWithData:(NSData *)data NS_DESIGNATED_INITIALIZER;
+
++(instancetype) archiveWithExpression:(SA_DiceExpression *)expression;
+
+@end
@@ -0,0 +1,630 @@
+//
+//  SA_DiceExpressionArchive.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceExpressionArchive.h"
+
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceRollBuffer.h"
+
+#import "SA_Utility.h"
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+enum {
+	SA_DiceExpressionArchiveFlag_HAS_RESULTS		= 1 << 0,
+	SA_DiceExpressionArchiveFlag_ROOT_HAS_RESULT	= 1 << 1
+};
+
+enum {
+	SA_DiceExpressionArchiveNodeFlag_HAS_VALUE		= 1 << 0,
+	SA_DiceExpressionArchiveNodeFlag_HAS_INPUT		= 1 << 1
+};
+
+enum {
+	SA_DiceExpressionArchiveResultFlag_EVALUATED	= 1 << 0,
+	SA_DiceExpressionArchiveResultFlag_HAS_RESULT	= 1 << 1,
+	SA_DiceExpressionArchiveResultFlag_HAS_ROLLS	= 1 << 2
+};
+
+// A growable buffer of encoded bytes.
+typedef struct {
+	uint8_t *bytes;
+	NSUInteger length;
+	NSUInteger capacity;
+} SA_DiceExpressionArchiveWriter;
+
+// The state of the decoding of an encoding. Once a read fails (because the
+// encoding is malformed, or too short), ‘failed’ is set, and all further
+// reads return 0.
+typedef struct {
+	const uint8_t *bytes;
+	NSUInteger length;
+	NSUInteger position;
+	BOOL failed;
+} SA_DiceExpressionArchiveReader;
+
+// The state of the collection of the results of an expression that is not a
+// view (in the order in which SA_DiceExpressionTree flattens it).
+typedef struct {
+	SA_DiceExpressionNodeResult *nodeResults;
+	NSUInteger nodeCount;
+	NSUInteger nodeCapacity;
+
+	NSInteger *rolls;
+	NSUInteger rollCount;
+	NSUInteger rollCapacity;
+
+	SA_DiceExplodedDie *explodedDice;
+	NSUInteger explodedDieCount;
+	NSUInteger explodedDieCapacity;
+
+	BOOL hasResults;
+} SA_DiceExpressionArchiveCollection;
+
+/*******************************/
+#pragma mark - Writing & reading
+/*******************************/
+
+// Makes room for (at least) the given number of bytes past the end of the
+// writer’s contents.
+static void SA_DiceExpressionArchiveReserve(SA_DiceExpressionArchiveWriter *writer,
+											NSUInteger count) {
+	if (writer->length + count <= writer->capacity)
+		return;
+
+	NSUInteger capacity = MAX(writer->capacity * 2, 64);
+	while (capacity < writer->length + count)
+		capacity *= 2;
+	writer->bytes = realloc(writer->bytes, capacity);
+	writer->capacity = capacity;
+}
+
+static void SA_DiceExpressionArchiveWriteByte(SA_DiceExpressionArchiveWriter *writer,
+											  uint8_t byte) {
+	SA_DiceExpressionArchiveReserve(writer, 1);
+	writer->bytes[writer->length++] = byte;
+}
+
+static void SA_DiceExpressionArchiveWriteBytes(SA_DiceExpressionArchiveWriter *writer,
+											   const void *bytes,
+											   NSUInteger count) {
+	if (count == 0)
+		return;
+
+	SA_DiceExpressionArchiveReserve(writer, count);
+	memcpy(writer->bytes + writer->length, bytes, count);
+	writer->length += count;
+}
+
+static void SA_DiceExpressionArchiveWriteVarint(SA_DiceExpressionArchiveWriter *writer,
+												uint64_t value) {
+	SA_DiceExpressionArchiveReserve(writer, 10);
+	while (value >= 0x80) {
+		writer->bytes[writer->length++] = (uint8_t) (value | 0x80);
+		value >>= 7;
+	}
+	writer->bytes[writer->length++] = (uint8_t) value;
+}
+
+static void SA_DiceExpressionArchiveWriteSigned(SA_DiceExpressionArchiveWriter *writer,
+												NSInteger value) {
+	int64_t signedValue = (int64_t) value;
+	SA_DiceExpressionArchiveWriteVarint(writer, ((uint64_t) signedValue << 1) ^ (uint64_t) (signedValue >> 63));
+}
+
+// Sub-expressions are written as the distance back to their node (they always
+// come before it), which is small, and so takes a byte.
+static void SA_DiceExpressionArchiveWriteChild(SA_DiceExpressionArchiveWriter *writer,
+											   NSUInteger node,
+											   NSUInteger child) {
+	SA_DiceExpressionArchiveWriteVarint(writer, (child == NSNotFound) ? 0 : (node - child));
+}
+
+static uint8_t SA_DiceExpressionArchiveReadByte(SA_DiceExpressionArchiveReader *reader) {
+	if (   reader->failed
+		|| reader->position >= reader->length) {
+		reader->failed = YES;
+		return 0;
+	}
+
+	return reader->bytes[reader->position++];
+}
+
+static uint64_t SA_DiceExpressionArchiveReadVarint(SA_DiceExpressionArchiveReader *reader) {
+	uint64_t value = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		uint8_t byte = SA_DiceExpressionArchiveReadByte(reader);
+		if (reader->failed)
+			return 0;
+
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return value;
+	}
+
+	// More than ten bytes.
+	reader->failed = YES;
+	return 0;
+}
+
+static NSInteger SA_DiceExpressionArchiveReadSigned(SA_DiceExpressionArchiveReader *reader) {
+	uint64_t value = SA_DiceExpressionArchiveReadVarint(reader);
+	return (NSInteger) (int64_t) ((value >> 1) ^ (0 - (value & 1)));
+}
+
+// Reads a varint that must be no greater than the given limit.
+static NSUInteger SA_DiceExpressionArchiveReadCount(SA_DiceExpressionArchiveReader *reader,
+													NSUInteger limit) {
+	uint64_t value = SA_DiceExpressionArchiveReadVarint(reader);
+	if (value > limit) {
+		reader->failed = YES;
+		return 0;
+	}
+
+	return (NSUInteger) value;
+}
+
+// Reads a byte that must be no greater than the given limit (the largest
+// value of the enumeration it encodes).
+static uint8_t SA_DiceExpressionArchiveReadEnumeration(SA_DiceExpressionArchiveReader *reader,
+													   NSUInteger limit) {
+	uint8_t value = SA_DiceExpressionArchiveReadByte(reader);
+	if (value > limit) {
+		reader->failed = YES;
+		return 0;
+	}
+
+	return value;
+}
+
+// Reads a sub-expression of the given node (see above).
+static NSUInteger SA_DiceExpressionArchiveReadChild(SA_DiceExpressionArchiveReader *reader,
+													NSUInteger node) {
+	NSUInteger distance = SA_DiceExpressionArchiveReadCount(reader, node);
+	return (distance == 0) ? NSNotFound : (node - distance);
+}
+
+/************************/
+#pragma mark - Collecting
+/************************/
+
+// Adds the results of the given expression (its sub-expressions first, then
+// its own, as SA_DiceExpressionTreeAddExpression() adds nodes), so that they
+// are indexed as the nodes of the tree flattened from the expression are.
+// (The errors of each node are already those of the flattened node.)
+static void SA_DiceExpressionArchiveCollectResults(SA_DiceExpressionArchiveCollection *collection,
+												   SA_DiceExpression *expression) {
+	if (expression == nil)
+		return;
+
+	SA_DiceExpressionArchiveCollectResults(collection, expression.leftOperand);
+	SA_DiceExpressionArchiveCollectResults(collection, expression.rightOperand);
+	SA_DiceExpressionArchiveCollectResults(collection, expression.dieCount);
+	SA_DiceExpressionArchiveCollectResults(collection, expression.dieSize);
+
+	NSNumber *result = expression.result;
+	SA_DiceRollBuffer *rolls = (expression.rolls != nil) ? [SA_DiceRollBuffer bufferWithArray:expression.rolls] : nil;
+
+	SA_DiceExpressionNodeResult nodeResult = {
+		.status = ((result != nil || rolls != nil)
+				   ? SA_DiceExpressionNodeStatus_EVALUATED
+				   : SA_DiceExpressionNodeStatus_UNEVALUATED),
+		.hasResult = (result != nil),
+		.hasRolls = (rolls != nil),
+		.errors = 0,
+		.value = result.integerValue,
+		.rolls = NSRangeMake(0, 0),
+		.explodedDieSize = 0
+	};
+	if (nodeResult.status == SA_DiceExpressionNodeStatus_EVALUATED)
+		collection->hasResults = YES;
+
+	if (rolls.explodedDice != NULL) {
+		NSUInteger count = rolls.explodedDieCount;
+		if (collection->explodedDieCount + count > collection->explodedDieCapacity) {
+			collection->explodedDieCapacity = MAX(collection->explodedDieCapacity * 2, collection->explodedDieCount + count);
+			collection->explodedDice = realloc(collection->explodedDice, collection->explodedDieCapacity * sizeof(SA_DiceExplodedDie));
+		}
+		if (count > 0)
+			memcpy(collection->explodedDice + collection->explodedDieCount, rolls.explodedDice, count * sizeof(SA_DiceExplodedDie));
+
+		nodeResult.rolls = NSRangeMake(collection->explodedDieCount, count);
+		nodeResult.explodedDieSize = rolls.explodedDieSize;
+		collection->explodedDieCount += count;
+	} else if (rolls != nil) {
+		NSUInteger count = rolls.count;
+		if (collection->rollCount + count > collection->rollCapacity) {
+			collection->rollCapacity = MAX(collection->rollCapacity * 2, collection->rollCount + count);
+			collection->rolls = realloc(collection->rolls, collection->rollCapacity * sizeof(NSInteger));
+		}
+		if (count > 0)
+			memcpy(collection->rolls + collection->rollCount, rolls.values, count * sizeof(NSInteger));
+
+		nodeResult.rolls = NSRangeMake(collection->rollCount, count);
+		collection->rollCount += count;
+	}
+
+	if (collection->nodeCount == collection->nodeCapacity) {
+		collection->nodeCapacity = (collection->nodeCapacity > 0) ? (collection->nodeCapacity * 2) : 16;
+		collection->nodeResults = realloc(collection->nodeResults, collection->nodeCapacity * sizeof(SA_DiceExpressionNodeResult));
+	}
+	collection->nodeResults[collection->nodeCount++] = nodeResult;
+}
+
+/***********************************************************/
+#pragma mark - SA_DiceExpressionArchive class implementation
+/***********************************************************/
+
+@implementation SA_DiceExpressionArchive {
+	NSData *_data;
+
+	uint8_t _version;
+	BOOL _hasResults;
+	NSNumber *_result;
+	SA_DiceExpressionError _errorBitMask;
+
+	// The location and length (in bytes) of the source string.
+	NSUInteger _sourceLocation;
+	NSUInteger _sourceLength;
+
+	NSUInteger _nodeCount;
+
+	// The location of the first node.
+	NSUInteger _nodesLocation;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(NSData *) data {
+	return _data;
+}
+
+-(uint8_t) version {
+	return _version;
+}
+
+-(NSString *) source {
+	return [[NSString alloc] initWithBytes:((const uint8_t *) _data.bytes + _sourceLocation)
+									length:_sourceLength
+								  encoding:NSUTF8StringEncoding];
+}
+
+-(NSNumber *) result {
+	return _result;
+}
+
+-(SA_DiceExpressionError) errorBitMask {
+	return _errorBitMask;
+}
+
+-(BOOL) hasResults {
+	return _hasResults;
+}
+
+-(NSUInteger) nodeCount {
+	return _nodeCount;
+}
+
+-(SA_DiceExpression *) expression {
+	if (_nodeCount == 0)
+		return nil;
+
+	NSString *source = self.source;
+	if (source == nil)
+		return nil;
+	NSUInteger sourceLength = source.length;
+
+	SA_DiceExpressionArchiveReader reader = {
+		.bytes = _data.bytes,
+		.length = _data.length,
+		.position = _nodesLocation,
+		.failed = NO
+	};
+
+	SA_DiceExpressionNode *nodes = malloc(_nodeCount * sizeof(SA_DiceExpressionNode));
+	for (NSUInteger i = 0; i < _nodeCount && !reader.failed; i++) {
+		SA_DiceExpressionNode *node = &nodes[i];
+		// The attributes are used to index tables (e.g., by the formatter),
+		// so any that is out of range makes the encoding malformed.
+		node->type = SA_DiceExpressionArchiveReadEnumeration(&reader, SA_DiceExpressionTerm_VALUE);
+		node->operator = SA_DiceExpressionArchiveReadEnumeration(&reader, SA_DiceExpressionOperator_TIMES);
+		node->rollCommand = SA_DiceExpressionArchiveReadEnumeration(&reader, SA_DiceExpressionRollCommand_SUM_EXPLODING);
+		node->dieType = SA_DiceExpressionArchiveReadEnumeration(&reader, SA_DiceExpressionDice_FUDGE);
+		node->rollModifier = SA_DiceExpressionArchiveReadEnumeration(&reader, SA_DiceExpressionRollModifier_KEEP_LOWEST);
+
+		uint8_t flags = SA_DiceExpressionArchiveReadByte(&reader);
+		node->hasValue = ((flags & SA_DiceExpressionArchiveNodeFlag_HAS_VALUE) != 0);
+		node->value = node->hasValue ? SA_DiceExpressionArchiveReadSigned(&reader) : 0;
+		node->errorBitMask = (SA_DiceExpressionError) SA_DiceExpressionArchiveReadVarint(&reader);
+
+		node->leftOperand = SA_DiceExpressionArchiveReadChild(&reader, i);
+		node->rightOperand = SA_DiceExpressionArchiveReadChild(&reader, i);
+		node->dieCount = SA_DiceExpressionArchiveReadChild(&reader, i);
+		node->dieSize = SA_DiceExpressionArchiveReadChild(&reader, i);
+
+		if ((flags & SA_DiceExpressionArchiveNodeFlag_HAS_INPUT) != 0) {
+			NSUInteger location = SA_DiceExpressionArchiveReadCount(&reader, sourceLength);
+			NSUInteger length = SA_DiceExpressionArchiveReadCount(&reader, sourceLength - location);
+			node->inputRange = NSRangeMake(location, length);
+		} else {
+			node->inputRange = NSRangeMake(NSNotFound, 0);
+		}
+	}
+
+	SA_DiceExpressionResults *results = nil;
+	if (   _hasResults
+		&& !reader.failed) {
+		SA_DiceExpressionNodeResult *nodeResults = malloc(_nodeCount * sizeof(SA_DiceExpressionNodeResult));
+		NSInteger *rolls = NULL;
+		NSUInteger rollCount = 0;
+		SA_DiceExplodedDie *explodedDice = NULL;
+		NSUInteger explodedDieCount = 0;
+
+		// The number of rolls of all the nodes (counting each explosion as a
+		// roll), which may not exceed SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT.
+		NSUInteger totalRollCount = 0;
+
+		for (NSUInteger i = 0; i < _nodeCount && !reader.failed; i++) {
+			SA_DiceExpressionNodeResult *nodeResult = &nodeResults[i];
+
+			uint8_t flags = SA_DiceExpressionArchiveReadByte(&reader);
+			nodeResult->status = (((flags & SA_DiceExpressionArchiveResultFlag_EVALUATED) != 0)
+								  ? SA_DiceExpressionNodeStatus_EVALUATED
+								  : SA_DiceExpressionNodeStatus_UNEVALUATED);
+			nodeResult->hasResult = ((flags & SA_DiceExpressionArchiveResultFlag_HAS_RESULT) != 0);
+			nodeResult->hasRolls = ((flags & SA_DiceExpressionArchiveResultFlag_HAS_ROLLS) != 0);
+			nodeResult->errors = (SA_DiceExpressionError) SA_DiceExpressionArchiveReadVarint(&reader);
+			nodeResult->value = nodeResult->hasResult ? SA_DiceExpressionArchiveReadSigned(&reader) : 0;
+			nodeResult->rolls = NSRangeMake(0, 0);
+			nodeResult->explodedDieSize = 0;
+
+			if (!nodeResult->hasRolls)
+				continue;
+
+			// Each roll takes at least one byte, so no count may be greater
+			// than the number of bytes left (which keeps a malformed count
+			// from making us allocate without bound).
+			nodeResult->explodedDieSize = SA_DiceExpressionArchiveReadCount(&reader, NSIntegerMax);
+			NSUInteger count = SA_DiceExpressionArchiveReadCount(&reader, reader.length - reader.position);
+			if (reader.failed)
+				break;
+
+			if (count > SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT - totalRollCount) {
+				reader.failed = YES;
+				break;
+			}
+			totalRollCount += count;
+
+			if (nodeResult->explodedDieSize != 0) {
+				// Each die’s rolls are expanded (by SA_DiceRollBuffer, and by
+				// the formatter) into one roll per explosion, so the
+				// explosions count towards the limit too (which keeps a
+				// malformed count from overflowing the buffer’s count).
+				explodedDice = realloc(explodedDice, (explodedDieCount + count) * sizeof(SA_DiceExplodedDie));
+				for (NSUInteger j = 0; j < count && !reader.failed; j++) {
+					NSUInteger explosionCount = SA_DiceExpressionArchiveReadCount(&reader, SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT - totalRollCount);
+					totalRollCount += explosionCount;
+					explodedDice[explodedDieCount + j].explosionCount = explosionCount;
+					explodedDice[explodedDieCount + j].finalRoll = SA_DiceExpressionArchiveReadSigned(&reader);
+				}
+				nodeResult->rolls = NSRangeMake(explodedDieCount, count);
+				explodedDieCount += count;
+			} else {
+				rolls = realloc(rolls, (rollCount + count) * sizeof(NSInteger));
+				for (NSUInteger j = 0; j < count; j++)
+					rolls[rollCount + j] = SA_DiceExpressionArchiveReadSigned(&reader);
+				nodeResult->rolls = NSRangeMake(rollCount, count);
+				rollCount += count;
+			}
+		}
+
+		if (!reader.failed) {
+			results = [[SA_DiceExpressionResults alloc] initWithNodeResults:nodeResults
+																	  count:_nodeCount
+																	  rolls:rolls
+																	  count:rollCount
+															   explodedDice:explodedDice
+																	  count:explodedDieCount];
+		}
+
+		free(nodeResults);
+		free(rolls);
+		free(explodedDice);
+	}
+
+	if (reader.failed) {
+		free(nodes);
+		return nil;
+	}
+
+	SA_DiceExpressionTree *tree = [[SA_DiceExpressionTree alloc] initByTakingNodes:nodes
+																			 count:_nodeCount
+																			source:source];
+	return [tree expressionForNode:tree.rootNode
+						   results:results];
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithData:nil];
+}
+
+-(instancetype) initWithExpression:(SA_DiceExpression *)expression {
+	if (expression == nil)
+		return nil;
+
+	// A view of the root of a tree is encoded straight from the tree and its
+	// results; any other expression is flattened first (and its results
+	// collected alongside).
+	SA_DiceExpressionTree *tree = expression.tree;
+	SA_DiceExpressionResults *results = expression.results;
+	if (   tree == nil
+		|| expression.treeNode != tree.rootNode) {
+		tree = [SA_DiceExpressionTree treeWithExpression:expression];
+
+		SA_DiceExpressionArchiveCollection collection = { 0 };
+		SA_DiceExpressionArchiveCollectResults(&collection, expression);
+		results = (collection.hasResults
+				   ? [[SA_DiceExpressionResults alloc] initWithNodeResults:collection.nodeResults
+																	 count:collection.nodeCount
+																	 rolls:collection.rolls
+																	 count:collection.rollCount
+															  explodedDice:collection.explodedDice
+																	 count:collection.explodedDieCount]
+				   : nil);
+
+		free(collection.nodeResults);
+		free(collection.rolls);
+		free(collection.explodedDice);
+	}
+
+	const SA_DiceExpressionNode *nodes = tree.nodes;
+	NSUInteger nodeCount = tree.nodeCount;
+	const SA_DiceExpressionNodeResult *nodeResults = results.nodeResults;
+
+	SA_DiceExpressionArchiveWriter writer = { NULL, 0, 0 };
+
+	// The header.
+	NSNumber *result = expression.result;
+	SA_DiceExpressionArchiveWriteByte(&writer, SA_DICE_EXPRESSION_ARCHIVE_VERSION);
+	SA_DiceExpressionArchiveWriteByte(&writer, (uint8_t) (((results != nil) ? SA_DiceExpressionArchiveFlag_HAS_RESULTS : 0)
+														  | ((result != nil) ? SA_DiceExpressionArchiveFlag_ROOT_HAS_RESULT : 0)));
+	SA_DiceExpressionArchiveWriteVarint(&writer, expression.errorBitMask);
+	if (result != nil)
+		SA_DiceExpressionArchiveWriteSigned(&writer, result.integerValue);
+
+	NSData *source = [tree.source dataUsingEncoding:NSUTF8StringEncoding];
+	SA_DiceExpressionArchiveWriteVarint(&writer, source.length);
+	SA_DiceExpressionArchiveWriteBytes(&writer, source.bytes, source.length);
+
+	// The nodes.
+	SA_DiceExpressionArchiveWriteVarint(&writer, nodeCount);
+	for (NSUInteger i = 0; i < nodeCount; i++) {
+		const SA_DiceExpressionNode *node = &nodes[i];
+		BOOL hasInput = (node->inputRange.location != NSNotFound);
+
+		uint8_t attributes[6] = {
+			node->type,
+			node->operator,
+			node->rollCommand,
+			node->dieType,
+			node->rollModifier,
+			(uint8_t) ((node->hasValue ? SA_DiceExpressionArchiveNodeFlag_HAS_VALUE : 0)
+					   | (hasInput ? SA_DiceExpressionArchiveNodeFlag_HAS_INPUT : 0))
+		};
+		SA_DiceExpressionArchiveWriteBytes(&writer, attributes, sizeof(attributes));
+		if (node->hasValue)
+			SA_DiceExpressionArchiveWriteSigned(&writer, node->value);
+		SA_DiceExpressionArchiveWriteVarint(&writer, node->errorBitMask);
+
+		SA_DiceExpressionArchiveWriteChild(&writer, i, node->leftOperand);
+		SA_DiceExpressionArchiveWriteChild(&writer, i, node->rightOperand);
+		SA_DiceExpressionArchiveWriteChild(&writer, i, node->dieCount);
+		SA_DiceExpressionArchiveWriteChild(&writer, i, node->dieSize);
+
+		if (hasInput) {
+			SA_DiceExpressionArchiveWriteVarint(&writer, node->inputRange.location);
+			SA_DiceExpressionArchiveWriteVarint(&writer, node->inputRange.length);
+		}
+	}
+
+	// The node results.
+	if (results != nil) {
+		for (NSUInteger i = 0; i < nodeCount; i++) {
+			const SA_DiceExpressionNodeResult *nodeResult = &nodeResults[i];
+
+			SA_DiceExpressionArchiveWriteByte(&writer, (uint8_t) (((nodeResult->status == SA_DiceExpressionNodeStatus_EVALUATED) ? SA_DiceExpressionArchiveResultFlag_EVALUATED : 0)
+																  | (nodeResult->hasResult ? SA_DiceExpressionArchiveResultFlag_HAS_RESULT : 0)
+																  | (nodeResult->hasRolls ? SA_DiceExpressionArchiveResultFlag_HAS_ROLLS : 0)));
+			SA_DiceExpressionArchiveWriteVarint(&writer, nodeResult->errors);
+			if (nodeResult->hasResult)
+				SA_DiceExpressionArchiveWriteSigned(&writer, nodeResult->value);
+
+			if (!nodeResult->hasRolls)
+				continue;
+
+			// Exploding dice are written in their compact form (as they are
+			// kept in the results), rather than as their individual rolls.
+			SA_DiceRollBuffer *rolls = [results rollsOfNode:i];
+			if (rolls.explodedDice != NULL) {
+				const SA_DiceExplodedDie *explodedDice = rolls.explodedDice;
+				NSUInteger count = rolls.explodedDieCount;
+				SA_DiceExpressionArchiveWriteVarint(&writer, rolls.explodedDieSize);
+				SA_DiceExpressionArchiveWriteVarint(&writer, count);
+				for (NSUInteger j = 0; j < count; j++) {
+					SA_DiceExpressionArchiveWriteVarint(&writer, explodedDice[j].explosionCount);
+					SA_DiceExpressionArchiveWriteSigned(&writer, explodedDice[j].finalRoll);
+				}
+			} else {
+				const NSInteger *values = rolls.values;
+				NSUInteger count = rolls.count;
+				SA_DiceExpressionArchiveWriteVarint(&writer, 0);
+				SA_DiceExpressionArchiveWriteVarint(&writer, count);
+				for (NSUInteger j = 0; j < count; j++)
+					SA_DiceExpressionArchiveWriteSigned(&writer, values[j]);
+			}
+		}
+	}
+
+	writer.bytes = realloc(writer.bytes, MAX(writer.length, 1));
+	return [self initWithData:[[NSData alloc] initWithBytesNoCopy:writer.bytes
+														   length:writer.length
+													 freeWhenDone:YES]];
+}
+
+-(instancetype) initWithData:(NSData *)data {
+	if (!(self = [super init]))
+		return nil;
+
+	if (data == nil)
+		return nil;
+
+	_data = [data copy];
+
+	SA_DiceExpressionArchiveReader reader = {
+		.bytes = _data.bytes,
+		.length = _data.length,
+		.position = 0,
+		.failed = NO
+	};
+
+	_version = SA_DiceExpressionArchiveReadByte(&reader);
+	if (   reader.failed
+		|| _version != SA_DICE_EXPRESSION_ARCHIVE_VERSION)
+		return nil;
+
+	uint8_t flags = SA_DiceExpressionArchiveReadByte(&reader);
+	_hasResults = ((flags & SA_DiceExpressionArchiveFlag_HAS_RESULTS) != 0);
+	_errorBitMask = (SA_DiceExpressionError) SA_DiceExpressionArchiveReadVarint(&reader);
+	if ((flags & SA_DiceExpressionArchiveFlag_ROOT_HAS_RESULT) != 0)
+		_result = @(SA_DiceExpressionArchiveReadSigned(&reader));
+
+	_sourceLength = SA_DiceExpressionArchiveReadCount(&reader, reader.length - reader.position);
+	_sourceLocation = reader.position;
+	reader.position += _sourceLength;
+
+	// Each node takes at least ten bytes.
+	_nodeCount = SA_DiceExpressionArchiveReadCount(&reader, (reader.length - MIN(reader.position, reader.length)) / 10);
+	_nodesLocation = reader.position;
+
+	if (reader.failed)
+		return nil;
+
+	return self;
+}
+
++(instancetype) archiveWithExpression:(SA_DiceExpression *)expression {
+	return [[SA_DiceExpressionArchive alloc] initWithExpression:expression];
+}
+
+@end
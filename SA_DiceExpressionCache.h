@@ -0,0 +1,87 @@
+//
+//  SA_DiceExpressionCache.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+@class SA_DiceParser;
+@class SA_DiceProgram;
+
+/****************************************************/
+#pragma mark SA_DiceExpressionCache class declaration
+/****************************************************/
+
+/*
+ A cache of parsed (and compiled) roll strings. Die roll requests tend to be
+ very repetitive, so most roll strings need be parsed only once.
+
+ Entries are keyed by roll string, parser behavior, and string format rules
+ (see SA_DiceParser.h), since any of those may change how a string is
+ parsed. Each entry holds an SA_DiceProgram, compiled from the parsed
+ expression; evaluating a program (see SA_DiceEvaluator.h) never modifies it,
+ or its expression tree (which is immutable; see SA_DiceExpressionTree.h), so
+ a cached program may be used any number of times, from any number of
+ threads.
+
+ The cache is bounded both by number of entries and by (estimated) memory
+ use; when either limit is exceeded, the least recently used entries are
+ evicted.
+
+ All methods are thread-safe.
+ */
+@interface SA_DiceExpressionCache : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The maximum number of entries.
+@property (readonly) NSUInteger countLimit;
+
+// The maximum total estimated memory use of all entries (in bytes).
+@property (readonly) NSUInteger costLimit;
+
+// The current number of entries, and their total estimated memory use.
+@property (readonly) NSUInteger count;
+@property (readonly) NSUInteger totalCost;
+
+// The number of lookups that found, and did not find, a cached entry; and
+// the number of entries evicted to stay within the limits.
+@property (readonly) NSUInteger hitCount;
+@property (readonly) NSUInteger missCount;
+@property (readonly) NSUInteger evictionCount;
+
+/******************************/
+#pragma mark - Class properties
+/******************************/
+
+// A cache shared by the whole process (with the default limits).
+@property (class, readonly) SA_DiceExpressionCache *sharedCache;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates a cache with the default limits (1024 entries, and 4 MB).
+-(instancetype) init;
+
+-(instancetype) initWithCountLimit:(NSUInteger)countLimit
+						 costLimit:(NSUInteger)costLimit NS_DESIGNATED_INITIALIZER;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Returns the compiled form of the given roll string, as parsed by the given
+// parser; parses and compiles it only if it is not already cached.
+-(SA_DiceProgram *) programForString:(NSString *)dieRollString
+							  parser:(SA_DiceParser *)parser;
+
+-(void) removeAllPrograms;
+
+// Resets the hit, miss, and eviction counts to zero.
+-(void) resetStatistics;
+
+@end
@@ -0,0 +1,326 @@
+//
+//  SA_DiceExpressionCache.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceExpressionCache.h"
+
+#import "SA_DiceParser.h"
+#import "SA_DiceProgram.h"
+
+#import <pthread.h>
+
+/*
+ The cache is a dictionary (for lookup) of entries which are also linked into
+ a doubly-linked list (for recency), most recently used first. Both are
+ guarded by a single mutex; it is held only for lookups and list updates,
+ never while parsing or compiling, so a slow miss does not block other
+ threads.
+ */
+
+/*********************************************************/
+#pragma mark - SA_DiceExpressionCacheKey class declaration
+/*********************************************************/
+
+@interface SA_DiceExpressionCacheKey : NSObject <NSCopying> {
+	@public
+	SA_DiceParserBehavior _parserBehavior;
+	const SA_DiceStringFormatRules *_stringFormatRules;
+	NSString *_string;
+}
+
+@end
+
+@implementation SA_DiceExpressionCacheKey
+
+-(NSUInteger) hash {
+	return (_string.hash ^ ((NSUInteger) _parserBehavior << 16) ^ (NSUInteger) _stringFormatRules);
+}
+
+-(BOOL) isEqual:(id)object {
+	if (![object isKindOfClass:[SA_DiceExpressionCacheKey class]])
+		return NO;
+
+	SA_DiceExpressionCacheKey *key = (SA_DiceExpressionCacheKey *) object;
+	return (key->_parserBehavior == _parserBehavior
+			&& key->_stringFormatRules == _stringFormatRules
+			&& [key->_string isEqualToString:_string]);
+}
+
+-(id) copyWithZone:(NSZone *)zone {
+	SA_DiceExpressionCacheKey *copy = [SA_DiceExpressionCacheKey new];
+	copy->_parserBehavior = _parserBehavior;
+	copy->_stringFormatRules = _stringFormatRules;
+	copy->_string = [_string copy];
+	return copy;
+}
+
+@end
+
+/***********************************************************/
+#pragma mark - SA_DiceExpressionCacheEntry class declaration
+/***********************************************************/
+
+@interface SA_DiceExpressionCacheEntry : NSObject {
+	@public
+	SA_DiceExpressionCacheKey *_key;
+	SA_DiceProgram *_program;
+	NSUInteger _cost;
+
+	// The dictionary owns the entries; the list links need not.
+	__unsafe_unretained SA_DiceExpressionCacheEntry *_previous;
+	__unsafe_unretained SA_DiceExpressionCacheEntry *_next;
+}
+
+@end
+
+@implementation SA_DiceExpressionCacheEntry
+
+@end
+
+/*********************************************************/
+#pragma mark - SA_DiceExpressionCache class implementation
+/*********************************************************/
+
+@implementation SA_DiceExpressionCache {
+	pthread_mutex_t _lock;
+
+	NSMutableDictionary <SA_DiceExpressionCacheKey *, SA_DiceExpressionCacheEntry *> *_entries;
+
+	// Most and least recently used entries.
+	__unsafe_unretained SA_DiceExpressionCacheEntry *_head;
+	__unsafe_unretained SA_DiceExpressionCacheEntry *_tail;
+
+	// Reused for lookups (under the lock), so that a hit allocates nothing.
+	SA_DiceExpressionCacheKey *_probeKey;
+
+	NSUInteger _totalCost;
+	NSUInteger _hitCount;
+	NSUInteger _missCount;
+	NSUInteger _evictionCount;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(NSUInteger) count {
+	pthread_mutex_lock(&_lock);
+	NSUInteger count = _entries.count;
+	pthread_mutex_unlock(&_lock);
+	return count;
+}
+
+-(NSUInteger) totalCost {
+	pthread_mutex_lock(&_lock);
+	NSUInteger totalCost = _totalCost;
+	pthread_mutex_unlock(&_lock);
+	return totalCost;
+}
+
+-(NSUInteger) hitCount {
+	pthread_mutex_lock(&_lock);
+	NSUInteger hitCount = _hitCount;
+	pthread_mutex_unlock(&_lock);
+	return hitCount;
+}
+
+-(NSUInteger) missCount {
+	pthread_mutex_lock(&_lock);
+	NSUInteger missCount = _missCount;
+	pthread_mutex_unlock(&_lock);
+	return missCount;
+}
+
+-(NSUInteger) evictionCount {
+	pthread_mutex_lock(&_lock);
+	NSUInteger evictionCount = _evictionCount;
+	pthread_mutex_unlock(&_lock);
+	return evictionCount;
+}
+
+/******************************/
+#pragma mark - Class properties
+/******************************/
+
++(SA_DiceExpressionCache *) sharedCache {
+	static SA_DiceExpressionCache *sharedCache;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		sharedCache = [SA_DiceExpressionCache new];
+	});
+
+	return sharedCache;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithCountLimit:1024
+						  costLimit:(4 * 1024 * 1024)];
+}
+
+-(instancetype) initWithCountLimit:(NSUInteger)countLimit
+						 costLimit:(NSUInteger)costLimit {
+	if (!(self = [super init]))
+		return nil;
+
+	_countLimit = countLimit;
+	_costLimit = costLimit;
+
+	pthread_mutex_init(&_lock, NULL);
+
+	_entries = [NSMutableDictionary dictionaryWithCapacity:MIN(countLimit, 1024)];
+	_probeKey = [SA_DiceExpressionCacheKey new];
+
+	return self;
+}
+
+-(void) dealloc {
+	pthread_mutex_destroy(&_lock);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceProgram *) programForString:(NSString *)dieRollString
+							  parser:(SA_DiceParser *)parser {
+	if (dieRollString == nil)
+		return nil;
+
+	SA_DiceParserBehavior parserBehavior = parser.parserBehavior;
+	const SA_DiceStringFormatRules *stringFormatRules = parser.stringFormatRules;
+
+	pthread_mutex_lock(&_lock);
+
+	_probeKey->_parserBehavior = parserBehavior;
+	_probeKey->_stringFormatRules = stringFormatRules;
+	_probeKey->_string = dieRollString;
+	SA_DiceExpressionCacheEntry *entry = _entries[_probeKey];
+	_probeKey->_string = nil;
+
+	if (entry != nil) {
+		_hitCount++;
+		[self moveEntryToFront:entry];
+		SA_DiceProgram *program = entry->_program;
+		pthread_mutex_unlock(&_lock);
+		return program;
+	}
+
+	_missCount++;
+	pthread_mutex_unlock(&_lock);
+
+	// Parse and compile without holding the lock. The program refers to the
+	// parsed tree (which is immutable) without copying it.
+	SA_DiceExpressionTree *tree = [parser expressionTreeForString:dieRollString];
+	if (tree == nil)
+		return nil;
+	SA_DiceProgram *program = [[SA_DiceProgram alloc] initWithExpressionTree:tree];
+
+	entry = [SA_DiceExpressionCacheEntry new];
+	entry->_key = [SA_DiceExpressionCacheKey new];
+	entry->_key->_parserBehavior = parserBehavior;
+	entry->_key->_stringFormatRules = stringFormatRules;
+	entry->_key->_string = [dieRollString copy];
+	entry->_program = program;
+	entry->_cost = program.estimatedMemorySize;
+
+	// A program too large to cache at all is simply returned.
+	if (entry->_cost > _costLimit || _countLimit == 0)
+		return program;
+
+	pthread_mutex_lock(&_lock);
+
+	// Another thread may have cached the same string in the meantime; if so,
+	// keep its program (so that all callers share one).
+	SA_DiceExpressionCacheEntry *existingEntry = _entries[entry->_key];
+	if (existingEntry != nil) {
+		[self moveEntryToFront:existingEntry];
+		program = existingEntry->_program;
+	} else {
+		_entries[entry->_key] = entry;
+		[self insertEntryAtFront:entry];
+		_totalCost += entry->_cost;
+		[self evictEntriesToFitLimits];
+	}
+
+	pthread_mutex_unlock(&_lock);
+
+	return program;
+}
+
+-(void) removeAllPrograms {
+	pthread_mutex_lock(&_lock);
+	[_entries removeAllObjects];
+	_head = nil;
+	_tail = nil;
+	_totalCost = 0;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(void) resetStatistics {
+	pthread_mutex_lock(&_lock);
+	_hitCount = 0;
+	_missCount = 0;
+	_evictionCount = 0;
+	pthread_mutex_unlock(&_lock);
+}
+
+/****************************/
+#pragma mark - Helper methods
+/****************************/
+
+// All helper methods must be called with the lock held.
+
+-(void) insertEntryAtFront:(SA_DiceExpressionCacheEntry *)entry {
+	entry->_previous = nil;
+	entry->_next = _head;
+	if (_head != nil)
+		_head->_previous = entry;
+	_head = entry;
+	if (_tail == nil)
+		_tail = entry;
+}
+
+-(void) unlinkEntry:(SA_DiceExpressionCacheEntry *)entry {
+	if (entry->_previous != nil)
+		entry->_previous->_next = entry->_next;
+	else
+		_head = entry->_next;
+
+	if (entry->_next != nil)
+		entry->_next->_previous = entry->_previous;
+	else
+		_tail = entry->_previous;
+
+	entry->_previous = nil;
+	entry->_next = nil;
+}
+
+-(void) moveEntryToFront:(SA_DiceExpressionCacheEntry *)entry {
+	if (entry == _head)
+		return;
+
+	[self unlinkEntry:entry];
+	[self insertEntryAtFront:entry];
+}
+
+-(void) evictEntriesToFitLimits {
+	while (_tail != nil
+		   && (_entries.count > _countLimit || _totalCost > _costLimit)) {
+		SA_DiceExpressionCacheEntry *entry = _tail;
+		[self unlinkEntry:entry];
+		_totalCost -= entry->_cost;
+		_evictionCount++;
+
+		// This releases the entry (and, unless a caller still holds it, its
+		// program).
+		[_entries removeObjectForKey:entry->_key];
+	}
+}
+
+@end
@@ -21,6 +21,11 @@ extern NSString * const SA_DB_STRING_FORMAT_RULES_PLIST_NAME;
  The file is organized as a dictionary contaning several sub-dictionaries. The
  valid keys (those for which values are present in the file), and the values
  that those keys may be expected to have, are listed below.
+
+ NOTE: The library does not read this file at runtime; its contents are
+ compiled into the default rules tables (see SA_DiceStringFormatRules.h). A
+ dictionary with this structure may be compiled into a rules table at runtime,
+ to override the defaults.
  */
 
 // The value for the top-level key SA_DB_VALID_CHARACTERS is a dictionary that 
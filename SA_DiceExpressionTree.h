@@ -0,0 +1,190 @@
+//
+//  SA_DiceExpressionTree.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+@class SA_DiceExpressionResults;
+
+/*
+ An SA_DiceExpressionTree is a compact, immutable representation of an
+ expression tree: all of its nodes are kept in one contiguous array, and
+ refer to their sub-expressions by index; and the input strings of all the
+ nodes are ranges of a single source string (e.g., the roll string the tree
+ was parsed from), rather than strings of their own. Holding on to a parsed
+ expression thus costs a few allocations, however large the expression.
+
+ A tree holds no results. Evaluating it (see SA_DiceProgram.h) produces an
+ SA_DiceExpressionResults object - a “slab” of per-node results, also held
+ in a few contiguous arrays - so that one tree may be evaluated any number of
+ times (from any number of threads at once), each evaluation’s results being
+ kept separately.
+
+ The usual SA_DiceExpression API is available for both: an SA_DiceExpression
+ may be a lightweight view of a node of a tree (and of its results, if any),
+ which reads its attributes from the tree, and creates views of its
+ sub-expressions only as they are asked for. (A view that is modified stops
+ being a view, and takes on a copy of its attributes; the tree itself is
+ never modified.)
+
+ Trees and results are immutable, and may be shared between threads.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// One node of an expression tree. The indices of sub-expressions are
+// NSNotFound for those which are nil. (The enumerated attributes are stored
+// as bytes, to keep nodes small.)
+typedef struct {
+	uint8_t type;			// SA_DiceExpressionTermType
+	uint8_t operator;		// SA_DiceExpressionOperator
+	uint8_t rollCommand;	// SA_DiceExpressionRollCommand
+	uint8_t dieType;		// SA_DiceExpressionDieType
+	uint8_t rollModifier;	// SA_DiceExpressionRollModifier
+
+	// NO if the node’s value is nil.
+	BOOL hasValue;
+	NSInteger value;
+
+	SA_DiceExpressionError errorBitMask;
+
+	NSUInteger leftOperand;
+	NSUInteger rightOperand;
+	NSUInteger dieCount;
+	NSUInteger dieSize;
+
+	// The node’s input string, as a range of the tree’s source string. (The
+	// location is NSNotFound if the input string is nil.)
+	NSRange inputRange;
+} SA_DiceExpressionNode;
+
+typedef NS_ENUM(uint8_t, SA_DiceExpressionNodeStatus) {
+	// The node was not evaluated (because it, or its parent, was erroneous
+	// to begin with, or because its parent never needed it); it has no
+	// result.
+	SA_DiceExpressionNodeStatus_UNEVALUATED,
+	SA_DiceExpressionNodeStatus_EVALUATED
+};
+
+// The result of evaluating one node. The rolls (if any) are a range of the
+// results’ rolls - or, if ‘explodedDieSize’ is not 0, of its exploded dice
+// (see SA_DiceRollBuffer.h), all of that size.
+typedef struct {
+	SA_DiceExpressionNodeStatus status;
+	BOOL hasResult;
+	BOOL hasRolls;
+	SA_DiceExpressionError errors;
+	NSInteger value;
+	NSRange rolls;
+	NSUInteger explodedDieSize;
+} SA_DiceExpressionNodeResult;
+
+/*****************************************************/
+#pragma mark - SA_DiceExpressionTree class declaration
+/*****************************************************/
+
+@interface SA_DiceExpressionTree : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The string of which the nodes’ input strings are ranges.
+@property (readonly) NSString *source;
+
+// The nodes (as a C array of -nodeCount nodes). Every node comes after its
+// sub-expressions; the root is the last node. (The root node index is
+// NSNotFound if the tree is empty.)
+@property (readonly) const SA_DiceExpressionNode *nodes NS_RETURNS_INNER_POINTER;
+@property (readonly) NSUInteger nodeCount;
+@property (readonly) NSUInteger rootNode;
+
+// A view of the root node (with no results), or nil if the tree is empty.
+// Each call returns a new view.
+@property (readonly) SA_DiceExpression *expression;
+
+// An estimate of the memory used by the tree (in bytes).
+@property (readonly) NSUInteger estimatedMemorySize;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Flattens the given expression into a new tree. (Where the input strings of
+// sub-expressions are found within those of their parents, as they are in
+// parsed expressions, they share the parents’ text; other input strings are
+// added to the source string.) Results and rolls, if the expression has any,
+// are not kept. Returns nil if the expression is nil.
+-(instancetype) initWithExpression:(SA_DiceExpression *)expression;
+
+// Creates a tree with the given nodes (which must be malloc()’d, and are
+// freed with the tree), and source string. The nodes must be ordered as
+// described above.
+-(instancetype) initByTakingNodes:(SA_DiceExpressionNode *)nodes
+							count:(NSUInteger)count
+						   source:(NSString *)source NS_DESIGNATED_INITIALIZER;
+
++(instancetype) treeWithExpression:(SA_DiceExpression *)expression;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Returns a view of the given node, with the given results (which must be
+// the results of evaluating this tree), or with no results (if nil).
+-(SA_DiceExpression *) expressionForNode:(NSUInteger)node
+								 results:(SA_DiceExpressionResults *)results;
+
+// Returns the input string of the given node.
+-(NSString *) inputStringOfNode:(NSUInteger)node;
+
+@end
+
+/********************************************************/
+#pragma mark - SA_DiceExpressionResults class declaration
+/********************************************************/
+
+@interface SA_DiceExpressionResults : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The result of each node of the tree that was evaluated (as a C array of
+// -nodeCount results, indexed as the tree’s nodes are).
+@property (readonly) const SA_DiceExpressionNodeResult *nodeResults NS_RETURNS_INNER_POINTER;
+@property (readonly) NSUInteger nodeCount;
+
+// An estimate of the memory used by the results (in bytes).
+@property (readonly) NSUInteger estimatedMemorySize;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates results from the given node results, rolls, and exploded dice (all
+// of which are copied, into a single allocation). Only the rolls and exploded
+// dice that the node results refer to need be given (i.e., the ranges must be
+// within the given counts).
+-(instancetype) initWithNodeResults:(const SA_DiceExpressionNodeResult *)nodeResults
+							  count:(NSUInteger)nodeCount
+							  rolls:(const NSInteger *)rolls
+							  count:(NSUInteger)rollCount
+					   explodedDice:(const SA_DiceExplodedDie *)explodedDice
+							  count:(NSUInteger)explodedDieCount NS_DESIGNATED_INITIALIZER;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Returns the rolls generated by the given node (or nil, if it has none).
+// Each call returns a new buffer.
+-(SA_DiceRollBuffer *) rollsOfNode:(NSUInteger)node;
+
+@end
@@ -0,0 +1,325 @@
+//
+//  SA_DiceExpressionTree.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceExpressionTree.h"
+
+#import "SA_DiceRollBuffer.h"
+
+#import <objc/runtime.h>
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// The state of the flattening of an expression into a tree.
+typedef struct {
+	SA_DiceExpressionNode *nodes;
+	NSUInteger nodeCount;
+	NSUInteger nodeCapacity;
+
+	__unsafe_unretained NSMutableString *source;
+} SA_DiceExpressionTreeFlattening;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Finds the given expression’s input string in the source string, within the
+// given range (if any), at or after ‘*searchLocation’ (which is then moved
+// past it); if it is not there, it is added to the end of the source string.
+// Returns the range of the input string.
+static NSRange SA_DiceExpressionTreeFindInputString(SA_DiceExpressionTreeFlattening *flattening,
+													NSString *inputString,
+													NSRange searchRange,
+													NSUInteger *searchLocation) {
+	if (inputString == nil)
+		return NSRangeMake(NSNotFound, 0);
+
+	if (searchRange.location != NSNotFound) {
+		NSRange inputRange = ((inputString.length == 0)
+							  ? NSRangeMake(*searchLocation, 0)
+							  : [flattening->source rangeOfString:inputString
+														 options:NSLiteralSearch
+														   range:NSRangeMake(*searchLocation, NSMaxRange(searchRange) - *searchLocation)]);
+		if (inputRange.location != NSNotFound) {
+			*searchLocation = NSMaxRange(inputRange);
+			return inputRange;
+		}
+	}
+
+	NSRange inputRange = NSRangeMake(flattening->source.length, inputString.length);
+	[flattening->source appendString:inputString];
+	return inputRange;
+}
+
+// Adds the nodes of the given expression (its sub-expressions first, then its
+// own), whose input string is to be looked for as described above; returns
+// the index of its node (or NSNotFound, if it is nil).
+static NSUInteger SA_DiceExpressionTreeAddExpression(SA_DiceExpressionTreeFlattening *flattening,
+													 SA_DiceExpression *expression,
+													 NSRange searchRange,
+													 NSUInteger *searchLocation) {
+	if (expression == nil)
+		return NSNotFound;
+
+	NSRange inputRange = SA_DiceExpressionTreeFindInputString(flattening, expression.inputString, searchRange, searchLocation);
+
+	// The sub-expressions’ input strings are looked for within this one’s, in
+	// order. (The sub-expressions must be added one at a time, in order, and
+	// so cannot be added in the initializer below.)
+	NSUInteger childSearchLocation = inputRange.location;
+	NSUInteger leftOperand = SA_DiceExpressionTreeAddExpression(flattening, expression.leftOperand, inputRange, &childSearchLocation);
+	NSUInteger rightOperand = SA_DiceExpressionTreeAddExpression(flattening, expression.rightOperand, inputRange, &childSearchLocation);
+	NSUInteger dieCount = SA_DiceExpressionTreeAddExpression(flattening, expression.dieCount, inputRange, &childSearchLocation);
+	NSUInteger dieSize = SA_DiceExpressionTreeAddExpression(flattening, expression.dieSize, inputRange, &childSearchLocation);
+
+	SA_DiceExpressionNode node = {
+		.type = (uint8_t) expression.type,
+		.operator = (uint8_t) expression.operator,
+		.rollCommand = (uint8_t) expression.rollCommand,
+		.dieType = (uint8_t) expression.dieType,
+		.rollModifier = (uint8_t) expression.rollModifier,
+		.hasValue = (expression.value != nil),
+		.value = expression.value.integerValue,
+		.errorBitMask = expression.errorBitMask,
+		.leftOperand = leftOperand,
+		.rightOperand = rightOperand,
+		.dieCount = dieCount,
+		.dieSize = dieSize,
+		.inputRange = inputRange
+	};
+
+	if (flattening->nodeCount == flattening->nodeCapacity) {
+		flattening->nodeCapacity = (flattening->nodeCapacity > 0) ? (flattening->nodeCapacity * 2) : 16;
+		flattening->nodes = realloc(flattening->nodes, flattening->nodeCapacity * sizeof(SA_DiceExpressionNode));
+	}
+	flattening->nodes[flattening->nodeCount] = node;
+
+	return flattening->nodeCount++;
+}
+
+/*********************************************************/
+#pragma mark - SA_DiceExpressionTree class implementation
+/*********************************************************/
+
+@implementation SA_DiceExpressionTree {
+	NSString *_source;
+
+	SA_DiceExpressionNode *_nodes;
+	NSUInteger _nodeCount;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(NSString *) source {
+	return _source;
+}
+
+-(const SA_DiceExpressionNode *) nodes {
+	return _nodes;
+}
+
+-(NSUInteger) nodeCount {
+	return _nodeCount;
+}
+
+-(NSUInteger) rootNode {
+	return (_nodeCount > 0) ? (_nodeCount - 1) : NSNotFound;
+}
+
+-(SA_DiceExpression *) expression {
+	if (_nodeCount == 0)
+		return nil;
+
+	return [self expressionForNode:(_nodeCount - 1)
+						   results:nil];
+}
+
+-(NSUInteger) estimatedMemorySize {
+	return (class_getInstanceSize([SA_DiceExpressionTree class])
+			+ (_nodeCount * sizeof(SA_DiceExpressionNode))
+			+ (_source.length * sizeof(unichar)));
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initByTakingNodes:NULL
+							 count:0
+							source:@""];
+}
+
+-(instancetype) initWithExpression:(SA_DiceExpression *)expression {
+	if (expression == nil)
+		return nil;
+
+	NSMutableString *source = [NSMutableString string];
+	SA_DiceExpressionTreeFlattening flattening = {
+		.nodes = NULL,
+		.nodeCount = 0,
+		.nodeCapacity = 0,
+		.source = source
+	};
+	NSUInteger searchLocation = 0;
+	SA_DiceExpressionTreeAddExpression(&flattening, expression, NSRangeMake(NSNotFound, 0), &searchLocation);
+
+	return [self initByTakingNodes:flattening.nodes
+							 count:flattening.nodeCount
+							source:[source copy]];
+}
+
+-(instancetype) initByTakingNodes:(SA_DiceExpressionNode *)nodes
+							count:(NSUInteger)count
+						   source:(NSString *)source {
+	if (!(self = [super init]))
+		return nil;
+
+	_nodes = nodes;
+	_nodeCount = count;
+	_source = [source copy];
+
+	return self;
+}
+
++(instancetype) treeWithExpression:(SA_DiceExpression *)expression {
+	return [[SA_DiceExpressionTree alloc] initWithExpression:expression];
+}
+
+-(void) dealloc {
+	free(_nodes);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceExpression *) expressionForNode:(NSUInteger)node
+								 results:(SA_DiceExpressionResults *)results {
+	return [[SA_DiceExpression alloc] initWithTree:self
+											  node:node
+										   results:results];
+}
+
+-(NSString *) inputStringOfNode:(NSUInteger)node {
+	NSRange inputRange = _nodes[node].inputRange;
+	if (inputRange.location == NSNotFound)
+		return nil;
+
+	return [_source substringWithRange:inputRange];
+}
+
+@end
+
+/************************************************************/
+#pragma mark - SA_DiceExpressionResults class implementation
+/************************************************************/
+
+@implementation SA_DiceExpressionResults {
+	// The node results, rolls, and exploded dice are all in one allocation
+	// (which ‘_nodeResults’ points to).
+	SA_DiceExpressionNodeResult *_nodeResults;
+	NSUInteger _nodeCount;
+
+	const NSInteger *_rolls;
+	NSUInteger _rollCount;
+
+	const SA_DiceExplodedDie *_explodedDice;
+	NSUInteger _explodedDieCount;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(const SA_DiceExpressionNodeResult *) nodeResults {
+	return _nodeResults;
+}
+
+-(NSUInteger) nodeCount {
+	return _nodeCount;
+}
+
+-(NSUInteger) estimatedMemorySize {
+	return (class_getInstanceSize([SA_DiceExpressionResults class])
+			+ (_nodeCount * sizeof(SA_DiceExpressionNodeResult))
+			+ (_rollCount * sizeof(NSInteger))
+			+ (_explodedDieCount * sizeof(SA_DiceExplodedDie)));
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithNodeResults:NULL
+							   count:0
+							   rolls:NULL
+							   count:0
+						explodedDice:NULL
+							   count:0];
+}
+
+-(instancetype) initWithNodeResults:(const SA_DiceExpressionNodeResult *)nodeResults
+							  count:(NSUInteger)nodeCount
+							  rolls:(const NSInteger *)rolls
+							  count:(NSUInteger)rollCount
+					   explodedDice:(const SA_DiceExplodedDie *)explodedDice
+							  count:(NSUInteger)explodedDieCount {
+	if (!(self = [super init]))
+		return nil;
+
+	// (All three element types are multiples of the word size, so each array
+	// is suitably aligned.)
+	size_t nodeResultsSize = nodeCount * sizeof(SA_DiceExpressionNodeResult);
+	size_t rollsSize = rollCount * sizeof(NSInteger);
+	size_t explodedDiceSize = explodedDieCount * sizeof(SA_DiceExplodedDie);
+	char *slab = malloc(MAX(nodeResultsSize + rollsSize + explodedDiceSize, 1));
+
+	if (nodeCount > 0)
+		memcpy(slab, nodeResults, nodeResultsSize);
+	if (rollCount > 0)
+		memcpy(slab + nodeResultsSize, rolls, rollsSize);
+	if (explodedDieCount > 0)
+		memcpy(slab + nodeResultsSize + rollsSize, explodedDice, explodedDiceSize);
+
+	_nodeResults = (SA_DiceExpressionNodeResult *) slab;
+	_nodeCount = nodeCount;
+	_rolls = (const NSInteger *) (slab + nodeResultsSize);
+	_rollCount = rollCount;
+	_explodedDice = (const SA_DiceExplodedDie *) (slab + nodeResultsSize + rollsSize);
+	_explodedDieCount = explodedDieCount;
+
+	return self;
+}
+
+-(void) dealloc {
+	free(_nodeResults);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceRollBuffer *) rollsOfNode:(NSUInteger)node {
+	const SA_DiceExpressionNodeResult *nodeResult = &_nodeResults[node];
+	if (!nodeResult->hasRolls)
+		return nil;
+
+	if (nodeResult->explodedDieSize != 0) {
+		return [[SA_DiceRollBuffer alloc] initWithExplodedDice:(_explodedDice + nodeResult->rolls.location)
+														 count:nodeResult->rolls.length
+													   dieSize:nodeResult->explodedDieSize];
+	} else {
+		return [[SA_DiceRollBuffer alloc] initWithValues:(_rolls + nodeResult->rolls.location)
+												   count:nodeResult->rolls.length];
+	}
+}
+
+@end
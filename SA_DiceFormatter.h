@@ -7,6 +7,10 @@
 #import <Foundation/Foundation.h>
 
 #import "SA_DiceExpression.h"
+#import "SA_DiceStringFormatRules.h"
+
+@class SA_DiceExpressionArchive;
+@class SA_DiceMetrics;
 
 /*********************/
 #pragma mark Constants
@@ -111,6 +115,46 @@ typedef NS_ENUM(unsigned int, SA_DiceFormatterBehavior) {
 	SA_DiceFormatterBehaviorFeepbot	=	65536
 };
 
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+/*
+ A buffer of UTF-16 characters, into which a formatter writes its output (see
+ -[SA_DiceFormatter appendStringFromExpression:toBuffer:]). A buffer may be
+ reused for any number of expressions (by resetting it between them), so that
+ formatting need not allocate anything at all once the buffer is large enough.
+
+ A buffer may start out with storage provided by the caller (e.g., an array on
+ the stack); if it outgrows that storage, it moves to storage of its own (and
+ must then be freed, with SA_DiceFormatterBufferFree()).
+ */
+typedef struct {
+	unichar *characters;
+	NSUInteger length;
+	NSUInteger capacity;
+	BOOL ownsCharacters;
+} SA_DiceFormatterBuffer;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Initializes the given buffer (empty), with the given storage (which may be
+// NULL, with capacity 0).
+void SA_DiceFormatterBufferInit(SA_DiceFormatterBuffer *buffer,
+								unichar *storage,
+								NSUInteger capacity);
+
+// Frees the buffer’s storage (unless it was provided by the caller). The
+// buffer may then be initialized again.
+void SA_DiceFormatterBufferFree(SA_DiceFormatterBuffer *buffer);
+
+// Empties the buffer (keeping its storage).
+NS_INLINE void SA_DiceFormatterBufferReset(SA_DiceFormatterBuffer *buffer) {
+	buffer->length = 0;
+}
+
 /************************************************/
 #pragma mark - SA_DiceFormatter class declaration
 /************************************************/
@@ -123,6 +167,17 @@ typedef NS_ENUM(unsigned int, SA_DiceFormatterBehavior) {
 
 @property SA_DiceFormatterBehavior formatterBehavior;
 
+// The rules which determine the canonical representations of operators, etc.,
+// and the descriptions of errors. By default (or if set to NULL), a formatter
+// uses the rules currently in effect for the whole library (see
+// SA_DiceStringFormatRules.h); a formatter may instead be given rules of its
+// own.
+@property (nonatomic) const SA_DiceStringFormatRules *stringFormatRules;
+
+// If set, every formatting operation is recorded in the given metrics (see
+// SA_DiceMetrics.h). The default is nil.
+@property (nonatomic) SA_DiceMetrics *metrics;
+
 /*************************************************/
 #pragma mark - Properties (“legacy” behavior mode)
 /*************************************************/
@@ -149,8 +204,23 @@ typedef NS_ENUM(unsigned int, SA_DiceFormatterBehavior) {
 /****************************/
 
 -(NSString *) stringFromExpression:(SA_DiceExpression *)expression;
+
+// Writes the same output as -stringFromExpression: to the end of the given
+// buffer (growing it as needed).
+-(void) appendStringFromExpression:(SA_DiceExpression *)expression
+						  toBuffer:(SA_DiceFormatterBuffer *)buffer;
+
 -(NSAttributedString *) attributedStringFromExpression:(SA_DiceExpression *)expression;
 
+// Formats an archived expression (see SA_DiceExpressionArchive.h). Behaviors
+// that need no more than the result (e.g., “simple”) read it from the archive
+// as it is; the others decode the expression first.
+-(NSString *) stringFromArchive:(SA_DiceExpressionArchive *)archive;
+
+-(void) appendStringFromArchive:(SA_DiceExpressionArchive *)archive
+					   toBuffer:(SA_DiceFormatterBuffer *)buffer;
+
+// These use the rules currently in effect for the whole library.
 +(NSString *) rectifyMinusSignInString:(NSString *)aString;
 +(NSString *) canonicalRepresentationForOperator:(SA_DiceExpressionOperator)operator;
 
@@ -6,17 +6,211 @@
 
 #import "SA_DiceFormatter.h"
 
-#import "SA_DiceExpressionStringConstants.h"
+#import "SA_DiceExpressionArchive.h"
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceMetrics.h"
 
 #import "SA_Utility.h"
 
+#import <stdatomic.h>
+
 /********************************/
 #pragma mark File-scope variables
 /********************************/
 
-static SA_DiceFormatterBehavior _defaultFormatterBehavior = SA_DiceFormatterBehaviorLegacy;
-static NSDictionary *_errorDescriptions;
-static NSDictionary *_stringFormatRules;
+// Read and written atomically, since any thread may create a new instance
+// (which reads it) at any time.
+static _Atomic(SA_DiceFormatterBehavior) _defaultFormatterBehavior = SA_DiceFormatterBehaviorLegacy;
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+// The state of one formatting operation: the buffer being written to, and
+// the rules (with the canonical minus sign looked up in advance).
+typedef struct {
+	SA_DiceFormatterBuffer *buffer;
+	const SA_DiceStringFormatRules *rules;
+	__unsafe_unretained NSString *canonicalMinusSign;
+	unichar canonicalMinusSignCharacter;
+} SA_DiceFormatterWriter;
+
+// A step of writing the nodes of an expression tree (see “Legacy” behavior,
+// below): the node to write, from the given phase on. (Phase 0 is the start
+// of the node; each later phase continues it, after one of its
+// sub-expressions has been written.)
+typedef struct {
+	NSUInteger node;
+	NSUInteger phase;
+} SA_DiceFormatterTreeStep;
+
+/****************************/
+#pragma mark - Output buffers
+/****************************/
+
+void SA_DiceFormatterBufferInit(SA_DiceFormatterBuffer *buffer,
+								unichar *storage,
+								NSUInteger capacity) {
+	buffer->characters = storage;
+	buffer->length = 0;
+	buffer->capacity = (storage != NULL) ? capacity : 0;
+	buffer->ownsCharacters = NO;
+}
+
+void SA_DiceFormatterBufferFree(SA_DiceFormatterBuffer *buffer) {
+	if (buffer->ownsCharacters)
+		free(buffer->characters);
+	SA_DiceFormatterBufferInit(buffer, NULL, 0);
+}
+
+// Makes room for (at least) the given number of characters past the end of
+// the buffer’s contents.
+static void SA_DiceFormatterBufferReserve(SA_DiceFormatterBuffer *buffer,
+										  NSUInteger additionalLength) {
+	if (buffer->length + additionalLength <= buffer->capacity)
+		return;
+
+	NSUInteger capacity = MAX(MAX(buffer->capacity * 2, buffer->length + additionalLength), 64);
+	if (buffer->ownsCharacters) {
+		buffer->characters = realloc(buffer->characters, capacity * sizeof(unichar));
+	} else {
+		unichar *characters = malloc(capacity * sizeof(unichar));
+		if (buffer->length > 0)
+			memcpy(characters, buffer->characters, buffer->length * sizeof(unichar));
+		buffer->characters = characters;
+		buffer->ownsCharacters = YES;
+	}
+	buffer->capacity = capacity;
+}
+
+/*
+ Everything is written with the minus signs already made canonical (exactly
+ as +[SA_DiceFormatter rectifyMinusSignInString:] would make them, had the
+ whole output been built first and then rectified): any character that is a
+ minus sign under the rules, but is not the canonical minus sign, is written
+ as the canonical minus sign.
+ */
+
+static SA_DiceFormatterWriter SA_DiceFormatterWriterMake(SA_DiceFormatterBuffer *buffer,
+														 const SA_DiceStringFormatRules *rules) {
+	NSString *canonicalMinusSign = rules->canonicalOperatorRepresentations[SA_DiceExpressionOperator_MINUS];
+	return (SA_DiceFormatterWriter) {
+		.buffer = buffer,
+		.rules = rules,
+		.canonicalMinusSign = canonicalMinusSign,
+		.canonicalMinusSignCharacter = ((canonicalMinusSign.length == 1)
+										? [canonicalMinusSign characterAtIndex:0]
+										: 0)
+	};
+}
+
+static void SA_DiceFormatterWriteCharacters(SA_DiceFormatterWriter *writer,
+											const unichar *characters,
+											NSUInteger count) {
+	SA_DiceFormatterBuffer *buffer = writer->buffer;
+	SA_DiceFormatterBufferReserve(buffer, count);
+
+	for (NSUInteger i = 0; i < count; i++) {
+		unichar character = characters[i];
+		if (   character == writer->canonicalMinusSignCharacter
+			|| SA_DiceStringFormatRulesCharacterClass(writer->rules, character) != SA_DiceCharacterClass_OPERATOR_MINUS) {
+			buffer->characters[buffer->length++] = character;
+		} else if (writer->canonicalMinusSignCharacter != 0) {
+			buffer->characters[buffer->length++] = writer->canonicalMinusSignCharacter;
+		} else {
+			// The canonical minus sign is not a single character (so it is
+			// copied as is, and room must be made for it).
+			NSUInteger minusSignLength = writer->canonicalMinusSign.length;
+			SA_DiceFormatterBufferReserve(buffer, minusSignLength + (count - i - 1));
+			[writer->canonicalMinusSign getCharacters:(buffer->characters + buffer->length)
+												range:NSRangeMake(0, minusSignLength)];
+			buffer->length += minusSignLength;
+		}
+	}
+}
+
+// A nil string is written as “(null)” (as it would be by a format string).
+static void SA_DiceFormatterWriteString(SA_DiceFormatterWriter *writer,
+										NSString *string) {
+	if (string == nil)
+		string = @"(null)";
+
+	NSUInteger length = string.length;
+	const unichar *characters = CFStringGetCharactersPtr((__bridge CFStringRef) string);
+	if (characters != NULL) {
+		SA_DiceFormatterWriteCharacters(writer, characters, length);
+		return;
+	}
+
+	unichar chunk[64];
+	for (NSUInteger location = 0; location < length; location += 64) {
+		NSUInteger chunkLength = MIN(length - location, 64);
+		[string getCharacters:chunk
+						range:NSRangeMake(location, chunkLength)];
+		SA_DiceFormatterWriteCharacters(writer, chunk, chunkLength);
+	}
+}
+
+static void SA_DiceFormatterWriteASCII(SA_DiceFormatterWriter *writer,
+									   const char *string) {
+	unichar characters[32];
+	NSUInteger count = 0;
+	for (; string[count] != '\0'; count++)
+		characters[count] = (unichar) string[count];
+	SA_DiceFormatterWriteCharacters(writer, characters, count);
+}
+
+static void SA_DiceFormatterWriteInteger(SA_DiceFormatterWriter *writer,
+										 NSInteger value) {
+	// Digits are generated backwards, from the end of the array.
+	unichar characters[24];
+	NSUInteger start = 24;
+	NSUInteger magnitude = (value < 0) ? ((NSUInteger) 0 - (NSUInteger) value) : (NSUInteger) value;
+	do {
+		characters[--start] = (unichar) ('0' + (magnitude % 10));
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0)
+		characters[--start] = '-';
+
+	SA_DiceFormatterWriteCharacters(writer, characters + start, 24 - start);
+}
+
+// A nil number is written as “(null)” (as it would be by a format string).
+static void SA_DiceFormatterWriteNumber(SA_DiceFormatterWriter *writer,
+										NSNumber *number) {
+	if (number == nil) {
+		SA_DiceFormatterWriteString(writer, nil);
+	} else {
+		SA_DiceFormatterWriteInteger(writer, number.integerValue);
+	}
+}
+
+// Returns the result of the given node of the given nodes, with the given
+// results of evaluating them (or nil, if it has none), as the ‘result’
+// property of a view of the node would.
+static NSNumber *SA_DiceFormatterResultOfNode(const SA_DiceExpressionNode *nodes,
+											  SA_DiceExpressionResults *results,
+											  NSUInteger index) {
+	if (   index == NSNotFound
+		|| results == nil)
+		return nil;
+
+	const SA_DiceExpressionNodeResult *nodeResult = &results.nodeResults[index];
+	if (nodeResult->status == SA_DiceExpressionNodeStatus_UNEVALUATED)
+		return nil;
+
+	const SA_DiceExpressionNode *node = &nodes[index];
+	switch (node->type) {
+		case SA_DiceExpressionTerm_OPERATION:
+		case SA_DiceExpressionTerm_ROLL_COMMAND:
+		case SA_DiceExpressionTerm_ROLL_MODIFIER:
+			return nodeResult->hasResult ? @(nodeResult->value) : nil;
+		case SA_DiceExpressionTerm_VALUE:
+		default:
+			return node->hasValue ? @(node->value) : nil;
+	}
+}
 
 /***************************************************/
 #pragma mark - SA_DiceFormatter class implementation
@@ -24,6 +218,7 @@ static NSDictionary *_stringFormatRules;
 
 @implementation SA_DiceFormatter {
 	SA_DiceFormatterBehavior _formatterBehavior;
+	const SA_DiceStringFormatRules *_stringFormatRules;
 }
 
 /**********************************/
@@ -54,28 +249,28 @@ static NSDictionary *_stringFormatRules;
 	return _formatterBehavior;
 }
 
+-(void) setStringFormatRules:(const SA_DiceStringFormatRules *)stringFormatRules {
+	_stringFormatRules = stringFormatRules;
+}
+
+-(const SA_DiceStringFormatRules *) stringFormatRules {
+	return _stringFormatRules ?: SA_DiceStringFormatRulesCurrent();
+}
+
 /******************************/
 #pragma mark - Class properties
 /******************************/
 
 +(void) setDefaultFormatterBehavior:(SA_DiceFormatterBehavior)newDefaultFormatterBehavior {
 	if (newDefaultFormatterBehavior == SA_DiceFormatterBehaviorDefault) {
-		_defaultFormatterBehavior = SA_DiceFormatterBehaviorLegacy;
+		atomic_store_explicit(&_defaultFormatterBehavior, SA_DiceFormatterBehaviorLegacy, memory_order_relaxed);
 	} else {
-		_defaultFormatterBehavior = newDefaultFormatterBehavior;
+		atomic_store_explicit(&_defaultFormatterBehavior, newDefaultFormatterBehavior, memory_order_relaxed);
 	}
 }
 
 +(SA_DiceFormatterBehavior) defaultFormatterBehavior {
-	return _defaultFormatterBehavior;
-}
-
-+(NSDictionary *) stringFormatRules {
-	if (_stringFormatRules == nil) {
-		[SA_DiceFormatter loadStringFormatRules];
-	}
-	
-	return _stringFormatRules;
+	return atomic_load_explicit(&_defaultFormatterBehavior, memory_order_relaxed);
 }
 
 /********************************************/
@@ -89,14 +284,6 @@ static NSDictionary *_stringFormatRules;
 -(instancetype) initWithBehavior:(SA_DiceFormatterBehavior)formatterBehavior {
 	if (self = [super init]) {
 		self.formatterBehavior = formatterBehavior;
-		
-		if (_errorDescriptions == nil) {
-			[SA_DiceFormatter loadErrorDescriptions];
-		}
-
-		if (_stringFormatRules == nil) {
-			[SA_DiceFormatter loadStringFormatRules];
-		}
 	}
 	return self;
 }
@@ -114,10 +301,39 @@ static NSDictionary *_stringFormatRules;
 /****************************/
 
 -(NSString *) stringFromExpression:(SA_DiceExpression *)expression {
+	// Most output fits on the stack.
+	unichar storage[256];
+	SA_DiceFormatterBuffer buffer;
+	SA_DiceFormatterBufferInit(&buffer, storage, 256);
+
+	[self appendStringFromExpression:expression
+							toBuffer:&buffer];
+	NSString *formattedString = [[NSString alloc] initWithCharacters:buffer.characters
+															  length:buffer.length];
+
+	SA_DiceFormatterBufferFree(&buffer);
+	return formattedString;
+}
+
+-(void) appendStringFromExpression:(SA_DiceExpression *)expression
+						  toBuffer:(SA_DiceFormatterBuffer *)buffer {
+	SA_DiceMetrics *metrics = _metrics;
+	uint64_t startTime = (metrics != nil) ? SA_DiceMetricsCurrentTime() : 0;
+
+	SA_DiceFormatterWriter writer = SA_DiceFormatterWriterMake(buffer, self.stringFormatRules);
+
 	if (_formatterBehavior == SA_DiceFormatterBehaviorSimple) {
-		return [self simpleStringFromExpression:expression];
+		[self simpleWriteExpression:expression
+							 writer:&writer];
 	} else { // if(_formatterBehavior == SA_DiceFormatterBehaviorLegacy)
-		return [self legacyStringFromExpression:expression];
+		[self legacyWriteExpression:expression
+							 writer:&writer];
+	}
+
+	if (metrics != nil) {
+		[metrics recordStage:SA_DiceMetricsStage_FORMAT
+					duration:(SA_DiceMetricsCurrentTime() - startTime)
+					  errors:0];
 	}
 }
 
@@ -126,37 +342,82 @@ static NSDictionary *_stringFormatRules;
 	return [[NSAttributedString alloc] initWithString:[self stringFromExpression:expression]];
 }
 
+-(NSString *) stringFromArchive:(SA_DiceExpressionArchive *)archive {
+	unichar storage[256];
+	SA_DiceFormatterBuffer buffer;
+	SA_DiceFormatterBufferInit(&buffer, storage, 256);
+
+	[self appendStringFromArchive:archive
+						 toBuffer:&buffer];
+	NSString *formattedString = [[NSString alloc] initWithCharacters:buffer.characters
+															  length:buffer.length];
+
+	SA_DiceFormatterBufferFree(&buffer);
+	return formattedString;
+}
+
+-(void) appendStringFromArchive:(SA_DiceExpressionArchive *)archive
+					   toBuffer:(SA_DiceFormatterBuffer *)buffer {
+	// The simple behavior writes only the result, which the archive has at
+	// hand; so the expression need not be decoded. (If it cannot be decoded,
+	// the result is all there is to write, whatever the behavior.)
+	if (_formatterBehavior != SA_DiceFormatterBehaviorSimple) {
+		SA_DiceExpression *expression = archive.expression;
+		if (expression != nil) {
+			[self appendStringFromExpression:expression
+									toBuffer:buffer];
+			return;
+		}
+	}
+
+	SA_DiceMetrics *metrics = _metrics;
+	uint64_t startTime = (metrics != nil) ? SA_DiceMetricsCurrentTime() : 0;
+
+	SA_DiceFormatterWriter writer = SA_DiceFormatterWriterMake(buffer, self.stringFormatRules);
+	if (archive.result != nil) {
+		SA_DiceFormatterWriteNumber(&writer, archive.result);
+	} else {
+		SA_DiceFormatterWriteASCII(&writer, "ERROR");
+	}
+
+	if (metrics != nil) {
+		[metrics recordStage:SA_DiceMetricsStage_FORMAT
+					duration:(SA_DiceMetricsCurrentTime() - startTime)
+					  errors:0];
+	}
+}
+
 /**********************************************/
 #pragma mark - “Legacy” behavior implementation
 /**********************************************/
 
 // METHODS
 
--(NSString *) legacyStringFromExpression:(SA_DiceExpression *)expression {
-	NSMutableString *formattedString = [NSMutableString string];
-	
-	// Attach the formatted string representation of the expression itself.
-	[formattedString appendString:[self legacyStringFromIntermediaryExpression:expression]];
+-(void) legacyWriteExpression:(SA_DiceExpression *)expression
+					   writer:(SA_DiceFormatterWriter *)writer {
+	// Write the formatted string representation of the expression itself.
+	[self legacyWriteIntermediaryExpression:expression
+									 writer:writer];
 	
 	// An expression may contain either a result, or one or more errors.
 	// If a result is present, attach it. If errors are present, attach them
 	// only if error reporting is enabled.
 	if (expression.result != nil) {
-		[formattedString appendFormat:@" = %@", expression.result];
+		SA_DiceFormatterWriteASCII(writer, " = ");
+		SA_DiceFormatterWriteNumber(writer, expression.result);
 	} else if (   _legacyModeErrorReportingEnabled == YES
 			   && expression.errorBitMask != 0) {
-		[formattedString appendFormat:((__builtin_popcountl(expression.errorBitMask) == 1)
-									   ? @" [ERROR: %@]"
-									   : @" [ERRORS: %@]"),
-		 [SA_DiceFormatter descriptionForErrors:expression.errorBitMask]];
+		SA_DiceFormatterWriteASCII(writer, ((__builtin_popcountl(expression.errorBitMask) == 1)
+											? " [ERROR: "
+											: " [ERRORS: "));
+		[SA_DiceFormatter writeDescriptionForErrors:expression.errorBitMask
+											 writer:writer];
+		SA_DiceFormatterWriteASCII(writer, "]");
 	}
-	
-	// Make all instances of the minus sign be represented with the proper,
-	// canonical minus sign.
-	return [SA_DiceFormatter rectifyMinusSignInString:formattedString];
 }
 
--(NSString *) legacyStringFromIntermediaryExpression:(SA_DiceExpression *)expression {
+-(void) legacyWriteIntermediaryExpression:(SA_DiceExpression *)expression
+								   writer:(SA_DiceFormatterWriter *)writer {
 	/*
 	 In legacy behavior, we do not print the results of intermediate terms in 
 	 the expression tree (since the legacy output format was designed for 
@@ -166,58 +427,79 @@ static NSDictionary *_stringFormatRules;
 	 The exception is roll commands, where the result of a roll-and-sum command
 	 is printed along with the rolls.
 	 
-	 For this reasons, when we recursively retrieve the string representations
-	 of sub-expressions, we call this method, not -[legacyStringFromExpression:].
+	 For this reasons, when we recursively write the string representations
+	 of sub-expressions, we call this method, not -[legacyWriteExpression:].
 	 */
 
+	// An unmodified view of a tree is written from the tree itself, without
+	// recursing; only expressions built (or modified) by hand are written by
+	// the methods below.
+	SA_DiceExpressionTree *tree = expression.tree;
+	if (tree != nil) {
+		[self legacyWriteNode:expression.treeNode
+					   ofTree:tree
+					  results:expression.results
+					   writer:writer];
+		return;
+	}
+
 	switch (expression.type) {
 		case SA_DiceExpressionTerm_OPERATION: {
-			return [self legacyStringFromOperationExpression:expression];
+			[self legacyWriteOperationExpression:expression
+										  writer:writer];
 			break;
 		}
 		case SA_DiceExpressionTerm_ROLL_COMMAND: {
-			return [self legacyStringFromRollCommandExpression:expression];
+			[self legacyWriteRollCommandExpression:expression
+											writer:writer];
 			break;
 		}
 		case SA_DiceExpressionTerm_ROLL_MODIFIER: {
-			return [self legacyStringFromRollModifierExpression:expression];
+			[self legacyWriteRollModifierExpression:expression
+											 writer:writer];
 			break;
 		}
 		case SA_DiceExpressionTerm_VALUE: {
-			return [self legacyStringFromValueExpression:expression];
+			[self legacyWriteValueExpression:expression
+									  writer:writer];
 			break;
 		}
 		default: {
-			return expression.inputString;
+			SA_DiceFormatterWriteString(writer, expression.inputString);
 			break;
 		}
 	}
 }
 
--(NSString *) legacyStringFromOperationExpression:(SA_DiceExpression *)expression {
+-(void) legacyWriteOperationExpression:(SA_DiceExpression *)expression
+								writer:(SA_DiceFormatterWriter *)writer {
 	if (expression.operator == SA_DiceExpressionOperator_MINUS &&
 		expression.leftOperand == nil) {
 		// Check to see if the term is a negation operation.
-		return [@[ [SA_DiceFormatter canonicalRepresentationForOperator:SA_DiceExpressionOperator_MINUS],
-				   [self legacyStringFromIntermediaryExpression:expression.rightOperand]
-				   ] componentsJoinedByString:@""];
+		SA_DiceFormatterWriteString(writer, writer->rules->canonicalOperatorRepresentations[SA_DiceExpressionOperator_MINUS]);
+		[self legacyWriteIntermediaryExpression:expression.rightOperand
+										 writer:writer];
 	} else if (expression.operator == SA_DiceExpressionOperator_MINUS ||
 			   expression.operator == SA_DiceExpressionOperator_PLUS ||
 			   expression.operator == SA_DiceExpressionOperator_TIMES) {
 		// Check to see if the term is an addition, subtraction, or
 		// multiplication operation.
-		return [@[ [self legacyStringFromIntermediaryExpression:expression.leftOperand],
-				   [SA_DiceFormatter canonicalRepresentationForOperator:expression.operator],
-				   [self legacyStringFromIntermediaryExpression:expression.rightOperand]
-				   ] componentsJoinedByString:@" "];
+		[self legacyWriteIntermediaryExpression:expression.leftOperand
+										 writer:writer];
+		SA_DiceFormatterWriteASCII(writer, " ");
+		SA_DiceFormatterWriteString(writer, writer->rules->canonicalOperatorRepresentations[expression.operator]);
+		SA_DiceFormatterWriteASCII(writer, " ");
+		[self legacyWriteIntermediaryExpression:expression.rightOperand
+										 writer:writer];
 	} else {
 		// If the operator is not one of the supported operators, default to
 		// outputting the input string.
-		return expression.inputString;
+		SA_DiceFormatterWriteString(writer, expression.inputString);
 	}
 }
 
--(NSString *) legacyStringFromRollCommandExpression:(SA_DiceExpression *)expression {
+-(void) legacyWriteRollCommandExpression:(SA_DiceExpression *)expression
+								  writer:(SA_DiceFormatterWriter *)writer {
 	/*
 	 In legacy behavior, we print the result of roll commands with the rolls
 	 generated by the roll command. If a roll command generates a roll-related 
@@ -227,36 +509,87 @@ static NSDictionary *_stringFormatRules;
 	 Legacy behavior assumes support for roll-and-sum only, so we do not need
 	 to adjust the output format for different roll commands.
 	*/
-	return [NSString stringWithFormat:@"%@%@%@ < %@%@ >",
-			[self legacyStringFromIntermediaryExpression:expression.dieCount],
-			[SA_DiceFormatter canonicalRepresentationForRollCommandDelimiter:expression.rollCommand],
-			[self legacyStringFromIntermediaryExpression:expression.dieSize],
-			((expression.rolls != nil) ?
-			 [NSString stringWithFormat:@"%@ = ",
-			  [(expression.dieType == SA_DiceExpressionDice_FUDGE ?
-				[self formattedFudgeRolls:expression.rolls] :
-				expression.rolls
-				) componentsJoinedByString:@" "]] :
-			 @""),
-			(expression.result ?: @"ERROR")];
-}
-
--(NSArray *) formattedFudgeRolls:(NSArray <NSNumber *> *)rolls {
-	static NSDictionary *fudgeDieRollRepresentations;
-	static dispatch_once_t onceToken;
-	dispatch_once(&onceToken, ^{
-		fudgeDieRollRepresentations = @{ @(-1): [SA_DiceFormatter canonicalRepresentationForOperator:SA_DiceExpressionOperator_MINUS],
-										 @(0): @"0",
-										 @(1): [SA_DiceFormatter canonicalRepresentationForOperator:SA_DiceExpressionOperator_PLUS]
-										 };
-	});
-
-	return [rolls map:^NSString *(NSNumber *roll) {
-		return fudgeDieRollRepresentations[roll];
-	}];
-}
-
--(NSString *) legacyStringFromRollModifierExpression:(SA_DiceExpression *)expression {
+	[self legacyWriteIntermediaryExpression:expression.dieCount
+									 writer:writer];
+	SA_DiceFormatterWriteString(writer, SA_DiceStringFormatRulesRollCommandDelimiterRepresentation(writer->rules, expression.rollCommand));
+	[self legacyWriteIntermediaryExpression:expression.dieSize
+									 writer:writer];
+	[self legacyWriteRollCommandRolls:expression.rolls
+							  dieType:expression.dieType
+							   result:expression.result
+							   writer:writer];
+}
+
+// Writes the rolls and the result of a roll command (everything after its
+// die size).
+-(void) legacyWriteRollCommandRolls:(SA_DiceRollBuffer *)rolls
+							dieType:(SA_DiceExpressionDieType)dieType
+							 result:(NSNumber *)result
+							 writer:(SA_DiceFormatterWriter *)writer {
+	SA_DiceFormatterWriteASCII(writer, " < ");
+	if (rolls != nil) {
+		[self legacyWriteRolls:rolls
+					   inRange:NSRangeMake(0, rolls.count)
+					   dieType:dieType
+						writer:writer];
+		SA_DiceFormatterWriteASCII(writer, " = ");
+	}
+	[self legacyWriteResult:result
+					 writer:writer];
+	SA_DiceFormatterWriteASCII(writer, " >");
+}
+
+-(void) legacyWriteRolls:(SA_DiceRollBuffer *)rolls
+				 inRange:(NSRange)range
+				 dieType:(SA_DiceExpressionDieType)dieType
+				  writer:(SA_DiceFormatterWriter *)writer {
+	// (Missing rolls are written as a nil string would be.)
+	if (rolls == nil) {
+		SA_DiceFormatterWriteString(writer, nil);
+		return;
+	}
+
+	// Exploding dice in compact form are written from their records, so that
+	// the rolls need not be generated only to be written out.
+	if (   rolls.explodedDice != NULL
+		&& dieType != SA_DiceExpressionDice_FUDGE
+		&& range.location == 0
+		&& range.length >= rolls.count) {
+		const SA_DiceExplodedDie *dice = rolls.explodedDice;
+		NSInteger dieSize = (NSInteger) rolls.explodedDieSize;
+		for (NSUInteger i = 0; i < rolls.explodedDieCount; i++) {
+			if (i > 0)
+				SA_DiceFormatterWriteASCII(writer, " ");
+
+			for (NSUInteger j = 0; j < dice[i].explosionCount; j++) {
+				SA_DiceFormatterWriteInteger(writer, dieSize);
+				SA_DiceFormatterWriteASCII(writer, " ");
+			}
+			SA_DiceFormatterWriteInteger(writer, dice[i].finalRoll);
+		}
+		return;
+	}
+
+	const NSInteger *values = rolls.values;
+	NSUInteger end = MIN(range.location + range.length, rolls.count);
+	for (NSUInteger i = range.location; i < end; i++) {
+		if (i > range.location)
+			SA_DiceFormatterWriteASCII(writer, " ");
+
+		if (dieType != SA_DiceExpressionDice_FUDGE) {
+			SA_DiceFormatterWriteInteger(writer, values[i]);
+		} else if (values[i] < 0) {
+			SA_DiceFormatterWriteString(writer, writer->rules->canonicalOperatorRepresentations[SA_DiceExpressionOperator_MINUS]);
+		} else if (values[i] > 0) {
+			SA_DiceFormatterWriteString(writer, writer->rules->canonicalOperatorRepresentations[SA_DiceExpressionOperator_PLUS]);
+		} else {
+			SA_DiceFormatterWriteASCII(writer, "0");
+		}
+	}
+}
+
+-(void) legacyWriteRollModifierExpression:(SA_DiceExpression *)expression
+								   writer:(SA_DiceFormatterWriter *)writer {
 	/*
 	 In legacy behavior, we print the result of roll modifiers with the rolls
 	 generated by the roll command, plus the modifications. If a roll modifier 
@@ -265,53 +598,222 @@ static NSDictionary *_stringFormatRules;
 	 Legacy behavior assumes support for the ‘keep’ modifier only, so we do not 
 	 need to adjust the output format for different roll modifiers.
 	 */
-	NSUInteger keptHowMany = expression.rightOperand.result.unsignedIntegerValue;
-	return [NSString stringWithFormat:@"%@%@%@%@%@ < %@ less %@ leaves %@ = %@ >",
-			[self legacyStringFromIntermediaryExpression:expression.leftOperand.dieCount],
-			[SA_DiceFormatter canonicalRepresentationForRollCommandDelimiter:expression.leftOperand.rollCommand],
-			[self legacyStringFromIntermediaryExpression:expression.leftOperand.dieSize],
-			[SA_DiceFormatter canonicalRepresentationForRollModifierDelimiter:expression.rollModifier],
-			expression.rightOperand.result,
-			((expression.leftOperand.rolls != nil) ?
-			 [(expression.leftOperand.dieType == SA_DiceExpressionDice_FUDGE ?
-			   [self formattedFudgeRolls:expression.rolls] :
-			   expression.leftOperand.rolls
-			   ) componentsJoinedByString:@" "] :
-			 @""),
-			[(expression.leftOperand.dieType == SA_DiceExpressionDice_FUDGE ?
-			  [self formattedFudgeRolls:[expression.rolls subarrayWithRange:NSRangeMake(keptHowMany, expression.rolls.count - keptHowMany)]] :
-			  [expression.rolls subarrayWithRange:NSRangeMake(keptHowMany, expression.rolls.count - keptHowMany)]
-			  ) componentsJoinedByString:@" "],
-			[(expression.leftOperand.dieType == SA_DiceExpressionDice_FUDGE ?
-			  [self formattedFudgeRolls:[expression.rolls subarrayWithRange:NSRangeMake(0, keptHowMany)]] :
-			  [expression.rolls subarrayWithRange:NSRangeMake(0, keptHowMany)]
-			  ) componentsJoinedByString:@" "],
-			(expression.result ?: @"ERROR")];
-}
-
--(NSString *) legacyStringFromValueExpression:(SA_DiceExpression *)expression {
-	if ([expression.inputString.lowercaseString isEqualToString:@"f"]) {
-		return @"F";
+	SA_DiceExpression *rollCommand = expression.leftOperand;
+
+	[self legacyWriteIntermediaryExpression:rollCommand.dieCount
+									 writer:writer];
+	SA_DiceFormatterWriteString(writer, SA_DiceStringFormatRulesRollCommandDelimiterRepresentation(writer->rules, rollCommand.rollCommand));
+	[self legacyWriteIntermediaryExpression:rollCommand.dieSize
+									 writer:writer];
+	SA_DiceFormatterWriteString(writer, SA_DiceStringFormatRulesRollModifierDelimiterRepresentation(writer->rules, expression.rollModifier));
+	[self legacyWriteRollModifierKeepCount:expression.rightOperand.result
+									 rolls:expression.rolls
+						  rollCommandRolls:rollCommand.rolls
+								   dieType:rollCommand.dieType
+									result:expression.result
+									writer:writer];
+}
+
+// Writes the keep count, the rolls, and the result of a roll modifier
+// (everything after its delimiter).
+-(void) legacyWriteRollModifierKeepCount:(NSNumber *)keepCount
+								   rolls:(SA_DiceRollBuffer *)rolls
+						rollCommandRolls:(SA_DiceRollBuffer *)rollCommandRolls
+								 dieType:(SA_DiceExpressionDieType)dieType
+								  result:(NSNumber *)result
+								  writer:(SA_DiceFormatterWriter *)writer {
+	NSUInteger keptHowMany = MIN(keepCount.unsignedIntegerValue, rolls.count);
+
+	SA_DiceFormatterWriteNumber(writer, keepCount);
+	SA_DiceFormatterWriteASCII(writer, " < ");
+	if (rollCommandRolls != nil) {
+		if (dieType == SA_DiceExpressionDice_FUDGE) {
+			[self legacyWriteRolls:rolls
+						   inRange:NSRangeMake(0, rolls.count)
+						   dieType:SA_DiceExpressionDice_FUDGE
+							writer:writer];
+		} else {
+			[self legacyWriteRolls:rollCommandRolls
+						   inRange:NSRangeMake(0, rollCommandRolls.count)
+						   dieType:SA_DiceExpressionDice_STANDARD
+							writer:writer];
+		}
+	}
+	SA_DiceFormatterWriteASCII(writer, " less ");
+	[self legacyWriteRolls:rolls
+				   inRange:NSRangeMake(keptHowMany, rolls.count - keptHowMany)
+				   dieType:dieType
+					writer:writer];
+	SA_DiceFormatterWriteASCII(writer, " leaves ");
+	[self legacyWriteRolls:rolls
+				   inRange:NSRangeMake(0, keptHowMany)
+				   dieType:dieType
+					writer:writer];
+	SA_DiceFormatterWriteASCII(writer, " = ");
+	[self legacyWriteResult:result
+					 writer:writer];
+	SA_DiceFormatterWriteASCII(writer, " >");
+}
+
+-(void) legacyWriteValueExpression:(SA_DiceExpression *)expression
+							writer:(SA_DiceFormatterWriter *)writer {
+	[self legacyWriteValue:expression.value
+			   inputString:expression.inputString
+					writer:writer];
+}
+
+-(void) legacyWriteValue:(NSNumber *)value
+			 inputString:(NSString *)inputString
+				  writer:(SA_DiceFormatterWriter *)writer {
+	if (   inputString.length == 1
+		&& ([inputString characterAtIndex:0] == 'f' || [inputString characterAtIndex:0] == 'F')) {
+		SA_DiceFormatterWriteASCII(writer, "F");
 	} else {
 		// We use the value for the ‘value’ property and not the ‘result’ property
 		// because they should be the same, and the ‘result’ property might not
 		// have a value (if the expression was not evaluated); this saves us
 		// having to compare it against nil, and saves code.
-		return [expression.value stringValue];
+		SA_DiceFormatterWriteNumber(writer, value);
 	}
 }
 
+-(void) legacyWriteResult:(NSNumber *)result
+				   writer:(SA_DiceFormatterWriter *)writer {
+	if (result != nil) {
+		SA_DiceFormatterWriteNumber(writer, result);
+	} else {
+		SA_DiceFormatterWriteASCII(writer, "ERROR");
+	}
+}
+
+// TREES
+
+/*
+ An unmodified view of an expression tree is written from the tree’s nodes
+ (and its results, if any), exactly as the methods above would write it, but
+ without recursing, as a tree may be as deep as it has nodes (a long chain of
+ additions, say, is parsed into a tree whose depth is its number of terms).
+ Each step writes as much of a node as it can before one of its
+ sub-expressions must be written; if there is more of the node to write after
+ that, a step that continues it is pushed on the stack first. So no node has
+ more than one step waiting at a time, and the stack is never deeper than the
+ path from the root to the node being written.
+ */
+
+-(void) legacyWriteNode:(NSUInteger)root
+				 ofTree:(SA_DiceExpressionTree *)tree
+				results:(SA_DiceExpressionResults *)results
+				 writer:(SA_DiceFormatterWriter *)writer {
+	const SA_DiceExpressionNode *nodes = tree.nodes;
+
+	SA_DiceFormatterTreeStep *steps = malloc((tree.nodeCount + 1) * sizeof(SA_DiceFormatterTreeStep));
+	NSUInteger stepCount = 0;
+	steps[stepCount++] = (SA_DiceFormatterTreeStep) { root, 0 };
+
+	while (stepCount > 0) {
+		SA_DiceFormatterTreeStep step = steps[--stepCount];
+		NSUInteger index = step.node;
+
+		// A nil sub-expression is written as its (nil) input string would be.
+		if (index == NSNotFound) {
+			SA_DiceFormatterWriteString(writer, nil);
+			continue;
+		}
+
+		const SA_DiceExpressionNode *node = &nodes[index];
+		switch (node->type) {
+			case SA_DiceExpressionTerm_OPERATION: {
+				if (   node->operator == SA_DiceExpressionOperator_MINUS
+					&& node->leftOperand == NSNotFound) {
+					SA_DiceFormatterWriteString(writer, writer->rules->canonicalOperatorRepresentations[SA_DiceExpressionOperator_MINUS]);
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { node->rightOperand, 0 };
+				} else if (   node->operator == SA_DiceExpressionOperator_MINUS
+						   || node->operator == SA_DiceExpressionOperator_PLUS
+						   || node->operator == SA_DiceExpressionOperator_TIMES) {
+					if (step.phase == 0) {
+						steps[stepCount++] = (SA_DiceFormatterTreeStep) { index, 1 };
+						steps[stepCount++] = (SA_DiceFormatterTreeStep) { node->leftOperand, 0 };
+					} else {
+						SA_DiceFormatterWriteASCII(writer, " ");
+						SA_DiceFormatterWriteString(writer, writer->rules->canonicalOperatorRepresentations[node->operator]);
+						SA_DiceFormatterWriteASCII(writer, " ");
+						steps[stepCount++] = (SA_DiceFormatterTreeStep) { node->rightOperand, 0 };
+					}
+				} else {
+					SA_DiceFormatterWriteString(writer, [tree inputStringOfNode:index]);
+				}
+				break;
+			}
+			case SA_DiceExpressionTerm_ROLL_COMMAND: {
+				if (step.phase == 0) {
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { index, 1 };
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { node->dieCount, 0 };
+				} else if (step.phase == 1) {
+					SA_DiceFormatterWriteString(writer, SA_DiceStringFormatRulesRollCommandDelimiterRepresentation(writer->rules, node->rollCommand));
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { index, 2 };
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { node->dieSize, 0 };
+				} else {
+					[self legacyWriteRollCommandRolls:[results rollsOfNode:index]
+											  dieType:node->dieType
+											   result:SA_DiceFormatterResultOfNode(nodes, results, index)
+											   writer:writer];
+				}
+				break;
+			}
+			case SA_DiceExpressionTerm_ROLL_MODIFIER: {
+				// The die count and die size written are those of the roll
+				// command that the modifier is applied to.
+				NSUInteger rollCommandIndex = node->leftOperand;
+				const SA_DiceExpressionNode *rollCommand = ((rollCommandIndex != NSNotFound)
+															? &nodes[rollCommandIndex]
+															: NULL);
+				if (step.phase == 0) {
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { index, 1 };
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { ((rollCommand != NULL) ? rollCommand->dieCount : NSNotFound), 0 };
+				} else if (step.phase == 1) {
+					SA_DiceFormatterWriteString(writer, SA_DiceStringFormatRulesRollCommandDelimiterRepresentation(writer->rules, ((rollCommand != NULL)
+																																  ? rollCommand->rollCommand
+																																  : SA_DiceExpressionRollCommand_NONE)));
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { index, 2 };
+					steps[stepCount++] = (SA_DiceFormatterTreeStep) { ((rollCommand != NULL) ? rollCommand->dieSize : NSNotFound), 0 };
+				} else {
+					SA_DiceFormatterWriteString(writer, SA_DiceStringFormatRulesRollModifierDelimiterRepresentation(writer->rules, node->rollModifier));
+					[self legacyWriteRollModifierKeepCount:SA_DiceFormatterResultOfNode(nodes, results, node->rightOperand)
+													 rolls:[results rollsOfNode:index]
+										  rollCommandRolls:((rollCommand != NULL) ? [results rollsOfNode:rollCommandIndex] : nil)
+												   dieType:((rollCommand != NULL) ? rollCommand->dieType : SA_DiceExpressionDice_STANDARD)
+													result:SA_DiceFormatterResultOfNode(nodes, results, index)
+													writer:writer];
+				}
+				break;
+			}
+			case SA_DiceExpressionTerm_VALUE: {
+				[self legacyWriteValue:(node->hasValue ? @(node->value) : nil)
+						   inputString:[tree inputStringOfNode:index]
+								writer:writer];
+				break;
+			}
+			default: {
+				SA_DiceFormatterWriteString(writer, [tree inputStringOfNode:index]);
+				break;
+			}
+		}
+	}
+
+	free(steps);
+}
+
 /**********************************************/
 #pragma mark - “Simple” behavior implementation
 /**********************************************/
 
--(NSString *) simpleStringFromExpression:(SA_DiceExpression *)expression {
-	NSString *formattedString = [NSString stringWithFormat:@"%@", 
-								 (expression.result ?: @"ERROR")];
-	
-	// Make all instances of the minus sign be represented with the proper,
-	// canonical minus sign.
-	return [SA_DiceFormatter rectifyMinusSignInString:formattedString];
+-(void) simpleWriteExpression:(SA_DiceExpression *)expression
+					   writer:(SA_DiceFormatterWriter *)writer {
+	if (expression.result != nil) {
+		SA_DiceFormatterWriteNumber(writer, expression.result);
+	} else {
+		SA_DiceFormatterWriteASCII(writer, "ERROR");
+	}
 }
 
 /****************************/
@@ -319,80 +821,63 @@ static NSDictionary *_stringFormatRules;
 /****************************/
 
 +(NSString *) rectifyMinusSignInString:(NSString *)aString {
-	NSMutableString* sameStringButMutable = aString.mutableCopy;
-	
-	NSString *validMinusSignCharacters = [SA_DiceFormatter stringFormatRules][SA_DB_VALID_CHARACTERS][SA_DB_VALID_OPERATOR_CHARACTERS][NSStringFromSA_DiceExpressionOperator(SA_DiceExpressionOperator_MINUS)];
-	[validMinusSignCharacters enumerateSubstringsInRange:NSRangeMake(0, validMinusSignCharacters.length) 
-												 options:NSStringEnumerationByComposedCharacterSequences 
-											  usingBlock:^(NSString *aValidMinusSignCharacter,
-														   NSRange characterRange,
-														   NSRange enclosingRange,
-														   BOOL *stop) {
-		 [sameStringButMutable replaceOccurrencesOfString:aValidMinusSignCharacter 
-											   withString:[SA_DiceFormatter canonicalRepresentationForOperator:SA_DiceExpressionOperator_MINUS]
-												  options:NSLiteralSearch 
-													range:NSRangeMake(0, sameStringButMutable.length)];
-	 }];
-	
-	return [sameStringButMutable copy];
+	return [SA_DiceFormatter rectifyMinusSignInString:aString
+												rules:SA_DiceStringFormatRulesCurrent()];
 }
 
-+(void) loadErrorDescriptions {
-	NSString* errorDescriptionsPath = [[NSBundle bundleForClass:[self class]] pathForResource:@"SA_DB_ErrorDescriptions"
-																					   ofType:@"plist"];
-	_errorDescriptions = [NSDictionary dictionaryWithContentsOfFile:errorDescriptionsPath];
-	if (!_errorDescriptions) {
-		NSLog(@"Could not load error descriptions!");
-	}
-}
-
-+(NSString *) descriptionForErrors:(NSUInteger)errorBitMask {
-	if (_errorDescriptions == nil) {
-		[SA_DiceFormatter loadErrorDescriptions];
-	}
-
-	NSMutableArray <NSString *> *errorDescriptions = [NSMutableArray array];
-	for (int i = 0; i <= 19; i++) {
-		if ((errorBitMask & (1 << i)) == 0)
++(NSString *) rectifyMinusSignInString:(NSString *)aString
+								 rules:(const SA_DiceStringFormatRules *)rules {
+	NSString *canonicalMinusSign = rules->canonicalOperatorRepresentations[SA_DiceExpressionOperator_MINUS];
+	unichar canonicalMinusSignCharacter = (canonicalMinusSign.length == 1) ? [canonicalMinusSign characterAtIndex:0] : 0;
+
+	NSUInteger length = aString.length;
+	unichar stackCharacters[256];
+	unichar *characters = (length <= 256) ? stackCharacters : malloc(length * sizeof(unichar));
+	[aString getCharacters:characters
+					 range:NSRangeMake(0, length)];
+
+	// Find the minus signs (if any) that are not already canonical; and if
+	// there are none, there is nothing to do.
+	NSMutableString *rectifiedString = nil;
+	NSUInteger copiedLength = 0;
+	for (NSUInteger i = 0; i < length; i++) {
+		if (   characters[i] == canonicalMinusSignCharacter
+			|| SA_DiceStringFormatRulesCharacterClass(rules, characters[i]) != SA_DiceCharacterClass_OPERATOR_MINUS)
 			continue;
-		NSString *errorName = NSStringFromSA_DiceExpressionError((SA_DiceExpressionError) (1 << i));
-		[errorDescriptions addObject:(_errorDescriptions[errorName] ?: errorName)];
-	}
-
-	return [errorDescriptions componentsJoinedByString:@" / "];
-}
 
-+(void) loadStringFormatRules {
-	NSString *stringFormatRulesPath = [[NSBundle bundleForClass:[self class]] pathForResource:SA_DB_STRING_FORMAT_RULES_PLIST_NAME
-																					   ofType:@"plist"];
-	_stringFormatRules = [NSDictionary dictionaryWithContentsOfFile:stringFormatRulesPath];
-	if (!_stringFormatRules) {
-		NSLog(@"Could not load string format rules!");
+		if (rectifiedString == nil)
+			rectifiedString = [NSMutableString stringWithCapacity:length];
+		CFStringAppendCharacters((__bridge CFMutableStringRef) rectifiedString, (characters + copiedLength), (CFIndex) (i - copiedLength));
+		[rectifiedString appendString:canonicalMinusSign];
+		copiedLength = i + 1;
 	}
-}
+	if (rectifiedString != nil)
+		CFStringAppendCharacters((__bridge CFMutableStringRef) rectifiedString, (characters + copiedLength), (CFIndex) (length - copiedLength));
 
-+(NSString *) canonicalRepresentationForOperator:(SA_DiceExpressionOperator)operator {
-	return [SA_DiceFormatter canonicalOperatorRepresentations][NSStringFromSA_DiceExpressionOperator(operator)];
-}
+	if (characters != stackCharacters)
+		free(characters);
 
-+(NSDictionary *) canonicalOperatorRepresentations {
-	return [SA_DiceFormatter stringFormatRules][SA_DB_CANONICAL_REPRESENTATIONS][SA_DB_CANONICAL_OPERATOR_REPRESENTATIONS];
+	return (rectifiedString != nil) ? [rectifiedString copy] : [aString copy];
 }
 
-+(NSString *) canonicalRepresentationForRollCommandDelimiter:(SA_DiceExpressionRollCommand)command {
-	return [SA_DiceFormatter canonicalRollCommandDelimiterRepresentations][NSStringFromSA_DiceExpressionRollCommand(command)];
-}
++(void) writeDescriptionForErrors:(NSUInteger)errorBitMask
+						   writer:(SA_DiceFormatterWriter *)writer {
+	BOOL first = YES;
+	for (NSUInteger i = 0; i < SA_DICE_STRING_FORMAT_RULES_ERROR_BIT_COUNT; i++) {
+		if ((errorBitMask & ((NSUInteger) 1 << i)) == 0)
+			continue;
 
-+(NSDictionary *) canonicalRollCommandDelimiterRepresentations {
-	return [SA_DiceFormatter stringFormatRules][SA_DB_CANONICAL_REPRESENTATIONS][SA_DB_CANONICAL_ROLL_COMMAND_DELIMITER_REPRESENTATIONS];
-}
+		if (!first)
+			SA_DiceFormatterWriteASCII(writer, " / ");
+		first = NO;
 
-+(NSString *) canonicalRepresentationForRollModifierDelimiter:(SA_DiceExpressionRollModifier)modifier {
-	return [SA_DiceFormatter canonicalRollModifierDelimiterRepresentations][NSStringFromSA_DiceExpressionRollModifier(modifier)];
+		NSString *errorDescription = SA_DiceStringFormatRulesErrorDescription(writer->rules, i);
+		SA_DiceFormatterWriteString(writer, (errorDescription ?: NSStringFromSA_DiceExpressionError((SA_DiceExpressionError) ((NSUInteger) 1 << i))));
+	}
 }
 
-+(NSDictionary *) canonicalRollModifierDelimiterRepresentations {
-	return [SA_DiceFormatter stringFormatRules][SA_DB_CANONICAL_REPRESENTATIONS][SA_DB_CANONICAL_ROLL_MODIFIER_DELIMITER_REPRESENTATIONS];
++(NSString *) canonicalRepresentationForOperator:(SA_DiceExpressionOperator)operator {
+	return SA_DiceStringFormatRulesOperatorRepresentation(SA_DiceStringFormatRulesCurrent(), operator);
 }
 
 @end
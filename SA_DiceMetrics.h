@@ -0,0 +1,97 @@
+//
+//  SA_DiceMetrics.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+/*
+ An SA_DiceMetrics object collects statistics about the roll pipeline: for
+ each stage (parsing, evaluation, and formatting), the number of requests, a
+ histogram of their latencies, and how often each error bit was set in their
+ results; and, for evaluations, histograms of the number of dice rolled, and
+ of the number of times dice exploded, per request. An evaluation service
+ (see SA_DiceRollService.h) also records how long requests wait in its queue
+ (as a fourth stage, “queue”), and a histogram of the depth of its queue.
+
+ Metrics are opt-in: a parser, evaluator, or formatter records them only if
+ given a metrics object (see the ‘metrics’ property of each). With none, the
+ cost is a single nil check per request. One metrics object may be shared by
+ any number of parsers, evaluators, and formatters, on any number of threads;
+ recording is lock-free.
+
+ Histograms have power-of-two buckets: bucket k counts the values no greater
+ than 2^k (and greater than 2^(k-1)).
+
+ A snapshot of all the metrics may be exported as text, in the Prometheus
+ text exposition format (one “name{labels} value” line per sample), e.g.:
+
+	sa_dice_requests_total{stage="parse"} 1024
+	sa_dice_errors_total{stage="evaluate",error="DIE_COUNT_EXCESSIVE"} 3
+	sa_dice_latency_nanoseconds_bucket{stage="evaluate",le="4096"} 1019
+
+ (A snapshot taken while metrics are being recorded is not instantaneous;
+ each value is read atomically, but not all at once.)
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef NS_ENUM(NSUInteger, SA_DiceMetricsStage) {
+	SA_DiceMetricsStage_PARSE,
+	SA_DiceMetricsStage_EVALUATE,
+	SA_DiceMetricsStage_FORMAT,
+	SA_DiceMetricsStage_QUEUE
+};
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// The current time (of a monotonic clock), in nanoseconds.
+uint64_t SA_DiceMetricsCurrentTime(void);
+
+NSString *NSStringFromSA_DiceMetricsStage(SA_DiceMetricsStage stage);
+
+/**********************************************/
+#pragma mark - SA_DiceMetrics class declaration
+/**********************************************/
+
+@interface SA_DiceMetrics : NSObject
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Records one request of the given stage, which took the given time, and
+// whose result had the given errors.
+-(void) recordStage:(SA_DiceMetricsStage)stage
+		   duration:(uint64_t)nanoseconds
+			 errors:(SA_DiceExpressionError)errors;
+
+// Records the number of dice rolled, and the number of times dice exploded,
+// in one evaluation.
+-(void) recordDiceRolled:(NSUInteger)diceRolledCount
+			  explosions:(NSUInteger)explosionCount;
+
+// Records the depth of a request queue (e.g., as a request is added to it).
+-(void) recordQueueDepth:(NSUInteger)queueDepth;
+
+// The number of requests of the given stage recorded so far.
+-(uint64_t) requestCountOfStage:(SA_DiceMetricsStage)stage;
+
+// The number of requests (of all stages) whose results had the given error
+// (which must be a single error bit).
+-(uint64_t) countOfError:(SA_DiceExpressionError)error;
+
+// A snapshot of all the metrics, in the text format described above.
+-(NSString *) textSnapshot;
+
+// Sets all the metrics back to zero.
+-(void) reset;
+
+@end
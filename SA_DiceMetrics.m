@@ -0,0 +1,235 @@
+//
+//  SA_DiceMetrics.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceMetrics.h"
+
+#import <stdatomic.h>
+#import <time.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+#define STAGE_COUNT			4
+#define ERROR_BIT_COUNT		(sizeof(SA_DiceExpressionError) * 8)
+
+// Enough buckets for values up to 2^47 (nanoseconds: about 39 hours).
+#define HISTOGRAM_BUCKET_COUNT	48
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+typedef struct {
+	_Atomic(uint64_t) count;
+	_Atomic(uint64_t) sum;
+	_Atomic(uint64_t) buckets[HISTOGRAM_BUCKET_COUNT];
+} SA_DiceMetricsHistogram;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+uint64_t SA_DiceMetricsCurrentTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+NSString *NSStringFromSA_DiceMetricsStage(SA_DiceMetricsStage stage) {
+	switch (stage) {
+		case SA_DiceMetricsStage_PARSE:
+			return @"parse";
+		case SA_DiceMetricsStage_EVALUATE:
+			return @"evaluate";
+		case SA_DiceMetricsStage_FORMAT:
+			return @"format";
+		case SA_DiceMetricsStage_QUEUE:
+			return @"queue";
+		default:
+			return nil;
+	}
+}
+
+// The bucket for the given value: the smallest k such that value <= 2^k
+// (or the last bucket, if the value is larger than that).
+NS_INLINE NSUInteger SA_DiceMetricsHistogramBucket(uint64_t value) {
+	if (value <= 1)
+		return 0;
+
+	NSUInteger bucket = 64 - (NSUInteger) __builtin_clzll(value - 1);
+	return MIN(bucket, HISTOGRAM_BUCKET_COUNT - 1);
+}
+
+static void SA_DiceMetricsHistogramRecord(SA_DiceMetricsHistogram *histogram,
+										  uint64_t value) {
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->buckets[SA_DiceMetricsHistogramBucket(value)], 1, memory_order_relaxed);
+}
+
+static void SA_DiceMetricsHistogramReset(SA_DiceMetricsHistogram *histogram) {
+	atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&histogram->sum, 0, memory_order_relaxed);
+	for (NSUInteger i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+		atomic_store_explicit(&histogram->buckets[i], 0, memory_order_relaxed);
+}
+
+// Writes the given histogram (with the given labels, if any, which must end
+// with a comma), as cumulative buckets, then its sum and count. Empty buckets
+// past the last non-empty one are left out (except for the +Inf bucket).
+static void SA_DiceMetricsHistogramWrite(SA_DiceMetricsHistogram *histogram,
+										 NSString *name,
+										 NSString *labels,
+										 NSMutableString *output) {
+	uint64_t buckets[HISTOGRAM_BUCKET_COUNT];
+	NSUInteger lastBucket = 0;
+	for (NSUInteger i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+		buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+		if (buckets[i] != 0)
+			lastBucket = i;
+	}
+
+	uint64_t cumulativeCount = 0;
+	for (NSUInteger i = 0; i <= lastBucket; i++) {
+		cumulativeCount += buckets[i];
+		[output appendFormat:@"%@_bucket{%@le=\"%llu\"} %llu\n", name, labels, (1ULL << i), cumulativeCount];
+	}
+	for (NSUInteger i = lastBucket + 1; i < HISTOGRAM_BUCKET_COUNT; i++)
+		cumulativeCount += buckets[i];
+	[output appendFormat:@"%@_bucket{%@le=\"+Inf\"} %llu\n", name, labels, cumulativeCount];
+
+	NSString *plainLabels = ((labels.length > 0)
+							 ? [NSString stringWithFormat:@"{%@}", [labels substringToIndex:(labels.length - 1)]]
+							 : @"");
+	[output appendFormat:@"%@_sum%@ %llu\n", name, plainLabels, atomic_load_explicit(&histogram->sum, memory_order_relaxed)];
+	[output appendFormat:@"%@_count%@ %llu\n", name, plainLabels, atomic_load_explicit(&histogram->count, memory_order_relaxed)];
+}
+
+/*************************************************/
+#pragma mark - SA_DiceMetrics class implementation
+/*************************************************/
+
+@implementation SA_DiceMetrics {
+	SA_DiceMetricsHistogram _latencies[STAGE_COUNT];
+	_Atomic(uint64_t) _errorCounts[STAGE_COUNT][ERROR_BIT_COUNT];
+
+	SA_DiceMetricsHistogram _diceRolled;
+	SA_DiceMetricsHistogram _explosions;
+
+	SA_DiceMetricsHistogram _queueDepths;
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(void) recordStage:(SA_DiceMetricsStage)stage
+		   duration:(uint64_t)nanoseconds
+			 errors:(SA_DiceExpressionError)errors {
+	if (stage >= STAGE_COUNT)
+		return;
+
+	SA_DiceMetricsHistogramRecord(&_latencies[stage], nanoseconds);
+
+	while (errors != 0) {
+		NSUInteger bit = (NSUInteger) __builtin_ctzl(errors);
+		atomic_fetch_add_explicit(&_errorCounts[stage][bit], 1, memory_order_relaxed);
+		errors &= errors - 1;
+	}
+}
+
+-(void) recordDiceRolled:(NSUInteger)diceRolledCount
+			  explosions:(NSUInteger)explosionCount {
+	SA_DiceMetricsHistogramRecord(&_diceRolled, diceRolledCount);
+	SA_DiceMetricsHistogramRecord(&_explosions, explosionCount);
+}
+
+-(void) recordQueueDepth:(NSUInteger)queueDepth {
+	SA_DiceMetricsHistogramRecord(&_queueDepths, queueDepth);
+}
+
+-(uint64_t) requestCountOfStage:(SA_DiceMetricsStage)stage {
+	if (stage >= STAGE_COUNT)
+		return 0;
+
+	return atomic_load_explicit(&_latencies[stage].count, memory_order_relaxed);
+}
+
+-(uint64_t) countOfError:(SA_DiceExpressionError)error {
+	if (error == 0)
+		return 0;
+
+	NSUInteger bit = (NSUInteger) __builtin_ctzl(error);
+	uint64_t count = 0;
+	for (NSUInteger stage = 0; stage < STAGE_COUNT; stage++)
+		count += atomic_load_explicit(&_errorCounts[stage][bit], memory_order_relaxed);
+	return count;
+}
+
+-(NSString *) textSnapshot {
+	NSMutableString *output = [NSMutableString string];
+
+	[output appendString:@"# TYPE sa_dice_requests_total counter\n"];
+	for (NSUInteger stage = 0; stage < STAGE_COUNT; stage++) {
+		[output appendFormat:@"sa_dice_requests_total{stage=\"%@\"} %llu\n",
+		 NSStringFromSA_DiceMetricsStage(stage),
+		 atomic_load_explicit(&_latencies[stage].count, memory_order_relaxed)];
+	}
+
+	// Only the errors that have occurred are listed. The names are those given
+	// by NSStringFromSA_DiceExpressionError(), without the “SA_DB_ERROR_”
+	// prefix.
+	[output appendString:@"# TYPE sa_dice_errors_total counter\n"];
+	for (NSUInteger stage = 0; stage < STAGE_COUNT; stage++) {
+		for (NSUInteger bit = 0; bit < ERROR_BIT_COUNT; bit++) {
+			uint64_t count = atomic_load_explicit(&_errorCounts[stage][bit], memory_order_relaxed);
+			if (count == 0)
+				continue;
+
+			NSString *errorName = NSStringFromSA_DiceExpressionError((SA_DiceExpressionError) 1 << bit);
+			errorName = ((errorName.length > 0)
+						 ? [errorName stringByReplacingOccurrencesOfString:@"SA_DB_ERROR_" withString:@""]
+						 : [NSString stringWithFormat:@"BIT_%lu", (unsigned long) bit]);
+			[output appendFormat:@"sa_dice_errors_total{stage=\"%@\",error=\"%@\"} %llu\n",
+			 NSStringFromSA_DiceMetricsStage(stage),
+			 errorName,
+			 count];
+		}
+	}
+
+	[output appendString:@"# TYPE sa_dice_latency_nanoseconds histogram\n"];
+	for (NSUInteger stage = 0; stage < STAGE_COUNT; stage++) {
+		SA_DiceMetricsHistogramWrite(&_latencies[stage],
+									 @"sa_dice_latency_nanoseconds",
+									 [NSString stringWithFormat:@"stage=\"%@\",", NSStringFromSA_DiceMetricsStage(stage)],
+									 output);
+	}
+
+	[output appendString:@"# TYPE sa_dice_dice_rolled histogram\n"];
+	SA_DiceMetricsHistogramWrite(&_diceRolled, @"sa_dice_dice_rolled", @"", output);
+
+	[output appendString:@"# TYPE sa_dice_explosions histogram\n"];
+	SA_DiceMetricsHistogramWrite(&_explosions, @"sa_dice_explosions", @"", output);
+
+	[output appendString:@"# TYPE sa_dice_queue_depth histogram\n"];
+	SA_DiceMetricsHistogramWrite(&_queueDepths, @"sa_dice_queue_depth", @"", output);
+
+	return output;
+}
+
+-(void) reset {
+	for (NSUInteger stage = 0; stage < STAGE_COUNT; stage++) {
+		SA_DiceMetricsHistogramReset(&_latencies[stage]);
+		for (NSUInteger bit = 0; bit < ERROR_BIT_COUNT; bit++)
+			atomic_store_explicit(&_errorCounts[stage][bit], 0, memory_order_relaxed);
+	}
+	SA_DiceMetricsHistogramReset(&_diceRolled);
+	SA_DiceMetricsHistogramReset(&_explosions);
+	SA_DiceMetricsHistogramReset(&_queueDepths);
+}
+
+@end
@@ -7,6 +7,10 @@
 #import <Foundation/Foundation.h>
 
 #import "SA_DiceExpression.h"
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceStringFormatRules.h"
+
+@class SA_DiceMetrics;
 
 /*********************/
 #pragma mark Constants
@@ -131,6 +135,17 @@ typedef NS_ENUM(NSUInteger, SA_DiceParserBehavior) {
 
 @property SA_DiceParserBehavior parserBehavior;
 
+// The rules which determine which characters are valid in a roll string, and
+// what they mean. By default (or if set to NULL), a parser uses the rules
+// currently in effect for the whole library (see SA_DiceStringFormatRules.h);
+// a parser may instead be given rules of its own (e.g., to give a particular
+// behavior mode its own set of valid characters).
+@property (nonatomic) const SA_DiceStringFormatRules *stringFormatRules;
+
+// If set, every parse is recorded in the given metrics (see SA_DiceMetrics.h):
+// its latency, and the errors in the resulting tree. The default is nil.
+@property (nonatomic) SA_DiceMetrics *metrics;
+
 /******************************/
 #pragma mark - Class properties
 /******************************/
@@ -150,6 +165,13 @@ typedef NS_ENUM(NSUInteger, SA_DiceParserBehavior) {
 #pragma mark - Public methods
 /****************************/
 
+// Parses the given roll string into an expression tree (see
+// SA_DiceExpressionTree.h). Returns nil if the parser’s behavior mode is not
+// implemented.
+-(SA_DiceExpressionTree *) expressionTreeForString:(NSString *)dieRollString;
+
+// Parses the given roll string, and returns a view of the root of the
+// resulting tree.
 -(SA_DiceExpression *) expressionForString:(NSString *)dieRollString;
 
 @end
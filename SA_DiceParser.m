@@ -6,17 +6,123 @@
 
 #import "SA_DiceParser.h"
 
-#import "SA_DiceExpressionStringConstants.h"
 #import "SA_DiceFormatter.h"
+#import "SA_DiceMetrics.h"
 
 #import "SA_Utility.h"
 
+#import <stdatomic.h>
+
 /********************************/
 #pragma mark File-scope variables
 /********************************/
 
-static SA_DiceParserBehavior _defaultParserBehavior = SA_DiceParserBehaviorLegacy;
-static NSDictionary *_validCharactersDict;
+// Read and written atomically, since any thread may create a new instance
+// (which reads it) at any time.
+static _Atomic(SA_DiceParserBehavior) _defaultParserBehavior = SA_DiceParserBehaviorLegacy;
+
+/*****************************/
+#pragma mark - Character classes
+/*****************************/
+
+NS_INLINE BOOL SA_DiceCharacterClassIsOperator(SA_DiceCharacterClass characterClass) {
+	return (   characterClass == SA_DiceCharacterClass_OPERATOR_PLUS
+			|| characterClass == SA_DiceCharacterClass_OPERATOR_MINUS
+			|| characterClass == SA_DiceCharacterClass_OPERATOR_TIMES);
+}
+
+NS_INLINE BOOL SA_DiceCharacterClassIsAdditiveOperator(SA_DiceCharacterClass characterClass) {
+	return (   characterClass == SA_DiceCharacterClass_OPERATOR_PLUS
+			|| characterClass == SA_DiceCharacterClass_OPERATOR_MINUS);
+}
+
+NS_INLINE BOOL SA_DiceCharacterClassIsRollCommandDelimiter(SA_DiceCharacterClass characterClass) {
+	return (   characterClass == SA_DiceCharacterClass_ROLL_COMMAND_SUM
+			|| characterClass == SA_DiceCharacterClass_ROLL_COMMAND_SUM_EXPLODING);
+}
+
+NS_INLINE BOOL SA_DiceCharacterClassIsDelimiter(SA_DiceCharacterClass characterClass) {
+	return (   SA_DiceCharacterClassIsRollCommandDelimiter(characterClass)
+			|| characterClass == SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_HIGHEST
+			|| characterClass == SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_LOWEST);
+}
+
+// The state of a single legacy-mode parse.
+typedef struct {
+	// The source string of the tree being built: the roll string, followed
+	// by whatever other text the nodes’ input strings need (see
+	// -legacyExpressionTreeForString:).
+	__unsafe_unretained NSString *source;
+
+	// The location (in the source string) of a copy of the roll string with
+	// its leading minus sign (if any) replaced by a hyphen; or NSNotFound, if
+	// there is no need for one. This is a hack to account for the fact that
+	// Cocoa’s Unicode compliance is incomplete. :( NSString’s integerValue
+	// method only accepts the hyphen as a negation sign when reading a number
+	// - not any of the Unicode characters which officially symbolize
+	// negation! But we are more modern-minded, and accept arbitrary symbols
+	// as minus-sign. For proper parsing, though, numbers must be read from
+	// this version of the string.
+	NSUInteger rectifiedLocation;
+
+	// The location (in the source string) of the implied die count “1” (as
+	// in ‘d6’), or NSNotFound.
+	NSUInteger impliedDieCountLocation;
+
+	// The class of each character of the roll string.
+	const SA_DiceCharacterClass *characterClasses;
+
+	// The nodes of the tree being built.
+	SA_DiceExpressionNode *nodes;
+	NSUInteger nodeCount;
+	NSUInteger nodeCapacity;
+} SA_DiceParserLegacyParseState;
+
+// Adds a node (with no sub-expressions) to the tree being built, and returns
+// its index. (Since this may move the nodes, pointers to nodes must not be
+// held across calls to it.)
+static NSUInteger SA_DiceParserAddNode(SA_DiceParserLegacyParseState *state,
+									   SA_DiceExpressionTermType type,
+									   NSRange inputRange) {
+	if (state->nodeCount == state->nodeCapacity) {
+		state->nodeCapacity *= 2;
+		state->nodes = realloc(state->nodes, state->nodeCapacity * sizeof(SA_DiceExpressionNode));
+	}
+
+	state->nodes[state->nodeCount] = (SA_DiceExpressionNode) {
+		.type = (uint8_t) type,
+		.leftOperand = NSNotFound,
+		.rightOperand = NSNotFound,
+		.dieCount = NSNotFound,
+		.dieSize = NSNotFound,
+		.inputRange = inputRange
+	};
+
+	return state->nodeCount++;
+}
+
+// Returns the range of the source string to use as the input string of the
+// part of the roll string in the given range.
+NS_INLINE NSRange SA_DiceParserInputRange(const SA_DiceParserLegacyParseState *state,
+										  NSRange range,
+										  BOOL rectified) {
+	if (   rectified
+		&& range.location == 0
+		&& state->rectifiedLocation != NSNotFound)
+		range.location = state->rectifiedLocation;
+
+	return range;
+}
+
+// YES if the given range of the source string is the Fudge die “size” (‘F’).
+NS_INLINE BOOL SA_DiceParserIsFudgeDieSize(const SA_DiceParserLegacyParseState *state,
+										   NSRange inputRange) {
+	if (inputRange.length != 1)
+		return NO;
+
+	unichar character = [state->source characterAtIndex:inputRange.location];
+	return (character == 'f' || character == 'F');
+}
 
 /************************************************/
 #pragma mark - SA_DiceParser class implementation
@@ -24,6 +130,7 @@ static NSDictionary *_validCharactersDict;
 
 @implementation SA_DiceParser {
 	SA_DiceParserBehavior _parserBehavior;
+	const SA_DiceStringFormatRules *_stringFormatRules;
 }
 
 /************************/
@@ -50,29 +157,28 @@ static NSDictionary *_validCharactersDict;
 	return _parserBehavior;
 }
 
+-(void) setStringFormatRules:(const SA_DiceStringFormatRules *)stringFormatRules {
+	_stringFormatRules = stringFormatRules;
+}
+
+-(const SA_DiceStringFormatRules *) stringFormatRules {
+	return _stringFormatRules ?: SA_DiceStringFormatRulesCurrent();
+}
+
 /******************************/
 #pragma mark - Class properties
 /******************************/
 
 +(void) setDefaultParserBehavior:(SA_DiceParserBehavior)newDefaultParserBehavior {
 	if (newDefaultParserBehavior == SA_DiceParserBehaviorDefault) {
-		_defaultParserBehavior = SA_DiceParserBehaviorLegacy;
+		atomic_store_explicit(&_defaultParserBehavior, SA_DiceParserBehaviorLegacy, memory_order_relaxed);
 	} else {
-		_defaultParserBehavior = newDefaultParserBehavior;
+		atomic_store_explicit(&_defaultParserBehavior, newDefaultParserBehavior, memory_order_relaxed);
 	}
 }
 
 +(SA_DiceParserBehavior) defaultParserBehavior {
-	return _defaultParserBehavior;
-}
-
-// TODO: Should this be on a per-mode, and therefore per-instance, basis?
-+(NSDictionary *) validCharactersDict {
-	if (_validCharactersDict == nil) {
-		[SA_DiceParser loadValidCharactersDict];
-	}
-	
-	return _validCharactersDict;
+	return atomic_load_explicit(&_defaultParserBehavior, memory_order_relaxed);
 }
 
 /********************************************/
@@ -89,10 +195,6 @@ static NSDictionary *_validCharactersDict;
 
 	self.parserBehavior = parserBehavior;
 
-	if (_validCharactersDict == nil) {
-		[SA_DiceParser loadValidCharactersDict];
-	}
-
 	return self;
 }
 
@@ -108,338 +210,455 @@ static NSDictionary *_validCharactersDict;
 #pragma mark - Public methods
 /****************************/
 
--(SA_DiceExpression *) expressionForString:(NSString *)dieRollString {
+-(SA_DiceExpressionTree *) expressionTreeForString:(NSString *)dieRollString {
+	SA_DiceMetrics *metrics = _metrics;
+	uint64_t startTime = (metrics != nil) ? SA_DiceMetricsCurrentTime() : 0;
+
+	SA_DiceExpressionTree *tree = nil;
 	if (_parserBehavior == SA_DiceParserBehaviorLegacy) {
-		return [self legacyExpressionForString:dieRollString];
-	} else {
-		return nil;
+		tree = [self legacyExpressionTreeForString:dieRollString];
+	}
+
+	if (metrics != nil) {
+		// Parse errors may be in any node of the tree.
+		SA_DiceExpressionError errors = 0;
+		const SA_DiceExpressionNode *nodes = tree.nodes;
+		for (NSUInteger i = 0; i < tree.nodeCount; i++)
+			errors |= nodes[i].errorBitMask;
+
+		[metrics recordStage:SA_DiceMetricsStage_PARSE
+					duration:(SA_DiceMetricsCurrentTime() - startTime)
+					  errors:errors];
 	}
+
+	return tree;
+}
+
+-(SA_DiceExpression *) expressionForString:(NSString *)dieRollString {
+	return [self expressionTreeForString:dieRollString].expression;
 }
 
 /**********************************************/
 #pragma mark - “Legacy” behavior implementation
 /**********************************************/
 
--(SA_DiceExpression *) legacyExpressionForString:(NSString *)dieRollString {
-	// Check for forbidden characters.
-	if ([dieRollString containsCharactersInSet:[[NSCharacterSet characterSetWithCharactersInString:[SA_DiceParser allValidCharacters]] invertedSet]]) {
-		SA_DiceExpression *errorExpression = [SA_DiceExpression new];
-		errorExpression.type = SA_DiceExpressionTerm_NONE;
-		errorExpression.inputString = dieRollString;
-		errorExpression.errorBitMask |= SA_DiceExpressionError_ROLL_STRING_HAS_ILLEGAL_CHARACTERS;
-		return errorExpression;
+/*
+ The legacy parser makes one pass over the roll string to classify each
+ character (see -legacyExpressionTreeForString:), and then builds the
+ expression tree with a small, fixed number of forward scans over each part of the
+ string, so parsing takes time linear in the length of the string, and the
+ depth of recursion does not depend on the number of terms. The grammar is as
+ follows:
+
+ expression	:= term ( ( ‘+’ | ‘-’ ) term )*
+ term		:= factor ( ‘*’ factor )*
+ factor		:= [ operator ] roll-chain
+ roll-chain	:= atom ( delimiter atom )*
+ atom		:= numeral*
+
+ All operators, and all roll command and roll modifier delimiters, are
+ left-associative (so, e.g., ‘5d6d10’ parses as “roll N d10s, where N is the
+ result of rolling 5d6”).
+
+ An operator character at the very start of an expression or term is not
+ treated as an operator that joins two operands; instead, the factor that
+ begins with it is a negative number (if the operator is a minus sign, and
+ anything follows it), or else an invalid expression. (Legacy mode does not
+ support parentheses, so there is no other way for an operator to follow
+ another.)
+
+ The tree is built directly as an SA_DiceExpressionTree (each of the methods
+ below returns the index of the node it adds); the nodes’ input strings are
+ ranges of the roll string itself, so no substrings are made.
+ */
+
+-(SA_DiceExpressionTree *) legacyExpressionTreeForString:(NSString *)dieRollString {
+	dieRollString = [dieRollString copy];
+	NSUInteger length = dieRollString.length;
+
+	// Classify each character of the string (checking for forbidden
+	// characters as we go). Since we check the entire string for forbidden
+	// characters here, there is no need to check parts of it later.
+	unichar stackCharacters[256];
+	SA_DiceCharacterClass stackCharacterClasses[256];
+	unichar *characters = (length <= 256) ? stackCharacters : malloc(length * sizeof(unichar));
+	SA_DiceCharacterClass *characterClasses = (length <= 256) ? stackCharacterClasses : malloc(length * sizeof(SA_DiceCharacterClass));
+
+	[dieRollString getCharacters:characters
+						   range:NSRangeMake(0, length)];
+
+	const SA_DiceStringFormatRules *rules = self.stringFormatRules;
+	BOOL hasIllegalCharacters = NO;
+	for (NSUInteger i = 0; i < length; i++) {
+		characterClasses[i] = SA_DiceStringFormatRulesCharacterClass(rules, characters[i]);
+		if (characterClasses[i] == SA_DiceCharacterClass_ILLEGAL)
+			hasIllegalCharacters = YES;
 	}
-	
-	// Since we have checked the entire string for forbidden characters, we can
-	// now begin parsing the string; there is no need to check substrings for
-	// illegal characters (which is why we do it only once, in this wrapper
-	// method). When constructing the expression tree, we call 
-	// legacyExpressionForLegalString:, not legacyExpressionForString:, when 
-	// recursively parsing substrings.
-	return [self legacyExpressionForLegalString:dieRollString];
-}
 
--(SA_DiceExpression *) legacyExpressionForLegalString:(NSString *)dieRollString {
-	// Make sure string is not empty.
-	if (dieRollString.length == 0) {
-		SA_DiceExpression *errorExpression = [SA_DiceExpression new];
-		errorExpression.type = SA_DiceExpressionTerm_NONE;
-		errorExpression.inputString = dieRollString;
-		errorExpression.errorBitMask |= SA_DiceExpressionError_ROLL_STRING_EMPTY;
-		return errorExpression;
-	}
-	
-	// We now know the string describes one of the allowable expression types
-	// (probably; it could be malformed in some way other than being empty or
-	// containing forbidden characters, such as e.g. by starting with a + sign).
-
-	// Check to see if the top-level term is an operation. Note that we parse
-	// operator expressions left-associatively.
-	NSRange lastOperatorRange = [dieRollString rangeOfCharacterFromSet:[NSCharacterSet
-																		characterSetWithCharactersInString:[SA_DiceParser
-																											allValidOperatorCharacters]]
-															   options:NSBackwardsSearch];
-	if (lastOperatorRange.location != NSNotFound) {
-		NSString *operator = [dieRollString substringWithRange:lastOperatorRange];
-		
-		if (lastOperatorRange.location != 0) {
-			return [self legacyExpressionForStringDescribingOperation:dieRollString
-												   withOperatorString:operator
-															  atRange:lastOperatorRange];
-		} else {
-			// If the last (and thus only) operator is the leading character of
-			// the expression, then this is one of several possible special cases.
-			// First, we check for whether there even is anything more to the
-			// roll string besides the operator. If not, then the string is
-			// malformed by definition...
-			// If the last operator is the leading character (i.e. there’s just
-			// one operator in the expression, and it’s at the beginning), and
-			// there’s more to the expression than just the operator, then
-			// this is either an expression whose first term (which may or may
-			// not be its only term) is a simple value expression which
-			// represents a negative number - or, it’s a malformed expression
-			// (because operators other than negation cannot begin an
-			// expression).
-			// In the former case, we do nothing, letting the testing for
-			// expression type fall through to the remaining cases (roll command
-			// or simple value).
-			// In the latter case, we register an error and return.
-			if (   dieRollString.length == lastOperatorRange.length
-				|| ([[SA_DiceParser validCharactersForOperator:SA_DiceExpressionOperator_MINUS] containsCharactersInString:operator] == NO)) {
-				SA_DiceExpression *expression = [SA_DiceExpression new];
-				expression.type = SA_DiceExpressionTerm_OPERATION;
-				expression.inputString = dieRollString;
-				expression.errorBitMask |= SA_DiceExpressionError_INVALID_EXPRESSION;
-				return expression;
+	// A tree has about one node for every character of the roll string.
+	SA_DiceParserLegacyParseState state = {
+		.source = dieRollString,
+		.rectifiedLocation = NSNotFound,
+		.impliedDieCountLocation = NSNotFound,
+		.characterClasses = characterClasses,
+		.nodes = malloc((length + 1) * sizeof(SA_DiceExpressionNode)),
+		.nodeCount = 0,
+		.nodeCapacity = length + 1
+	};
+
+	NSString *source = dieRollString;
+	if (hasIllegalCharacters) {
+		NSUInteger node = SA_DiceParserAddNode(&state, SA_DiceExpressionTerm_NONE, NSRangeMake(0, length));
+		state.nodes[node].errorBitMask |= SA_DiceExpressionError_ROLL_STRING_HAS_ILLEGAL_CHARACTERS;
+	} else if (length == 0) {
+		[self legacyEmptyExpressionInRange:NSRangeMake(0, 0)
+									 state:&state];
+	} else {
+		// The input strings of nearly all nodes are parts of the roll string;
+		// the exceptions are those which must be read from the rectified
+		// string (see above), and implied die counts. The text these need is
+		// added to the end of the source string (if it may be needed at
+		// all).
+		BOOL needsRectifiedString = (   characterClasses[0] == SA_DiceCharacterClass_OPERATOR_MINUS
+									 && characters[0] != '-');
+		BOOL needsImpliedDieCount = NO;
+		for (NSUInteger i = 0; i < length; i++) {
+			if (   SA_DiceCharacterClassIsRollCommandDelimiter(characterClasses[i])
+				&& (   i == 0
+					|| SA_DiceCharacterClassIsOperator(characterClasses[i - 1]))) {
+				needsImpliedDieCount = YES;
+				break;
 			}
-
-			// We’ve determined that this expression begins with a simple
-			// value expression that represents a negative number.
-			// This next line is a hack to account for the fact that Cocoa’s
-			// Unicode compliance is incomplete. :( NSString’s integerValue
-			// method only accepts the hyphen as a negation sign when reading a
-			// number - not any of the Unicode characters which officially
-			// symbolize negation! But we are more modern-minded, and accept
-			// arbitrary symbols as minus-sign. For proper parsing, though,
-			// we have to replace it like this...
-			dieRollString = [dieRollString stringByReplacingCharactersInRange:lastOperatorRange
-																   withString:@"-"];
-
-			// Now we fall through to “is it a roll command, or maybe a simple
-			// value?”...
 		}
+		if (   needsRectifiedString
+			|| needsImpliedDieCount) {
+			NSMutableString *extendedSource = [dieRollString mutableCopy];
+			if (needsRectifiedString) {
+				state.rectifiedLocation = extendedSource.length;
+				[extendedSource appendString:@"-"];
+				[extendedSource appendString:[dieRollString substringFromIndex:1]];
+			}
+			if (needsImpliedDieCount) {
+				state.impliedDieCountLocation = extendedSource.length;
+				[extendedSource appendString:@"1"];
+			}
+			source = [extendedSource copy];
+			state.source = source;
+		}
+
+		[self legacyOperationExpressionInRange:NSRangeMake(0, length)
+								multiplicative:NO
+										 state:&state];
 	}
-	
-	// If not an operation, the top-level term might be a die roll command
-	// or a die roll modifier.
-	// Look for one of the characters recognized as valid die roll or die roll
-	// modifier delimiters.
-	// Note that we parse roll commands left-associatively, therefore e.g. 
-	// 5d6d10 parses as “roll N d10s, where N is the result of rolling 5d6”.
-	NSMutableCharacterSet *validDelimiterCharacters = [NSMutableCharacterSet characterSetWithCharactersInString:[SA_DiceParser allValidRollCommandDelimiterCharacters]];
-	[validDelimiterCharacters addCharactersInString:[SA_DiceParser allValidRollModifierDelimiterCharacters]];
-	NSRange lastDelimiterRange = [dieRollString rangeOfCharacterFromSet:validDelimiterCharacters
-																options:NSBackwardsSearch];
-	if (lastDelimiterRange.location != NSNotFound) {
-		if ([[SA_DiceParser allValidRollCommandDelimiterCharacters] containsString:[dieRollString substringWithRange:lastDelimiterRange]])
-			return [self legacyExpressionForStringDescribingRollCommand:dieRollString
-												   withDelimiterAtRange:lastDelimiterRange];
-		else if ([[SA_DiceParser allValidRollModifierDelimiterCharacters] containsString:[dieRollString substringWithRange:lastDelimiterRange]])
-			return [self legacyExpressionForStringDescribingRollModifier:dieRollString
-													withDelimiterAtRange:lastDelimiterRange];
-		else
-			// This should be impossible.
-			NSLog(@"IMPOSSIBLE CONDITION ENCOUNTERED WHILE PARSING DIE ROLL STRING!");
-	}
-	
-	// If not an operation nor a roll command, the top-level term can only be
-	// a simple numeric value.
-	return [self legacyExpressionForStringDescribingNumericValue:dieRollString];
-}
 
--(SA_DiceExpression *) legacyExpressionForStringDescribingOperation:(NSString *)dieRollString
-												 withOperatorString:(NSString *)operatorString
-															atRange:(NSRange)operatorRange {
-	SA_DiceExpression *expression = [SA_DiceExpression new];
+	if (characters != stackCharacters)
+		free(characters);
+	if (characterClasses != stackCharacterClasses)
+		free(characterClasses);
 
-	expression.type = SA_DiceExpressionTerm_OPERATION;
-	expression.inputString = dieRollString;
+	return [[SA_DiceExpressionTree alloc] initByTakingNodes:state.nodes
+													  count:state.nodeCount
+													 source:source];
+}
 
-	// Operands of a binary operator are the expressions generated by 
-	// parsing the strings before and after the addition operator.
-	expression.leftOperand = [self legacyExpressionForLegalString:[dieRollString substringToIndex:operatorRange.location]];
-	expression.rightOperand = [self legacyExpressionForLegalString:[dieRollString substringFromIndex:(operatorRange.location + operatorRange.length)]];
-	
-	if ([[SA_DiceParser validCharactersForOperator:SA_DiceExpressionOperator_PLUS] containsCharactersInString:operatorString]) {
-		// Check to see if the term is an addition operation.
-		expression.operator = SA_DiceExpressionOperator_PLUS;
-	} else if ([[SA_DiceParser validCharactersForOperator:SA_DiceExpressionOperator_MINUS] containsCharactersInString:operatorString]) {
-		// Check to see if the term is a subtraction operation.
-		expression.operator = SA_DiceExpressionOperator_MINUS;
-	} else if ([[SA_DiceParser validCharactersForOperator:SA_DiceExpressionOperator_TIMES] containsCharactersInString:operatorString]) {
-		// Check to see if the term is a multiplication operation.
-		// Look for other, lower-precedence operators to the left of the
-		// multiplication operator. If found, split the string there 
-		// instead of at the current operator.
-		NSString *allLowerPrecedenceOperators = [@[ [SA_DiceParser validCharactersForOperator:SA_DiceExpressionOperator_PLUS],
-													[SA_DiceParser validCharactersForOperator:SA_DiceExpressionOperator_MINUS] ]
-												 componentsJoinedByString:@""];
-		NSRange lastLowerPrecedenceOperatorRange = [dieRollString rangeOfCharacterFromSet:[NSCharacterSet
-																						   characterSetWithCharactersInString:allLowerPrecedenceOperators]
-																				  options:NSBackwardsSearch
-																					range:NSRangeMake(1, operatorRange.location - 1)];
-		if (lastLowerPrecedenceOperatorRange.location != NSNotFound) {
-			return [self legacyExpressionForStringDescribingOperation:dieRollString
-												   withOperatorString:[dieRollString substringWithRange:lastLowerPrecedenceOperatorRange]
-															  atRange:lastLowerPrecedenceOperatorRange];
+// Parses an expression (if ‘multiplicative’ is NO) or a term (if YES). In the
+// former case, we split the string at additive operators, and parse the
+// operands as terms; in the latter, at multiplicative operators, parsing the
+// operands as factors.
+-(NSUInteger) legacyOperationExpressionInRange:(NSRange)range
+								multiplicative:(BOOL)multiplicative
+										 state:(SA_DiceParserLegacyParseState *)state {
+	if (range.length == 0)
+		return [self legacyEmptyExpressionInRange:range
+											state:state];
+
+	NSUInteger expression = NSNotFound;
+	NSUInteger operandStart = range.location;
+
+	// An operator at the very start of the range does not split it (see
+	// above); hence we begin looking for operators at the second character.
+	for (NSUInteger i = range.location + 1; i <= NSMaxRange(range); i++) {
+		if (i < NSMaxRange(range)) {
+			SA_DiceCharacterClass characterClass = state->characterClasses[i];
+			if (!(multiplicative
+				  ? (characterClass == SA_DiceCharacterClass_OPERATOR_TIMES)
+				  : SA_DiceCharacterClassIsAdditiveOperator(characterClass)))
+				continue;
 		}
-		
-		expression.operator = SA_DiceExpressionOperator_TIMES;
-	} else {
-		expression.errorBitMask |= SA_DiceExpressionError_UNKNOWN_OPERATOR;
-	}
 
-	// The operands have now been parsed recursively; this parsing may have 
-	// generated one or more errors. Inherit any error(s) from the 
-	// error-generating operand(s).
-	expression.errorBitMask |= expression.leftOperand.errorBitMask;
-	expression.errorBitMask |= expression.rightOperand.errorBitMask;
-
-	return expression;
-}
+		// We have found the end of an operand (either at an operator, or at
+		// the end of the range). Parse it, and join it to the operands to its
+		// left (if any).
+		NSRange operandRange = NSRangeMake(operandStart, i - operandStart);
+		NSUInteger operand = (multiplicative
+							  ? [self legacyFactorExpressionInRange:operandRange
+															  state:state]
+							  : [self legacyOperationExpressionInRange:operandRange
+														multiplicative:YES
+																 state:state]);
+		if (expression == NSNotFound) {
+			expression = operand;
+		} else {
+			expression = [self legacyExpressionDescribingOperationInRange:NSRangeMake(range.location, i - range.location)
+													  withOperatorAtIndex:(operandStart - 1)
+															  leftOperand:expression
+															 rightOperand:operand
+																	state:state];
+		}
 
--(SA_DiceExpression *) legacyExpressionForStringDescribingRollCommand:(NSString *)dieRollString
-												 withDelimiterAtRange:(NSRange)delimiterRange {
-	SA_DiceExpression *expression = [SA_DiceExpression new];
-
-	expression.type = SA_DiceExpressionTerm_ROLL_COMMAND;
-	expression.inputString = dieRollString;
-
-	// For now, only two kinds of roll command is supported - roll-and-sum,
-	// and roll-and-sum with exploding dice.
-	// These roll one or more dice of a given sort, and determine the sum of
-	// their rolled values. (In the “exploding dice” version, each die can
-	// explode, of course.)
-	if ([[SA_DiceParser validCharactersForRollCommandDelimiter:SA_DiceExpressionRollCommand_SUM]
-		 containsString:[dieRollString substringWithRange:delimiterRange]])
-		expression.rollCommand = SA_DiceExpressionRollCommand_SUM;
-	else if ([[SA_DiceParser validCharactersForRollCommandDelimiter:SA_DiceExpressionRollCommand_SUM_EXPLODING]
-			  containsString:[dieRollString substringWithRange:delimiterRange]])
-		expression.rollCommand = SA_DiceExpressionRollCommand_SUM_EXPLODING;
-
-	// Check to see if the delimiter is the initial character of the roll 
-	// string. If so (i.e. if the die count is omitted), we assume it to be 1
-	// (i.e. ‘d6’ is read as ‘1d6’).
-	// Otherwise, the die count is the expression generated by parsing the
-	// string before the delimiter.
-	expression.dieCount = ((delimiterRange.location == 0) ?
-						   [self legacyExpressionForStringDescribingNumericValue:@"1"] :
-						   [self legacyExpressionForLegalString:[dieRollString substringToIndex:delimiterRange.location]]);
-
-	// The die size is the expression generated by parsing the string after the 
-	// delimiter.
-	expression.dieSize = [self legacyExpressionForLegalString:[dieRollString substringFromIndex:(delimiterRange.location + delimiterRange.length)]];
-	if ([expression.dieSize.inputString.lowercaseString isEqualToString:@"f"])
-		expression.dieType = SA_DiceExpressionDice_FUDGE;
-
-	// The die count and die size have now been parsed recursively; this parsing
-	// may have generated one or more errors. Inherit any error(s) from the 
-	// error-generating sub-terms.
-	expression.errorBitMask |= expression.dieCount.errorBitMask;
-	expression.errorBitMask |= expression.dieSize.errorBitMask;
+		operandStart = i + 1;
+	}
 
 	return expression;
 }
 
--(SA_DiceExpression *) legacyExpressionForStringDescribingRollModifier:(NSString *)dieRollString
-												  withDelimiterAtRange:(NSRange)delimiterRange {
-	SA_DiceExpression *expression = [SA_DiceExpression new];
-
-	expression.type = SA_DiceExpressionTerm_ROLL_MODIFIER;
-	expression.inputString = dieRollString;
-
-	// The possible roll modifiers are KEEP HIGHEST and KEEP LOWEST.
-	// These take a roll command and a number, and keep that number of rolls
-	// generated by the roll command (either the highest or lowest rolls,
-	// respectively).
-	if ([[SA_DiceParser validCharactersForRollModifierDelimiter:SA_DiceExpressionRollModifier_KEEP_HIGHEST]
-		 containsString:[dieRollString substringWithRange:delimiterRange]])
-		expression.rollModifier = SA_DiceExpressionRollModifier_KEEP_HIGHEST;
-	else if ([[SA_DiceParser validCharactersForRollModifierDelimiter:SA_DiceExpressionRollModifier_KEEP_LOWEST]
-			  containsString:[dieRollString substringWithRange:delimiterRange]])
-		expression.rollModifier = SA_DiceExpressionRollModifier_KEEP_LOWEST;
-
-	// Check to see if the delimiter is the initial character of the roll
-	// string. If so, set an error, because a roll modifier requires a
-	// roll command to modify.
-	if (delimiterRange.location == 0) {
-		expression.errorBitMask |= SA_DiceExpressionError_ROLL_STRING_EMPTY;
-		return expression;
+-(NSUInteger) legacyExpressionDescribingOperationInRange:(NSRange)range
+									 withOperatorAtIndex:(NSUInteger)operatorIndex
+											 leftOperand:(NSUInteger)leftOperand
+											rightOperand:(NSUInteger)rightOperand
+												   state:(SA_DiceParserLegacyParseState *)state {
+	NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_OPERATION, range);
+	SA_DiceExpressionNode *expression = &state->nodes[index];
+
+	switch (state->characterClasses[operatorIndex]) {
+		case SA_DiceCharacterClass_OPERATOR_PLUS:
+			expression->operator = SA_DiceExpressionOperator_PLUS;
+			break;
+		case SA_DiceCharacterClass_OPERATOR_MINUS:
+			expression->operator = SA_DiceExpressionOperator_MINUS;
+			break;
+		case SA_DiceCharacterClass_OPERATOR_TIMES:
+			expression->operator = SA_DiceExpressionOperator_TIMES;
+			break;
+		default:
+			expression->errorBitMask |= SA_DiceExpressionError_UNKNOWN_OPERATOR;
+			break;
 	}
 
-	// Otherwise, the left operand is the expression generated by parsing the
-	// string before the delimiter.
-	expression.leftOperand = [self legacyExpressionForLegalString:[dieRollString substringToIndex:delimiterRange.location]];
-
-	// The right operand is the expression generated by parsing the string after
-	// the delimiter.
-	expression.rightOperand = [self legacyExpressionForLegalString:[dieRollString substringFromIndex:(delimiterRange.location + delimiterRange.length)]];
+	// Operands of a binary operator are the expressions generated by parsing
+	// the strings before and after the operator.
+	expression->leftOperand = leftOperand;
+	expression->rightOperand = rightOperand;
 
-	// The left and right operands have now been parsed recursively; this
-	// parsing may have generated one or more errors. Inherit any error(s) from
-	// the error-generating sub-terms.
-	expression.errorBitMask |= expression.leftOperand.errorBitMask;
-	expression.errorBitMask |= expression.rightOperand.errorBitMask;
+	// The operands have already been parsed; this parsing may have generated
+	// one or more errors. Inherit any error(s) from the error-generating
+	// operand(s).
+	expression->errorBitMask |= state->nodes[leftOperand].errorBitMask;
+	expression->errorBitMask |= state->nodes[rightOperand].errorBitMask;
 
-	return expression;
+	return index;
 }
 
--(SA_DiceExpression *) legacyExpressionForStringDescribingNumericValue:(NSString *)dieRollString {
-	SA_DiceExpression *expression = [SA_DiceExpression new];
-
-	expression.type = SA_DiceExpressionTerm_VALUE;
-	expression.inputString = dieRollString;
-	if ([expression.inputString.lowercaseString isEqualToString:@"f"])
-		expression.value = @(-1);
-	else
-		expression.value = @(dieRollString.integerValue);
-
-	return expression;
-}
+// A factor contains no operators, except possibly for its first character.
+-(NSUInteger) legacyFactorExpressionInRange:(NSRange)range
+									  state:(SA_DiceParserLegacyParseState *)state {
+	if (range.length == 0)
+		return [self legacyEmptyExpressionInRange:range
+											state:state];
+
+	// If the factor begins with an operator, then it is either a negative
+	// number (or roll command, etc.), or - if the operator is not a minus
+	// sign, or if there is nothing after it - it is malformed (because
+	// operators other than negation cannot begin an expression).
+	BOOL rectified = NO;
+	SA_DiceCharacterClass leadingCharacterClass = state->characterClasses[range.location];
+	if (SA_DiceCharacterClassIsOperator(leadingCharacterClass)) {
+		if (   range.length == 1
+			|| leadingCharacterClass != SA_DiceCharacterClass_OPERATOR_MINUS)
+			return [self legacyInvalidExpressionInRange:range
+												  state:state];
+
+		rectified = YES;
+	}
 
-/****************************/
-#pragma mark - Helper methods
-/****************************/
+	// The factor is either a simple numeric value, or a chain of roll
+	// commands and/or roll modifiers; in the latter case, we build the chain
+	// from left to right, each link becoming the die count (or the operand
+	// to be modified) of the next.
+	NSUInteger expression = NSNotFound;
+	NSUInteger delimiterIndex = NSNotFound;
+	for (NSUInteger i = range.location; i < NSMaxRange(range); i++) {
+		if (!SA_DiceCharacterClassIsDelimiter(state->characterClasses[i]))
+			continue;
+
+		if (delimiterIndex != NSNotFound) {
+			expression = [self legacyExpressionDescribingRollInRange:NSRangeMake(range.location, i - range.location)
+												 withDelimiterAtIndex:delimiterIndex
+													  innerExpression:expression
+															rectified:rectified
+																state:state];
+		}
+		delimiterIndex = i;
+	}
 
-+(void) loadValidCharactersDict {
-	NSString *stringFormatRulesPath = [[NSBundle bundleForClass:[self class]] pathForResource:SA_DB_STRING_FORMAT_RULES_PLIST_NAME
-																					   ofType:@"plist"];
-	_validCharactersDict = [NSDictionary dictionaryWithContentsOfFile:stringFormatRulesPath][SA_DB_VALID_CHARACTERS];
-	if (!_validCharactersDict) {
-		NSLog(@"Could not load valid characters dictionary!");
+	if (delimiterIndex == NSNotFound) {
+		return [self legacyAtomExpressionInRange:range
+									   rectified:rectified
+										   state:state];
+	} else {
+		return [self legacyExpressionDescribingRollInRange:range
+									  withDelimiterAtIndex:delimiterIndex
+										   innerExpression:expression
+												 rectified:rectified
+													 state:state];
 	}
 }
 
-// TODO: Should this be on a per-mode, and therefore per-instance, basis?
-+(NSString *) allValidCharacters {
-	return [ @[ [SA_DiceParser validNumeralCharacters], 
-				[SA_DiceParser allValidRollCommandDelimiterCharacters],
-				[SA_DiceParser allValidRollModifierDelimiterCharacters],
-				[SA_DiceParser allValidOperatorCharacters] ] componentsJoinedByString:@""];
-}
+// Parses a roll command or roll modifier. The inner expression is the already
+// parsed part of the chain to the left of the delimiter (if this is not the
+// first link of the chain; otherwise, it is NSNotFound).
+-(NSUInteger) legacyExpressionDescribingRollInRange:(NSRange)range
+							   withDelimiterAtIndex:(NSUInteger)delimiterIndex
+									innerExpression:(NSUInteger)innerExpression
+										  rectified:(BOOL)rectified
+											  state:(SA_DiceParserLegacyParseState *)state {
+	NSRange inputRange = SA_DiceParserInputRange(state, range, rectified);
+
+	NSRange leftRange = NSRangeMake(range.location, delimiterIndex - range.location);
+	NSRange rightRange = NSRangeMake(delimiterIndex + 1, NSMaxRange(range) - (delimiterIndex + 1));
+
+	SA_DiceCharacterClass delimiterClass = state->characterClasses[delimiterIndex];
+	if (SA_DiceCharacterClassIsRollCommandDelimiter(delimiterClass)) {
+		// If the die count is omitted, we assume it to be 1 (i.e. ‘d6’ is read
+		// as ‘1d6’).
+		NSUInteger dieCount;
+		if (innerExpression != NSNotFound) {
+			dieCount = innerExpression;
+		} else if (leftRange.length == 0) {
+			dieCount = [self legacyExpressionDescribingNumericValueInRange:NSRangeMake(state->impliedDieCountLocation, 1)
+																	 state:state];
+		} else {
+			dieCount = [self legacyAtomExpressionInRange:leftRange
+											   rectified:rectified
+												   state:state];
+		}
 
-+(NSString *) allValidOperatorCharacters {
-	NSDictionary *validOperatorCharactersDict = [SA_DiceParser validCharactersDict][SA_DB_VALID_OPERATOR_CHARACTERS];
-	
-	return [validOperatorCharactersDict.allValues componentsJoinedByString:@""];
-}
+		// The die size is the expression generated by parsing the string after
+		// the delimiter.
+		NSUInteger dieSize = [self legacyAtomExpressionInRange:rightRange
+													 rectified:rectified
+														 state:state];
+
+		NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_ROLL_COMMAND, inputRange);
+		SA_DiceExpressionNode *expression = &state->nodes[index];
+
+		// For now, only two kinds of roll command is supported - roll-and-sum,
+		// and roll-and-sum with exploding dice.
+		// These roll one or more dice of a given sort, and determine the sum of
+		// their rolled values. (In the “exploding dice” version, each die can
+		// explode, of course.)
+		expression->rollCommand = ((delimiterClass == SA_DiceCharacterClass_ROLL_COMMAND_SUM)
+								   ? SA_DiceExpressionRollCommand_SUM
+								   : SA_DiceExpressionRollCommand_SUM_EXPLODING);
+
+		expression->dieCount = dieCount;
+		expression->dieSize = dieSize;
+		if (SA_DiceParserIsFudgeDieSize(state, state->nodes[dieSize].inputRange))
+			expression->dieType = SA_DiceExpressionDice_FUDGE;
+
+		// The die count and die size have now been parsed; this parsing may
+		// have generated one or more errors. Inherit any error(s) from the
+		// error-generating sub-terms.
+		expression->errorBitMask |= state->nodes[dieCount].errorBitMask;
+		expression->errorBitMask |= state->nodes[dieSize].errorBitMask;
+
+		return index;
+	} else {
+		// The possible roll modifiers are KEEP HIGHEST and KEEP LOWEST.
+		// These take a roll command and a number, and keep that number of rolls
+		// generated by the roll command (either the highest or lowest rolls,
+		// respectively).
+		SA_DiceExpressionRollModifier rollModifier = ((delimiterClass == SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_HIGHEST)
+													  ? SA_DiceExpressionRollModifier_KEEP_HIGHEST
+													  : SA_DiceExpressionRollModifier_KEEP_LOWEST);
+
+		// If there is nothing before the delimiter, set an error, because a
+		// roll modifier requires a roll command to modify.
+		if (   innerExpression == NSNotFound
+			&& leftRange.length == 0) {
+			NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_ROLL_MODIFIER, inputRange);
+			state->nodes[index].rollModifier = (uint8_t) rollModifier;
+			state->nodes[index].errorBitMask |= SA_DiceExpressionError_ROLL_STRING_EMPTY;
+			return index;
+		}
 
-+(NSString *) validCharactersForOperator:(SA_DiceExpressionOperator)operator {
-	return [SA_DiceParser validCharactersDict][SA_DB_VALID_OPERATOR_CHARACTERS][NSStringFromSA_DiceExpressionOperator(operator)];
+		// Otherwise, the left operand is the expression before the delimiter,
+		// and the right operand is the expression after it.
+		NSUInteger leftOperand = ((innerExpression != NSNotFound)
+								  ? innerExpression
+								  : [self legacyAtomExpressionInRange:leftRange
+															rectified:rectified
+																state:state]);
+		NSUInteger rightOperand = [self legacyAtomExpressionInRange:rightRange
+														  rectified:rectified
+															  state:state];
+
+		NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_ROLL_MODIFIER, inputRange);
+		SA_DiceExpressionNode *expression = &state->nodes[index];
+
+		expression->rollModifier = (uint8_t) rollModifier;
+		expression->leftOperand = leftOperand;
+		expression->rightOperand = rightOperand;
+
+		// The left and right operands have now been parsed; this parsing may
+		// have generated one or more errors. Inherit any error(s) from the
+		// error-generating sub-terms.
+		expression->errorBitMask |= state->nodes[leftOperand].errorBitMask;
+		expression->errorBitMask |= state->nodes[rightOperand].errorBitMask;
+
+		return index;
+	}
 }
 
-+(NSString *) validNumeralCharacters {
-	return [SA_DiceParser validCharactersDict][SA_DB_VALID_NUMERAL_CHARACTERS];
+// An atom contains only numerals (except that the first atom of a factor
+// may begin with a minus sign).
+-(NSUInteger) legacyAtomExpressionInRange:(NSRange)range
+								rectified:(BOOL)rectified
+									state:(SA_DiceParserLegacyParseState *)state {
+	if (range.length == 0)
+		return [self legacyEmptyExpressionInRange:range
+											state:state];
+
+	NSRange inputRange = SA_DiceParserInputRange(state, range, rectified);
+
+	// A lone minus sign is not a number.
+	if (   range.length == 1
+		&& SA_DiceCharacterClassIsOperator(state->characterClasses[range.location]))
+		return [self legacyInvalidExpressionInRange:inputRange
+											  state:state];
+
+	return [self legacyExpressionDescribingNumericValueInRange:inputRange
+														 state:state];
 }
 
-+(NSString *) validCharactersForRollCommandDelimiter:(SA_DiceExpressionRollCommand)command {
-	return [SA_DiceParser validCharactersDict][SA_DB_VALID_ROLL_COMMAND_DELIMITER_CHARACTERS][NSStringFromSA_DiceExpressionRollCommand(command)];
-}
+// The given range is of the source string (not the roll string).
+-(NSUInteger) legacyExpressionDescribingNumericValueInRange:(NSRange)inputRange
+													 state:(SA_DiceParserLegacyParseState *)state {
+	NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_VALUE, inputRange);
+	SA_DiceExpressionNode *expression = &state->nodes[index];
 
-+(NSString *) allValidRollCommandDelimiterCharacters {
-	NSDictionary *validRollCommandDelimiterCharactersDict = [SA_DiceParser validCharactersDict][SA_DB_VALID_ROLL_COMMAND_DELIMITER_CHARACTERS];
+	expression->hasValue = YES;
+	if (SA_DiceParserIsFudgeDieSize(state, inputRange))
+		expression->value = -1;
+	else
+		expression->value = [state->source substringWithRange:inputRange].integerValue;
 
-	return [validRollCommandDelimiterCharactersDict.allValues componentsJoinedByString:@""];
+	return index;
 }
 
-+(NSString *) validCharactersForRollModifierDelimiter:(SA_DiceExpressionRollModifier)modifier {
-	return [SA_DiceParser validCharactersDict][SA_DB_VALID_ROLL_MODIFIER_DELIMITER_CHARACTERS][NSStringFromSA_DiceExpressionRollModifier(modifier)];
+-(NSUInteger) legacyEmptyExpressionInRange:(NSRange)range
+									 state:(SA_DiceParserLegacyParseState *)state {
+	NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_NONE, NSRangeMake(range.location, 0));
+	state->nodes[index].errorBitMask |= SA_DiceExpressionError_ROLL_STRING_EMPTY;
+	return index;
 }
 
-+(NSString *) allValidRollModifierDelimiterCharacters {
-	NSDictionary *validRollModifierDelimiterCharactersDict = [SA_DiceParser validCharactersDict][SA_DB_VALID_ROLL_MODIFIER_DELIMITER_CHARACTERS];
-
-	return [validRollModifierDelimiterCharactersDict.allValues componentsJoinedByString:@""];
+// The given range is of the source string (not the roll string).
+-(NSUInteger) legacyInvalidExpressionInRange:(NSRange)inputRange
+									   state:(SA_DiceParserLegacyParseState *)state {
+	NSUInteger index = SA_DiceParserAddNode(state, SA_DiceExpressionTerm_OPERATION, inputRange);
+	state->nodes[index].errorBitMask |= SA_DiceExpressionError_INVALID_EXPRESSION;
+	return index;
 }
 
 @end
@@ -0,0 +1,176 @@
+//
+//  SA_DiceProgram.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceRNG.h"
+
+/*
+ An SA_DiceProgram is an expression tree compiled into a flat sequence of
+ instructions for a small stack machine. Compiling an expression once, and
+ then running the program as many times as needed, is much cheaper than
+ evaluating the expression tree each time: running a program involves no
+ Objective-C message sends, no boxed numbers, and (once the machine’s
+ buffers have grown to fit) no memory allocation at all.
+
+ Parts of the expression that involve no dice (and, so, have the same
+ result every time) are evaluated once, when the program is compiled, and
+ replaced by their results (“constant folding”); so are parts whose
+ evaluation is certain to fail. The result of running a program - including
+ its error bits, and the sequence of random numbers it draws - is exactly
+ the same as that of evaluating the expression it was compiled from.
+
+ A program is compiled from an expression tree (see SA_DiceExpressionTree.h),
+ which it refers to, rather than copies; the program’s nodes are the tree’s
+ nodes. After a program has run, its machine holds the result of every
+ sub-expression, from which an annotated result tree (the same tree that
+ -[SA_DiceEvaluator resultOfExpression:] would return) can be made on
+ demand: the results are copied into an SA_DiceExpressionResults slab, and
+ the result tree is a view of the expression tree with those results.
+
+ Programs are immutable, and may be shared between threads; machines may not
+ (each thread must use its own).
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// The state of the stack machine that runs programs: its stack, and its
+// storage for rolls and for the results of sub-expressions. A machine may be
+// used to run any number of programs (one at a time), and keeps its buffers
+// from one run to the next.
+typedef struct SA_DiceMachine SA_DiceMachine;
+
+// Everything a program needs from its evaluator.
+typedef struct {
+	// The generator to roll dice with.
+	SA_DiceRNG *rng;
+
+	// The largest die count and die size allowed (see SA_DiceEvaluator).
+	NSUInteger maxDieCount;
+	NSUInteger maxDieSize;
+
+	// The largest total number of times dice may explode in one run (see
+	// SA_DiceEvaluator).
+	NSUInteger maxExplosionCount;
+
+	// If YES, roll commands whose individual rolls are not needed (i.e., all
+	// but those to which a ‘keep’ modifier is applied) generate only their
+	// sums (see SA_DiceSumSampler.h), and the result tree has no rolls for
+	// them. (The results are distributed just as they otherwise would be,
+	// but are not the same for a given sequence of random numbers.)
+	BOOL sumsOnly;
+
+	// The largest worst-case cost of a run (see SA_DiceCostEstimator.h); a
+	// program that might cost more is not run at all, and fails with the
+	// error SA_DiceExpressionError_COST_EXCESSIVE. (NSUIntegerMax for no
+	// limit.)
+	NSUInteger maxCost;
+} SA_DiceProgramEnvironment;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+SA_DiceMachine *SA_DiceMachineCreate(void);
+
+void SA_DiceMachineDestroy(SA_DiceMachine *machine);
+
+// The number of dice rolled (not counting explosions), and the number of
+// times dice exploded, in the last run on the given machine.
+NSUInteger SA_DiceMachineDiceRolledCount(const SA_DiceMachine *machine);
+NSUInteger SA_DiceMachineExplosionCount(const SA_DiceMachine *machine);
+
+// Applies the given operator to the given operands, exactly as the evaluator
+// does (checking for overflow); any errors are added to the given error bit
+// mask (and the result is then 0).
+NSInteger SA_DiceProgramApplyOperator(SA_DiceExpressionOperator operator,
+									  NSInteger leftOperand,
+									  NSInteger rightOperand,
+									  SA_DiceExpressionError *errors);
+
+/*************************************************/
+#pragma mark - SA_DiceProgram class declaration
+/*************************************************/
+
+@interface SA_DiceProgram : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The expression the program was compiled from (a view of the root node of
+// the program’s expression tree).
+@property (readonly) SA_DiceExpression *expression;
+
+// The expression tree the program was compiled from.
+@property (readonly) SA_DiceExpressionTree *expressionTree;
+
+// The number of instructions in the program.
+@property (readonly) NSUInteger instructionCount;
+
+// An estimate of the memory used by the program, including its expression
+// tree (in bytes).
+@property (readonly) NSUInteger estimatedMemorySize;
+
+// YES if the program involves no dice (i.e., its result was computed when it
+// was compiled, and is the same every time).
+@property (readonly, getter=isConstant) BOOL constant;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Compiles the given expression. If it is an unmodified view of an expression
+// tree (as the parser returns), the tree itself is compiled (without copying
+// it); otherwise, the expression is first flattened into a new tree. (Either
+// way, later changes to the given expression do not affect the program.)
+-(instancetype) initWithExpression:(SA_DiceExpression *)expression;
+
+// Same as -initWithExpression:. (Retained for compatibility; since trees are
+// immutable, the expression is no longer taken over by the program.)
+-(instancetype) initByTakingExpression:(SA_DiceExpression *)expression;
+
+// Compiles the given tree (from its root node).
+-(instancetype) initWithExpressionTree:(SA_DiceExpressionTree *)tree;
+
+// Compiles the given node of the given tree (and its sub-expressions).
+-(instancetype) initWithExpressionTree:(SA_DiceExpressionTree *)tree
+								  node:(NSUInteger)node NS_DESIGNATED_INITIALIZER;
+
++(instancetype) programWithExpression:(SA_DiceExpression *)expression;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Runs the program on the given machine, and returns its result. Any errors
+// are returned by reference (if there are any, the result is meaningless).
+// The program’s worst-case cost is checked against the environment’s limit
+// before anything is rolled. A program compiled from no expression runs
+// nothing, and fails with SA_DiceExpressionError_INVALID_EXPRESSION.
+// If ‘recordResultTree’ is YES, the machine also keeps the result of every
+// sub-expression, so that -resultTreeFromMachine: may be called afterwards.
+-(NSInteger) runOnMachine:(SA_DiceMachine *)machine
+			  environment:(const SA_DiceProgramEnvironment *)environment
+		 recordResultTree:(BOOL)recordResultTree
+				   errors:(SA_DiceExpressionError *)errors;
+
+// Builds the annotated result tree of the program’s last run on the given
+// machine (which must have been run with ‘recordResultTree’ set, and must
+// not have run any other program since).
+-(SA_DiceExpression *) resultTreeFromMachine:(SA_DiceMachine *)machine;
+
+// As above; the given block (if not nil) is also called once for each
+// sub-expression that was evaluated, sub-expressions first, with a view of
+// that sub-expression (with its results).
+-(SA_DiceExpression *) resultTreeFromMachine:(SA_DiceMachine *)machine
+								 traceHandler:(void (^)(SA_DiceExpression *node))traceHandler;
+
+@end
@@ -0,0 +1,1163 @@
+//
+//  SA_DiceProgram.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceProgram.h"
+
+#import "SA_DiceCostEstimator.h"
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceRollBuffer.h"
+#import "SA_DiceRollKernels.h"
+#import "SA_DiceSumSampler.h"
+
+#import "SA_Utility.h"
+
+#import <objc/runtime.h>
+#import <stdatomic.h>
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef NS_ENUM(uint8_t, SA_DiceOpcode) {
+	// Pushes a constant (a value, or errors).
+	SA_DiceOpcode_PUSH,
+
+	// Pop a die size (except for Fudge dice) and a die count; roll that many
+	// dice; push the sum (and the rolls).
+	SA_DiceOpcode_ROLL,
+	SA_DiceOpcode_ROLL_EXPLODING,
+	SA_DiceOpcode_ROLL_FUDGE,
+
+	// Pop a keep count and a set of rolls; push the sum of the kept rolls
+	// (and the rolls, in keep order).
+	SA_DiceOpcode_KEEP_HIGHEST,
+	SA_DiceOpcode_KEEP_LOWEST,
+
+	// Pops a right-hand and a left-hand operand; pushes the result of
+	// applying the instruction’s operator to them.
+	SA_DiceOpcode_OPERATE
+};
+
+typedef struct {
+	SA_DiceOpcode opcode;
+
+	// The operator (OPERATE only).
+	SA_DiceExpressionOperator operator;
+
+	// The node whose result the instruction computes (all but PUSH).
+	NSUInteger node;
+
+	// YES if the rolls must be stored individually (i.e., if a ‘keep’
+	// modifier is applied to them); otherwise, exploding dice are stored in
+	// compact form, and, when only sums are asked for, no rolls are stored at
+	// all (ROLL, etc., only).
+	BOOL rollsNeeded;
+
+	// The constant to push (PUSH only).
+	NSInteger value;
+	SA_DiceExpressionError errors;
+} SA_DiceInstruction;
+
+// The steps of the walk over the expression tree that emits the instructions
+// (see “Compilation”, below).
+typedef NS_ENUM(uint8_t, SA_DiceEmissionStepKind) {
+	// Emit the instructions for a node (and its sub-expressions).
+	SA_DiceEmissionStepKind_NODE,
+
+	// Mark the rolls of the last instruction emitted as needed (if it rolls
+	// dice), for the ‘keep’ modifier applied to them.
+	SA_DiceEmissionStepKind_ROLLS_NEEDED,
+
+	// Emit the node’s own instruction (once its sub-expressions have been
+	// emitted).
+	SA_DiceEmissionStepKind_INSTRUCTION
+};
+
+typedef struct {
+	NSUInteger node;
+	SA_DiceEmissionStepKind kind;
+} SA_DiceEmissionStep;
+
+// How a roll command stores its rolls.
+typedef NS_ENUM(uint8_t, SA_DiceRollStorage) {
+	// Only the sum is generated.
+	SA_DiceRollStorage_NONE,
+
+	// Exploding dice are stored in compact form (one record per die); other
+	// rolls, individually.
+	SA_DiceRollStorage_COMPACT,
+
+	// Every roll is stored individually (as a ‘keep’ modifier needs them).
+	SA_DiceRollStorage_FULL
+};
+
+// A value on the machine’s stack: the result of a sub-expression (or its
+// errors, if it has any), and the rolls it generated (if any), as a range of
+// the machine’s roll storage. (The range’s location is NSNotFound for roll
+// commands whose rolls were not stored. For exploding dice stored in compact
+// form, the range is of the machine’s exploded dice instead, and the die size
+// is recorded; otherwise, the die size is 0.)
+typedef struct {
+	NSInteger value;
+	SA_DiceExpressionError errors;
+	NSRange rolls;
+	NSUInteger explodedDieSize;
+} SA_DiceMachineSlot;
+
+// Dice with no more faces than this have their faces counted as they are
+// rolled, when their rolls are stored for a ‘keep’ modifier.
+#define SA_DICE_MACHINE_MAX_COUNTED_FACE_COUNT	256
+
+struct SA_DiceMachine {
+	SA_DiceMachineSlot *stack;
+	NSUInteger stackCapacity;
+
+	// Rolls generated during the current run.
+	NSInteger *rolls;
+	NSUInteger rollCount;
+	NSUInteger rollCapacity;
+
+	// Exploding dice (in compact form) rolled during the current run, and the
+	// number of times they have exploded (whether stored or not).
+	SA_DiceExplodedDie *explodedDice;
+	NSUInteger explodedDieCount;
+	NSUInteger explodedDieCapacity;
+	NSUInteger explosionCount;
+
+	// The number of dice rolled in the last run (not counting explosions).
+	NSUInteger diceRolledCount;
+
+	// The face counts of the last roll command whose faces were counted (see
+	// above), its lowest face, its number of faces, and the range of its rolls
+	// (whose location is NSNotFound if there is none), so that the ‘keep’
+	// modifier applied to it can order its rolls without counting them again.
+	NSUInteger faceCounts[SA_DICE_MACHINE_MAX_COUNTED_FACE_COUNT];
+	NSInteger countedLowestFace;
+	NSUInteger countedFaceCount;
+	NSRange countedRolls;
+
+	// The result of each node of the expression tree of the program last run
+	// (if recorded).
+	SA_DiceExpressionNodeResult *nodeResults;
+	NSUInteger nodeResultCapacity;
+
+	// The serial number of the program whose cost was last estimated on this
+	// machine (0 if none), the limits it was estimated with, and its
+	// worst-case cost; so that a program run again and again, with the same
+	// limits, is estimated only once.
+	uint64_t costedProgram;
+	NSUInteger costedMaxDieCount;
+	NSUInteger costedMaxDieSize;
+	NSUInteger costedMaxExplosionCount;
+	BOOL costedSumsOnly;
+	double costedWorstCase;
+};
+
+/**********************************/
+#pragma mark - File-scope variables
+/**********************************/
+
+// The serial number of the last program compiled.
+static _Atomic(uint64_t) _lastProgramSerialNumber = 0;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+SA_DiceMachine *SA_DiceMachineCreate(void) {
+	return calloc(1, sizeof(SA_DiceMachine));
+}
+
+void SA_DiceMachineDestroy(SA_DiceMachine *machine) {
+	if (machine == NULL)
+		return;
+
+	free(machine->stack);
+	free(machine->rolls);
+	free(machine->explodedDice);
+	free(machine->nodeResults);
+	free(machine);
+}
+
+NSUInteger SA_DiceMachineDiceRolledCount(const SA_DiceMachine *machine) {
+	return machine->diceRolledCount;
+}
+
+NSUInteger SA_DiceMachineExplosionCount(const SA_DiceMachine *machine) {
+	return machine->explosionCount;
+}
+
+NSInteger SA_DiceProgramApplyOperator(SA_DiceExpressionOperator operator,
+									  NSInteger leftOperand,
+									  NSInteger rightOperand,
+									  SA_DiceExpressionError *errors) {
+	switch (operator) {
+		case SA_DiceExpressionOperator_MINUS: {
+			// First, we check for possible overflow...
+			if (   leftOperand > 0
+				&& rightOperand < 0
+				&& (NSIntegerMax + rightOperand) < leftOperand) {
+				*errors |= SA_DiceExpressionError_INTEGER_OVERFLOW_SUBTRACTION;
+				return 0;
+			} else if (   leftOperand < 0
+					   && rightOperand > 0
+					   && (NSIntegerMin + rightOperand) > leftOperand) {
+				*errors |= SA_DiceExpressionError_INTEGER_UNDERFLOW_SUBTRACTION;
+				return 0;
+			}
+
+			// No overflow will occur. We can perform the subtraction operation.
+			return leftOperand - rightOperand;
+		}
+		case SA_DiceExpressionOperator_PLUS: {
+			// First, we check for possible overflow...
+			if (   rightOperand > 0
+				&& leftOperand > 0
+				&& (NSIntegerMax - rightOperand) < leftOperand) {
+				*errors |= SA_DiceExpressionError_INTEGER_OVERFLOW_ADDITION;
+				return 0;
+			} else if (   rightOperand < 0
+					   && leftOperand < 0
+					   && (NSIntegerMin - rightOperand) > leftOperand) {
+				*errors |= SA_DiceExpressionError_INTEGER_UNDERFLOW_ADDITION;
+				return 0;
+			}
+
+			// No overflow will occur. We can perform the addition operation.
+			return leftOperand + rightOperand;
+		}
+		case SA_DiceExpressionOperator_TIMES: {
+			// First, we check for possible overflow...
+			if (   (   leftOperand == NSIntegerMin
+					&& (   rightOperand != 0
+						|| rightOperand != 1 ))
+				|| (   rightOperand == NSIntegerMin
+					&& (   leftOperand != 0
+						|| leftOperand != 1 ))
+				|| (   leftOperand != 0
+					&& ((NSIntegerMax / ABS(leftOperand)) < rightOperand))
+				) {
+				if (   (   leftOperand > 0
+						&& rightOperand > 0)
+					|| (   leftOperand < 0
+						&& rightOperand < 0)) {
+					*errors |= SA_DiceExpressionError_INTEGER_OVERFLOW_MULTIPLICATION;
+				} else {
+					*errors |= SA_DiceExpressionError_INTEGER_UNDERFLOW_MULTIPLICATION;
+				}
+				return 0;
+			}
+
+			// No overflow will occur. We can perform the multiplication operation.
+			return leftOperand * rightOperand;
+		}
+		default: {
+			*errors |= SA_DiceExpressionError_UNKNOWN_OPERATOR;
+			return 0;
+		}
+	}
+}
+
+/*******************************/
+#pragma mark - Machine internals
+/*******************************/
+
+static void SA_DiceMachineReserve(SA_DiceMachine *machine,
+								  NSUInteger stackDepth,
+								  NSUInteger nodeCount) {
+	if (stackDepth > machine->stackCapacity) {
+		machine->stack = realloc(machine->stack, stackDepth * sizeof(SA_DiceMachineSlot));
+		machine->stackCapacity = stackDepth;
+	}
+	if (nodeCount > machine->nodeResultCapacity) {
+		machine->nodeResults = realloc(machine->nodeResults, nodeCount * sizeof(SA_DiceExpressionNodeResult));
+		machine->nodeResultCapacity = nodeCount;
+	}
+}
+
+NS_INLINE void SA_DiceMachineReserveRolls(SA_DiceMachine *machine,
+										  NSUInteger additionalRollCount) {
+	if (additionalRollCount > machine->rollCapacity - machine->rollCount) {
+		NSUInteger capacity = MAX(machine->rollCapacity * 2, machine->rollCount + additionalRollCount);
+		machine->rolls = realloc(machine->rolls, capacity * sizeof(NSInteger));
+		machine->rollCapacity = capacity;
+	}
+}
+
+NS_INLINE void SA_DiceMachineReserveExplodedDice(SA_DiceMachine *machine,
+												 NSUInteger additionalDieCount) {
+	if (additionalDieCount > machine->explodedDieCapacity - machine->explodedDieCount) {
+		NSUInteger capacity = MAX(machine->explodedDieCapacity * 2, machine->explodedDieCount + additionalDieCount);
+		machine->explodedDice = realloc(machine->explodedDice, capacity * sizeof(SA_DiceExplodedDie));
+		machine->explodedDieCapacity = capacity;
+	}
+}
+
+// Rolls exploding dice (of size 2 or more). The total number of explosions
+// in a run is limited (see SA_DiceEvaluator), which bounds the number of
+// rolls that may have to be stored; and since the sum of exploding dice is not
+// bounded by the limits on die count and die size, it is checked for overflow.
+static SA_DiceMachineSlot SA_DiceMachineRollExploding(SA_DiceMachine *machine,
+													  const SA_DiceProgramEnvironment *environment,
+													  SA_DiceRollStorage storage,
+													  NSUInteger count,
+													  NSUInteger size) {
+	SA_DiceMachineSlot result = { 0, 0, NSRangeMake(NSNotFound, 0), 0 };
+	if (storage == SA_DiceRollStorage_COMPACT) {
+		SA_DiceMachineReserveExplodedDice(machine, count);
+		result.rolls.location = machine->explodedDieCount;
+		result.explodedDieSize = size;
+	} else if (storage == SA_DiceRollStorage_FULL) {
+		SA_DiceMachineReserveRolls(machine, count);
+		result.rolls.location = machine->rollCount;
+	}
+
+	for (NSUInteger i = 0; i < count; i++) {
+		NSInteger finalRoll;
+		NSUInteger explosionCount = SA_DiceRNGRollExplodingDie(environment->rng, size, &finalRoll);
+
+		if (explosionCount > environment->maxExplosionCount - machine->explosionCount) {
+			result.errors |= SA_DiceExpressionError_EXPLOSION_COUNT_EXCESSIVE;
+		} else if (   (NSUInteger) finalRoll > (NSUInteger) (NSIntegerMax - result.value)
+				   || explosionCount > ((NSUInteger) (NSIntegerMax - result.value) - (NSUInteger) finalRoll) / size) {
+			result.errors |= SA_DiceExpressionError_INTEGER_OVERFLOW_ADDITION;
+		}
+		if (result.errors != 0) {
+			// Whatever was stored is discarded.
+			if (result.explodedDieSize != 0) {
+				machine->explodedDieCount = result.rolls.location;
+			} else if (storage == SA_DiceRollStorage_FULL) {
+				machine->rollCount = result.rolls.location;
+			}
+			return (SA_DiceMachineSlot) { 0, result.errors, NSRangeMake(0, 0), 0 };
+		}
+
+		machine->explosionCount += explosionCount;
+		result.value += (NSInteger) (explosionCount * size) + finalRoll;
+
+		if (storage == SA_DiceRollStorage_COMPACT) {
+			machine->explodedDice[machine->explodedDieCount++] = (SA_DiceExplodedDie) { explosionCount, finalRoll };
+		} else if (storage == SA_DiceRollStorage_FULL) {
+			SA_DiceMachineReserveRolls(machine, explosionCount + 1);
+			for (NSUInteger j = 0; j < explosionCount; j++)
+				machine->rolls[machine->rollCount++] = (NSInteger) size;
+			machine->rolls[machine->rollCount++] = finalRoll;
+		}
+	}
+
+	if (result.explodedDieSize != 0) {
+		result.rolls.length = machine->explodedDieCount - result.rolls.location;
+	} else if (storage == SA_DiceRollStorage_FULL) {
+		result.rolls.length = machine->rollCount - result.rolls.location;
+	}
+
+	return result;
+}
+
+static SA_DiceMachineSlot SA_DiceMachineRoll(SA_DiceMachine *machine,
+											 const SA_DiceProgramEnvironment *environment,
+											 SA_DiceOpcode opcode,
+											 SA_DiceRollStorage storage,
+											 SA_DiceMachineSlot dieCount,
+											 SA_DiceMachineSlot dieSize) {
+	// Evaluating the die count and die size may have generated errors; if so,
+	// we cannot roll.
+	SA_DiceMachineSlot result = { 0, (dieCount.errors | dieSize.errors), NSRangeMake(0, 0), 0 };
+	if (result.errors != 0)
+		return result;
+
+	// The die count and die size may still have values that make it
+	// impossible to evaluate the roll command. (Die size only matters for
+	// standard dice, not for Fudge dice.)
+	if (dieCount.value < 0) {
+		result.errors |= SA_DiceExpressionError_DIE_COUNT_NEGATIVE;
+	} else if ((NSUInteger) dieCount.value > environment->maxDieCount) {
+		result.errors |= SA_DiceExpressionError_DIE_COUNT_EXCESSIVE;
+	}
+	if (opcode != SA_DiceOpcode_ROLL_FUDGE) {
+		if (dieSize.value < 1) {
+			result.errors |= SA_DiceExpressionError_DIE_SIZE_INVALID;
+		} else if ((NSUInteger) dieSize.value > environment->maxDieSize) {
+			result.errors |= SA_DiceExpressionError_DIE_SIZE_EXCESSIVE;
+		}
+	}
+	if (result.errors != 0)
+		return result;
+
+	NSUInteger count = (NSUInteger) dieCount.value;
+	NSUInteger size = (NSUInteger) dieSize.value;
+	machine->diceRolledCount += count;
+
+	if (   opcode == SA_DiceOpcode_ROLL_EXPLODING
+		&& size > 1)
+		return SA_DiceMachineRollExploding(machine, environment, storage, count, size);
+
+	// NOTE: The limits are guaranteed (by SA_DiceEvaluator) to be small
+	// enough that the sum of the rolls (of dice that do not explode) cannot
+	// overflow. But a sum that is not stored costs so little that even an
+	// enormous die count passes admission control; so, in case the limits
+	// were set some other way, a sum that might overflow is not drawn.
+	if (storage == SA_DiceRollStorage_NONE) {
+		NSUInteger faceCount = (opcode == SA_DiceOpcode_ROLL_FUDGE) ? 3 : size;
+		if (count > ((NSUInteger) NSIntegerMax / faceCount)) {
+			result.errors |= SA_DiceExpressionError_INTEGER_OVERFLOW_ADDITION;
+			return result;
+		}
+
+		result.rolls.location = NSNotFound;
+		result.value = ((opcode == SA_DiceOpcode_ROLL_FUDGE)
+						? SA_DiceSumSamplerSumOfFudgeDice(environment->rng, count)
+						: SA_DiceSumSamplerSumOfDice(environment->rng, size, count));
+		return result;
+	}
+
+	result.rolls.location = machine->rollCount;
+	SA_DiceMachineReserveRolls(machine, count);
+	NSUInteger faceCount = (opcode == SA_DiceOpcode_ROLL_FUDGE) ? 3 : size;
+	NSInteger lowestFace = (opcode == SA_DiceOpcode_ROLL_FUDGE) ? -1 : 1;
+	if (   storage == SA_DiceRollStorage_FULL
+		&& faceCount <= SA_DICE_MACHINE_MAX_COUNTED_FACE_COUNT) {
+		// The rolls are stored individually for a ‘keep’ modifier; the faces
+		// are counted (and the rolls added up) in the same pass that rolls
+		// them (see SA_DiceRollKernels.h).
+		memset(machine->faceCounts, 0, faceCount * sizeof(NSUInteger));
+		result.value = SA_DiceRollKernelRollDice(environment->rng,
+												 (uint32_t) faceCount,
+												 lowestFace,
+												 count,
+												 machine->rolls + machine->rollCount,
+												 machine->faceCounts).sum;
+		machine->countedLowestFace = lowestFace;
+		machine->countedFaceCount = faceCount;
+		machine->countedRolls = NSRangeMake(machine->rollCount, count);
+	} else if (opcode == SA_DiceOpcode_ROLL_FUDGE) {
+		result.value = SA_DiceRNGRollFudgeDice(environment->rng, count, machine->rolls + machine->rollCount);
+	} else {
+		result.value = SA_DiceRNGRollDice(environment->rng, size, count, machine->rolls + machine->rollCount);
+	}
+	machine->rollCount += count;
+	result.rolls.length = count;
+
+	return result;
+}
+
+static SA_DiceMachineSlot SA_DiceMachineKeep(SA_DiceMachine *machine,
+											 SA_DiceOpcode opcode,
+											 SA_DiceMachineSlot rolls,
+											 SA_DiceMachineSlot keepCount) {
+	SA_DiceMachineSlot result = { 0, (rolls.errors | keepCount.errors), NSRangeMake(0, 0), 0 };
+	if (result.errors != 0)
+		return result;
+
+	// The keep count must be no greater than the number of rolls (and, of
+	// course, not negative).
+	if (keepCount.value < 0) {
+		result.errors |= SA_DiceExpressionError_KEEP_COUNT_NEGATIVE;
+		return result;
+	}
+	if ((NSUInteger) keepCount.value > rolls.rolls.length) {
+		result.errors |= SA_DiceExpressionError_KEEP_COUNT_EXCEEDS_ROLL_COUNT;
+		return result;
+	}
+
+	// The rolls, in keep order, go after all the others (so that the rolls
+	// of the roll command itself are kept as they are).
+	SA_DiceMachineReserveRolls(machine, rolls.rolls.length);
+	result.rolls = NSRangeMake(machine->rollCount, rolls.rolls.length);
+	if (   rolls.rolls.location == machine->countedRolls.location
+		&& rolls.rolls.length == machine->countedRolls.length) {
+		result.value = SA_DiceRollBufferOrderCountsForKeeping(machine->faceCounts,
+															  machine->countedLowestFace,
+															  machine->countedFaceCount,
+															  (NSUInteger) keepCount.value,
+															  (opcode == SA_DiceOpcode_KEEP_HIGHEST),
+															  machine->rolls + machine->rollCount);
+	} else {
+		result.value = SA_DiceRollBufferOrderForKeeping(machine->rolls + rolls.rolls.location,
+														rolls.rolls.length,
+														(NSUInteger) keepCount.value,
+														(opcode == SA_DiceOpcode_KEEP_HIGHEST),
+														machine->rolls + machine->rollCount);
+	}
+	machine->rollCount += rolls.rolls.length;
+
+	return result;
+}
+
+/*************************************************/
+#pragma mark - SA_DiceProgram class implementation
+/*************************************************/
+
+@implementation SA_DiceProgram {
+	SA_DiceExpressionTree *_tree;
+	const SA_DiceExpressionNode *_nodes;
+	NSUInteger _nodeCount;
+	NSUInteger _rootNode;
+
+	SA_DiceExpression *_expression;
+
+	// For each node of the tree: whether its result was computed at compile
+	// time, and its result (if so; otherwise, or if the node is never
+	// evaluated, it is unevaluated).
+	BOOL *_constantNodes;
+	SA_DiceExpressionNodeResult *_constantNodeResults;
+
+	SA_DiceInstruction *_instructions;
+	NSUInteger _instructionCount;
+	NSUInteger _instructionCapacity;
+
+	NSUInteger _stackDepth;
+	NSUInteger _maxStackDepth;
+
+	// Distinguishes the program from all others (see SA_DiceMachine).
+	uint64_t _serialNumber;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(SA_DiceExpression *) expression {
+	return _expression;
+}
+
+-(SA_DiceExpressionTree *) expressionTree {
+	return _tree;
+}
+
+-(NSUInteger) instructionCount {
+	return _instructionCount;
+}
+
+-(NSUInteger) estimatedMemorySize {
+	return (class_getInstanceSize([SA_DiceProgram class])
+			+ (_nodeCount * (sizeof(BOOL) + sizeof(SA_DiceExpressionNodeResult)))
+			+ (_instructionCapacity * sizeof(SA_DiceInstruction))
+			+ _tree.estimatedMemorySize);
+}
+
+-(BOOL) isConstant {
+	return (_rootNode == NSNotFound || _constantNodes[_rootNode]);
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithExpressionTree:nil
+								   node:NSNotFound];
+}
+
+-(instancetype) initWithExpression:(SA_DiceExpression *)expression {
+	return [self initByTakingExpression:expression];
+}
+
+-(instancetype) initByTakingExpression:(SA_DiceExpression *)expression {
+	// An unmodified view of a tree is compiled from the tree itself; any
+	// other expression is first flattened into a tree of its own.
+	SA_DiceExpressionTree *tree = expression.tree;
+	if (tree != nil) {
+		return [self initWithExpressionTree:tree
+									   node:expression.treeNode];
+	} else {
+		tree = [SA_DiceExpressionTree treeWithExpression:expression];
+		return [self initWithExpressionTree:tree
+									   node:tree.rootNode];
+	}
+}
+
+-(instancetype) initWithExpressionTree:(SA_DiceExpressionTree *)tree {
+	return [self initWithExpressionTree:tree
+								   node:tree.rootNode];
+}
+
+-(instancetype) initWithExpressionTree:(SA_DiceExpressionTree *)tree
+								  node:(NSUInteger)node {
+	if (!(self = [super init]))
+		return nil;
+
+	_tree = tree;
+	_nodes = tree.nodes;
+	_nodeCount = tree.nodeCount;
+	_rootNode = (tree != nil) ? node : NSNotFound;
+	_serialNumber = atomic_fetch_add_explicit(&_lastProgramSerialNumber, 1, memory_order_relaxed) + 1;
+
+	_constantNodes = calloc(MAX(_nodeCount, 1), sizeof(BOOL));
+	_constantNodeResults = calloc(MAX(_nodeCount, 1), sizeof(SA_DiceExpressionNodeResult));
+
+	if (_rootNode != NSNotFound) {
+		_expression = [tree expressionForNode:_rootNode
+									  results:nil];
+
+		[self analyzeNodes];
+		[self emitNode:_rootNode];
+	}
+
+	return self;
+}
+
++(instancetype) programWithExpression:(SA_DiceExpression *)expression {
+	return [[SA_DiceProgram alloc] initWithExpression:expression];
+}
+
+-(void) dealloc {
+	free(_constantNodes);
+	free(_constantNodeResults);
+	free(_instructions);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(NSInteger) runOnMachine:(SA_DiceMachine *)machine
+			  environment:(const SA_DiceProgramEnvironment *)environment
+		 recordResultTree:(BOOL)recordResultTree
+				   errors:(SA_DiceExpressionError *)errors {
+	SA_DiceMachineReserve(machine, _maxStackDepth, (recordResultTree ? _nodeCount : 0));
+	machine->rollCount = 0;
+	machine->explodedDieCount = 0;
+	machine->explosionCount = 0;
+	machine->diceRolledCount = 0;
+	machine->countedRolls = NSRangeMake(NSNotFound, 0);
+
+	// A program compiled from no expression (or an empty tree) has nothing
+	// to run, and no result.
+	if (_instructionCount == 0) {
+		if (errors != NULL)
+			*errors = SA_DiceExpressionError_INVALID_EXPRESSION;
+		return 0;
+	}
+
+	// A program that might cost too much is not run at all. (Constant
+	// programs roll nothing, and cost nothing.)
+	if (   environment->maxCost != NSUIntegerMax
+		&& !self.isConstant
+		&& [self worstCaseCostOnMachine:machine
+							environment:environment] > (double) environment->maxCost) {
+		if (recordResultTree) {
+			memset(machine->nodeResults, 0, _nodeCount * sizeof(SA_DiceExpressionNodeResult));
+			machine->nodeResults[_rootNode] = (SA_DiceExpressionNodeResult) {
+				.status = SA_DiceExpressionNodeStatus_EVALUATED,
+				.errors = SA_DiceExpressionError_COST_EXCESSIVE
+			};
+		}
+		if (errors != NULL)
+			*errors = SA_DiceExpressionError_COST_EXCESSIVE;
+		return 0;
+	}
+
+	// The results of constant nodes are already known; the rest are filled
+	// in as the instructions that compute them are executed.
+	SA_DiceExpressionNodeResult *nodeResults = NULL;
+	if (recordResultTree) {
+		nodeResults = machine->nodeResults;
+		memcpy(nodeResults, _constantNodeResults, _nodeCount * sizeof(SA_DiceExpressionNodeResult));
+	}
+
+	SA_DiceMachineSlot *stack = machine->stack;
+	NSUInteger stackSize = 0;
+	for (NSUInteger i = 0; i < _instructionCount; i++) {
+		const SA_DiceInstruction *instruction = &_instructions[i];
+		SA_DiceRollStorage storage = (instruction->rollsNeeded
+									  ? SA_DiceRollStorage_FULL
+									  : (environment->sumsOnly
+										 ? SA_DiceRollStorage_NONE
+										 : SA_DiceRollStorage_COMPACT));
+
+		SA_DiceMachineSlot result;
+		switch (instruction->opcode) {
+			case SA_DiceOpcode_PUSH: {
+				stack[stackSize++] = (SA_DiceMachineSlot) { instruction->value, instruction->errors, NSRangeMake(0, 0), 0 };
+				continue;
+			}
+			case SA_DiceOpcode_ROLL:
+			case SA_DiceOpcode_ROLL_EXPLODING: {
+				SA_DiceMachineSlot dieSize = stack[--stackSize];
+				SA_DiceMachineSlot dieCount = stack[--stackSize];
+				result = SA_DiceMachineRoll(machine, environment, instruction->opcode, storage, dieCount, dieSize);
+				break;
+			}
+			case SA_DiceOpcode_ROLL_FUDGE: {
+				SA_DiceMachineSlot dieCount = stack[--stackSize];
+				result = SA_DiceMachineRoll(machine, environment, instruction->opcode, storage, dieCount, (SA_DiceMachineSlot) { 0 });
+				break;
+			}
+			case SA_DiceOpcode_KEEP_HIGHEST:
+			case SA_DiceOpcode_KEEP_LOWEST: {
+				SA_DiceMachineSlot keepCount = stack[--stackSize];
+				SA_DiceMachineSlot rolls = stack[--stackSize];
+				result = SA_DiceMachineKeep(machine, instruction->opcode, rolls, keepCount);
+				break;
+			}
+			case SA_DiceOpcode_OPERATE:
+			default: {
+				SA_DiceMachineSlot rightOperand = stack[--stackSize];
+				SA_DiceMachineSlot leftOperand = stack[--stackSize];
+				result = (SA_DiceMachineSlot) { 0, (leftOperand.errors | rightOperand.errors), NSRangeMake(0, 0), 0 };
+				if (result.errors == 0)
+					result.value = SA_DiceProgramApplyOperator(instruction->operator, leftOperand.value, rightOperand.value, &result.errors);
+				break;
+			}
+		}
+
+		stack[stackSize++] = result;
+
+		if (nodeResults != NULL) {
+			nodeResults[instruction->node] = (SA_DiceExpressionNodeResult) {
+				.status = SA_DiceExpressionNodeStatus_EVALUATED,
+				.hasResult = (result.errors == 0),
+				.hasRolls = (   result.errors == 0
+							 && instruction->opcode != SA_DiceOpcode_OPERATE
+							 && result.rolls.location != NSNotFound),
+				.errors = result.errors,
+				.value = result.value,
+				.rolls = result.rolls,
+				.explodedDieSize = result.explodedDieSize
+			};
+		}
+	}
+
+	if (errors != NULL)
+		*errors = stack[0].errors;
+
+	return stack[0].value;
+}
+
+-(SA_DiceExpression *) resultTreeFromMachine:(SA_DiceMachine *)machine {
+	return [self resultTreeFromMachine:machine
+						  traceHandler:nil];
+}
+
+-(SA_DiceExpression *) resultTreeFromMachine:(SA_DiceMachine *)machine
+								 traceHandler:(void (^)(SA_DiceExpression *node))traceHandler {
+	if (_rootNode == NSNotFound)
+		return nil;
+
+	// The results (and rolls) are copied off the machine into a single slab,
+	// and the result tree is a view of the program’s tree with those results.
+	SA_DiceExpressionResults *results = [[SA_DiceExpressionResults alloc] initWithNodeResults:machine->nodeResults
+																						 count:_nodeCount
+																						 rolls:machine->rolls
+																						 count:machine->rollCount
+																				  explodedDice:machine->explodedDice
+																						 count:machine->explodedDieCount];
+
+	// Nodes come after their sub-expressions, so tracing them in order of
+	// index visits sub-expressions first.
+	if (traceHandler != nil) {
+		const SA_DiceExpressionNodeResult *nodeResults = results.nodeResults;
+		for (NSUInteger i = 0; i < _nodeCount; i++) {
+			if (nodeResults[i].status == SA_DiceExpressionNodeStatus_EVALUATED)
+				traceHandler([_tree expressionForNode:i
+											  results:results]);
+		}
+	}
+
+	return [_tree expressionForNode:_rootNode
+							results:results];
+}
+
+/*******************************/
+#pragma mark - Admission control
+/*******************************/
+
+// Returns the worst-case cost of running the program with the given
+// environment’s limits (see SA_DiceCostEstimator.h). The cost is kept on the
+// machine, and estimated again only if the machine has since run another
+// program, or the limits have changed.
+-(double) worstCaseCostOnMachine:(SA_DiceMachine *)machine
+					 environment:(const SA_DiceProgramEnvironment *)environment {
+	if (   machine->costedProgram != _serialNumber
+		|| machine->costedMaxDieCount != environment->maxDieCount
+		|| machine->costedMaxDieSize != environment->maxDieSize
+		|| machine->costedMaxExplosionCount != environment->maxExplosionCount
+		|| machine->costedSumsOnly != environment->sumsOnly) {
+		machine->costedProgram = _serialNumber;
+		machine->costedMaxDieCount = environment->maxDieCount;
+		machine->costedMaxDieSize = environment->maxDieSize;
+		machine->costedMaxExplosionCount = environment->maxExplosionCount;
+		machine->costedSumsOnly = environment->sumsOnly;
+		machine->costedWorstCase = SA_DiceCostMeasuresTotal(SA_DiceCostOfNode(_nodes, _rootNode, environment).worstCase);
+	}
+
+	return machine->costedWorstCase;
+}
+
+/*************************/
+#pragma mark - Compilation
+/*************************/
+
+/*
+ Compilation takes two passes over the expression tree. The first computes
+ the result of every node that can be evaluated without rolling dice. The
+ second emits the instructions, in postfix order: each constant node becomes
+ a single PUSH (which stands in for all its sub-expressions); each other
+ node, the instructions for its sub-expressions, followed by its own.
+
+ Neither pass recurses, as a tree may be as deep as it has nodes (a long
+ chain of additions, say, is parsed into a tree whose depth is its number of
+ terms), and a worker thread’s stack is small. Nodes come after their
+ sub-expressions, so the first pass analyzes them in order of index; the
+ second keeps a stack of its own.
+
+ A node is constant if it does not depend on dice, or if it is certain to
+ be erroneous - because it was erroneous to begin with (in which case it is
+ not evaluated at all), or because its roll command or roll modifier is
+ unknown or inapplicable, or because its sub-expressions (all constant) are
+ erroneous.
+
+ Nodes that are never evaluated (the sub-expressions of nodes that are
+ erroneous to begin with, or whose roll command or modifier is unknown or
+ inapplicable, and the die sizes of Fudge dice) are not analyzed at all, and
+ their results remain unevaluated.
+ */
+
+-(void) foldNode:(NSUInteger)index
+		  status:(SA_DiceExpressionNodeStatus)status
+		  errors:(SA_DiceExpressionError)errors
+		   value:(NSInteger)value
+	   hasResult:(BOOL)hasResult {
+	_constantNodes[index] = YES;
+	_constantNodeResults[index] = (SA_DiceExpressionNodeResult) {
+		.status = status,
+		.hasResult = hasResult,
+		.hasRolls = NO,
+		.errors = errors,
+		.value = value,
+		.rolls = NSRangeMake(0, 0)
+	};
+}
+
+// Nil sub-expressions (which have no node) are constant, with the value 0.
+-(BOOL) isConstantNode:(NSUInteger)index {
+	return (index == NSNotFound || _constantNodes[index]);
+}
+
+-(SA_DiceExpressionError) constantErrorsOfNode:(NSUInteger)index {
+	return (index == NSNotFound) ? 0 : _constantNodeResults[index].errors;
+}
+
+-(NSInteger) constantValueOfNode:(NSUInteger)index {
+	return (index == NSNotFound) ? 0 : _constantNodeResults[index].value;
+}
+
+// Returns, in ‘subexpressions’, the sub-expressions of the given node that
+// are evaluated (if the node itself is), or NSNotFound in their place. Which
+// they are depends only on the node (and, for a ‘keep’ modifier, on the node
+// it is applied to), not on their results.
+static void SA_DiceProgramEvaluatedSubexpressions(const SA_DiceExpressionNode *nodes,
+												  NSUInteger index,
+												  NSUInteger subexpressions[2]) {
+	const SA_DiceExpressionNode *node = &nodes[index];
+	subexpressions[0] = NSNotFound;
+	subexpressions[1] = NSNotFound;
+
+	if (node->errorBitMask != 0)
+		return;
+
+	switch (node->type) {
+		case SA_DiceExpressionTerm_OPERATION: {
+			subexpressions[0] = node->leftOperand;
+			subexpressions[1] = node->rightOperand;
+			break;
+		}
+		case SA_DiceExpressionTerm_ROLL_COMMAND: {
+			if (   node->rollCommand != SA_DiceExpressionRollCommand_SUM
+				&& node->rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING)
+				break;
+
+			// The die size of Fudge dice is not evaluated.
+			subexpressions[0] = node->dieCount;
+			if (node->dieType == SA_DiceExpressionDice_STANDARD)
+				subexpressions[1] = node->dieSize;
+			break;
+		}
+		case SA_DiceExpressionTerm_ROLL_MODIFIER: {
+			if (   node->rollModifier != SA_DiceExpressionRollModifier_KEEP_HIGHEST
+				&& node->rollModifier != SA_DiceExpressionRollModifier_KEEP_LOWEST)
+				break;
+
+			const SA_DiceExpressionNode *rollCommand = ((node->leftOperand != NSNotFound)
+														? &nodes[node->leftOperand]
+														: NULL);
+			if (   rollCommand == NULL
+				|| rollCommand->type != SA_DiceExpressionTerm_ROLL_COMMAND
+				|| (   rollCommand->rollCommand != SA_DiceExpressionRollCommand_SUM
+					&& rollCommand->rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING))
+				break;
+
+			subexpressions[0] = node->leftOperand;
+			subexpressions[1] = node->rightOperand;
+			break;
+		}
+		case SA_DiceExpressionTerm_VALUE:
+		default:
+			break;
+	}
+}
+
+-(void) analyzeNodes {
+	// First, the nodes that are evaluated are marked, from the root down (in
+	// reverse order of index, as parents come after their sub-expressions);
+	// then they are analyzed, sub-expressions first (in order of index).
+	BOOL *evaluatedNodes = calloc(_nodeCount, sizeof(BOOL));
+	evaluatedNodes[_rootNode] = YES;
+	for (NSUInteger i = _rootNode + 1; i-- > 0; ) {
+		if (!evaluatedNodes[i])
+			continue;
+
+		NSUInteger subexpressions[2];
+		SA_DiceProgramEvaluatedSubexpressions(_nodes, i, subexpressions);
+		for (NSUInteger j = 0; j < 2; j++) {
+			if (subexpressions[j] != NSNotFound)
+				evaluatedNodes[subexpressions[j]] = YES;
+		}
+	}
+
+	for (NSUInteger i = 0; i <= _rootNode; i++) {
+		if (evaluatedNodes[i])
+			[self analyzeNode:i];
+	}
+
+	free(evaluatedNodes);
+}
+
+// Analyzes the given node, whose evaluated sub-expressions (if any) have
+// been analyzed already.
+-(void) analyzeNode:(NSUInteger)index {
+	const SA_DiceExpressionNode *node = &_nodes[index];
+
+	// An expression that is erroneous to begin with (i.e., the parser has
+	// judged that it is malformed, etc.) is not evaluated.
+	if (node->errorBitMask != 0) {
+		[self foldNode:index
+				status:SA_DiceExpressionNodeStatus_UNEVALUATED
+				errors:node->errorBitMask
+				 value:0
+			 hasResult:NO];
+		return;
+	}
+
+	switch (node->type) {
+		case SA_DiceExpressionTerm_OPERATION: {
+			if (   [self isConstantNode:node->leftOperand]
+				&& [self isConstantNode:node->rightOperand]) {
+				SA_DiceExpressionError errors = [self constantErrorsOfNode:node->leftOperand] | [self constantErrorsOfNode:node->rightOperand];
+				NSInteger value = 0;
+				if (errors == 0)
+					value = SA_DiceProgramApplyOperator(node->operator, [self constantValueOfNode:node->leftOperand], [self constantValueOfNode:node->rightOperand], &errors);
+				[self foldNode:index
+						status:SA_DiceExpressionNodeStatus_EVALUATED
+						errors:errors
+						 value:value
+					 hasResult:(errors == 0)];
+			}
+			break;
+		}
+		case SA_DiceExpressionTerm_ROLL_COMMAND: {
+			if (   node->rollCommand != SA_DiceExpressionRollCommand_SUM
+				&& node->rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING) {
+				[self foldNode:index
+						status:SA_DiceExpressionNodeStatus_EVALUATED
+						errors:SA_DiceExpressionError_UNKNOWN_ROLL_COMMAND
+						 value:0
+					 hasResult:NO];
+				break;
+			}
+
+			// The die size of Fudge dice is not evaluated.
+			NSUInteger dieCount = node->dieCount;
+			NSUInteger dieSize = ((node->dieType == SA_DiceExpressionDice_STANDARD)
+								  ? node->dieSize
+								  : NSNotFound);
+			SA_DiceExpressionError errors = [self constantErrorsOfNode:dieCount] | [self constantErrorsOfNode:dieSize];
+			if (   [self isConstantNode:dieCount]
+				&& [self isConstantNode:dieSize]
+				&& errors != 0) {
+				[self foldNode:index
+						status:SA_DiceExpressionNodeStatus_EVALUATED
+						errors:errors
+						 value:0
+					 hasResult:NO];
+			}
+			break;
+		}
+		case SA_DiceExpressionTerm_ROLL_MODIFIER: {
+			if (   node->rollModifier != SA_DiceExpressionRollModifier_KEEP_HIGHEST
+				&& node->rollModifier != SA_DiceExpressionRollModifier_KEEP_LOWEST) {
+				[self foldNode:index
+						status:SA_DiceExpressionNodeStatus_EVALUATED
+						errors:SA_DiceExpressionError_UNKNOWN_ROLL_MODIFIER
+						 value:0
+					 hasResult:NO];
+				break;
+			}
+
+			// The ‘keep’ modifiers can only be applied to roll commands.
+			const SA_DiceExpressionNode *rollCommand = ((node->leftOperand != NSNotFound)
+														? &_nodes[node->leftOperand]
+														: NULL);
+			if (   rollCommand == NULL
+				|| rollCommand->type != SA_DiceExpressionTerm_ROLL_COMMAND
+				|| (   rollCommand->rollCommand != SA_DiceExpressionRollCommand_SUM
+					&& rollCommand->rollCommand != SA_DiceExpressionRollCommand_SUM_EXPLODING)) {
+				[self foldNode:index
+						status:SA_DiceExpressionNodeStatus_EVALUATED
+						errors:SA_DiceExpressionError_ROLL_MODIFIER_INAPPLICABLE
+						 value:0
+					 hasResult:NO];
+				break;
+			}
+
+			SA_DiceExpressionError errors = [self constantErrorsOfNode:node->leftOperand] | [self constantErrorsOfNode:node->rightOperand];
+			if (   [self isConstantNode:node->leftOperand]
+				&& [self isConstantNode:node->rightOperand]
+				&& errors != 0) {
+				[self foldNode:index
+						status:SA_DiceExpressionNodeStatus_EVALUATED
+						errors:errors
+						 value:0
+					 hasResult:NO];
+			}
+			break;
+		}
+		case SA_DiceExpressionTerm_VALUE:
+		default: {
+			[self foldNode:index
+					status:SA_DiceExpressionNodeStatus_EVALUATED
+					errors:0
+					 value:(node->hasValue ? node->value : 0)
+				 hasResult:node->hasValue];
+			break;
+		}
+	}
+}
+
+-(void) emitInstruction:(SA_DiceInstruction)instruction {
+	if (_instructionCount == _instructionCapacity) {
+		_instructionCapacity = (_instructionCapacity > 0) ? (_instructionCapacity * 2) : 16;
+		_instructions = realloc(_instructions, _instructionCapacity * sizeof(SA_DiceInstruction));
+	}
+	_instructions[_instructionCount++] = instruction;
+
+	// Keep track of how deep the stack will get.
+	switch (instruction.opcode) {
+		case SA_DiceOpcode_PUSH:
+			_stackDepth++;
+			break;
+		case SA_DiceOpcode_ROLL_FUDGE:
+			break;
+		default:
+			_stackDepth--;
+			break;
+	}
+	_maxStackDepth = MAX(_maxStackDepth, _stackDepth);
+}
+
+-(void) emitNode:(NSUInteger)root {
+	// Each node on the path from the root to the node being emitted has at
+	// most three steps pending (its ‘keep’ marking, its right-hand
+	// sub-expression, and its own instruction), and that path is no longer
+	// than the tree has nodes.
+	SA_DiceEmissionStep *steps = malloc(((3 * _nodeCount) + 1) * sizeof(SA_DiceEmissionStep));
+	NSUInteger stepCount = 0;
+	steps[stepCount++] = (SA_DiceEmissionStep) { root, SA_DiceEmissionStepKind_NODE };
+
+	// Steps are pushed in reverse of the order in which they are to be taken.
+	while (stepCount > 0) {
+		SA_DiceEmissionStep step = steps[--stepCount];
+		NSUInteger index = step.node;
+
+		if (step.kind == SA_DiceEmissionStepKind_ROLLS_NEEDED) {
+			// The rolls to keep from must be stored individually, even if
+			// only sums are asked for.
+			SA_DiceInstruction *rollInstruction = &_instructions[_instructionCount - 1];
+			if (rollInstruction->opcode != SA_DiceOpcode_PUSH)
+				rollInstruction->rollsNeeded = YES;
+			continue;
+		}
+
+		if (   step.kind == SA_DiceEmissionStepKind_NODE
+			&& [self isConstantNode:index]) {
+			[self emitInstruction:(SA_DiceInstruction) {
+				.opcode = SA_DiceOpcode_PUSH,
+				.node = index,
+				.value = [self constantValueOfNode:index],
+				.errors = [self constantErrorsOfNode:index]
+			}];
+			continue;
+		}
+
+		const SA_DiceExpressionNode *node = &_nodes[index];
+		if (step.kind == SA_DiceEmissionStepKind_NODE) {
+			steps[stepCount++] = (SA_DiceEmissionStep) { index, SA_DiceEmissionStepKind_INSTRUCTION };
+			switch (node->type) {
+				case SA_DiceExpressionTerm_ROLL_COMMAND: {
+					if (node->dieType == SA_DiceExpressionDice_STANDARD)
+						steps[stepCount++] = (SA_DiceEmissionStep) { node->dieSize, SA_DiceEmissionStepKind_NODE };
+					steps[stepCount++] = (SA_DiceEmissionStep) { node->dieCount, SA_DiceEmissionStepKind_NODE };
+					break;
+				}
+				case SA_DiceExpressionTerm_ROLL_MODIFIER: {
+					steps[stepCount++] = (SA_DiceEmissionStep) { node->rightOperand, SA_DiceEmissionStepKind_NODE };
+					steps[stepCount++] = (SA_DiceEmissionStep) { index, SA_DiceEmissionStepKind_ROLLS_NEEDED };
+					steps[stepCount++] = (SA_DiceEmissionStep) { node->leftOperand, SA_DiceEmissionStepKind_NODE };
+					break;
+				}
+				case SA_DiceExpressionTerm_OPERATION:
+				default: {
+					steps[stepCount++] = (SA_DiceEmissionStep) { node->rightOperand, SA_DiceEmissionStepKind_NODE };
+					steps[stepCount++] = (SA_DiceEmissionStep) { node->leftOperand, SA_DiceEmissionStepKind_NODE };
+					break;
+				}
+			}
+			continue;
+		}
+
+		switch (node->type) {
+			case SA_DiceExpressionTerm_ROLL_COMMAND: {
+				if (node->dieType == SA_DiceExpressionDice_STANDARD) {
+					[self emitInstruction:(SA_DiceInstruction) {
+						.opcode = ((node->rollCommand == SA_DiceExpressionRollCommand_SUM_EXPLODING)
+								   ? SA_DiceOpcode_ROLL_EXPLODING
+								   : SA_DiceOpcode_ROLL),
+						.node = index
+					}];
+				} else {
+					[self emitInstruction:(SA_DiceInstruction) {
+						.opcode = SA_DiceOpcode_ROLL_FUDGE,
+						.node = index
+					}];
+				}
+				break;
+			}
+			case SA_DiceExpressionTerm_ROLL_MODIFIER: {
+				[self emitInstruction:(SA_DiceInstruction) {
+					.opcode = ((node->rollModifier == SA_DiceExpressionRollModifier_KEEP_HIGHEST)
+							   ? SA_DiceOpcode_KEEP_HIGHEST
+							   : SA_DiceOpcode_KEEP_LOWEST),
+					.node = index
+				}];
+				break;
+			}
+			case SA_DiceExpressionTerm_OPERATION:
+			default: {
+				[self emitInstruction:(SA_DiceInstruction) {
+					.opcode = SA_DiceOpcode_OPERATE,
+					.operator = node->operator,
+					.node = index
+				}];
+				break;
+			}
+		}
+	}
+
+	free(steps);
+}
+
+@end
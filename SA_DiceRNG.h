@@ -0,0 +1,207 @@
+//
+//  SA_DiceRNG.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+/*
+ SA_DiceRNG is the random number generation backend used by SA_DiceBag.
+
+ It is a plain C interface, so that the hot path of rolling dice involves no
+ Objective-C message sends, no boxed numbers, and no per-die-size objects. A
+ generator is a small value type (SA_DiceRNG) which the caller owns; it may
+ live in an instance variable, on the stack, or anywhere else.
+
+ The default generator is xoshiro256** (Blackman & Vigna), which has 256 bits
+ of state, a period of 2^256 − 1, and passes all known statistical tests. Any
+ other source of uniformly distributed 64-bit words may be plugged in instead
+ (see SA_DiceRNGInitWithWordFunction()).
+
+ There is also a counter-based generator, Philox2x64-10 (Salmon et al.,
+ “Parallel Random Numbers: As Easy as 1, 2, 3”, 2011), each of whose outputs
+ is a pure function of a key, a stream number, and a counter (the index of the
+ output in the stream). Its whole state is thus a position (see
+ SA_DiceRNGPosition), which is cheap to record; and it may be started at any
+ position at no extra cost (“skip-ahead”), so that any sequence of rolls it
+ has made may be made again, exactly, on demand.
+
+ Bounded integers are generated with Lemire’s nearly-divisionless method,
+ which is unbiased and needs no per-bound state; so a die of any size costs
+ the same to roll as any other, and nothing is allocated per die size.
+
+ NOTE: An SA_DiceRNG is not thread-safe. Do not use the same generator from
+ multiple threads at once.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef struct SA_DiceRNG SA_DiceRNG;
+
+// A function which returns the next uniformly distributed 64-bit word from the
+// given generator (advancing its state).
+typedef uint64_t (*SA_DiceRNGWordFunction)(SA_DiceRNG *rng);
+
+// A function which writes the next ‘count’ words from the given generator into
+// the given buffer (exactly the words that as many calls to its word function
+// would return).
+typedef void (*SA_DiceRNGFillFunction)(SA_DiceRNG *rng,
+									   NSUInteger count,
+									   uint64_t *words);
+
+struct SA_DiceRNG {
+	SA_DiceRNGWordFunction nextWord;
+
+	// If not NULL, used by SA_DiceRNGFillWords() (instead of calling the word
+	// function once per word). NULL for the built-in generators.
+	SA_DiceRNGFillFunction fillWords;
+
+	union {
+		// State for the built-in xoshiro256** generator.
+		uint64_t xoshiro256[4];
+
+		// State for the built-in Philox2x64-10 generator: its position, and
+		// the current block of output (two words, computed together).
+		struct {
+			uint64_t key;
+			uint64_t stream;
+			uint64_t counter;
+			uint64_t block[2];
+		} philox;
+
+		// Arbitrary state for a caller-supplied word function.
+		void *context;
+	} state;
+};
+
+// A position in the output of a counter-based generator. Every output word is
+// determined by its position alone.
+typedef struct {
+	uint64_t key;
+	uint64_t stream;
+
+	// The index (in the stream) of the next word to be generated.
+	uint64_t counter;
+} SA_DiceRNGPosition;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// -------------------------
+// Initialization & seeding.
+// -------------------------
+
+// Initializes the given generator as an xoshiro256** generator, with state
+// derived (via SplitMix64) from the given seed. The same seed always produces
+// the same sequence of outputs, on every platform.
+void SA_DiceRNGInitWithSeed(SA_DiceRNG *rng,
+							uint64_t seed);
+
+// Initializes the given generator as an xoshiro256** generator, with state
+// derived from the given seed and stream number. Generators with the same
+// seed and different stream numbers produce unrelated sequences; this is
+// useful for dividing work among threads (giving each unit of work its own
+// stream), while keeping results reproducible.
+void SA_DiceRNGInitWithSeedAndStream(SA_DiceRNG *rng,
+									 uint64_t seed,
+									 uint64_t stream);
+
+// Initializes the given generator as an xoshiro256** generator, seeded from
+// the operating system’s entropy source.
+void SA_DiceRNGInitWithSystemEntropy(SA_DiceRNG *rng);
+
+// Initializes the given generator to draw its words from the given function;
+// the context pointer is stored in rng->state.context, for the function’s use.
+void SA_DiceRNGInitWithWordFunction(SA_DiceRNG *rng,
+									SA_DiceRNGWordFunction nextWord,
+									void *context);
+
+// As above, but also with a function which draws many words at once (for
+// sources which can do so faster than one word at a time).
+void SA_DiceRNGInitWithWordFunctions(SA_DiceRNG *rng,
+									 SA_DiceRNGWordFunction nextWord,
+									 SA_DiceRNGFillFunction fillWords,
+									 void *context);
+
+// Initializes the given generator as a Philox2x64-10 counter-based generator,
+// at the given position. This takes the same time whatever the position, so
+// replaying rolls made anywhere in a stream is cheap.
+//
+// NOTE: Generators with the same key and stream produce the same outputs; so
+// a key must not be used again for unrelated rolls (e.g., by each run of a
+// program). Take a new key from SA_DiceRNGSystemEntropySeed() instead.
+void SA_DiceRNGInitWithPosition(SA_DiceRNG *rng,
+								SA_DiceRNGPosition position);
+
+// Returns a 64-bit seed taken from the operating system’s entropy source.
+uint64_t SA_DiceRNGSystemEntropySeed(void);
+
+// -------------------------
+// Counter-based generation.
+// -------------------------
+
+// YES if the given generator is a Philox2x64-10 generator.
+BOOL SA_DiceRNGIsCounterBased(const SA_DiceRNG *rng);
+
+// Returns the current position of the given (counter-based) generator; a
+// generator initialized with it (see SA_DiceRNGInitWithPosition()) generates
+// the same outputs from then on as this one will. (For any other generator,
+// returns all zeros.)
+SA_DiceRNGPosition SA_DiceRNGGetPosition(const SA_DiceRNG *rng);
+
+// ---------------
+// Raw generation.
+// ---------------
+
+NS_INLINE uint64_t SA_DiceRNGNextWord(SA_DiceRNG *rng) {
+	return rng->nextWord(rng);
+}
+
+// Writes the next ‘count’ words from the given generator into the given
+// buffer (exactly the words that as many calls to SA_DiceRNGNextWord() would
+// return, but faster, for the built-in generators).
+void SA_DiceRNGFillWords(SA_DiceRNG *rng,
+						 NSUInteger count,
+						 uint64_t *words);
+
+// Returns a uniformly distributed integer in the range [0, bound). The bound
+// must be at least 1.
+uint64_t SA_DiceRNGUniform(SA_DiceRNG *rng,
+						   uint64_t bound);
+
+// -----------
+// Dice rolls.
+// -----------
+
+// Rolls the given number of dice of the given size (which must be at least 1,
+// and no greater than NSIntegerMax), writing the results (each in the range
+// [1, dieSize]) into the given buffer, which must have room for at least
+// ‘count’ values. Returns the sum of the rolls. (Where vector instructions are
+// available, dice of up to 2^32 − 1 sides are rolled in bulk; see
+// SA_DiceRollKernels.h. The rolls are the same either way.)
+NSInteger SA_DiceRNGRollDice(SA_DiceRNG *rng,
+							 NSUInteger dieSize,
+							 NSUInteger count,
+							 NSInteger *buffer);
+
+// Rolls the given number of Fudge dice, writing the results (each one of −1,
+// 0, or 1) into the given buffer, which must have room for at least ‘count’
+// values. Returns the sum of the rolls.
+NSInteger SA_DiceRNGRollFudgeDice(SA_DiceRNG *rng,
+								  NSUInteger count,
+								  NSInteger *buffer);
+
+// Rolls one exploding die of the given size (which must be at least 2): one
+// that, each time it comes up showing its maximum value, is rolled again (and
+// the rolls added up). Returns the number of times it explodes, and its final
+// roll (which is less than the die size) by reference. The number of
+// explosions is drawn directly from its (geometric) distribution - to within
+// the precision of a double - so this takes the same time however many times
+// the die explodes.
+NSUInteger SA_DiceRNGRollExplodingDie(SA_DiceRNG *rng,
+									  NSUInteger dieSize,
+									  NSInteger *finalRoll);
@@ -0,0 +1,355 @@
+//
+//  SA_DiceRNG.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceRNG.h"
+
+#import "SA_DiceRollKernels.h"
+
+#if defined(__APPLE__)
+#import <stdlib.h>
+#else
+#import <unistd.h>
+#endif
+#import <math.h>
+#import <time.h>
+
+/*****************************************/
+#pragma mark xoshiro256** implementation
+/*****************************************/
+
+NS_INLINE uint64_t SA_DiceRNGRotateLeft(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+// The state transition and output function of xoshiro256**.
+NS_INLINE uint64_t SA_DiceRNGXoshiro256Step(uint64_t *s) {
+	uint64_t result = SA_DiceRNGRotateLeft(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+
+	s[2] ^= t;
+
+	s[3] = SA_DiceRNGRotateLeft(s[3], 45);
+
+	return result;
+}
+
+static uint64_t SA_DiceRNGXoshiro256NextWord(SA_DiceRNG *rng) {
+	return SA_DiceRNGXoshiro256Step(rng->state.xoshiro256);
+}
+
+// SplitMix64, used to expand a single 64-bit seed into the full generator
+// state (as recommended by the authors of xoshiro256**).
+NS_INLINE uint64_t SA_DiceRNGSplitMix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/******************************************/
+#pragma mark - Philox2x64-10 implementation
+/******************************************/
+
+#define PHILOX_MULTIPLIER	0xD2B74407B1CE6E93ULL
+#define PHILOX_KEY_INCREMENT	0x9E3779B97F4A7C15ULL
+#define PHILOX_ROUND_COUNT	10
+
+NS_INLINE uint64_t SA_DiceRNGMultiplyHighLow(uint64_t a,
+											 uint64_t b,
+											 uint64_t *low) {
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t) a * b;
+	*low = (uint64_t) product;
+	return (uint64_t) (product >> 64);
+#else
+	uint64_t aLow = (uint32_t) a, aHigh = a >> 32;
+	uint64_t bLow = (uint32_t) b, bHigh = b >> 32;
+	uint64_t lowLow = aLow * bLow;
+	uint64_t lowHigh = aLow * bHigh;
+	uint64_t highLow = aHigh * bLow;
+	uint64_t middle = (lowLow >> 32) + (uint32_t) lowHigh + (uint32_t) highLow;
+	*low = (middle << 32) | (uint32_t) lowLow;
+	return (aHigh * bHigh) + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+#endif
+}
+
+// Computes the block of output (two words) for the given key and 128-bit
+// counter (here, the block index and the stream number).
+static void SA_DiceRNGPhiloxBlock(uint64_t key,
+								  uint64_t blockIndex,
+								  uint64_t stream,
+								  uint64_t *block) {
+	uint64_t x0 = blockIndex;
+	uint64_t x1 = stream;
+	for (int i = 0; i < PHILOX_ROUND_COUNT; i++) {
+		uint64_t low;
+		uint64_t high = SA_DiceRNGMultiplyHighLow(PHILOX_MULTIPLIER, x0, &low);
+		x0 = high ^ key ^ x1;
+		x1 = low;
+		key += PHILOX_KEY_INCREMENT;
+	}
+	block[0] = x0;
+	block[1] = x1;
+}
+
+// Word n of a stream is word (n mod 2) of block (n / 2). A block is computed
+// when its first word is needed (or, after skipping ahead to its second word,
+// by SA_DiceRNGInitWithPosition()).
+static uint64_t SA_DiceRNGPhiloxNextWord(SA_DiceRNG *rng) {
+	uint64_t counter = rng->state.philox.counter++;
+	if ((counter & 1) == 0)
+		SA_DiceRNGPhiloxBlock(rng->state.philox.key, counter >> 1, rng->state.philox.stream, rng->state.philox.block);
+	return rng->state.philox.block[counter & 1];
+}
+
+/*********************************************/
+#pragma mark - Bounded integer implementation
+/*********************************************/
+
+/*
+ Lemire’s nearly-divisionless method (“Fast Random Integer Generation in an
+ Interval”, 2019). We multiply a random word by the bound, and take the high
+ half of the product as the result; the low half tells us whether the word
+ fell into the small biased region, in which case we draw again. A division
+ is needed only on the (rare) path where a rejection is possible at all.
+
+ Bounds that fit in 32 bits use the high 32 bits of each word and a 32×32-bit
+ product, which is cheaper (and vectorizes well); larger bounds use the full
+ word and a 64×64-bit product.
+
+ The word function is passed explicitly so that callers which know which
+ generator they have (see SA_DiceRNGRollDice()) can pass a constant, which
+ lets the compiler inline the generator into the loop.
+ */
+NS_INLINE uint64_t SA_DiceRNGUniform32(SA_DiceRNG *rng,
+									   SA_DiceRNGWordFunction nextWord,
+									   uint32_t bound) {
+	uint64_t product = (nextWord(rng) >> 32) * (uint64_t) bound;
+	uint32_t low = (uint32_t) product;
+	if (low < bound) {
+		uint32_t threshold = ((uint32_t) -bound) % bound;
+		while (low < threshold) {
+			product = (nextWord(rng) >> 32) * (uint64_t) bound;
+			low = (uint32_t) product;
+		}
+	}
+	return product >> 32;
+}
+
+NS_INLINE uint64_t SA_DiceRNGUniform64(SA_DiceRNG *rng,
+									   SA_DiceRNGWordFunction nextWord,
+									   uint64_t bound) {
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t) nextWord(rng) * bound;
+	uint64_t low = (uint64_t) product;
+	if (low < bound) {
+		uint64_t threshold = (-bound) % bound;
+		while (low < threshold) {
+			product = (__uint128_t) nextWord(rng) * bound;
+			low = (uint64_t) product;
+		}
+	}
+	return (uint64_t) (product >> 64);
+#else
+	// No 128-bit arithmetic on this platform; fall back to rejection sampling
+	// with a modulo reduction (slower, but equally unbiased).
+	uint64_t threshold = (-bound) % bound;
+	uint64_t word;
+	do {
+		word = nextWord(rng);
+	} while (word < threshold);
+	return word % bound;
+#endif
+}
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+void SA_DiceRNGInitWithSeed(SA_DiceRNG *rng,
+							uint64_t seed) {
+	rng->nextWord = SA_DiceRNGXoshiro256NextWord;
+	rng->fillWords = NULL;
+
+	uint64_t x = seed;
+	for (int i = 0; i < 4; i++)
+		rng->state.xoshiro256[i] = SA_DiceRNGSplitMix64(&x);
+}
+
+void SA_DiceRNGInitWithSeedAndStream(SA_DiceRNG *rng,
+									 uint64_t seed,
+									 uint64_t stream) {
+	// SplitMix64 is a bijection, so distinct stream numbers yield distinct
+	// seeds (which SplitMix64 then expands into unrelated states).
+	uint64_t x = stream;
+	SA_DiceRNGInitWithSeed(rng, seed ^ SA_DiceRNGSplitMix64(&x));
+}
+
+void SA_DiceRNGInitWithSystemEntropy(SA_DiceRNG *rng) {
+	SA_DiceRNGInitWithSeed(rng, SA_DiceRNGSystemEntropySeed());
+}
+
+void SA_DiceRNGInitWithWordFunction(SA_DiceRNG *rng,
+									SA_DiceRNGWordFunction nextWord,
+									void *context) {
+	SA_DiceRNGInitWithWordFunctions(rng, nextWord, NULL, context);
+}
+
+void SA_DiceRNGInitWithWordFunctions(SA_DiceRNG *rng,
+									 SA_DiceRNGWordFunction nextWord,
+									 SA_DiceRNGFillFunction fillWords,
+									 void *context) {
+	rng->nextWord = nextWord;
+	rng->fillWords = fillWords;
+	rng->state.context = context;
+}
+
+void SA_DiceRNGInitWithPosition(SA_DiceRNG *rng,
+								SA_DiceRNGPosition position) {
+	rng->nextWord = SA_DiceRNGPhiloxNextWord;
+	rng->fillWords = NULL;
+
+	rng->state.philox.key = position.key;
+	rng->state.philox.stream = position.stream;
+	rng->state.philox.counter = position.counter;
+	if ((position.counter & 1) == 1)
+		SA_DiceRNGPhiloxBlock(position.key, position.counter >> 1, position.stream, rng->state.philox.block);
+}
+
+uint64_t SA_DiceRNGSystemEntropySeed(void) {
+	uint64_t seed = 0;
+#if defined(__APPLE__)
+	arc4random_buf(&seed, sizeof(seed));
+#else
+	if (getentropy(&seed, sizeof(seed)) != 0) {
+		// Should never happen; but if the entropy source is unavailable, we
+		// would still rather roll dice than not. Mix together whatever
+		// varies from run to run.
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		uint64_t x = ((uint64_t) now.tv_sec << 32) ^ (uint64_t) now.tv_nsec ^ (uint64_t) (uintptr_t) &now;
+		seed = SA_DiceRNGSplitMix64(&x);
+	}
+#endif
+	return seed;
+}
+
+BOOL SA_DiceRNGIsCounterBased(const SA_DiceRNG *rng) {
+	return (rng->nextWord == SA_DiceRNGPhiloxNextWord);
+}
+
+SA_DiceRNGPosition SA_DiceRNGGetPosition(const SA_DiceRNG *rng) {
+	if (!SA_DiceRNGIsCounterBased(rng))
+		return (SA_DiceRNGPosition) { 0 };
+
+	return (SA_DiceRNGPosition) {
+		.key = rng->state.philox.key,
+		.stream = rng->state.philox.stream,
+		.counter = rng->state.philox.counter
+	};
+}
+
+void SA_DiceRNGFillWords(SA_DiceRNG *rng,
+						 NSUInteger count,
+						 uint64_t *words) {
+	if (rng->nextWord == SA_DiceRNGXoshiro256NextWord) {
+		// Working on a copy of the state lets the compiler keep it in
+		// registers for the whole loop.
+		uint64_t state[4] = {
+			rng->state.xoshiro256[0],
+			rng->state.xoshiro256[1],
+			rng->state.xoshiro256[2],
+			rng->state.xoshiro256[3]
+		};
+		for (NSUInteger i = 0; i < count; i++)
+			words[i] = SA_DiceRNGXoshiro256Step(state);
+		memcpy(rng->state.xoshiro256, state, sizeof(state));
+	} else if (rng->fillWords != NULL) {
+		rng->fillWords(rng, count, words);
+	} else {
+		for (NSUInteger i = 0; i < count; i++)
+			words[i] = rng->nextWord(rng);
+	}
+}
+
+uint64_t SA_DiceRNGUniform(SA_DiceRNG *rng,
+						   uint64_t bound) {
+	return ((bound <= UINT32_MAX)
+			? SA_DiceRNGUniform32(rng, rng->nextWord, (uint32_t) bound)
+			: SA_DiceRNGUniform64(rng, rng->nextWord, bound));
+}
+
+NSInteger SA_DiceRNGRollDice(SA_DiceRNG *rng,
+							 NSUInteger dieSize,
+							 NSUInteger count,
+							 NSInteger *buffer) {
+	// Where there are vector kernels, dice are rolled in bulk (see
+	// SA_DiceRollKernels.h); the rolls are the same either way.
+	if (   dieSize <= UINT32_MAX
+		&& SA_DiceRollKernelCurrent() != SA_DiceRollKernel_SCALAR)
+		return SA_DiceRollKernelRollDice(rng, (uint32_t) dieSize, 1, count, buffer, NULL).sum;
+
+	NSInteger sum = 0;
+
+	// For the built-in generator, we pass its word function as a constant,
+	// so that it is inlined into the loop (instead of being called
+	// indirectly, once per die).
+	if (rng->nextWord == SA_DiceRNGXoshiro256NextWord) {
+		if (dieSize <= UINT32_MAX) {
+			for (NSUInteger i = 0; i < count; i++) {
+				buffer[i] = (NSInteger) SA_DiceRNGUniform32(rng, SA_DiceRNGXoshiro256NextWord, (uint32_t) dieSize) + 1;
+				sum += buffer[i];
+			}
+		} else {
+			for (NSUInteger i = 0; i < count; i++) {
+				buffer[i] = (NSInteger) SA_DiceRNGUniform64(rng, SA_DiceRNGXoshiro256NextWord, dieSize) + 1;
+				sum += buffer[i];
+			}
+		}
+	} else {
+		for (NSUInteger i = 0; i < count; i++) {
+			buffer[i] = (NSInteger) SA_DiceRNGUniform(rng, dieSize) + 1;
+			sum += buffer[i];
+		}
+	}
+
+	return sum;
+}
+
+NSInteger SA_DiceRNGRollFudgeDice(SA_DiceRNG *rng,
+								  NSUInteger count,
+								  NSInteger *buffer) {
+	// A Fudge die is a d3, relabeled as −1, 0, and 1.
+	if (SA_DiceRollKernelCurrent() != SA_DiceRollKernel_SCALAR)
+		return SA_DiceRollKernelRollDice(rng, 3, -1, count, buffer, NULL).sum;
+
+	NSInteger sum = SA_DiceRNGRollDice(rng, 3, count, buffer);
+	for (NSUInteger i = 0; i < count; i++)
+		buffer[i] -= 2;
+
+	return sum - (2 * (NSInteger) count);
+}
+
+NSUInteger SA_DiceRNGRollExplodingDie(SA_DiceRNG *rng,
+									  NSUInteger dieSize,
+									  NSInteger *finalRoll) {
+	// The die explodes at least k times with probability (1 / dieSize)^k; so,
+	// for u uniformly distributed in (0, 1], the number of explosions is the
+	// largest k such that u ≤ (1 / dieSize)^k.
+	double u = (double) ((SA_DiceRNGNextWord(rng) >> 11) + 1) * 0x1.0p-53;
+	double explosionCount = floor(log(u) / -log((double) dieSize));
+
+	// Each roll after the last explosion is equally likely to be any value
+	// but the maximum.
+	*finalRoll = (NSInteger) SA_DiceRNGUniform(rng, dieSize - 1) + 1;
+
+	return (NSUInteger) explosionCount;
+}
@@ -0,0 +1,106 @@
+//
+//  SA_DiceRanking.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+@class SA_DiceFormatter;
+
+/*
+ An SA_DiceRanking is a list of evaluated expressions (e.g., the initiative
+ rolls of the participants in a combat, or the rolls of a group check),
+ ranked by their results, with ties broken by their attempt bonuses - as
+ by compareEvaluatedExpressionsByResult() and then
+ compareEvaluatedExpressionsByAttemptBonus() - and any remaining ties by
+ their order in the list.
+
+ Rankings are usually made by an evaluator (see -[SA_DiceEvaluator
+ rankingOfPrograms:highestFirst:]), in one of two ways:
+
+ 1. From a list of expressions: each expression’s result is ranked, and its
+ attempt bonus is the result of its right operand (e.g., the 5 in
+ “1d20+5”), as compareEvaluatedExpressionsByAttemptBonus() has it. (An
+ expression that has no result, or no right operand, counts as 0, as with
+ the comparison functions.)
+
+ 2. From one expression, and a list of bonuses (e.g., “1d20”, and each
+ participant’s initiative modifier): the expression is evaluated once for
+ each bonus, and each bonus is added to its result; the attempt bonus of
+ each entry is the bonus itself.
+
+ The ranking is done on the entries’ results and bonuses as plain integers
+ (see SA_DiceRankingEntry). Result trees are kept, but nothing is formatted
+ until it is asked for; so a caller that shows only the top few entries
+ formats only those. (In the second case, the result tree of an entry - the
+ expression plus its bonus - is also put together only when it is asked
+ for.)
+
+ Rankings are immutable, and may be shared between threads.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef struct {
+	// The entry’s position in the list that was ranked (of expressions, or of
+	// bonuses).
+	NSUInteger index;
+
+	// The entry’s result (including its bonus, if any; 0 if it has none),
+	// attempt bonus, and errors.
+	NSInteger result;
+	NSInteger attemptBonus;
+	SA_DiceExpressionError errors;
+} SA_DiceRankingEntry;
+
+/**********************************************/
+#pragma mark - SA_DiceRanking class declaration
+/**********************************************/
+
+@interface SA_DiceRanking : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The entries, in rank order (as a C array of -count entries).
+@property (readonly) const SA_DiceRankingEntry *entries NS_RETURNS_INNER_POINTER;
+@property (readonly) NSUInteger count;
+
+// YES if the highest results rank first (as for initiative); NO if the
+// lowest do.
+@property (readonly) BOOL highestFirst;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Ranks the given result trees (e.g., as returned by -[SA_DiceEvaluator
+// resultsOfPrograms:]); if bonuses are given (as a C array of as many
+// bonuses as there are results), each is added to the corresponding result,
+// as described above.
+-(instancetype) initWithResults:(NSArray <SA_DiceExpression *> *)results
+						bonuses:(const NSInteger *)bonuses
+				   highestFirst:(BOOL)highestFirst NS_DESIGNATED_INITIALIZER;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Returns the result tree of the entry of the given rank (0 being the first).
+// For an entry with a bonus, this is the expression plus its bonus, which is
+// put together anew by each call.
+-(SA_DiceExpression *) resultAtRank:(NSUInteger)rank;
+
+// Formats the entries of the given ranks (with the given formatter), and
+// returns their formatted strings, in rank order. The range is clipped to
+// the number of entries.
+-(NSArray <NSString *> *) linesForRanks:(NSRange)ranks
+							  formatter:(SA_DiceFormatter *)formatter;
+
+@end
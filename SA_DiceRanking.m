@@ -0,0 +1,240 @@
+//
+//  SA_DiceRanking.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceRanking.h"
+
+#import "SA_DiceExpressionTree.h"
+#import "SA_DiceFormatter.h"
+
+/*********************/
+#pragma mark Functions
+/*********************/
+
+// Returns the result of the given node (as -[SA_DiceExpression result] would
+// for a view of it, but unboxed), or 0 if it has none.
+static NSInteger SA_DiceRankingResultOfNode(const SA_DiceExpressionNode *nodes,
+											const SA_DiceExpressionNodeResult *nodeResults,
+											NSUInteger node,
+											BOOL *hasResult) {
+	*hasResult = NO;
+	if (   node == NSNotFound
+		|| nodeResults[node].status == SA_DiceExpressionNodeStatus_UNEVALUATED)
+		return 0;
+
+	if (nodes[node].type == SA_DiceExpressionTerm_VALUE) {
+		*hasResult = nodes[node].hasValue;
+		return nodes[node].value;
+	} else {
+		*hasResult = nodeResults[node].hasResult;
+		return nodeResults[node].value;
+	}
+}
+
+// Ranks entries in ascending order of result, then of attempt bonus; ties are
+// left in order of index.
+static int SA_DiceRankingCompareAscending(const void *a,
+										  const void *b) {
+	const SA_DiceRankingEntry *entry1 = a;
+	const SA_DiceRankingEntry *entry2 = b;
+
+	if (entry1->result != entry2->result)
+		return (entry1->result < entry2->result) ? -1 : 1;
+	if (entry1->attemptBonus != entry2->attemptBonus)
+		return (entry1->attemptBonus < entry2->attemptBonus) ? -1 : 1;
+	return (entry1->index < entry2->index) ? -1 : ((entry1->index > entry2->index) ? 1 : 0);
+}
+
+// As above, but ties are put in reverse order of index (so that, once the
+// entries are reversed, the highest results rank first, and ties are in
+// order of index).
+static int SA_DiceRankingCompareAscendingReversingTies(const void *a,
+													   const void *b) {
+	const SA_DiceRankingEntry *entry1 = a;
+	const SA_DiceRankingEntry *entry2 = b;
+
+	if (entry1->result != entry2->result)
+		return (entry1->result < entry2->result) ? -1 : 1;
+	if (entry1->attemptBonus != entry2->attemptBonus)
+		return (entry1->attemptBonus < entry2->attemptBonus) ? -1 : 1;
+	return (entry1->index > entry2->index) ? -1 : ((entry1->index < entry2->index) ? 1 : 0);
+}
+
+/*************************************************/
+#pragma mark - SA_DiceRanking class implementation
+/*************************************************/
+
+@implementation SA_DiceRanking {
+	SA_DiceRankingEntry *_entries;
+	NSUInteger _count;
+
+	// The result trees, and the bonuses (or NULL, if there are none), in the
+	// order in which they were given.
+	NSArray <SA_DiceExpression *> *_results;
+	NSInteger *_bonuses;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(const SA_DiceRankingEntry *) entries {
+	return _entries;
+}
+
+-(NSUInteger) count {
+	return _count;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithResults:@[]
+						 bonuses:NULL
+					highestFirst:YES];
+}
+
+-(instancetype) initWithResults:(NSArray <SA_DiceExpression *> *)results
+						bonuses:(const NSInteger *)bonuses
+				   highestFirst:(BOOL)highestFirst {
+	if (!(self = [super init]))
+		return nil;
+
+	_results = [results copy];
+	_count = _results.count;
+	_highestFirst = highestFirst;
+	_entries = malloc(MAX(_count, 1) * sizeof(SA_DiceRankingEntry));
+	if (bonuses != NULL) {
+		_bonuses = malloc(MAX(_count, 1) * sizeof(NSInteger));
+		memcpy(_bonuses, bonuses, _count * sizeof(NSInteger));
+	}
+
+	// The keys are read straight from the trees and their results, where the
+	// result trees are views (as those made by an evaluator are), so that
+	// nothing is boxed.
+	for (NSUInteger i = 0; i < _count; i++) {
+		SA_DiceExpression *result = _results[i];
+		SA_DiceExpressionTree *tree = result.tree;
+		SA_DiceExpressionResults *nodeResults = result.results;
+
+		NSInteger value;
+		BOOL hasValue;
+		NSInteger attemptBonus;
+		SA_DiceExpressionError errors;
+		if (   tree != nil
+			&& nodeResults != nil) {
+			NSUInteger node = result.treeNode;
+			BOOL hasAttemptBonus;
+			value = SA_DiceRankingResultOfNode(tree.nodes, nodeResults.nodeResults, node, &hasValue);
+			attemptBonus = SA_DiceRankingResultOfNode(tree.nodes, nodeResults.nodeResults, tree.nodes[node].rightOperand, &hasAttemptBonus);
+			errors = tree.nodes[node].errorBitMask | nodeResults.nodeResults[node].errors;
+		} else {
+			value = result.result.integerValue;
+			hasValue = (result.result != nil);
+			attemptBonus = result.rightOperand.result.integerValue;
+			errors = result.errorBitMask;
+		}
+
+		// With a bonus, the attempt bonus is the bonus; and the result is the
+		// sum (if there is a result to add it to, and the sum does not
+		// overflow).
+		if (_bonuses != NULL) {
+			NSInteger bonus = _bonuses[i];
+			attemptBonus = bonus;
+			if (!hasValue) {
+				value = 0;
+			} else if (__builtin_add_overflow(value, bonus, &value)) {
+				value = 0;
+				errors |= ((bonus > 0)
+						   ? SA_DiceExpressionError_INTEGER_OVERFLOW_ADDITION
+						   : SA_DiceExpressionError_INTEGER_UNDERFLOW_ADDITION);
+			}
+		}
+
+		_entries[i] = (SA_DiceRankingEntry) {
+			.index = i,
+			.result = value,
+			.attemptBonus = attemptBonus,
+			.errors = errors
+		};
+	}
+
+	if (_highestFirst) {
+		qsort(_entries, _count, sizeof(SA_DiceRankingEntry), SA_DiceRankingCompareAscendingReversingTies);
+		for (NSUInteger i = 0; i < _count / 2; i++) {
+			SA_DiceRankingEntry entry = _entries[i];
+			_entries[i] = _entries[_count - 1 - i];
+			_entries[_count - 1 - i] = entry;
+		}
+	} else {
+		qsort(_entries, _count, sizeof(SA_DiceRankingEntry), SA_DiceRankingCompareAscending);
+	}
+
+	return self;
+}
+
+-(void) dealloc {
+	free(_entries);
+	free(_bonuses);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceExpression *) resultAtRank:(NSUInteger)rank {
+	const SA_DiceRankingEntry *entry = &_entries[rank];
+	SA_DiceExpression *result = _results[entry->index];
+	if (_bonuses == NULL)
+		return result;
+
+	// The bonus is shown as it would have been written (i.e., a negative
+	// bonus is subtracted).
+	NSInteger bonus = _bonuses[entry->index];
+	BOOL subtract = (bonus < 0 && bonus != NSIntegerMin);
+
+	SA_DiceExpression *bonusExpression = [SA_DiceExpression new];
+	bonusExpression.type = SA_DiceExpressionTerm_VALUE;
+	bonusExpression.value = @(subtract ? -bonus : bonus);
+	bonusExpression.result = bonusExpression.value;
+	bonusExpression.inputString = bonusExpression.value.stringValue;
+
+	SA_DiceExpression *expression = [SA_DiceExpression expressionByJoiningExpression:result
+																		toExpression:bonusExpression
+																		withOperator:(subtract
+																					  ? SA_DiceExpressionOperator_MINUS
+																					  : SA_DiceExpressionOperator_PLUS)];
+	expression.errorBitMask = entry->errors;
+	expression.result = (entry->errors == 0) ? @(entry->result) : nil;
+
+	return expression;
+}
+
+-(NSArray <NSString *> *) linesForRanks:(NSRange)ranks
+							  formatter:(SA_DiceFormatter *)formatter {
+	NSUInteger start = MIN(ranks.location, _count);
+	NSUInteger end = start + MIN(ranks.length, _count - start);
+
+	// One buffer serves for all the lines.
+	unichar storage[256];
+	SA_DiceFormatterBuffer buffer;
+	SA_DiceFormatterBufferInit(&buffer, storage, 256);
+
+	NSMutableArray <NSString *> *lines = [NSMutableArray arrayWithCapacity:(end - start)];
+	for (NSUInteger rank = start; rank < end; rank++) {
+		SA_DiceFormatterBufferReset(&buffer);
+		[formatter appendStringFromExpression:[self resultAtRank:rank]
+									 toBuffer:&buffer];
+		[lines addObject:[[NSString alloc] initWithCharacters:buffer.characters
+													   length:buffer.length]];
+	}
+
+	SA_DiceFormatterBufferFree(&buffer);
+	return lines;
+}
+
+@end
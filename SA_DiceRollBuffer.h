@@ -0,0 +1,140 @@
+//
+//  SA_DiceRollBuffer.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// One exploding die (see SA_DiceRNGRollExplodingDie()): the number of times
+// it exploded, and its final roll. Its rolls are the die’s maximum value,
+// once for each explosion, followed by the final roll.
+typedef struct {
+	NSUInteger explosionCount;
+	NSInteger finalRoll;
+} SA_DiceExplodedDie;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Writes the given values into the output buffer (which must have room for
+// ‘count’ values, and must not overlap the input), in the order used by the
+// ‘keep highest’ and ‘keep lowest’ roll modifiers (see
+// -[SA_DiceRollBuffer bufferKeeping:highest:keptSum:]). Returns the sum of
+// the <keepCount> kept values. The keep count must be no greater than the
+// number of values.
+NSInteger SA_DiceRollBufferOrderForKeeping(const NSInteger *values,
+										   NSUInteger count,
+										   NSUInteger keepCount,
+										   BOOL keepHighest,
+										   NSInteger *output);
+
+// As SA_DiceRollBufferOrderForKeeping(), but for values that have already
+// been counted: ‘counts’ holds the number of times each of the values
+// ‘lowestValue’ through ‘lowestValue + range − 1’ occurs (e.g., the face counts
+// from SA_DiceRollKernelRollDice()). The output buffer must have room for as
+// many values as were counted.
+NSInteger SA_DiceRollBufferOrderCountsForKeeping(const NSUInteger *counts,
+												 NSInteger lowestValue,
+												 NSUInteger range,
+												 NSUInteger keepCount,
+												 BOOL keepHighest,
+												 NSInteger *output);
+
+/************************************************/
+#pragma mark - SA_DiceRollBuffer class declaration
+/************************************************/
+
+/*
+ An immutable, contiguous buffer of die rolls (as unboxed integers), along
+ with their sum.
+
+ SA_DiceRollBuffer is a subclass of NSArray, so it may be used anywhere an
+ NSArray <NSNumber *> of rolls is expected; elements are boxed only when
+ they are accessed as objects (and, on platforms with tagged pointers, small
+ integers are not heap-allocated even then). Code that cares about speed
+ should use the -values pointer and the -sum property instead.
+
+ The rolls of exploding dice may be held in compact form: one record per die
+ (see SA_DiceExplodedDie), however many times it exploded. The individual
+ rolls are then generated only if they are asked for (e.g., via -values, or
+ any NSArray method).
+ */
+@interface SA_DiceRollBuffer : NSArray <NSNumber *>
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The rolls, as a C array of -count integers.
+@property (readonly) const NSInteger *values NS_RETURNS_INNER_POINTER;
+
+// The sum of all the rolls in the buffer.
+@property (readonly) NSInteger sum;
+
+// For a buffer of exploding dice in compact form, the dice (as a C array of
+// -explodedDieCount records), and their size; otherwise NULL, 0, and 0.
+@property (readonly) const SA_DiceExplodedDie *explodedDice NS_RETURNS_INNER_POINTER;
+@property (readonly) NSUInteger explodedDieCount;
+@property (readonly) NSUInteger explodedDieSize;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates an empty roll buffer.
+-(instancetype) init;
+
+// Creates a roll buffer containing a copy of the given values.
+-(instancetype) initWithValues:(const NSInteger *)values
+						 count:(NSUInteger)count;
+
+// Creates a roll buffer which takes ownership of the given malloc()’d array
+// of values (which will be free()’d when the buffer is deallocated). The sum
+// must be the sum of the values (callers generally compute it in the same
+// pass that generates the values).
+-(instancetype) initByTakingValues:(NSInteger *)values
+							 count:(NSUInteger)count
+							   sum:(NSInteger)sum;
+
+// Creates a roll buffer, in compact form, containing the rolls of the given
+// exploding dice (of the given size); the records are copied. The sum of the
+// rolls must not overflow.
+-(instancetype) initWithExplodedDice:(const SA_DiceExplodedDie *)dice
+							   count:(NSUInteger)dieCount
+							 dieSize:(NSUInteger)dieSize;
+
+// Creates a roll buffer from an array of NSNumbers. (If the given array is
+// already a roll buffer, it is returned as is.)
++(instancetype) bufferWithArray:(NSArray <NSNumber *> *)array;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(NSInteger) valueAtIndex:(NSUInteger)index;
+
+// Returns the sum of the rolls in the given range.
+-(NSInteger) sumOfValuesInRange:(NSRange)range;
+
+// Returns a new buffer containing the same rolls, sorted in the given order.
+-(SA_DiceRollBuffer *) sortedBufferAscending:(BOOL)ascending;
+
+// Returns a new buffer containing the same rolls, in the order used by the
+// ‘keep highest’ and ‘keep lowest’ roll modifiers: the <keepCount> kept
+// rolls first, then the discarded rolls; both parts are ordered from highest
+// to lowest (if keeping the highest rolls) or from lowest to highest (if
+// keeping the lowest). (This is the same order as that of a full sort, but is
+// arrived at without one.) The sum of the kept rolls is returned by reference.
+//
+// The keep count must be no greater than the number of rolls.
+-(SA_DiceRollBuffer *) bufferKeeping:(NSUInteger)keepCount
+							 highest:(BOOL)keepHighest
+							 keptSum:(NSInteger *)keptSum;
+
+@end
@@ -0,0 +1,457 @@
+//
+//  SA_DiceRollBuffer.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceRollBuffer.h"
+
+#import <stdatomic.h>
+
+/*********************/
+#pragma mark Functions
+/*********************/
+
+// Writes the decimal representation of the given value into the given
+// character buffer (which must have room for at least 20 characters), and
+// returns the number of characters written.
+static NSUInteger SA_DiceRollBufferWriteInteger(char *destination,
+												NSInteger value) {
+	char digits[20];
+	NSUInteger digitCount = 0;
+	NSUInteger magnitude = (value < 0) ? (0 - (NSUInteger) value) : (NSUInteger) value;
+	do {
+		digits[digitCount++] = (char) ('0' + (magnitude % 10));
+		magnitude /= 10;
+	} while (magnitude != 0);
+
+	NSUInteger length = 0;
+	if (value < 0)
+		destination[length++] = '-';
+	while (digitCount > 0)
+		destination[length++] = digits[--digitCount];
+
+	return length;
+}
+
+static int SA_DiceRollBufferCompareAscending(const void *a, const void *b) {
+	NSInteger x = *(const NSInteger *) a;
+	NSInteger y = *(const NSInteger *) b;
+	return (x > y) - (x < y);
+}
+
+static int SA_DiceRollBufferCompareDescending(const void *a, const void *b) {
+	return SA_DiceRollBufferCompareAscending(b, a);
+}
+
+/*************************************/
+#pragma mark - Keep modifier support
+/*************************************/
+
+// Roll buffers whose values span no more than this many distinct integers are
+// ordered for the ‘keep’ modifiers by counting, using a histogram on the stack.
+#define SA_DICE_ROLL_BUFFER_STACK_HISTOGRAM_SIZE	256
+
+// Orders the given values for a ‘keep’ modifier by counting how many times
+// each value occurs (O(count + range) time). The values must all lie in
+// [minValue, minValue + range). Returns the sum of the kept values.
+static NSInteger SA_DiceRollBufferKeepByCounting(const NSInteger *values,
+												 NSUInteger count,
+												 NSInteger minValue,
+												 NSUInteger range,
+												 NSUInteger keepCount,
+												 BOOL keepHighest,
+												 NSInteger *output) {
+	NSUInteger stackHistogram[SA_DICE_ROLL_BUFFER_STACK_HISTOGRAM_SIZE];
+	NSUInteger *histogram;
+	if (range <= SA_DICE_ROLL_BUFFER_STACK_HISTOGRAM_SIZE) {
+		histogram = stackHistogram;
+		memset(histogram, 0, range * sizeof(NSUInteger));
+	} else {
+		histogram = calloc(range, sizeof(NSUInteger));
+	}
+
+	for (NSUInteger i = 0; i < count; i++)
+		histogram[(NSUInteger) values[i] - (NSUInteger) minValue]++;
+
+	NSInteger keptSum = SA_DiceRollBufferOrderCountsForKeeping(histogram, minValue, range, keepCount, keepHighest, output);
+
+	if (histogram != stackHistogram)
+		free(histogram);
+
+	return keptSum;
+}
+
+// Rearranges the given values so that the value at index <nth> is the one
+// that would be there if the values were sorted in ascending order, with no
+// greater value before it and no lesser value after it (Hoare’s selection
+// algorithm; O(count) expected time).
+static void SA_DiceRollBufferSelect(NSInteger *values,
+									NSUInteger count,
+									NSUInteger nth) {
+	NSInteger left = 0;
+	NSInteger right = (NSInteger) count - 1;
+	NSInteger k = (NSInteger) nth;
+	while (left < right) {
+		NSInteger pivot = values[k];
+		NSInteger i = left;
+		NSInteger j = right;
+		do {
+			while (values[i] < pivot)
+				i++;
+			while (pivot < values[j])
+				j--;
+			if (i <= j) {
+				NSInteger swap = values[i];
+				values[i] = values[j];
+				values[j] = swap;
+				i++;
+				j--;
+			}
+		} while (i <= j);
+
+		if (j < k)
+			left = i;
+		if (k < i)
+			right = j;
+	}
+}
+
+// Orders the given values for a ‘keep’ modifier by selection: the kept values
+// are partitioned from the discarded ones (and summed) in linear time; each
+// part is then sorted separately, for display. Returns the sum of the kept
+// values.
+static NSInteger SA_DiceRollBufferKeepBySelection(const NSInteger *values,
+												  NSUInteger count,
+												  NSUInteger keepCount,
+												  BOOL keepHighest,
+												  NSInteger *output) {
+	memcpy(output, values, count * sizeof(NSInteger));
+
+	// After selection, the lowest <boundary> values are at the front of the
+	// buffer, and the rest after them.
+	NSUInteger boundary = keepHighest ? (count - keepCount) : keepCount;
+	if (boundary > 0 && boundary < count)
+		SA_DiceRollBufferSelect(output, count, boundary);
+
+	NSInteger keptSum = 0;
+	NSUInteger keptStart = keepHighest ? boundary : 0;
+	for (NSUInteger i = keptStart; i < keptStart + keepCount; i++)
+		keptSum += output[i];
+
+	qsort(output, boundary, sizeof(NSInteger), SA_DiceRollBufferCompareAscending);
+	qsort(output + boundary, count - boundary, sizeof(NSInteger), SA_DiceRollBufferCompareAscending);
+
+	// The buffer is now in ascending order, with the kept values first (if
+	// keeping the lowest); if keeping the highest, reversing it puts the kept
+	// values first, in descending order.
+	if (keepHighest && count > 1) {
+		for (NSUInteger i = 0, j = count - 1; i < j; i++, j--) {
+			NSInteger swap = output[i];
+			output[i] = output[j];
+			output[j] = swap;
+		}
+	}
+
+	return keptSum;
+}
+
+NSInteger SA_DiceRollBufferOrderCountsForKeeping(const NSUInteger *counts,
+												 NSInteger lowestValue,
+												 NSUInteger range,
+												 NSUInteger keepCount,
+												 BOOL keepHighest,
+												 NSInteger *output) {
+	NSInteger keptSum = 0;
+	NSUInteger position = 0;
+	for (NSUInteger i = 0; i < range; i++) {
+		NSUInteger bucket = keepHighest ? (range - 1 - i) : i;
+		NSInteger value = (NSInteger) ((NSUInteger) lowestValue + bucket);
+		for (NSUInteger occurrences = counts[bucket]; occurrences > 0; occurrences--) {
+			if (position < keepCount)
+				keptSum += value;
+			output[position++] = value;
+		}
+	}
+
+	return keptSum;
+}
+
+NSInteger SA_DiceRollBufferOrderForKeeping(const NSInteger *values,
+										   NSUInteger count,
+										   NSUInteger keepCount,
+										   BOOL keepHighest,
+										   NSInteger *output) {
+	if (count == 0)
+		return 0;
+
+	NSInteger minValue = NSIntegerMax;
+	NSInteger maxValue = NSIntegerMin;
+	for (NSUInteger i = 0; i < count; i++) {
+		if (values[i] < minValue)
+			minValue = values[i];
+		if (values[i] > maxValue)
+			maxValue = values[i];
+	}
+
+	// Die rolls usually span a small range of values (e.g., at most six
+	// distinct values for any number of d6s); when they do, counting them is
+	// the fastest way to order them. Otherwise, we fall back on selection.
+	NSUInteger span = (NSUInteger) maxValue - (NSUInteger) minValue;
+	if (   span < SA_DICE_ROLL_BUFFER_STACK_HISTOGRAM_SIZE
+		|| span < count) {
+		return SA_DiceRollBufferKeepByCounting(values, count, minValue, span + 1, keepCount, keepHighest, output);
+	} else {
+		return SA_DiceRollBufferKeepBySelection(values, count, keepCount, keepHighest, output);
+	}
+}
+
+/*****************************************************/
+#pragma mark - SA_DiceRollBuffer class implementation
+/*****************************************************/
+
+@implementation SA_DiceRollBuffer {
+	// For a buffer in compact form, the values are generated when first
+	// asked for (by whichever thread asks first).
+	_Atomic(NSInteger *) _values;
+	NSUInteger _count;
+	NSInteger _sum;
+
+	SA_DiceExplodedDie *_explodedDice;
+	NSUInteger _explodedDieCount;
+	NSUInteger _explodedDieSize;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(const NSInteger *) values {
+	NSInteger *values = atomic_load_explicit(&_values, memory_order_acquire);
+	if (   values != NULL
+		|| _explodedDice == NULL)
+		return values;
+
+	values = malloc(MAX(_count, 1) * sizeof(NSInteger));
+	NSUInteger position = 0;
+	for (NSUInteger i = 0; i < _explodedDieCount; i++) {
+		for (NSUInteger j = 0; j < _explodedDice[i].explosionCount; j++)
+			values[position++] = (NSInteger) _explodedDieSize;
+		values[position++] = _explodedDice[i].finalRoll;
+	}
+
+	// Another thread may have gotten there first.
+	NSInteger *expected = NULL;
+	if (!atomic_compare_exchange_strong_explicit(&_values, &expected, values, memory_order_acq_rel, memory_order_acquire)) {
+		free(values);
+		values = expected;
+	}
+
+	return values;
+}
+
+-(NSInteger) sum {
+	return _sum;
+}
+
+-(const SA_DiceExplodedDie *) explodedDice {
+	return _explodedDice;
+}
+
+-(NSUInteger) explodedDieCount {
+	return _explodedDieCount;
+}
+
+-(NSUInteger) explodedDieSize {
+	return _explodedDieSize;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initByTakingValues:NULL
+							  count:0
+								sum:0];
+}
+
+-(instancetype) initWithValues:(const NSInteger *)values
+						 count:(NSUInteger)count {
+	NSInteger *valuesCopy = malloc(count * sizeof(NSInteger));
+	NSInteger sum = 0;
+	for (NSUInteger i = 0; i < count; i++) {
+		valuesCopy[i] = values[i];
+		sum += values[i];
+	}
+
+	return [self initByTakingValues:valuesCopy
+							  count:count
+								sum:sum];
+}
+
+-(instancetype) initByTakingValues:(NSInteger *)values
+							 count:(NSUInteger)count
+							   sum:(NSInteger)sum {
+	if (!(self = [super init]))
+		return nil;
+
+	atomic_init(&_values, values);
+	_count = count;
+	_sum = sum;
+
+	return self;
+}
+
+-(instancetype) initWithExplodedDice:(const SA_DiceExplodedDie *)dice
+							   count:(NSUInteger)dieCount
+							 dieSize:(NSUInteger)dieSize {
+	NSUInteger count = dieCount;
+	NSInteger sum = 0;
+	for (NSUInteger i = 0; i < dieCount; i++) {
+		count += dice[i].explosionCount;
+		sum += ((NSInteger) (dice[i].explosionCount * dieSize)) + dice[i].finalRoll;
+	}
+
+	if (!(self = [self initByTakingValues:NULL
+									count:count
+									  sum:sum]))
+		return nil;
+
+	_explodedDice = malloc(MAX(dieCount, 1) * sizeof(SA_DiceExplodedDie));
+	if (dieCount > 0)
+		memcpy(_explodedDice, dice, dieCount * sizeof(SA_DiceExplodedDie));
+	_explodedDieCount = dieCount;
+	_explodedDieSize = dieSize;
+
+	return self;
+}
+
++(instancetype) bufferWithArray:(NSArray <NSNumber *> *)array {
+	if ([array isKindOfClass:[SA_DiceRollBuffer class]])
+		return (SA_DiceRollBuffer *) array;
+
+	NSUInteger count = array.count;
+	NSInteger *values = malloc(count * sizeof(NSInteger));
+	NSInteger sum = 0;
+	for (NSUInteger i = 0; i < count; i++) {
+		values[i] = array[i].integerValue;
+		sum += values[i];
+	}
+
+	return [[SA_DiceRollBuffer alloc] initByTakingValues:values
+												   count:count
+													 sum:sum];
+}
+
+-(void) dealloc {
+	free(atomic_load_explicit(&_values, memory_order_relaxed));
+	free(_explodedDice);
+}
+
+/*****************************************/
+#pragma mark - NSArray primitive methods
+/*****************************************/
+
+-(NSUInteger) count {
+	return _count;
+}
+
+-(NSNumber *) objectAtIndex:(NSUInteger)index {
+	if (index >= _count)
+		[NSException raise:NSRangeException
+					format:@"Index %lu beyond bounds of roll buffer of count %lu", (unsigned long) index, (unsigned long) _count];
+
+	return @(self.values[index]);
+}
+
+/****************************************/
+#pragma mark - NSArray method overrides
+/****************************************/
+
+// Roll buffers are immutable, so a copy is the buffer itself. (NSArray’s own
+// implementation would box every element into a new array.)
+-(id) copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+-(NSArray *) subarrayWithRange:(NSRange)range {
+	if (range.location + range.length > _count)
+		[NSException raise:NSRangeException
+					format:@"Range %@ beyond bounds of roll buffer of count %lu", NSStringFromRange(range), (unsigned long) _count];
+
+	return [[SA_DiceRollBuffer alloc] initWithValues:(self.values + range.location)
+											   count:range.length];
+}
+
+-(NSString *) componentsJoinedByString:(NSString *)separator {
+	if (_count == 0)
+		return @"";
+
+	const NSInteger *values = self.values;
+	const char *separatorUTF8 = separator.UTF8String;
+	NSUInteger separatorLength = strlen(separatorUTF8);
+
+	// Each value takes at most 20 characters (including a minus sign).
+	NSUInteger capacity = (_count * 20) + ((_count - 1) * separatorLength);
+	char *characters = malloc(capacity);
+	NSUInteger length = 0;
+	for (NSUInteger i = 0; i < _count; i++) {
+		if (i > 0) {
+			memcpy(characters + length, separatorUTF8, separatorLength);
+			length += separatorLength;
+		}
+		length += SA_DiceRollBufferWriteInteger(characters + length, values[i]);
+	}
+
+	return [[NSString alloc] initWithBytesNoCopy:characters
+										  length:length
+										encoding:NSUTF8StringEncoding
+									freeWhenDone:YES];
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(NSInteger) valueAtIndex:(NSUInteger)index {
+	return self.values[index];
+}
+
+-(NSInteger) sumOfValuesInRange:(NSRange)range {
+	const NSInteger *values = self.values;
+	NSInteger sum = 0;
+	for (NSUInteger i = range.location; i < range.location + range.length; i++)
+		sum += values[i];
+
+	return sum;
+}
+
+-(SA_DiceRollBuffer *) sortedBufferAscending:(BOOL)ascending {
+	NSInteger *sortedValues = malloc(_count * sizeof(NSInteger));
+	if (_count > 0)
+		memcpy(sortedValues, self.values, _count * sizeof(NSInteger));
+	qsort(sortedValues, _count, sizeof(NSInteger), (ascending
+													? SA_DiceRollBufferCompareAscending
+													: SA_DiceRollBufferCompareDescending));
+
+	return [[SA_DiceRollBuffer alloc] initByTakingValues:sortedValues
+												   count:_count
+													 sum:_sum];
+}
+
+-(SA_DiceRollBuffer *) bufferKeeping:(NSUInteger)keepCount
+							 highest:(BOOL)keepHighest
+							 keptSum:(NSInteger *)keptSum {
+	NSInteger *orderedValues = malloc(_count * sizeof(NSInteger));
+	NSInteger sumOfKeptValues = SA_DiceRollBufferOrderForKeeping(self.values, _count, keepCount, keepHighest, orderedValues);
+
+	if (keptSum != NULL)
+		*keptSum = sumOfKeptValues;
+
+	return [[SA_DiceRollBuffer alloc] initByTakingValues:orderedValues
+												   count:_count
+													 sum:_sum];
+}
+
+@end
@@ -0,0 +1,96 @@
+//
+//  SA_DiceRollHistory.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+@class SA_DiceExpression;
+@class SA_DiceExpressionArchive;
+
+/*
+ SA_DiceRollHistory is an append-only file of archived expressions (see
+ SA_DiceExpressionArchive.h) - e.g., the roll history of one channel, kept
+ for re-displaying rolls, or for “reroll last” commands.
+
+ The file is memory-mapped, and its entries are read straight from the
+ mapping: an entry is an SA_DiceExpressionArchive whose bytes are those of
+ the mapped file (nothing is copied), and whose root result, errors, and
+ roll string may be read without decoding anything else. The expression
+ itself is decoded only when it is asked for (e.g., by SA_DiceFormatter;
+ see -[SA_DiceFormatter stringFromArchive:]). Holding on to thousands of
+ rolls thus costs a few bytes of address space each, rather than a tree of
+ objects each.
+
+ THE FILE FORMAT (VERSION 1)
+
+	8 bytes	“SA_DiceH”
+	4 bytes	the version (1), little-endian
+	4 bytes	reserved (0)
+
+ followed by the entries, each:
+
+	4 bytes	the length of the archive (in bytes), little-endian
+	...		the archive (see SA_DiceExpressionArchive.h)
+
+ Entries are only ever added to the end of the file. When the file is
+ opened, its entries are indexed (by reading the length of each, and nothing
+ else); an incomplete entry at the end (e.g., one that was being written
+ when the process was killed) is removed.
+
+ A history may be used from any number of threads at once (and its entries
+ remain valid after the history is deallocated); but a file should be
+ opened by only one history (in only one process) at a time.
+ */
+
+/************************************************/
+#pragma mark SA_DiceRollHistory class declaration
+/************************************************/
+
+@interface SA_DiceRollHistory : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+@property (readonly) NSString *path;
+
+// The number of entries.
+@property (readonly) NSUInteger entryCount;
+
+// The most recently added entry (or nil, if there are none).
+@property (readonly) SA_DiceExpressionArchive *lastEntry;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Opens the history file at the given path, creating it if it does not
+// exist. Returns nil if the file cannot be opened or created, or if it is
+// not a history file (of a known version).
+-(instancetype) initWithPath:(NSString *)path NS_DESIGNATED_INITIALIZER;
+
++(instancetype) historyWithPath:(NSString *)path;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Archives the given expression, and adds it to the end of the history.
+// Returns the index of the new entry, or NSNotFound if the expression is nil,
+// or if it could not be written.
+-(NSUInteger) appendExpression:(SA_DiceExpression *)expression;
+
+// As above, but for an expression that has already been archived.
+-(NSUInteger) appendArchive:(SA_DiceExpressionArchive *)archive;
+
+// Returns the entry at the given index (or nil, if there is no such entry).
+// Each call returns a new archive (but copies nothing).
+-(SA_DiceExpressionArchive *) entryAtIndex:(NSUInteger)index;
+
+// Flushes the entries added so far to permanent storage (see fsync(2)).
+// Returns NO if that fails.
+-(BOOL) synchronize;
+
+@end
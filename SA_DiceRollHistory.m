@@ -0,0 +1,351 @@
+//
+//  SA_DiceRollHistory.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceRollHistory.h"
+
+#import "SA_DiceExpressionArchive.h"
+
+#import <errno.h>
+#import <fcntl.h>
+#import <pthread.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+#define SA_DICE_ROLL_HISTORY_VERSION		1
+#define SA_DICE_ROLL_HISTORY_HEADER_SIZE	16
+
+static const char SA_DiceRollHistoryMagic[8] = { 'S', 'A', '_', 'D', 'i', 'c', 'e', 'H' };
+
+// Mappings are made larger than the file (to the next power of two, and no
+// smaller than this), so that most entries added later are already mapped.
+// (Only the part of a mapping that is within the file is ever read.)
+#define SA_DICE_ROLL_HISTORY_MIN_MAPPING_SIZE	(64 * 1024)
+
+// The location and length of the archive of one entry.
+typedef struct {
+	uint64_t location;
+	uint32_t length;
+} SA_DiceRollHistoryEntry;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+static uint32_t SA_DiceRollHistoryReadUInt32(const uint8_t *bytes) {
+	return ((uint32_t) bytes[0]
+			| ((uint32_t) bytes[1] << 8)
+			| ((uint32_t) bytes[2] << 16)
+			| ((uint32_t) bytes[3] << 24));
+}
+
+static void SA_DiceRollHistoryWriteUInt32(uint8_t *bytes,
+										  uint32_t value) {
+	bytes[0] = (uint8_t) value;
+	bytes[1] = (uint8_t) (value >> 8);
+	bytes[2] = (uint8_t) (value >> 16);
+	bytes[3] = (uint8_t) (value >> 24);
+}
+
+// Writes all of the given bytes at the given offset (retrying after partial
+// writes and interruptions). Returns NO if that fails.
+static BOOL SA_DiceRollHistoryWrite(int fileDescriptor,
+									const uint8_t *bytes,
+									size_t length,
+									off_t offset) {
+	while (length > 0) {
+		ssize_t written = pwrite(fileDescriptor, bytes, length, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return NO;
+		}
+
+		bytes += written;
+		length -= (size_t) written;
+		offset += written;
+	}
+
+	return YES;
+}
+
+/*********************************************************/
+#pragma mark - SA_DiceRollHistoryMapping class declaration
+/*********************************************************/
+
+// A read-only mapping of (a prefix of) a history file, which is unmapped when
+// the last entry read from it is deallocated.
+@interface SA_DiceRollHistoryMapping : NSObject {
+	@public
+	const uint8_t *_bytes;
+	size_t _length;
+}
+
+-(instancetype) initWithFileDescriptor:(int)fileDescriptor
+								length:(size_t)length;
+
+@end
+
+@implementation SA_DiceRollHistoryMapping
+
+-(instancetype) initWithFileDescriptor:(int)fileDescriptor
+								length:(size_t)length {
+	if (!(self = [super init]))
+		return nil;
+
+	void *bytes = mmap(NULL, length, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+	if (bytes == MAP_FAILED)
+		return nil;
+
+	_bytes = bytes;
+	_length = length;
+
+	return self;
+}
+
+-(void) dealloc {
+	munmap((void *) _bytes, _length);
+}
+
+@end
+
+/*****************************************************/
+#pragma mark - SA_DiceRollHistory class implementation
+/*****************************************************/
+
+@implementation SA_DiceRollHistory {
+	// Guards everything below.
+	pthread_mutex_t _lock;
+
+	int _fileDescriptor;
+	uint64_t _fileSize;
+
+	SA_DiceRollHistoryMapping *_mapping;
+
+	SA_DiceRollHistoryEntry *_entries;
+	NSUInteger _entryCount;
+	NSUInteger _entryCapacity;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(NSUInteger) entryCount {
+	pthread_mutex_lock(&_lock);
+	NSUInteger entryCount = _entryCount;
+	pthread_mutex_unlock(&_lock);
+
+	return entryCount;
+}
+
+-(SA_DiceExpressionArchive *) lastEntry {
+	pthread_mutex_lock(&_lock);
+	SA_DiceExpressionArchive *lastEntry = (_entryCount > 0) ? [self entryAtIndexInMapping:(_entryCount - 1)] : nil;
+	pthread_mutex_unlock(&_lock);
+
+	return lastEntry;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithPath:nil];
+}
+
+-(instancetype) initWithPath:(NSString *)path {
+	if (!(self = [super init]))
+		return nil;
+
+	_fileDescriptor = -1;
+	pthread_mutex_init(&_lock, NULL);
+
+	if (path == nil)
+		return nil;
+	_path = [path copy];
+
+	_fileDescriptor = open(_path.fileSystemRepresentation, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (_fileDescriptor < 0)
+		return nil;
+
+	struct stat status;
+	if (fstat(_fileDescriptor, &status) != 0)
+		return nil;
+	_fileSize = (uint64_t) status.st_size;
+
+	// A new (empty) file gets a header; an existing one must have one.
+	if (_fileSize == 0) {
+		uint8_t header[SA_DICE_ROLL_HISTORY_HEADER_SIZE] = { 0 };
+		memcpy(header, SA_DiceRollHistoryMagic, sizeof(SA_DiceRollHistoryMagic));
+		SA_DiceRollHistoryWriteUInt32(header + 8, SA_DICE_ROLL_HISTORY_VERSION);
+		if (!SA_DiceRollHistoryWrite(_fileDescriptor, header, sizeof(header), 0))
+			return nil;
+		_fileSize = sizeof(header);
+	}
+	if (   _fileSize < SA_DICE_ROLL_HISTORY_HEADER_SIZE
+		|| ![self mapFile])
+		return nil;
+
+	if (   memcmp(_mapping->_bytes, SA_DiceRollHistoryMagic, sizeof(SA_DiceRollHistoryMagic)) != 0
+		|| SA_DiceRollHistoryReadUInt32(_mapping->_bytes + 8) != SA_DICE_ROLL_HISTORY_VERSION)
+		return nil;
+
+	// Index the entries (reading only their lengths).
+	uint64_t location = SA_DICE_ROLL_HISTORY_HEADER_SIZE;
+	while (location + 4 <= _fileSize) {
+		uint32_t length = SA_DiceRollHistoryReadUInt32(_mapping->_bytes + location);
+		if (location + 4 + length > _fileSize)
+			break;
+
+		[self addEntryAtLocation:(location + 4)
+						  length:length];
+		location += 4 + length;
+	}
+
+	// Remove an incomplete entry at the end, if there is one.
+	if (location != _fileSize) {
+		if (ftruncate(_fileDescriptor, (off_t) location) != 0)
+			return nil;
+		_fileSize = location;
+	}
+
+	return self;
+}
+
++(instancetype) historyWithPath:(NSString *)path {
+	return [[SA_DiceRollHistory alloc] initWithPath:path];
+}
+
+-(void) dealloc {
+	if (_fileDescriptor >= 0)
+		close(_fileDescriptor);
+	free(_entries);
+	pthread_mutex_destroy(&_lock);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(NSUInteger) appendExpression:(SA_DiceExpression *)expression {
+	return [self appendArchive:[SA_DiceExpressionArchive archiveWithExpression:expression]];
+}
+
+-(NSUInteger) appendArchive:(SA_DiceExpressionArchive *)archive {
+	NSData *data = archive.data;
+	if (   data == nil
+		|| data.length > UINT32_MAX)
+		return NSNotFound;
+
+	// The length and the archive are written together, so that an entry is
+	// never left without its archive (except by a failed write, which is
+	// undone).
+	size_t length = 4 + data.length;
+	uint8_t stackBytes[512];
+	uint8_t *bytes = (length <= sizeof(stackBytes)) ? stackBytes : malloc(length);
+	SA_DiceRollHistoryWriteUInt32(bytes, (uint32_t) data.length);
+	memcpy(bytes + 4, data.bytes, data.length);
+
+	pthread_mutex_lock(&_lock);
+
+	NSUInteger index = NSNotFound;
+	if (SA_DiceRollHistoryWrite(_fileDescriptor, bytes, length, (off_t) _fileSize)) {
+		index = [self addEntryAtLocation:(_fileSize + 4)
+								  length:(uint32_t) data.length];
+		_fileSize += length;
+	} else {
+		ftruncate(_fileDescriptor, (off_t) _fileSize);
+	}
+
+	pthread_mutex_unlock(&_lock);
+
+	if (bytes != stackBytes)
+		free(bytes);
+
+	return index;
+}
+
+-(SA_DiceExpressionArchive *) entryAtIndex:(NSUInteger)index {
+	pthread_mutex_lock(&_lock);
+	SA_DiceExpressionArchive *entry = (index < _entryCount) ? [self entryAtIndexInMapping:index] : nil;
+	pthread_mutex_unlock(&_lock);
+
+	return entry;
+}
+
+-(BOOL) synchronize {
+	pthread_mutex_lock(&_lock);
+	BOOL synchronized = (fsync(_fileDescriptor) == 0);
+	pthread_mutex_unlock(&_lock);
+
+	return synchronized;
+}
+
+/****************************/
+#pragma mark - Helper methods
+/****************************/
+
+// All helper methods must be called with the lock held.
+
+// Maps the file anew (with room to grow; see above). The old mapping, if any,
+// is unmapped once no entries read from it remain. Returns NO if the file
+// cannot be mapped.
+-(BOOL) mapFile {
+	size_t length = SA_DICE_ROLL_HISTORY_MIN_MAPPING_SIZE;
+	while (length < _fileSize)
+		length *= 2;
+
+	SA_DiceRollHistoryMapping *mapping = [[SA_DiceRollHistoryMapping alloc] initWithFileDescriptor:_fileDescriptor
+																						    length:length];
+	if (mapping == nil)
+		return NO;
+
+	_mapping = mapping;
+	return YES;
+}
+
+// Returns the index of the new entry.
+-(NSUInteger) addEntryAtLocation:(uint64_t)location
+						  length:(uint32_t)length {
+	if (_entryCount == _entryCapacity) {
+		_entryCapacity = (_entryCapacity > 0) ? (_entryCapacity * 2) : 64;
+		_entries = realloc(_entries, _entryCapacity * sizeof(SA_DiceRollHistoryEntry));
+	}
+	_entries[_entryCount] = (SA_DiceRollHistoryEntry) {
+		.location = location,
+		.length = length
+	};
+
+	return _entryCount++;
+}
+
+// Returns an archive whose bytes are those of the given entry in the mapping
+// (mapping the file anew, if the entry is past the end of the mapping); the
+// archive keeps the mapping alive.
+-(SA_DiceExpressionArchive *) entryAtIndexInMapping:(NSUInteger)index {
+	SA_DiceRollHistoryEntry entry = _entries[index];
+	if (   entry.location + entry.length > _mapping->_length
+		&& ![self mapFile])
+		return nil;
+
+	SA_DiceRollHistoryMapping *mapping = _mapping;
+	NSData *data = [[NSData alloc] initWithBytesNoCopy:(void *) (mapping->_bytes + entry.location)
+												length:entry.length
+										   deallocator:^(void *bytes, NSUInteger length) {
+		// Only here to keep the mapping alive as long as the data.
+		(void) mapping;
+	}];
+
+	return [[SA_DiceExpressionArchive alloc] initWithData:data];
+}
+
+@end
@@ -0,0 +1,77 @@
+//
+//  SA_DiceRollKernels.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceRNG.h"
+
+/*
+ The functions below roll many dice at once, and, in the same pass, add up
+ the rolls, find the lowest and highest, and (optionally) count how many
+ times each face came up.
+
+ Random words are generated in batches (see SA_DiceRNGFillWords()), and then
+ mapped to rolls several at a time, with vector instructions (AVX2 or
+ SSE4.1, chosen at run time according to what the processor supports; or, on
+ other processors, a scalar loop). The mapping is the same as that of
+ SA_DiceRNGUniform() (Lemire’s method, using the high 32 bits of each word):
+ whether a word is rejected depends on that word alone, so rejected words are
+ simply dropped from the batch, and each batch is only as large as the number
+ of dice still to be rolled. The kernels thus consume exactly the same words,
+ and produce exactly the same rolls, as rolling the dice one at a time with
+ SA_DiceRNGUniform() - whichever kernel is used.
+
+ All functions are thread-safe (though the given generator must, as always,
+ be used by one thread at a time).
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef NS_ENUM(NSUInteger, SA_DiceRollKernel) {
+	// The best kernel the processor supports.
+	SA_DiceRollKernel_AUTOMATIC,
+
+	SA_DiceRollKernel_SCALAR,
+	SA_DiceRollKernel_SSE41,
+	SA_DiceRollKernel_AVX2
+};
+
+// The sum, lowest, and highest of a set of rolls. (For no rolls, the sum is
+// 0, the lowest is NSIntegerMax, and the highest is NSIntegerMin.)
+typedef struct {
+	NSInteger sum;
+	NSInteger lowest;
+	NSInteger highest;
+} SA_DiceRollSummary;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Rolls the given number of dice with the given number of faces (at least 1),
+// which are labeled with consecutive integers from ‘lowestFace’ up (e.g., 1
+// through 6 for a d6, or −1 through 1 for a Fudge die), writing the rolls into
+// the given buffer, which must have room for at least ‘count’ values. If
+// ‘faceCounts’ is not NULL, it must have room for ‘faceCount’ counts, and the
+// number of times each face came up is added to the count at its index
+// (counting from the lowest face). Returns the summary of the rolls, which
+// must be such that their sum cannot overflow.
+SA_DiceRollSummary SA_DiceRollKernelRollDice(SA_DiceRNG *rng,
+											 uint32_t faceCount,
+											 NSInteger lowestFace,
+											 NSUInteger count,
+											 NSInteger *buffer,
+											 NSUInteger *faceCounts);
+
+// Returns the kernel that SA_DiceRollKernelRollDice() uses.
+SA_DiceRollKernel SA_DiceRollKernelCurrent(void);
+
+// Makes SA_DiceRollKernelRollDice() use the given kernel (for all threads),
+// if the processor supports it (e.g., to compare kernels, in benchmarks).
+// Returns NO (and changes nothing) if it does not.
+BOOL SA_DiceRollKernelSelect(SA_DiceRollKernel kernel);
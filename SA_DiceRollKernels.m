@@ -0,0 +1,308 @@
+//
+//  SA_DiceRollKernels.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceRollKernels.h"
+
+#import <stdatomic.h>
+
+#if defined(__x86_64__) && (defined(__clang__) || defined(__GNUC__))
+#define SA_DICE_ROLL_KERNELS_X86	1
+#import <immintrin.h>
+#endif
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+// The largest number of words generated at once (into a buffer on the stack).
+#define BATCH_SIZE	256
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+// How words are mapped to rolls. A word whose product with the face count
+// has a low half less than the threshold is rejected (see SA_DiceRNG.m).
+typedef struct {
+	uint32_t faceCount;
+	uint32_t threshold;
+	NSInteger lowestFace;
+	NSUInteger *faceCounts;
+} SA_DiceRollKernelMapping;
+
+// The running totals of the rolls, each counted from the lowest face (i.e.,
+// as offsets in [0, faceCount)).
+typedef struct {
+	uint64_t sum;
+	uint32_t lowest;
+	uint32_t highest;
+} SA_DiceRollKernelTotals;
+
+// Maps the given words to rolls, writing those that are not rejected into
+// the output buffer (in order), and adding them to the totals (and the face
+// counts). Returns the number of rolls written.
+typedef NSUInteger (*SA_DiceRollKernelFunction)(const uint64_t *words,
+												NSUInteger count,
+												const SA_DiceRollKernelMapping *mapping,
+												NSInteger *output,
+												SA_DiceRollKernelTotals *totals);
+
+static _Atomic(SA_DiceRollKernel) SA_DiceRollKernelSelected = SA_DiceRollKernel_AUTOMATIC;
+
+/***************************/
+#pragma mark - Scalar kernel
+/***************************/
+
+static NSUInteger SA_DiceRollKernelMapScalar(const uint64_t *words,
+											 NSUInteger count,
+											 const SA_DiceRollKernelMapping *mapping,
+											 NSInteger *output,
+											 SA_DiceRollKernelTotals *totals) {
+	// (The mapping and totals are copied into locals, so that the compiler
+	// need not assume that writing the output may change them.)
+	const uint64_t faceCount = mapping->faceCount;
+	const uint32_t threshold = mapping->threshold;
+	const NSInteger lowestFace = mapping->lowestFace;
+	NSUInteger *faceCounts = mapping->faceCounts;
+
+	uint64_t sum = totals->sum;
+	uint32_t lowest = totals->lowest;
+	uint32_t highest = totals->highest;
+
+	NSUInteger accepted = 0;
+	for (NSUInteger i = 0; i < count; i++) {
+		uint64_t product = (words[i] >> 32) * faceCount;
+		if ((uint32_t) product < threshold)
+			continue;
+
+		uint32_t offset = (uint32_t) (product >> 32);
+		output[accepted++] = (NSInteger) offset + lowestFace;
+
+		sum += offset;
+		lowest = MIN(lowest, offset);
+		highest = MAX(highest, offset);
+		if (faceCounts != NULL)
+			faceCounts[offset]++;
+	}
+
+	totals->sum = sum;
+	totals->lowest = lowest;
+	totals->highest = highest;
+
+	return accepted;
+}
+
+#if SA_DICE_ROLL_KERNELS_X86
+
+/****************************/
+#pragma mark - Vector kernels
+/****************************/
+
+/*
+ Each word is in a 64-bit lane: its high half is shifted down and multiplied
+ by the face count (a 32×32-bit product, as in SA_DiceRNGUniform()); the low
+ half of the product decides rejection, and the high half is the roll. Both
+ halves are less than 2^32, so the rolls are kept in 64-bit lanes whose high
+ halves are 0, on which unsigned 32-bit minimum and maximum give the right
+ answers. Rejections are rare (and impossible for powers of two); a group of
+ words with any rejected word in it is mapped by the scalar kernel instead.
+ */
+
+__attribute__((target("avx2")))
+static NSUInteger SA_DiceRollKernelMapAVX2(const uint64_t *words,
+										   NSUInteger count,
+										   const SA_DiceRollKernelMapping *mapping,
+										   NSInteger *output,
+										   SA_DiceRollKernelTotals *totals) {
+	const __m256i faceCountVector = _mm256_set1_epi64x((long long) mapping->faceCount);
+	const __m256i thresholdVector = _mm256_set1_epi64x((long long) mapping->threshold);
+	const __m256i lowHalfMask = _mm256_set1_epi64x(0xFFFFFFFFLL);
+	const __m256i lowestFaceVector = _mm256_set1_epi64x((long long) mapping->lowestFace);
+
+	__m256i sumVector = _mm256_setzero_si256();
+	__m256i lowestVector = lowHalfMask;
+	__m256i highestVector = _mm256_setzero_si256();
+
+	NSUInteger accepted = 0;
+	NSUInteger i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256i wordVector = _mm256_loadu_si256((const __m256i *) (words + i));
+		__m256i products = _mm256_mul_epu32(_mm256_srli_epi64(wordVector, 32), faceCountVector);
+		__m256i lowHalves = _mm256_and_si256(products, lowHalfMask);
+		__m256i acceptedMask = _mm256_cmpeq_epi32(_mm256_max_epu32(lowHalves, thresholdVector), lowHalves);
+		if (_mm256_movemask_epi8(acceptedMask) != -1) {
+			accepted += SA_DiceRollKernelMapScalar(words + i, 4, mapping, output + accepted, totals);
+			continue;
+		}
+
+		__m256i offsets = _mm256_srli_epi64(products, 32);
+		_mm256_storeu_si256((__m256i *) (output + accepted), _mm256_add_epi64(offsets, lowestFaceVector));
+		sumVector = _mm256_add_epi64(sumVector, offsets);
+		lowestVector = _mm256_min_epu32(lowestVector, offsets);
+		highestVector = _mm256_max_epu32(highestVector, offsets);
+		if (mapping->faceCounts != NULL) {
+			for (NSUInteger j = 0; j < 4; j++)
+				mapping->faceCounts[output[accepted + j] - mapping->lowestFace]++;
+		}
+		accepted += 4;
+	}
+
+	uint64_t sums[4], lowests[4], highests[4];
+	_mm256_storeu_si256((__m256i *) sums, sumVector);
+	_mm256_storeu_si256((__m256i *) lowests, lowestVector);
+	_mm256_storeu_si256((__m256i *) highests, highestVector);
+	for (NSUInteger j = 0; j < 4; j++) {
+		totals->sum += sums[j];
+		totals->lowest = MIN(totals->lowest, (uint32_t) lowests[j]);
+		totals->highest = MAX(totals->highest, (uint32_t) highests[j]);
+	}
+
+	return accepted + SA_DiceRollKernelMapScalar(words + i, count - i, mapping, output + accepted, totals);
+}
+
+__attribute__((target("sse4.1")))
+static NSUInteger SA_DiceRollKernelMapSSE41(const uint64_t *words,
+											NSUInteger count,
+											const SA_DiceRollKernelMapping *mapping,
+											NSInteger *output,
+											SA_DiceRollKernelTotals *totals) {
+	const __m128i faceCountVector = _mm_set1_epi64x((long long) mapping->faceCount);
+	const __m128i thresholdVector = _mm_set1_epi64x((long long) mapping->threshold);
+	const __m128i lowHalfMask = _mm_set1_epi64x(0xFFFFFFFFLL);
+	const __m128i lowestFaceVector = _mm_set1_epi64x((long long) mapping->lowestFace);
+
+	__m128i sumVector = _mm_setzero_si128();
+	__m128i lowestVector = lowHalfMask;
+	__m128i highestVector = _mm_setzero_si128();
+
+	NSUInteger accepted = 0;
+	NSUInteger i = 0;
+	for (; i + 2 <= count; i += 2) {
+		__m128i wordVector = _mm_loadu_si128((const __m128i *) (words + i));
+		__m128i products = _mm_mul_epu32(_mm_srli_epi64(wordVector, 32), faceCountVector);
+		__m128i lowHalves = _mm_and_si128(products, lowHalfMask);
+		__m128i acceptedMask = _mm_cmpeq_epi32(_mm_max_epu32(lowHalves, thresholdVector), lowHalves);
+		if (_mm_movemask_epi8(acceptedMask) != 0xFFFF) {
+			accepted += SA_DiceRollKernelMapScalar(words + i, 2, mapping, output + accepted, totals);
+			continue;
+		}
+
+		__m128i offsets = _mm_srli_epi64(products, 32);
+		_mm_storeu_si128((__m128i *) (output + accepted), _mm_add_epi64(offsets, lowestFaceVector));
+		sumVector = _mm_add_epi64(sumVector, offsets);
+		lowestVector = _mm_min_epu32(lowestVector, offsets);
+		highestVector = _mm_max_epu32(highestVector, offsets);
+		if (mapping->faceCounts != NULL) {
+			mapping->faceCounts[output[accepted] - mapping->lowestFace]++;
+			mapping->faceCounts[output[accepted + 1] - mapping->lowestFace]++;
+		}
+		accepted += 2;
+	}
+
+	uint64_t sums[2], lowests[2], highests[2];
+	_mm_storeu_si128((__m128i *) sums, sumVector);
+	_mm_storeu_si128((__m128i *) lowests, lowestVector);
+	_mm_storeu_si128((__m128i *) highests, highestVector);
+	for (NSUInteger j = 0; j < 2; j++) {
+		totals->sum += sums[j];
+		totals->lowest = MIN(totals->lowest, (uint32_t) lowests[j]);
+		totals->highest = MAX(totals->highest, (uint32_t) highests[j]);
+	}
+
+	return accepted + SA_DiceRollKernelMapScalar(words + i, count - i, mapping, output + accepted, totals);
+}
+
+#endif
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+static BOOL SA_DiceRollKernelIsSupported(SA_DiceRollKernel kernel) {
+	switch (kernel) {
+		case SA_DiceRollKernel_AUTOMATIC:
+		case SA_DiceRollKernel_SCALAR:
+			return YES;
+#if SA_DICE_ROLL_KERNELS_X86
+		case SA_DiceRollKernel_SSE41:
+			return (__builtin_cpu_supports("sse4.1") != 0);
+		case SA_DiceRollKernel_AVX2:
+			return (__builtin_cpu_supports("avx2") != 0);
+#endif
+		default:
+			return NO;
+	}
+}
+
+static SA_DiceRollKernelFunction SA_DiceRollKernelFunctionFor(SA_DiceRollKernel kernel) {
+	switch (kernel) {
+#if SA_DICE_ROLL_KERNELS_X86
+		case SA_DiceRollKernel_SSE41:
+			return SA_DiceRollKernelMapSSE41;
+		case SA_DiceRollKernel_AVX2:
+			return SA_DiceRollKernelMapAVX2;
+#endif
+		default:
+			return SA_DiceRollKernelMapScalar;
+	}
+}
+
+SA_DiceRollSummary SA_DiceRollKernelRollDice(SA_DiceRNG *rng,
+											 uint32_t faceCount,
+											 NSInteger lowestFace,
+											 NSUInteger count,
+											 NSInteger *buffer,
+											 NSUInteger *faceCounts) {
+	if (count == 0)
+		return (SA_DiceRollSummary) { 0, NSIntegerMax, NSIntegerMin };
+
+	SA_DiceRollKernelMapping mapping = {
+		.faceCount = faceCount,
+		.threshold = ((uint32_t) -faceCount) % faceCount,
+		.lowestFace = lowestFace,
+		.faceCounts = faceCounts
+	};
+	SA_DiceRollKernelTotals totals = { 0, UINT32_MAX, 0 };
+	SA_DiceRollKernelFunction map = SA_DiceRollKernelFunctionFor(SA_DiceRollKernelCurrent());
+
+	// Each batch has one word for each die still to be rolled; so no more
+	// words are generated than rolling the dice one at a time would use.
+	uint64_t words[BATCH_SIZE];
+	NSUInteger rolledCount = 0;
+	while (rolledCount < count) {
+		NSUInteger batchSize = MIN(count - rolledCount, BATCH_SIZE);
+		SA_DiceRNGFillWords(rng, batchSize, words);
+		rolledCount += map(words, batchSize, &mapping, buffer + rolledCount, &totals);
+	}
+
+	return (SA_DiceRollSummary) {
+		.sum = (NSInteger) totals.sum + ((NSInteger) count * lowestFace),
+		.lowest = (NSInteger) totals.lowest + lowestFace,
+		.highest = (NSInteger) totals.highest + lowestFace
+	};
+}
+
+SA_DiceRollKernel SA_DiceRollKernelCurrent(void) {
+	SA_DiceRollKernel kernel = atomic_load_explicit(&SA_DiceRollKernelSelected, memory_order_relaxed);
+	if (kernel != SA_DiceRollKernel_AUTOMATIC)
+		return kernel;
+
+#if SA_DICE_ROLL_KERNELS_X86
+	if (__builtin_cpu_supports("avx2"))
+		return SA_DiceRollKernel_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SA_DiceRollKernel_SSE41;
+#endif
+	return SA_DiceRollKernel_SCALAR;
+}
+
+BOOL SA_DiceRollKernelSelect(SA_DiceRollKernel kernel) {
+	if (!SA_DiceRollKernelIsSupported(kernel))
+		return NO;
+
+	atomic_store_explicit(&SA_DiceRollKernelSelected, kernel, memory_order_relaxed);
+	return YES;
+}
@@ -0,0 +1,180 @@
+//
+//  SA_DiceRollService.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+@class SA_DiceEvaluator;
+@class SA_DiceExpression;
+@class SA_DiceExpressionCache;
+@class SA_DiceFormatter;
+@class SA_DiceMetrics;
+@class SA_DiceParser;
+
+// Called, on one of the service’s worker threads, with the formatted result
+// of a request, and its result tree.
+typedef void (^SA_DiceRollServiceCompletionHandler)(NSString *output, SA_DiceExpression *result);
+
+/*
+ SA_DiceRollService is an asynchronous front end to a parser, an evaluator,
+ and a formatter: roll strings are submitted from any thread, and each is
+ parsed (through an expression cache; see SA_DiceExpressionCache.h),
+ evaluated, and formatted on one of a fixed pool of worker threads, after
+ which its completion handler is called (or its future is fulfilled).
+
+ Submitted requests wait in a queue of fixed capacity. When the queue is
+ full, -submitRollString:completionHandler: (and -futureForRollString:)
+ block until there is room, and -trySubmitRollString:completionHandler:
+ refuses the request; so a burst of requests slows its submitters down,
+ rather than piling up without bound.
+
+ Requests that arrive close together are processed in micro-batches: a
+ worker that finds requests waiting takes as many as are waiting (up to
+ maxBatchSize), waiting for more for no longer than batchWindow after the
+ oldest of them arrived. The batch’s requests are looked up in the cache,
+ grouped so that requests for the same roll string (and, so, the same
+ compiled program, with the same roll commands) run back to back, and
+ evaluated in one pass, with one stack machine and generator (see
+ -[SA_DiceEvaluator resultsOfPrograms:]); only then is each formatted and
+ completed (in the order of submission).
+
+ The queue depth, and the number of requests submitted, refused, and
+ completed, may be read at any time; and, if the service is given metrics
+ (see SA_DiceMetrics.h), it records how long each request waited in the
+ queue, and the depth of the queue as each request was added to it. (The
+ parser, evaluator, and formatter record their own stages, if given
+ metrics.)
+
+ A service may be used from any number of threads at once. Once closed, it
+ accepts no more requests, but completes those it has already accepted, and
+ its worker threads then exit. (The worker threads keep the service alive;
+ so a service is not deallocated until it has been closed.)
+ */
+
+/***********************************************/
+#pragma mark SA_DiceRollFuture class declaration
+/***********************************************/
+
+// The eventual result of a request submitted with -futureForRollString:.
+@interface SA_DiceRollFuture : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// YES once the request has been completed.
+@property (readonly, getter=isDone) BOOL done;
+
+// The formatted result, and the result tree, of the request. Reading either
+// blocks until the request has been completed.
+@property (readonly) NSString *output;
+@property (readonly) SA_DiceExpression *result;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Blocks until the request has been completed.
+-(void) wait;
+
+// Blocks until the request has been completed, or until the given time has
+// passed; returns YES in the former case, NO in the latter.
+-(BOOL) waitWithTimeout:(NSTimeInterval)timeout;
+
+@end
+
+/**************************************************/
+#pragma mark - SA_DiceRollService class declaration
+/**************************************************/
+
+@interface SA_DiceRollService : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+@property (readonly) SA_DiceParser *parser;
+@property (readonly) SA_DiceEvaluator *evaluator;
+@property (readonly) SA_DiceFormatter *formatter;
+@property (readonly) SA_DiceExpressionCache *expressionCache;
+
+// The number of worker threads, and the largest number of requests that may
+// wait in the queue.
+@property (readonly) NSUInteger workerCount;
+@property (readonly) NSUInteger queueCapacity;
+
+// The largest number of requests in one batch, and the longest time a
+// worker waits for a batch to fill up (in seconds), counted from the arrival
+// of the oldest request in the batch. The defaults are 64 and 0.0002 (200
+// microseconds); with a window of 0, workers take whatever is waiting, and
+// do not wait for more.
+@property NSUInteger maxBatchSize;
+@property NSTimeInterval batchWindow;
+
+// If set, the time each request waits in the queue, and the queue depth as
+// each request is added, are recorded in the given metrics. The default is
+// nil.
+@property SA_DiceMetrics *metrics;
+
+// The number of requests waiting in the queue (not counting those being
+// processed).
+@property (readonly) NSUInteger queueDepth;
+
+// The number of requests accepted, refused (by
+// -trySubmitRollString:completionHandler:, or after the service was closed),
+// and completed, so far.
+@property (readonly) uint64_t submittedCount;
+@property (readonly) uint64_t refusedCount;
+@property (readonly) uint64_t completedCount;
+
+// The number of batches processed so far.
+@property (readonly) uint64_t batchCount;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Creates a service with a new parser, evaluator, and formatter (of the
+// default behaviors), the shared expression cache, one worker per active
+// processor core, and a queue capacity of 4096.
+-(instancetype) init;
+
+// The default (0) worker count means one per active processor core. The
+// queue capacity must be at least 1.
+-(instancetype) initWithParser:(SA_DiceParser *)parser
+					 evaluator:(SA_DiceEvaluator *)evaluator
+					 formatter:(SA_DiceFormatter *)formatter
+			   expressionCache:(SA_DiceExpressionCache *)expressionCache
+				   workerCount:(NSUInteger)workerCount
+				 queueCapacity:(NSUInteger)queueCapacity NS_DESIGNATED_INITIALIZER;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Submits the given roll string, blocking while the queue is full. The
+// completion handler is called once the request has been completed. Returns
+// NO (and does not call the handler) if the service has been closed, or if
+// the roll string is nil.
+-(BOOL) submitRollString:(NSString *)dieRollString
+	   completionHandler:(SA_DiceRollServiceCompletionHandler)completionHandler;
+
+// As above, but returns NO at once (refusing the request) if the queue is
+// full.
+-(BOOL) trySubmitRollString:(NSString *)dieRollString
+		  completionHandler:(SA_DiceRollServiceCompletionHandler)completionHandler;
+
+// Submits the given roll string, blocking while the queue is full, and
+// returns a future for its result (or nil, if the service has been closed,
+// or if the roll string is nil).
+-(SA_DiceRollFuture *) futureForRollString:(NSString *)dieRollString;
+
+// Blocks until every request accepted so far has been completed.
+-(void) waitUntilIdle;
+
+// Stops accepting requests (those already accepted are still completed).
+-(void) close;
+
+@end
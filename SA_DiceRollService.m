@@ -0,0 +1,541 @@
+//
+//  SA_DiceRollService.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceRollService.h"
+
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceExpression.h"
+#import "SA_DiceExpressionCache.h"
+#import "SA_DiceFormatter.h"
+#import "SA_DiceMetrics.h"
+#import "SA_DiceParser.h"
+#import "SA_DiceProgram.h"
+
+#import "SA_Utility.h"
+
+#import <pthread.h>
+#import <stdlib.h>
+#import <time.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+#define DEFAULT_QUEUE_CAPACITY		4096
+#define DEFAULT_MAX_BATCH_SIZE		64
+#define DEFAULT_BATCH_WINDOW		0.0002
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+// A request’s position in its batch, and the position (in the batch) of the
+// first request with the same program; sorting by the latter (and then by
+// the former) groups the requests by program, in order of first appearance.
+typedef struct {
+	NSUInteger index;
+	NSUInteger groupIndex;
+} SA_DiceRollRequestOrder;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+static int SA_DiceRollRequestOrderCompare(const void *a,
+										  const void *b) {
+	const SA_DiceRollRequestOrder *left = a;
+	const SA_DiceRollRequestOrder *right = b;
+	if (left->groupIndex != right->groupIndex)
+		return (left->groupIndex < right->groupIndex) ? -1 : 1;
+	if (left->index != right->index)
+		return (left->index < right->index) ? -1 : 1;
+	return 0;
+}
+
+/**************************************************/
+#pragma mark - SA_DiceRollRequest class declaration
+/**************************************************/
+
+@interface SA_DiceRollRequest : NSObject
+
+@property NSString *rollString;
+@property (copy) SA_DiceRollServiceCompletionHandler completionHandler;
+
+// When the request was added to the queue (see SA_DiceMetricsCurrentTime()).
+@property uint64_t submissionTime;
+
+@end
+
+@implementation SA_DiceRollRequest
+@end
+
+/****************************************************/
+#pragma mark - SA_DiceRollFuture class implementation
+/****************************************************/
+
+@interface SA_DiceRollFuture ()
+
+-(void) fulfillWithOutput:(NSString *)output
+				   result:(SA_DiceExpression *)result;
+
+@end
+
+@implementation SA_DiceRollFuture {
+	// Entered when the future is created, and left when it is fulfilled.
+	dispatch_group_t _group;
+
+	NSString *_output;
+	SA_DiceExpression *_result;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(BOOL) isDone {
+	return (dispatch_group_wait(_group, DISPATCH_TIME_NOW) == 0);
+}
+
+-(NSString *) output {
+	[self wait];
+	return _output;
+}
+
+-(SA_DiceExpression *) result {
+	[self wait];
+	return _result;
+}
+
+/**************************/
+#pragma mark - Initializers
+/**************************/
+
+-(instancetype) init {
+	if (!(self = [super init]))
+		return nil;
+
+	_group = dispatch_group_create();
+	dispatch_group_enter(_group);
+
+	return self;
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(void) wait {
+	dispatch_group_wait(_group, DISPATCH_TIME_FOREVER);
+}
+
+-(BOOL) waitWithTimeout:(NSTimeInterval)timeout {
+	return (dispatch_group_wait(_group, dispatch_time(DISPATCH_TIME_NOW, (int64_t) (timeout * NSEC_PER_SEC))) == 0);
+}
+
+/*****************************/
+#pragma mark - Private methods
+/*****************************/
+
+-(void) fulfillWithOutput:(NSString *)output
+				   result:(SA_DiceExpression *)result {
+	_output = output;
+	_result = result;
+	dispatch_group_leave(_group);
+}
+
+@end
+
+/*****************************************************/
+#pragma mark - SA_DiceRollService class implementation
+/*****************************************************/
+
+@implementation SA_DiceRollService {
+	// Guards the queue, the counts, the batching settings, and the metrics.
+	pthread_mutex_t _lock;
+	pthread_cond_t _requestsWaiting;
+	pthread_cond_t _roomInQueue;
+	pthread_cond_t _allDone;
+
+	NSMutableArray <SA_DiceRollRequest *> *_requests;
+	BOOL _closed;
+
+	// Requests accepted, but not yet completed.
+	NSUInteger _pendingCount;
+
+	uint64_t _submittedCount;
+	uint64_t _refusedCount;
+	uint64_t _completedCount;
+	uint64_t _batchCount;
+
+	NSUInteger _maxBatchSize;
+	NSTimeInterval _batchWindow;
+	SA_DiceMetrics *_metrics;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(NSUInteger) maxBatchSize {
+	pthread_mutex_lock(&_lock);
+	NSUInteger maxBatchSize = _maxBatchSize;
+	pthread_mutex_unlock(&_lock);
+	return maxBatchSize;
+}
+-(void) setMaxBatchSize:(NSUInteger)maxBatchSize {
+	pthread_mutex_lock(&_lock);
+	_maxBatchSize = MAX(maxBatchSize, 1);
+	pthread_mutex_unlock(&_lock);
+}
+
+-(NSTimeInterval) batchWindow {
+	pthread_mutex_lock(&_lock);
+	NSTimeInterval batchWindow = _batchWindow;
+	pthread_mutex_unlock(&_lock);
+	return batchWindow;
+}
+-(void) setBatchWindow:(NSTimeInterval)batchWindow {
+	pthread_mutex_lock(&_lock);
+	_batchWindow = MAX(batchWindow, 0.0);
+	pthread_mutex_unlock(&_lock);
+}
+
+-(SA_DiceMetrics *) metrics {
+	pthread_mutex_lock(&_lock);
+	SA_DiceMetrics *metrics = _metrics;
+	pthread_mutex_unlock(&_lock);
+	return metrics;
+}
+-(void) setMetrics:(SA_DiceMetrics *)metrics {
+	pthread_mutex_lock(&_lock);
+	_metrics = metrics;
+	pthread_mutex_unlock(&_lock);
+}
+
+-(NSUInteger) queueDepth {
+	pthread_mutex_lock(&_lock);
+	NSUInteger queueDepth = _requests.count;
+	pthread_mutex_unlock(&_lock);
+	return queueDepth;
+}
+
+-(uint64_t) submittedCount {
+	pthread_mutex_lock(&_lock);
+	uint64_t submittedCount = _submittedCount;
+	pthread_mutex_unlock(&_lock);
+	return submittedCount;
+}
+
+-(uint64_t) refusedCount {
+	pthread_mutex_lock(&_lock);
+	uint64_t refusedCount = _refusedCount;
+	pthread_mutex_unlock(&_lock);
+	return refusedCount;
+}
+
+-(uint64_t) completedCount {
+	pthread_mutex_lock(&_lock);
+	uint64_t completedCount = _completedCount;
+	pthread_mutex_unlock(&_lock);
+	return completedCount;
+}
+
+-(uint64_t) batchCount {
+	pthread_mutex_lock(&_lock);
+	uint64_t batchCount = _batchCount;
+	pthread_mutex_unlock(&_lock);
+	return batchCount;
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithParser:[SA_DiceParser defaultParser]
+					  evaluator:[SA_DiceEvaluator new]
+					  formatter:[SA_DiceFormatter defaultFormatter]
+				expressionCache:[SA_DiceExpressionCache sharedCache]
+					workerCount:0
+				  queueCapacity:DEFAULT_QUEUE_CAPACITY];
+}
+
+-(instancetype) initWithParser:(SA_DiceParser *)parser
+					 evaluator:(SA_DiceEvaluator *)evaluator
+					 formatter:(SA_DiceFormatter *)formatter
+			   expressionCache:(SA_DiceExpressionCache *)expressionCache
+				   workerCount:(NSUInteger)workerCount
+				 queueCapacity:(NSUInteger)queueCapacity {
+	if (!(self = [super init]))
+		return nil;
+
+	_parser = parser;
+	_evaluator = evaluator;
+	_formatter = formatter;
+	_expressionCache = expressionCache;
+	_workerCount = (workerCount > 0) ? workerCount : NSProcessInfo.processInfo.activeProcessorCount;
+	_queueCapacity = MAX(queueCapacity, 1);
+
+	_maxBatchSize = DEFAULT_MAX_BATCH_SIZE;
+	_batchWindow = DEFAULT_BATCH_WINDOW;
+
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_requestsWaiting, NULL);
+	pthread_cond_init(&_roomInQueue, NULL);
+	pthread_cond_init(&_allDone, NULL);
+	_requests = [NSMutableArray arrayWithCapacity:MIN(_queueCapacity, DEFAULT_QUEUE_CAPACITY)];
+
+	// (Each worker thread keeps the service alive until it is closed, and
+	// all accepted requests have been completed.)
+	for (NSUInteger i = 0; i < _workerCount; i++) {
+		NSThread *worker = [[NSThread alloc] initWithTarget:self
+												   selector:@selector(runWorker)
+													 object:nil];
+		worker.name = [NSString stringWithFormat:@"SA_DiceRollService worker %lu", (unsigned long) i];
+		worker.qualityOfService = NSQualityOfServiceUserInitiated;
+		[worker start];
+	}
+
+	return self;
+}
+
+-(void) dealloc {
+	pthread_cond_destroy(&_requestsWaiting);
+	pthread_cond_destroy(&_roomInQueue);
+	pthread_cond_destroy(&_allDone);
+	pthread_mutex_destroy(&_lock);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(BOOL) submitRollString:(NSString *)dieRollString
+	   completionHandler:(SA_DiceRollServiceCompletionHandler)completionHandler {
+	return [self submitRollString:dieRollString
+				completionHandler:completionHandler
+					 waitForRoom:YES];
+}
+
+-(BOOL) trySubmitRollString:(NSString *)dieRollString
+		  completionHandler:(SA_DiceRollServiceCompletionHandler)completionHandler {
+	return [self submitRollString:dieRollString
+				completionHandler:completionHandler
+					 waitForRoom:NO];
+}
+
+-(SA_DiceRollFuture *) futureForRollString:(NSString *)dieRollString {
+	SA_DiceRollFuture *future = [SA_DiceRollFuture new];
+	BOOL submitted = [self submitRollString:dieRollString
+						  completionHandler:^(NSString *output, SA_DiceExpression *result) {
+		[future fulfillWithOutput:output
+						   result:result];
+	}
+								waitForRoom:YES];
+
+	return submitted ? future : nil;
+}
+
+-(void) waitUntilIdle {
+	pthread_mutex_lock(&_lock);
+	while (_pendingCount > 0)
+		pthread_cond_wait(&_allDone, &_lock);
+	pthread_mutex_unlock(&_lock);
+}
+
+-(void) close {
+	pthread_mutex_lock(&_lock);
+	_closed = YES;
+	pthread_cond_broadcast(&_requestsWaiting);
+	pthread_cond_broadcast(&_roomInQueue);
+	pthread_mutex_unlock(&_lock);
+}
+
+/****************************/
+#pragma mark - Helper methods
+/****************************/
+
+-(BOOL) submitRollString:(NSString *)dieRollString
+	   completionHandler:(SA_DiceRollServiceCompletionHandler)completionHandler
+			 waitForRoom:(BOOL)waitForRoom {
+	if (dieRollString == nil)
+		return NO;
+
+	SA_DiceRollRequest *request = [SA_DiceRollRequest new];
+	request.rollString = dieRollString;
+	request.completionHandler = completionHandler;
+
+	pthread_mutex_lock(&_lock);
+
+	while (   waitForRoom
+		   && !_closed
+		   && _requests.count >= _queueCapacity)
+		pthread_cond_wait(&_roomInQueue, &_lock);
+	if (   _closed
+		|| _requests.count >= _queueCapacity) {
+		_refusedCount++;
+		pthread_mutex_unlock(&_lock);
+		return NO;
+	}
+
+	request.submissionTime = SA_DiceMetricsCurrentTime();
+	[_requests addObject:request];
+	_submittedCount++;
+	_pendingCount++;
+	NSUInteger queueDepth = _requests.count;
+	SA_DiceMetrics *metrics = _metrics;
+	pthread_cond_signal(&_requestsWaiting);
+
+	pthread_mutex_unlock(&_lock);
+
+	[metrics recordQueueDepth:queueDepth];
+
+	return YES;
+}
+
+-(void) runWorker {
+	NSMutableArray <SA_DiceRollRequest *> *batch = [NSMutableArray array];
+	for (;;) {
+		@autoreleasepool {
+			SA_DiceMetrics *metrics = [self takeBatch:batch];
+			if (batch.count == 0)
+				break;
+
+			[self processBatch:batch
+					   metrics:metrics];
+			[batch removeAllObjects];
+		}
+	}
+}
+
+// Waits for requests, and moves a batch of them from the queue into the
+// given array (leaving it empty only if the service has been closed, and
+// there are no more requests). Returns the metrics to record the batch in.
+-(SA_DiceMetrics *) takeBatch:(NSMutableArray <SA_DiceRollRequest *> *)batch {
+	pthread_mutex_lock(&_lock);
+
+	for (;;) {
+		while (   _requests.count == 0
+			   && !_closed)
+			pthread_cond_wait(&_requestsWaiting, &_lock);
+		if (_requests.count == 0)
+			break;
+
+		// Wait (unless closing) for the batch to fill up, but no longer than
+		// the batch window after the oldest request arrived. (Another worker
+		// may take the requests meanwhile; if so, start over.)
+		uint64_t deadline = _requests[0].submissionTime + (uint64_t) (_batchWindow * 1.0e9);
+		while (   _requests.count > 0
+			   && _requests.count < _maxBatchSize
+			   && !_closed) {
+			uint64_t now = SA_DiceMetricsCurrentTime();
+			if (now >= deadline)
+				break;
+
+			// (Condition variables wait until a time of the real-time clock.)
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			uint64_t nanoseconds = (uint64_t) until.tv_nsec + (deadline - now);
+			until.tv_sec += (time_t) (nanoseconds / 1000000000);
+			until.tv_nsec = (long) (nanoseconds % 1000000000);
+			pthread_cond_timedwait(&_requestsWaiting, &_lock, &until);
+		}
+		if (_requests.count == 0)
+			continue;
+
+		NSRange taken = NSRangeMake(0, MIN(_requests.count, _maxBatchSize));
+		[batch addObjectsFromArray:[_requests subarrayWithRange:taken]];
+		[_requests removeObjectsInRange:taken];
+		_batchCount++;
+		pthread_cond_broadcast(&_roomInQueue);
+		break;
+	}
+
+	SA_DiceMetrics *metrics = _metrics;
+
+	pthread_mutex_unlock(&_lock);
+
+	return metrics;
+}
+
+-(void) processBatch:(NSArray <SA_DiceRollRequest *> *)batch
+			 metrics:(SA_DiceMetrics *)metrics {
+	NSUInteger requestCount = batch.count;
+
+	if (metrics != nil) {
+		uint64_t now = SA_DiceMetricsCurrentTime();
+		for (SA_DiceRollRequest *request in batch)
+			[metrics recordStage:SA_DiceMetricsStage_QUEUE
+						duration:(now - request.submissionTime)
+						  errors:0];
+	}
+
+	NSMutableArray *results = [NSMutableArray arrayWithCapacity:requestCount];
+	for (NSUInteger i = 0; i < requestCount; i++)
+		[results addObject:[NSNull null]];
+
+	// Requests for the same roll string get the same (cached) program; they
+	// are run back to back, with the programs of each group in the order in
+	// which they first appear in the batch.
+	NSMapTable *groupIndices = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsObjectPointerPersonality
+													 valueOptions:NSPointerFunctionsStrongMemory];
+	NSMutableArray *programs = [NSMutableArray arrayWithCapacity:requestCount];	// SA_DiceProgram, or NSNull
+	SA_DiceRollRequestOrder *order = malloc(MAX(requestCount, 1) * sizeof(SA_DiceRollRequestOrder));
+	NSUInteger orderCount = 0;
+	for (NSUInteger i = 0; i < requestCount; i++) {
+		SA_DiceProgram *program = [_expressionCache programForString:batch[i].rollString
+															  parser:_parser];
+
+		// A roll string that has no program (because it does not parse to a
+		// tree, or because the parser’s behavior is not the legacy one) is
+		// parsed and evaluated on its own, and kept out of the batch. (An
+		// erroneous expression is returned unevaluated, with its errors.)
+		if (program == nil) {
+			SA_DiceExpression *result = [_evaluator resultOfExpression:[_parser expressionForString:batch[i].rollString]];
+			if (result != nil)
+				results[i] = result;
+			[programs addObject:[NSNull null]];
+			continue;
+		}
+		[programs addObject:program];
+
+		NSNumber *groupIndex = [groupIndices objectForKey:program];
+		if (groupIndex == nil) {
+			groupIndex = @(i);
+			[groupIndices setObject:groupIndex
+							 forKey:program];
+		}
+		order[orderCount++] = (SA_DiceRollRequestOrder) { i, groupIndex.unsignedIntegerValue };
+	}
+	qsort(order, orderCount, sizeof(SA_DiceRollRequestOrder), SA_DiceRollRequestOrderCompare);
+
+	NSMutableArray <SA_DiceProgram *> *orderedPrograms = [NSMutableArray arrayWithCapacity:orderCount];
+	for (NSUInteger i = 0; i < orderCount; i++)
+		[orderedPrograms addObject:programs[order[i].index]];
+	NSArray <SA_DiceExpression *> *orderedResults = [_evaluator resultsOfPrograms:orderedPrograms];
+
+	for (NSUInteger i = 0; i < orderCount; i++)
+		results[order[i].index] = orderedResults[i];
+	free(order);
+
+	// Requests are completed in the order in which they were submitted.
+	for (NSUInteger i = 0; i < requestCount; i++) {
+		SA_DiceExpression *result = (results[i] != [NSNull null]) ? results[i] : nil;
+		NSString *output = [_formatter stringFromExpression:result];
+		SA_DiceRollServiceCompletionHandler completionHandler = batch[i].completionHandler;
+		if (completionHandler != nil)
+			completionHandler(output, result);
+	}
+
+	pthread_mutex_lock(&_lock);
+	_completedCount += requestCount;
+	_pendingCount -= requestCount;
+	if (_pendingCount == 0)
+		pthread_cond_broadcast(&_allDone);
+	pthread_mutex_unlock(&_lock);
+}
+
+@end
@@ -0,0 +1,78 @@
+//
+//  SA_DiceSimulationResult.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+/*
+ The aggregated results of evaluating an expression many times (see
+ SA_DiceSimulator.h): how many evaluations failed (and with what errors),
+ statistics of the results of those that succeeded, and a histogram of those
+ results.
+
+ Results are immutable, and may be shared between threads.
+ */
+
+/*****************************************************/
+#pragma mark SA_DiceSimulationResult class declaration
+/*****************************************************/
+
+@interface SA_DiceSimulationResult : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The number of evaluations, and the number of those that failed.
+@property (readonly) NSUInteger evaluationCount;
+@property (readonly) NSUInteger errorCount;
+
+// Every error reported by any failed evaluation.
+@property (readonly) SA_DiceExpressionError errors;
+
+// Statistics of the results of the evaluations that succeeded (all 0, if
+// none did). The variance is the sample variance.
+@property (readonly) NSInteger minimum;
+@property (readonly) NSInteger maximum;
+@property (readonly) double mean;
+@property (readonly) double variance;
+@property (readonly) double standardDeviation;
+
+// NO if the results were too widely spread to keep a histogram of (see
+// SA_DiceSimulator); the histogram methods below then return 0.
+@property (readonly) BOOL hasHistogram;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+// Takes ownership of the given (malloc’d) histogram, which holds the number
+// of successful evaluations with each result from ‘minimum’ to ‘maximum’. (If
+// the histogram is NULL, there is none.)
+-(instancetype) initWithEvaluationCount:(NSUInteger)evaluationCount
+							 errorCount:(NSUInteger)errorCount
+								 errors:(SA_DiceExpressionError)errors
+								minimum:(NSInteger)minimum
+								maximum:(NSInteger)maximum
+								   mean:(double)mean
+							   variance:(double)variance
+					  byTakingHistogram:(uint64_t *)histogram NS_DESIGNATED_INITIALIZER;
+
+-(instancetype) init NS_UNAVAILABLE;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// The number of successful evaluations with the given result.
+-(NSUInteger) countOfValue:(NSInteger)value;
+
+// The smallest result which is at least as large as the given fraction
+// (between 0 and 1) of all results of successful evaluations.
+-(NSInteger) percentile:(double)fraction;
+
+@end
@@ -0,0 +1,101 @@
+//
+//  SA_DiceSimulationResult.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceSimulationResult.h"
+
+/**********************************************************/
+#pragma mark - SA_DiceSimulationResult class implementation
+/**********************************************************/
+
+@implementation SA_DiceSimulationResult {
+	uint64_t *_histogram;
+}
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+-(double) standardDeviation {
+	return sqrt(_variance);
+}
+
+-(BOOL) hasHistogram {
+	return (_histogram != NULL);
+}
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) initWithEvaluationCount:(NSUInteger)evaluationCount
+							 errorCount:(NSUInteger)errorCount
+								 errors:(SA_DiceExpressionError)errors
+								minimum:(NSInteger)minimum
+								maximum:(NSInteger)maximum
+								   mean:(double)mean
+							   variance:(double)variance
+					  byTakingHistogram:(uint64_t *)histogram {
+	if (!(self = [super init])) {
+		free(histogram);
+		return nil;
+	}
+
+	_evaluationCount = evaluationCount;
+	_errorCount = errorCount;
+	_errors = errors;
+	_minimum = minimum;
+	_maximum = maximum;
+	_mean = mean;
+	_variance = variance;
+
+	// With no successful evaluations, there is nothing to histogram.
+	if (errorCount == evaluationCount) {
+		free(histogram);
+		histogram = NULL;
+	}
+	_histogram = histogram;
+
+	return self;
+}
+
+-(void) dealloc {
+	free(_histogram);
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(NSUInteger) countOfValue:(NSInteger)value {
+	if (   _histogram == NULL
+		|| value < _minimum
+		|| value > _maximum)
+		return 0;
+
+	return (NSUInteger) _histogram[(NSUInteger) (value - _minimum)];
+}
+
+-(NSInteger) percentile:(double)fraction {
+	if (_histogram == NULL)
+		return 0;
+
+	// The rank (counting from 1) of the result sought.
+	NSUInteger successCount = _evaluationCount - _errorCount;
+	double rank = ceil(fraction * (double) successCount);
+	uint64_t target = (uint64_t) MAX(rank, 1.0);
+
+	uint64_t cumulativeCount = 0;
+	NSUInteger binCount = (NSUInteger) (_maximum - _minimum) + 1;
+	for (NSUInteger i = 0; i < binCount; i++) {
+		cumulativeCount += _histogram[i];
+		if (cumulativeCount >= target)
+			return _minimum + (NSInteger) i;
+	}
+
+	return _maximum;
+}
+
+@end
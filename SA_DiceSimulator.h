@@ -0,0 +1,90 @@
+//
+//  SA_DiceSimulator.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+@class SA_DiceEvaluator;
+@class SA_DiceProgram;
+@class SA_DiceSimulationResult;
+
+/*
+ SA_DiceSimulator evaluates a compiled expression (see SA_DiceProgram.h) many
+ times - on all available cores - and aggregates the results (see
+ SA_DiceSimulationResult.h). No result trees are built, nothing is allocated
+ per evaluation, and roll commands generate only their sums (see the
+ sumsOnly property of SA_DiceEvaluator); so simulating rolls of very many
+ dice is cheap.
+
+ The work is divided into fixed-size blocks of evaluations, each of which
+ rolls its dice with its own random number stream, derived from the given
+ seed and the block’s index (see SA_DiceRNGInitWithSeedAndStream()). So the
+ result of a simulation depends only on the program, the number of
+ evaluations, and the seed - not on the number of threads, or on how the
+ blocks happen to be scheduled.
+
+ A simulator may be used from multiple threads at once (as long as its
+ properties are not modified meanwhile).
+ */
+
+/**********************************************/
+#pragma mark SA_DiceSimulator class declaration
+/**********************************************/
+
+@interface SA_DiceSimulator : NSObject
+
+/************************/
+#pragma mark - Properties
+/************************/
+
+// The largest die count and die size allowed, and the largest number of
+// explosions in one evaluation (see SA_DiceEvaluator). The defaults are those
+// of a new SA_DiceEvaluator.
+@property NSUInteger maxDieCount;
+@property NSUInteger maxDieSize;
+@property NSUInteger maxExplosionCount;
+
+// The largest worst-case cost of one evaluation (see SA_DiceEvaluator); if
+// the program might cost more, every evaluation fails. The default is that of
+// a new SA_DiceEvaluator. (The cost is estimated once per thread, not once
+// per evaluation.)
+@property NSUInteger maxCost;
+
+// The number of threads to use. The default (0) means one per active
+// processor core.
+@property NSUInteger threadCount;
+
+// The largest number of distinct results to keep a histogram of (i.e., the
+// largest difference between the smallest and largest results, plus one). If
+// the results are spread more widely than this, no histogram is kept (but
+// all the other statistics are). The default is 2^20.
+@property NSUInteger maxHistogramBinCount;
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init;
+
+// Creates a simulator with the same limits as the given evaluator.
+-(instancetype) initWithEvaluator:(SA_DiceEvaluator *)evaluator;
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+// Evaluates the given program the given number of times, and returns the
+// aggregated results. This method blocks until all evaluations are done.
+//
+// If a progress object is given, its total unit count is set to the number
+// of evaluations, and its completed unit count is updated (from the worker
+// threads) as blocks of evaluations are finished. Cancelling the progress
+// object stops the simulation; nil is then returned.
+-(SA_DiceSimulationResult *) resultOfEvaluatingProgram:(SA_DiceProgram *)program
+											 count:(NSUInteger)evaluationCount
+											  seed:(uint64_t)seed
+										  progress:(NSProgress *)progress;
+
+@end
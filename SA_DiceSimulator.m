@@ -0,0 +1,340 @@
+//
+//  SA_DiceSimulator.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceSimulator.h"
+
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceProgram.h"
+#import "SA_DiceRNG.h"
+#import "SA_DiceSimulationResult.h"
+
+#import <stdatomic.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+// The number of evaluations in each block (i.e., per random number stream).
+// Changing this changes the results of simulations with a given seed.
+#define BLOCK_SIZE							(1 << 16)
+
+#define DEFAULT_MAX_HISTOGRAM_BIN_COUNT		(1 << 20)
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+// Statistics of the successful evaluations in one block. (These are kept
+// per block, and combined in block order at the end, so that rounding is the
+// same no matter which thread ran which block.)
+typedef struct {
+	NSUInteger successCount;
+	double mean;
+	double sumOfSquaredDeviations;
+} SA_DiceSimulationBlockStatistics;
+
+// Everything else each worker thread aggregates (all of which may be
+// combined in any order).
+typedef struct {
+	NSUInteger errorCount;
+	SA_DiceExpressionError errors;
+
+	BOOL hasResults;
+	NSInteger minimum;
+	NSInteger maximum;
+
+	// Counts of each result from histogramMinimum up.
+	uint64_t *histogram;
+	NSInteger histogramMinimum;
+	NSUInteger histogramCount;
+	BOOL histogramOverflowed;
+} SA_DiceSimulationWorkerState;
+
+/************************/
+#pragma mark - Histograms
+/************************/
+
+// Counts the given result in the worker’s histogram (growing it as needed);
+// if the worker’s results (including this one, which must already be counted
+// in the worker’s minimum and maximum) are spread more widely than the limit
+// allows, the histogram is discarded. (This is judged by the range of the
+// results, and not by the extent of the histogram, which may have grown
+// beyond them; so a worker’s histogram overflows only if the range of all the
+// results is too wide, however the results are divided among workers.)
+static void SA_DiceSimulationCount(SA_DiceSimulationWorkerState *state,
+								   NSInteger value,
+								   NSUInteger maxHistogramBinCount) {
+	if (state->histogramOverflowed)
+		return;
+
+	if (   state->histogram != NULL
+		&& value >= state->histogramMinimum
+		&& ((NSUInteger) value - (NSUInteger) state->histogramMinimum) < state->histogramCount) {
+		state->histogram[(NSUInteger) value - (NSUInteger) state->histogramMinimum]++;
+		return;
+	}
+
+	// (The range is computed in unsigned arithmetic, which is exact, however
+	// far apart the results are.)
+	NSUInteger range = (NSUInteger) state->maximum - (NSUInteger) state->minimum;
+	if (range >= maxHistogramBinCount) {
+		free(state->histogram);
+		state->histogram = NULL;
+		state->histogramOverflowed = YES;
+		return;
+	}
+
+	// The histogram must grow to include the results (and, so that it need
+	// not grow again for every new result, somewhat more, in the direction
+	// of the new result; as far as that is possible without overflow).
+	NSUInteger resultCount = range + 1;
+	NSUInteger count = MIN(MAX(resultCount, state->histogramCount + (state->histogramCount / 2)), maxHistogramBinCount);
+	NSUInteger extraCount = count - resultCount;
+	NSInteger histogramMinimum;
+	if (   state->histogram != NULL
+		&& value < state->histogramMinimum) {
+		histogramMinimum = ((extraCount > (NSUInteger) state->minimum - (NSUInteger) NSIntegerMin)
+							? NSIntegerMin
+							: state->minimum - (NSInteger) extraCount);
+	} else {
+		histogramMinimum = ((extraCount > (NSUInteger) NSIntegerMax - (NSUInteger) state->maximum)
+							? NSIntegerMax - (NSInteger) (count - 1)
+							: state->minimum);
+	}
+
+	// Only the results need be copied (the rest of the old histogram is
+	// empty); they are within the new histogram’s extent.
+	uint64_t *histogram = calloc(count, sizeof(uint64_t));
+	if (state->histogram != NULL) {
+		NSInteger first = MAX(state->histogramMinimum, state->minimum);
+		NSInteger last = MIN(state->histogramMinimum + (NSInteger) (state->histogramCount - 1), state->maximum);
+		if (first <= last)
+			memcpy(histogram + (NSUInteger) (first - histogramMinimum),
+				   state->histogram + (NSUInteger) (first - state->histogramMinimum),
+				   ((NSUInteger) last - (NSUInteger) first + 1) * sizeof(uint64_t));
+	}
+	free(state->histogram);
+	state->histogram = histogram;
+	state->histogramMinimum = histogramMinimum;
+	state->histogramCount = count;
+
+	state->histogram[(NSUInteger) value - (NSUInteger) state->histogramMinimum]++;
+}
+
+/***************************************************/
+#pragma mark - SA_DiceSimulator class implementation
+/***************************************************/
+
+@implementation SA_DiceSimulator
+
+/********************************************/
+#pragma mark - Initializers & factory methods
+/********************************************/
+
+-(instancetype) init {
+	return [self initWithEvaluator:[SA_DiceEvaluator new]];
+}
+
+-(instancetype) initWithEvaluator:(SA_DiceEvaluator *)evaluator {
+	if (!(self = [super init]))
+		return nil;
+
+	_maxDieCount = evaluator.maxDieCount;
+	_maxDieSize = evaluator.maxDieSize;
+	_maxExplosionCount = evaluator.maxExplosionCount;
+	_maxCost = evaluator.maxCost;
+	_threadCount = 0;
+	_maxHistogramBinCount = DEFAULT_MAX_HISTOGRAM_BIN_COUNT;
+
+	return self;
+}
+
+/****************************/
+#pragma mark - Public methods
+/****************************/
+
+-(SA_DiceSimulationResult *) resultOfEvaluatingProgram:(SA_DiceProgram *)program
+												 count:(NSUInteger)evaluationCount
+												  seed:(uint64_t)seed
+											  progress:(NSProgress *)progress {
+	if (program == nil)
+		return nil;
+
+	progress.totalUnitCount = (int64_t) evaluationCount;
+
+	NSUInteger blockCount = (evaluationCount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	NSUInteger workerCount = (_threadCount > 0) ? _threadCount : NSProcessInfo.processInfo.activeProcessorCount;
+	workerCount = MAX(MIN(workerCount, blockCount), 1);
+
+	// As in SA_DiceEvaluator, the limits must be such that no sum of rolls
+	// can overflow.
+	NSUInteger maxDieSize = MAX(_maxDieSize, 1);
+	NSUInteger maxDieCount = MIN(_maxDieCount, (NSUInteger) NSIntegerMax / maxDieSize);
+	NSUInteger maxExplosionCount = _maxExplosionCount;
+	NSUInteger maxCost = _maxCost;
+	NSUInteger maxHistogramBinCount = MAX(_maxHistogramBinCount, 1);
+
+	SA_DiceSimulationBlockStatistics *blockStatistics = calloc(MAX(blockCount, 1), sizeof(SA_DiceSimulationBlockStatistics));
+	SA_DiceSimulationWorkerState *workerStates = calloc(workerCount, sizeof(SA_DiceSimulationWorkerState));
+	// (These are on the stack, but dispatch_apply() does not return until
+	// every worker is done with them.)
+	atomic_uint_fast64_t nextBlock = 0;
+	atomic_bool cancelled = false;
+	atomic_uint_fast64_t *nextBlockPointer = &nextBlock;
+	atomic_bool *cancelledPointer = &cancelled;
+
+	dispatch_apply(workerCount, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t worker) {
+		SA_DiceSimulationWorkerState *state = &workerStates[worker];
+		SA_DiceMachine *machine = SA_DiceMachineCreate();
+		SA_DiceRNG rng;
+		SA_DiceProgramEnvironment environment = {
+			.rng = &rng,
+			.maxDieCount = maxDieCount,
+			.maxDieSize = maxDieSize,
+			.maxExplosionCount = maxExplosionCount,
+			.sumsOnly = YES,
+			.maxCost = maxCost
+		};
+
+		for (;;) {
+			NSUInteger block = (NSUInteger) atomic_fetch_add(nextBlockPointer, 1);
+			if (   block >= blockCount
+				|| atomic_load(cancelledPointer))
+				break;
+			if (progress.cancelled) {
+				atomic_store(cancelledPointer, true);
+				break;
+			}
+
+			SA_DiceRNGInitWithSeedAndStream(&rng, seed, block);
+			NSUInteger blockEvaluationCount = MIN(BLOCK_SIZE, evaluationCount - (block * BLOCK_SIZE));
+
+			// Running statistics (Welford’s method).
+			SA_DiceSimulationBlockStatistics statistics = { 0 };
+			for (NSUInteger i = 0; i < blockEvaluationCount; i++) {
+				SA_DiceExpressionError errors = 0;
+				NSInteger value = [program runOnMachine:machine
+											environment:&environment
+									   recordResultTree:NO
+												 errors:&errors];
+				if (errors != 0) {
+					state->errorCount++;
+					state->errors |= errors;
+					continue;
+				}
+
+				statistics.successCount++;
+				double delta = (double) value - statistics.mean;
+				statistics.mean += delta / (double) statistics.successCount;
+				statistics.sumOfSquaredDeviations += delta * ((double) value - statistics.mean);
+
+				if (!state->hasResults) {
+					state->hasResults = YES;
+					state->minimum = value;
+					state->maximum = value;
+				} else {
+					state->minimum = MIN(state->minimum, value);
+					state->maximum = MAX(state->maximum, value);
+				}
+				SA_DiceSimulationCount(state, value, maxHistogramBinCount);
+			}
+			blockStatistics[block] = statistics;
+
+			if (progress != nil) {
+				@synchronized (progress) {
+					progress.completedUnitCount += (int64_t) blockEvaluationCount;
+				}
+			}
+		}
+
+		SA_DiceMachineDestroy(machine);
+	});
+
+	SA_DiceSimulationResult *result = nil;
+	if (!atomic_load(&cancelled)) {
+		// Combine the blocks’ statistics, in order (Chan et al.’s method).
+		NSUInteger successCount = 0;
+		double mean = 0.0;
+		double sumOfSquaredDeviations = 0.0;
+		for (NSUInteger block = 0; block < blockCount; block++) {
+			SA_DiceSimulationBlockStatistics statistics = blockStatistics[block];
+			if (statistics.successCount == 0)
+				continue;
+
+			NSUInteger combinedCount = successCount + statistics.successCount;
+			double delta = statistics.mean - mean;
+			mean += delta * ((double) statistics.successCount / (double) combinedCount);
+			sumOfSquaredDeviations += (statistics.sumOfSquaredDeviations
+									   + (delta * delta * ((double) successCount * (double) statistics.successCount / (double) combinedCount)));
+			successCount = combinedCount;
+		}
+
+		NSUInteger errorCount = 0;
+		SA_DiceExpressionError errors = 0;
+		BOOL hasResults = NO;
+		NSInteger minimum = 0, maximum = 0;
+		for (NSUInteger worker = 0; worker < workerCount; worker++) {
+			SA_DiceSimulationWorkerState *state = &workerStates[worker];
+			errorCount += state->errorCount;
+			errors |= state->errors;
+			if (!state->hasResults)
+				continue;
+
+			minimum = hasResults ? MIN(minimum, state->minimum) : state->minimum;
+			maximum = hasResults ? MAX(maximum, state->maximum) : state->maximum;
+			hasResults = YES;
+		}
+
+		// Whether there is a histogram depends only on the overall range of
+		// the results (and not on how they were divided among workers; a
+		// worker’s histogram overflows only if the overall range is too
+		// wide).
+		uint64_t *histogram = NULL;
+		if (   hasResults
+			&& ((NSUInteger) maximum - (NSUInteger) minimum) < maxHistogramBinCount) {
+			histogram = calloc((NSUInteger) (maximum - minimum) + 1, sizeof(uint64_t));
+			for (NSUInteger worker = 0; worker < workerCount; worker++) {
+				SA_DiceSimulationWorkerState *state = &workerStates[worker];
+				if (state->histogram == NULL)
+					continue;
+
+				// The worker’s histogram may have grown beyond its results
+				// (and so beyond the overall range); only the part within
+				// the overall range holds any results.
+				NSInteger first = MAX(state->histogramMinimum, minimum);
+				NSInteger last = MIN(state->histogramMinimum + (NSInteger) (state->histogramCount - 1), maximum);
+				if (first > last)
+					continue;
+
+				NSUInteger sourceIndex = (NSUInteger) (first - state->histogramMinimum);
+				NSUInteger destinationIndex = (NSUInteger) (first - minimum);
+				NSUInteger binCount = (NSUInteger) last - (NSUInteger) first + 1;
+				for (NSUInteger i = 0; i < binCount; i++)
+					histogram[destinationIndex + i] += state->histogram[sourceIndex + i];
+			}
+		}
+
+		result = [[SA_DiceSimulationResult alloc] initWithEvaluationCount:evaluationCount
+															   errorCount:errorCount
+																   errors:errors
+																  minimum:minimum
+																  maximum:maximum
+																	 mean:mean
+																 variance:((successCount > 1)
+																		   ? (sumOfSquaredDeviations / (double) (successCount - 1))
+																		   : 0.0)
+														byTakingHistogram:histogram];
+	}
+
+	for (NSUInteger worker = 0; worker < workerCount; worker++)
+		free(workerStates[worker].histogram);
+	free(workerStates);
+	free(blockStatistics);
+
+	return result;
+}
+
+@end
@@ -0,0 +1,166 @@
+//
+//  SA_DiceStringFormatRules.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceExpression.h"
+
+/*
+ SA_DiceStringFormatRules is the compiled form of the string format rules
+ (see SA_DiceExpressionStringConstants.h) and the error descriptions: the
+ rules that define which characters are legal in a die roll string (and what
+ each one means), how the components of an expression are represented in
+ formatted output, and how each error is described.
+
+ The default rules are compiled into the library, as static tables; they
+ are identical to the contents of SA_DB_StringFormatRules.plist and
+ SA_DB_ErrorDescriptions.plist (which document the format of the rules, and
+ may be edited and compiled at runtime to override the defaults - see
+ SA_DiceStringFormatRulesCreateWithPropertyLists()). Nothing is loaded from
+ the bundle.
+
+ Looking up the class of a character, the canonical representation of an
+ operator, or the description of an error is an array index (or, for
+ non-ASCII characters, a binary search over a short list); no dictionaries
+ are consulted, and no strings are built.
+
+ A rules table is immutable once created, and lives for the lifetime of the
+ process; so a pointer to one may be freely shared, and read from any
+ thread, and need never be released.
+ */
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+// The class of a character in a die roll string (i.e., what the character
+// represents).
+typedef NS_ENUM(uint8_t, SA_DiceCharacterClass) {
+	SA_DiceCharacterClass_ILLEGAL,
+	SA_DiceCharacterClass_NUMERAL,
+	SA_DiceCharacterClass_OPERATOR_PLUS,
+	SA_DiceCharacterClass_OPERATOR_MINUS,
+	SA_DiceCharacterClass_OPERATOR_TIMES,
+	SA_DiceCharacterClass_ROLL_COMMAND_SUM,
+	SA_DiceCharacterClass_ROLL_COMMAND_SUM_EXPLODING,
+	SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_HIGHEST,
+	SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_LOWEST
+};
+
+#define SA_DICE_CHARACTER_CLASS_COUNT	(SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_LOWEST + 1)
+
+// The number of error bits for which a rules table can hold descriptions
+// (i.e., the number of bits in an SA_DiceExpressionError).
+#define SA_DICE_STRING_FORMAT_RULES_ERROR_BIT_COUNT		(sizeof(NSUInteger) * CHAR_BIT)
+
+// A non-ASCII character, and its class.
+typedef struct {
+	unichar character;
+	SA_DiceCharacterClass characterClass;
+} SA_DiceCharacterClassMapping;
+
+typedef struct {
+	// The class of each ASCII character, indexed by code point.
+	SA_DiceCharacterClass asciiCharacterClasses[128];
+
+	// The class of each legal non-ASCII character, sorted by code point.
+	// (Characters not listed are illegal.)
+	const SA_DiceCharacterClassMapping *nonASCIICharacterClasses;
+	NSUInteger nonASCIICharacterClassCount;
+
+	// Canonical representations, indexed by operator, roll command, and roll
+	// modifier, respectively. (The entries for the NONE values are nil.)
+	__unsafe_unretained NSString *canonicalOperatorRepresentations[SA_DiceExpressionOperator_TIMES + 1];
+	__unsafe_unretained NSString *canonicalRollCommandDelimiterRepresentations[SA_DiceExpressionRollCommand_SUM_EXPLODING + 1];
+	__unsafe_unretained NSString *canonicalRollModifierDelimiterRepresentations[SA_DiceExpressionRollModifier_KEEP_LOWEST + 1];
+
+	// Error descriptions, indexed by bit number (i.e., the description of
+	// error (1 << i) is at index i). Errors with no description are nil.
+	__unsafe_unretained NSString *errorDescriptions[SA_DICE_STRING_FORMAT_RULES_ERROR_BIT_COUNT];
+} SA_DiceStringFormatRules;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// ------------------------
+// Obtaining a rules table.
+// ------------------------
+
+// Returns the rules compiled into the library.
+const SA_DiceStringFormatRules *SA_DiceStringFormatRulesDefault(void);
+
+// Returns the rules currently in effect (i.e., the default rules, unless
+// others have been installed with SA_DiceStringFormatRulesInstall()).
+const SA_DiceStringFormatRules *SA_DiceStringFormatRulesCurrent(void);
+
+// Makes the given rules the rules currently in effect, for all parsers and
+// formatters which have not been given rules of their own. The change is
+// atomic: a parse or format operation already in progress (on any thread)
+// finishes with the rules it started with, and every later one sees the new
+// rules in their entirety. Passing NULL restores the default rules.
+void SA_DiceStringFormatRulesInstall(const SA_DiceStringFormatRules *rules);
+
+// Compiles a new rules table from the contents of a string format rules
+// property list (structured like SA_DB_StringFormatRules.plist) and an error
+// descriptions property list (structured like SA_DB_ErrorDescriptions.plist).
+// Either may be nil; anything not specified (i.e., a missing dictionary or a
+// missing entry) is taken from the default rules. (Note that specifying the
+// set of valid characters replaces the default set of valid characters
+// entirely.) If a character is listed as valid for more than one purpose,
+// the first (in the order of SA_DiceCharacterClass) is used.
+const SA_DiceStringFormatRules *SA_DiceStringFormatRulesCreateWithPropertyLists(NSDictionary *stringFormatRules,
+																				  NSDictionary *errorDescriptions);
+
+// --------
+// Lookups.
+// --------
+
+// Returns the class of the given character, under the given rules. (Use
+// SA_DiceStringFormatRulesCharacterClass(), which handles ASCII characters
+// inline, and calls this only for other characters.)
+SA_DiceCharacterClass SA_DiceStringFormatRulesNonASCIICharacterClass(const SA_DiceStringFormatRules *rules,
+																	  unichar character);
+
+NS_INLINE SA_DiceCharacterClass SA_DiceStringFormatRulesCharacterClass(const SA_DiceStringFormatRules *rules,
+																		unichar character) {
+	return ((character < 128)
+			? rules->asciiCharacterClasses[character]
+			: SA_DiceStringFormatRulesNonASCIICharacterClass(rules, character));
+}
+
+// Returns the description of the error with the given bit number, under the
+// given rules (or nil, if it has none).
+NS_INLINE NSString *SA_DiceStringFormatRulesErrorDescription(const SA_DiceStringFormatRules *rules,
+															 NSUInteger errorBit) {
+	return ((errorBit < SA_DICE_STRING_FORMAT_RULES_ERROR_BIT_COUNT)
+			? rules->errorDescriptions[errorBit]
+			: nil);
+}
+
+// Returns the canonical representation of the given operator, roll command
+// delimiter, or roll modifier delimiter, under the given rules (or nil, if
+// it has none, or if the value is not one of its enumeration’s values).
+NS_INLINE NSString *SA_DiceStringFormatRulesOperatorRepresentation(const SA_DiceStringFormatRules *rules,
+																   SA_DiceExpressionOperator operator) {
+	return ((operator <= SA_DiceExpressionOperator_TIMES)
+			? rules->canonicalOperatorRepresentations[operator]
+			: nil);
+}
+
+NS_INLINE NSString *SA_DiceStringFormatRulesRollCommandDelimiterRepresentation(const SA_DiceStringFormatRules *rules,
+																			   SA_DiceExpressionRollCommand rollCommand) {
+	return ((rollCommand <= SA_DiceExpressionRollCommand_SUM_EXPLODING)
+			? rules->canonicalRollCommandDelimiterRepresentations[rollCommand]
+			: nil);
+}
+
+NS_INLINE NSString *SA_DiceStringFormatRulesRollModifierDelimiterRepresentation(const SA_DiceStringFormatRules *rules,
+																				SA_DiceExpressionRollModifier rollModifier) {
+	return ((rollModifier <= SA_DiceExpressionRollModifier_KEEP_LOWEST)
+			? rules->canonicalRollModifierDelimiterRepresentations[rollModifier]
+			: nil);
+}
@@ -0,0 +1,283 @@
+//
+//  SA_DiceStringFormatRules.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceStringFormatRules.h"
+
+#import "SA_DiceExpressionStringConstants.h"
+
+#import <stdatomic.h>
+
+/****************************/
+#pragma mark The default rules
+/****************************/
+
+/*
+ These tables are compiled from SA_DB_StringFormatRules.plist and
+ SA_DB_ErrorDescriptions.plist; if either of those files changes, these must
+ be changed to match.
+ */
+
+static const SA_DiceCharacterClassMapping SA_DiceStringFormatRulesDefaultNonASCIICharacterClasses[] = {
+	{ 0x00B7, SA_DiceCharacterClass_OPERATOR_TIMES },	// MIDDLE DOT
+	{ 0x00D7, SA_DiceCharacterClass_OPERATOR_TIMES },	// MULTIPLICATION SIGN
+	{ 0x2013, SA_DiceCharacterClass_OPERATOR_MINUS },	// EN DASH
+	{ 0x2212, SA_DiceCharacterClass_OPERATOR_MINUS },	// MINUS SIGN
+	{ 0x22C5, SA_DiceCharacterClass_OPERATOR_TIMES },	// DOT OPERATOR
+	{ 0xFE63, SA_DiceCharacterClass_OPERATOR_MINUS },	// SMALL HYPHEN-MINUS
+	{ 0xFF0D, SA_DiceCharacterClass_OPERATOR_MINUS }	// FULLWIDTH HYPHEN-MINUS
+};
+
+static const SA_DiceStringFormatRules SA_DiceStringFormatRulesDefaultRules = {
+	.asciiCharacterClasses = {
+		['0'] = SA_DiceCharacterClass_NUMERAL,
+		['1'] = SA_DiceCharacterClass_NUMERAL,
+		['2'] = SA_DiceCharacterClass_NUMERAL,
+		['3'] = SA_DiceCharacterClass_NUMERAL,
+		['4'] = SA_DiceCharacterClass_NUMERAL,
+		['5'] = SA_DiceCharacterClass_NUMERAL,
+		['6'] = SA_DiceCharacterClass_NUMERAL,
+		['7'] = SA_DiceCharacterClass_NUMERAL,
+		['8'] = SA_DiceCharacterClass_NUMERAL,
+		['9'] = SA_DiceCharacterClass_NUMERAL,
+		['f'] = SA_DiceCharacterClass_NUMERAL,
+		['F'] = SA_DiceCharacterClass_NUMERAL,
+
+		['+'] = SA_DiceCharacterClass_OPERATOR_PLUS,
+		['-'] = SA_DiceCharacterClass_OPERATOR_MINUS,
+		['*'] = SA_DiceCharacterClass_OPERATOR_TIMES,
+
+		['d'] = SA_DiceCharacterClass_ROLL_COMMAND_SUM,
+		['D'] = SA_DiceCharacterClass_ROLL_COMMAND_SUM,
+		['e'] = SA_DiceCharacterClass_ROLL_COMMAND_SUM_EXPLODING,
+		['E'] = SA_DiceCharacterClass_ROLL_COMMAND_SUM_EXPLODING,
+
+		['k'] = SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_HIGHEST,
+		['K'] = SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_HIGHEST,
+		['l'] = SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_LOWEST,
+		['L'] = SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_LOWEST
+	},
+
+	.nonASCIICharacterClasses = SA_DiceStringFormatRulesDefaultNonASCIICharacterClasses,
+	.nonASCIICharacterClassCount = (sizeof(SA_DiceStringFormatRulesDefaultNonASCIICharacterClasses)
+									/ sizeof(SA_DiceCharacterClassMapping)),
+
+	.canonicalOperatorRepresentations = {
+		[SA_DiceExpressionOperator_MINUS]	= @"-",
+		[SA_DiceExpressionOperator_PLUS]	= @"+",
+		[SA_DiceExpressionOperator_TIMES]	= @"*"
+	},
+	.canonicalRollCommandDelimiterRepresentations = {
+		[SA_DiceExpressionRollCommand_SUM]				= @"d",
+		[SA_DiceExpressionRollCommand_SUM_EXPLODING]	= @"e"
+	},
+	.canonicalRollModifierDelimiterRepresentations = {
+		[SA_DiceExpressionRollModifier_KEEP_HIGHEST]	= @"k",
+		[SA_DiceExpressionRollModifier_KEEP_LOWEST]		= @"l"
+	},
+
+	// Indexed by bit number; see SA_DiceExpressionError.
+	.errorDescriptions = {
+		[ 0] = @"Empty expression",
+		[ 1] = @"Illegal characters detected",
+		[ 2] = @"Unknown roll command",
+		[ 3] = @"Roll modifier cannot be applied",
+		[ 4] = @"Unknown roll modifier",
+		[ 5] = @"Die count negative",
+		[ 6] = @"Too many dice",
+		[ 7] = @"Invalid die size (zero or negative)",
+		[ 8] = @"Die size too big",
+		[ 9] = @"Unknown operator",
+		[10] = @"Invalid expression",
+		[11] = @"Integer overflow during negation",
+		[12] = @"Integer overflow during addition",
+		[13] = @"Integer underflow during addition",
+		[14] = @"Integer overflow during subtraction",
+		[15] = @"Integer underflow during subtraction",
+		[16] = @"Integer overflow during multiplication",
+		[17] = @"Integer underflow during multiplication",
+		[18] = @"Can’t keep more rolls than were made",
+		[19] = @"Can’t keep a negative number of rolls",
+		[20] = @"Dice exploded too many times",
+		[21] = @"Expression too costly to evaluate"
+	}
+};
+
+/********************************/
+#pragma mark - File-scope variables
+/********************************/
+
+// The rules currently in effect; NULL means the default rules. Rules tables
+// are never deallocated, so a reader that loaded the old pointer before a
+// new table was installed may go on using it safely.
+static _Atomic(const SA_DiceStringFormatRules *) _currentRules = NULL;
+
+/********************************/
+#pragma mark - Compilation support
+/********************************/
+
+// Rules tables live for the lifetime of the process, and so must the strings
+// they refer to.
+static NSString *SA_DiceStringFormatRulesImmortalString(NSString *string) {
+	return (__bridge NSString *) CFBridgingRetain([string copy]);
+}
+
+static NSString *SA_DiceStringFormatRulesValidCharacters(NSDictionary *validCharacters,
+														 SA_DiceCharacterClass characterClass) {
+	switch (characterClass) {
+		case SA_DiceCharacterClass_NUMERAL:
+			return validCharacters[SA_DB_VALID_NUMERAL_CHARACTERS];
+		case SA_DiceCharacterClass_OPERATOR_PLUS:
+			return validCharacters[SA_DB_VALID_OPERATOR_CHARACTERS][NSStringFromSA_DiceExpressionOperator(SA_DiceExpressionOperator_PLUS)];
+		case SA_DiceCharacterClass_OPERATOR_MINUS:
+			return validCharacters[SA_DB_VALID_OPERATOR_CHARACTERS][NSStringFromSA_DiceExpressionOperator(SA_DiceExpressionOperator_MINUS)];
+		case SA_DiceCharacterClass_OPERATOR_TIMES:
+			return validCharacters[SA_DB_VALID_OPERATOR_CHARACTERS][NSStringFromSA_DiceExpressionOperator(SA_DiceExpressionOperator_TIMES)];
+		case SA_DiceCharacterClass_ROLL_COMMAND_SUM:
+			return validCharacters[SA_DB_VALID_ROLL_COMMAND_DELIMITER_CHARACTERS][NSStringFromSA_DiceExpressionRollCommand(SA_DiceExpressionRollCommand_SUM)];
+		case SA_DiceCharacterClass_ROLL_COMMAND_SUM_EXPLODING:
+			return validCharacters[SA_DB_VALID_ROLL_COMMAND_DELIMITER_CHARACTERS][NSStringFromSA_DiceExpressionRollCommand(SA_DiceExpressionRollCommand_SUM_EXPLODING)];
+		case SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_HIGHEST:
+			return validCharacters[SA_DB_VALID_ROLL_MODIFIER_DELIMITER_CHARACTERS][NSStringFromSA_DiceExpressionRollModifier(SA_DiceExpressionRollModifier_KEEP_HIGHEST)];
+		case SA_DiceCharacterClass_ROLL_MODIFIER_KEEP_LOWEST:
+			return validCharacters[SA_DB_VALID_ROLL_MODIFIER_DELIMITER_CHARACTERS][NSStringFromSA_DiceExpressionRollModifier(SA_DiceExpressionRollModifier_KEEP_LOWEST)];
+		default:
+			return nil;
+	}
+}
+
+static int SA_DiceStringFormatRulesCompareMappings(const void *a, const void *b) {
+	unichar x = ((const SA_DiceCharacterClassMapping *) a)->character;
+	unichar y = ((const SA_DiceCharacterClassMapping *) b)->character;
+	return (x > y) - (x < y);
+}
+
+static void SA_DiceStringFormatRulesCompileCharacterClasses(SA_DiceStringFormatRules *rules,
+															NSDictionary *validCharacters) {
+	memset(rules->asciiCharacterClasses, SA_DiceCharacterClass_ILLEGAL, sizeof(rules->asciiCharacterClasses));
+
+	// There are at most as many non-ASCII characters as there are
+	// characters, in all.
+	NSUInteger capacity = 0;
+	for (SA_DiceCharacterClass characterClass = SA_DiceCharacterClass_NUMERAL;
+		 characterClass < SA_DICE_CHARACTER_CLASS_COUNT;
+		 characterClass++) {
+		capacity += SA_DiceStringFormatRulesValidCharacters(validCharacters, characterClass).length;
+	}
+
+	SA_DiceCharacterClassMapping *nonASCIICharacterClasses = malloc(MAX(capacity, 1) * sizeof(SA_DiceCharacterClassMapping));
+	NSUInteger nonASCIICharacterClassCount = 0;
+	for (SA_DiceCharacterClass characterClass = SA_DiceCharacterClass_NUMERAL;
+		 characterClass < SA_DICE_CHARACTER_CLASS_COUNT;
+		 characterClass++) {
+		NSString *characters = SA_DiceStringFormatRulesValidCharacters(validCharacters, characterClass);
+		for (NSUInteger i = 0; i < characters.length; i++) {
+			unichar character = [characters characterAtIndex:i];
+			if (character < 128) {
+				if (rules->asciiCharacterClasses[character] == SA_DiceCharacterClass_ILLEGAL)
+					rules->asciiCharacterClasses[character] = characterClass;
+				continue;
+			}
+
+			// Roll strings are classified one UTF-16 code unit at a time, so
+			// characters outside the Basic Multilingual Plane can never match.
+			if (CFStringIsSurrogateHighCharacter(character) || CFStringIsSurrogateLowCharacter(character))
+				continue;
+
+			BOOL alreadyClassified = NO;
+			for (NSUInteger j = 0; j < nonASCIICharacterClassCount; j++) {
+				if (nonASCIICharacterClasses[j].character == character) {
+					alreadyClassified = YES;
+					break;
+				}
+			}
+			if (!alreadyClassified) {
+				nonASCIICharacterClasses[nonASCIICharacterClassCount++] = (SA_DiceCharacterClassMapping) { character, characterClass };
+			}
+		}
+	}
+
+	qsort(nonASCIICharacterClasses, nonASCIICharacterClassCount, sizeof(SA_DiceCharacterClassMapping), SA_DiceStringFormatRulesCompareMappings);
+
+	rules->nonASCIICharacterClasses = nonASCIICharacterClasses;
+	rules->nonASCIICharacterClassCount = nonASCIICharacterClassCount;
+}
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+const SA_DiceStringFormatRules *SA_DiceStringFormatRulesDefault(void) {
+	return &SA_DiceStringFormatRulesDefaultRules;
+}
+
+const SA_DiceStringFormatRules *SA_DiceStringFormatRulesCurrent(void) {
+	const SA_DiceStringFormatRules *rules = atomic_load_explicit(&_currentRules, memory_order_acquire);
+	return rules ?: &SA_DiceStringFormatRulesDefaultRules;
+}
+
+void SA_DiceStringFormatRulesInstall(const SA_DiceStringFormatRules *rules) {
+	atomic_store_explicit(&_currentRules, rules, memory_order_release);
+}
+
+const SA_DiceStringFormatRules *SA_DiceStringFormatRulesCreateWithPropertyLists(NSDictionary *stringFormatRules,
+																				  NSDictionary *errorDescriptions) {
+	SA_DiceStringFormatRules *rules = malloc(sizeof(SA_DiceStringFormatRules));
+	memcpy(rules, &SA_DiceStringFormatRulesDefaultRules, sizeof(SA_DiceStringFormatRules));
+
+	NSDictionary *validCharacters = stringFormatRules[SA_DB_VALID_CHARACTERS];
+	if (validCharacters != nil)
+		SA_DiceStringFormatRulesCompileCharacterClasses(rules, validCharacters);
+
+	NSDictionary *canonicalRepresentations = stringFormatRules[SA_DB_CANONICAL_REPRESENTATIONS];
+	for (SA_DiceExpressionOperator operator = SA_DiceExpressionOperator_MINUS;
+		 operator <= SA_DiceExpressionOperator_TIMES;
+		 operator++) {
+		NSString *representation = canonicalRepresentations[SA_DB_CANONICAL_OPERATOR_REPRESENTATIONS][NSStringFromSA_DiceExpressionOperator(operator)];
+		if (representation != nil)
+			rules->canonicalOperatorRepresentations[operator] = SA_DiceStringFormatRulesImmortalString(representation);
+	}
+	for (SA_DiceExpressionRollCommand command = SA_DiceExpressionRollCommand_SUM;
+		 command <= SA_DiceExpressionRollCommand_SUM_EXPLODING;
+		 command++) {
+		NSString *representation = canonicalRepresentations[SA_DB_CANONICAL_ROLL_COMMAND_DELIMITER_REPRESENTATIONS][NSStringFromSA_DiceExpressionRollCommand(command)];
+		if (representation != nil)
+			rules->canonicalRollCommandDelimiterRepresentations[command] = SA_DiceStringFormatRulesImmortalString(representation);
+	}
+	for (SA_DiceExpressionRollModifier modifier = SA_DiceExpressionRollModifier_KEEP_HIGHEST;
+		 modifier <= SA_DiceExpressionRollModifier_KEEP_LOWEST;
+		 modifier++) {
+		NSString *representation = canonicalRepresentations[SA_DB_CANONICAL_ROLL_MODIFIER_DELIMITER_REPRESENTATIONS][NSStringFromSA_DiceExpressionRollModifier(modifier)];
+		if (representation != nil)
+			rules->canonicalRollModifierDelimiterRepresentations[modifier] = SA_DiceStringFormatRulesImmortalString(representation);
+	}
+
+	for (NSUInteger i = 0; i < SA_DICE_STRING_FORMAT_RULES_ERROR_BIT_COUNT; i++) {
+		NSString *errorName = NSStringFromSA_DiceExpressionError((SA_DiceExpressionError) ((NSUInteger) 1 << i));
+		NSString *description = (errorName.length > 0) ? errorDescriptions[errorName] : nil;
+		if (description != nil)
+			rules->errorDescriptions[i] = SA_DiceStringFormatRulesImmortalString(description);
+	}
+
+	return rules;
+}
+
+SA_DiceCharacterClass SA_DiceStringFormatRulesNonASCIICharacterClass(const SA_DiceStringFormatRules *rules,
+																	  unichar character) {
+	NSUInteger low = 0;
+	NSUInteger high = rules->nonASCIICharacterClassCount;
+	while (low < high) {
+		NSUInteger middle = low + ((high - low) / 2);
+		unichar middleCharacter = rules->nonASCIICharacterClasses[middle].character;
+		if (middleCharacter == character)
+			return rules->nonASCIICharacterClasses[middle].characterClass;
+		else if (middleCharacter < character)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return SA_DiceCharacterClass_ILLEGAL;
+}
@@ -0,0 +1,57 @@
+//
+//  SA_DiceSumSampler.h
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceRNG.h"
+
+/*
+ The functions below generate the sum of rolling some number of dice, without
+ rolling each die: the sum is drawn directly from its exact probability
+ distribution (see SA_DiceDistributionCalculator.h), so the results are
+ statistically indistinguishable from those of rolling each die and adding up
+ the rolls (though, of course, a generator with a given seed does not produce
+ the same sums both ways).
+
+ Sums of many dice are drawn in chunks: the distribution of the sum of 2^k
+ dice of a given size (for each k, up to the largest for which the number of
+ possible sums is no more than a fixed limit) is computed once, when first
+ needed, and made into an alias table (Walker’s method), from which each
+ chunk’s sum is drawn with two random words. So the cost of a sum is
+ proportional to the number of dice divided by the chunk size (for six-sided
+ dice, a chunk is 4096 dice), not to the number of dice. For very large dice
+ (more than about 16,000 sides), there are no chunks, and each die is rolled
+ (though the rolls are still not stored).
+
+ The distributions are kept for the lifetime of the process, and shared by
+ all threads; a limited number of die sizes is kept (dice of other sizes are
+ rolled one at a time).
+
+ All functions are thread-safe (though the given generator must, as always,
+ be used by one thread at a time).
+ */
+
+/*********************/
+#pragma mark Functions
+/*********************/
+
+// Returns the sum of rolling the given number of dice of the given size
+// (which must be at least 1). The count and size must be such that the sum
+// cannot overflow.
+NSInteger SA_DiceSumSamplerSumOfDice(SA_DiceRNG *rng,
+									 NSUInteger dieSize,
+									 NSUInteger count);
+
+// Returns the sum of rolling the given number of Fudge dice.
+NSInteger SA_DiceSumSamplerSumOfFudgeDice(SA_DiceRNG *rng,
+										  NSUInteger count);
+
+// Returns the number of random words that SA_DiceSumSamplerSumOfDice() draws
+// for the given number of dice of the given size - not counting any that are
+// rejected (see SA_DiceRNGUniform()), and assuming that the die size is one
+// for which tables are kept.
+NSUInteger SA_DiceSumSamplerWordCount(NSUInteger dieSize,
+									  NSUInteger count);
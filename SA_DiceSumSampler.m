@@ -0,0 +1,270 @@
+//
+//  SA_DiceSumSampler.m
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+#import "SA_DiceSumSampler.h"
+
+#import "SA_DiceDistribution.h"
+#import "SA_DiceDistributionCalculator.h"
+#import "SA_DiceExpression.h"
+
+#import <pthread.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+// The largest number of possible sums an alias table may have.
+#define MAX_TABLE_SIZE			(1 << 15)
+
+// The largest number of die sizes for which alias tables are kept.
+#define MAX_DIE_SIZE_COUNT		64
+
+// Fewer dice than this are simply rolled (and added up).
+#define SAMPLING_THRESHOLD		32
+
+// Enough levels for any die size (a table for 2^k dice of size 2 or more has
+// more than 2^k possible sums).
+#define MAX_LEVEL_COUNT			16
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+// An alias table for the sum of some number of dice (each counted from 0, so
+// the possible sums are 0 through ‘count’ − 1).
+typedef struct {
+	NSUInteger count;
+	double *probabilities;
+	uint32_t *aliases;
+} SA_DiceSumTable;
+
+// The alias tables for one die size: the table at index k is for the sum of
+// 2^k dice (for k from 1 up to ‘levelCount’; there is no table for a single
+// die). Tables are built as they are needed.
+typedef struct {
+	NSUInteger dieSize;
+	NSUInteger levelCount;
+	SA_DiceSumTable *tables[MAX_LEVEL_COUNT + 1];
+} SA_DiceSumTableSet;
+
+/**********************************/
+#pragma mark - File-scope variables
+/**********************************/
+
+// Guards the table sets (and the building of tables). Table sets and tables,
+// once built, are never modified or freed.
+static pthread_mutex_t _tableSetsLock = PTHREAD_MUTEX_INITIALIZER;
+static SA_DiceSumTableSet *_tableSets[MAX_DIE_SIZE_COUNT];
+static NSUInteger _tableSetCount = 0;
+
+/**************************/
+#pragma mark - Alias tables
+/**************************/
+
+// Builds an alias table for the sum of the given number of dice of the given
+// size (Vose’s method).
+static SA_DiceSumTable *SA_DiceSumTableCreate(NSUInteger dieSize,
+											  NSUInteger diceCount) {
+	NSUInteger count = (diceCount * (dieSize - 1)) + 1;
+
+	SA_DiceExpression *dieCountExpression = [SA_DiceExpression new];
+	dieCountExpression.type = SA_DiceExpressionTerm_VALUE;
+	dieCountExpression.value = @(diceCount);
+	SA_DiceExpression *dieSizeExpression = [SA_DiceExpression new];
+	dieSizeExpression.type = SA_DiceExpressionTerm_VALUE;
+	dieSizeExpression.value = @(dieSize);
+	SA_DiceExpression *rollCommand = [SA_DiceExpression new];
+	rollCommand.type = SA_DiceExpressionTerm_ROLL_COMMAND;
+	rollCommand.rollCommand = SA_DiceExpressionRollCommand_SUM;
+	rollCommand.dieType = SA_DiceExpressionDice_STANDARD;
+	rollCommand.dieCount = dieCountExpression;
+	rollCommand.dieSize = dieSizeExpression;
+
+	SA_DiceDistributionCalculator *calculator = [SA_DiceDistributionCalculator new];
+	calculator.maxDieCount = diceCount;
+	calculator.maxDieSize = dieSize;
+	calculator.maxValueCount = MAX_TABLE_SIZE;
+	calculator.maxOperationCount = NSUIntegerMax;
+	SA_DiceDistribution *distribution = [calculator distributionOfExpression:rollCommand];
+
+	SA_DiceSumTable *table = malloc(sizeof(SA_DiceSumTable));
+	table->count = count;
+	table->probabilities = malloc(count * sizeof(double));
+	table->aliases = malloc(count * sizeof(uint32_t));
+
+	// Scale the probabilities so that they average 1. (Convolution may leave
+	// tiny negative values where the true probabilities are vanishingly
+	// small; these are taken to be 0.)
+	double totalProbability = 0.0;
+	for (NSUInteger i = 0; i < count; i++) {
+		table->probabilities[i] = MAX([distribution probabilityOfValue:(NSInteger) (diceCount + i)], 0.0);
+		totalProbability += table->probabilities[i];
+	}
+	for (NSUInteger i = 0; i < count; i++)
+		table->probabilities[i] *= (double) count / totalProbability;
+
+	// Pair each value with less than its share of probability with one that
+	// has more than its share.
+	NSUInteger *small = malloc(count * sizeof(NSUInteger));
+	NSUInteger *large = malloc(count * sizeof(NSUInteger));
+	NSUInteger smallCount = 0, largeCount = 0;
+	for (NSUInteger i = 0; i < count; i++) {
+		if (table->probabilities[i] < 1.0) {
+			small[smallCount++] = i;
+		} else {
+			large[largeCount++] = i;
+		}
+	}
+	while (   smallCount > 0
+		   && largeCount > 0) {
+		NSUInteger lesser = small[--smallCount];
+		NSUInteger greater = large[largeCount - 1];
+
+		table->aliases[lesser] = (uint32_t) greater;
+		table->probabilities[greater] -= (1.0 - table->probabilities[lesser]);
+		if (table->probabilities[greater] < 1.0) {
+			largeCount--;
+			small[smallCount++] = greater;
+		}
+	}
+	// (Whatever is left over has, but for rounding, exactly its share.)
+	while (largeCount > 0) {
+		NSUInteger i = large[--largeCount];
+		table->probabilities[i] = 1.0;
+		table->aliases[i] = (uint32_t) i;
+	}
+	while (smallCount > 0) {
+		NSUInteger i = small[--smallCount];
+		table->probabilities[i] = 1.0;
+		table->aliases[i] = (uint32_t) i;
+	}
+
+	free(small);
+	free(large);
+
+	return table;
+}
+
+NS_INLINE NSUInteger SA_DiceSumTableSample(const SA_DiceSumTable *table,
+										   SA_DiceRNG *rng) {
+	NSUInteger i = (NSUInteger) SA_DiceRNGUniform(rng, table->count);
+	double u = (double) (SA_DiceRNGNextWord(rng) >> 11) * 0x1.0p-53;
+	return (u < table->probabilities[i]) ? i : table->aliases[i];
+}
+
+// The number of levels of tables for the given die size (i.e., the largest
+// k such that the sum of 2^k dice has no more than MAX_TABLE_SIZE possible
+// sums).
+static NSUInteger SA_DiceSumSamplerLevelCount(NSUInteger dieSize) {
+	NSUInteger levelCount = 0;
+	while (   levelCount < MAX_LEVEL_COUNT
+		   && (((NSUInteger) 1 << (levelCount + 1)) * (dieSize - 1)) + 1 <= MAX_TABLE_SIZE)
+		levelCount++;
+	return levelCount;
+}
+
+// Returns the table set for the given die size, with every table needed for
+// the sum of the given number of dice built; or NULL, if there is no room for
+// another die size.
+static SA_DiceSumTableSet *SA_DiceSumTableSetForDieSize(NSUInteger dieSize,
+														NSUInteger diceCount) {
+	pthread_mutex_lock(&_tableSetsLock);
+
+	SA_DiceSumTableSet *tableSet = NULL;
+	for (NSUInteger i = 0; i < _tableSetCount; i++) {
+		if (_tableSets[i]->dieSize == dieSize) {
+			tableSet = _tableSets[i];
+			break;
+		}
+	}
+	if (   tableSet == NULL
+		&& _tableSetCount < MAX_DIE_SIZE_COUNT) {
+		tableSet = calloc(1, sizeof(SA_DiceSumTableSet));
+		tableSet->dieSize = dieSize;
+		tableSet->levelCount = SA_DiceSumSamplerLevelCount(dieSize);
+		_tableSets[_tableSetCount++] = tableSet;
+	}
+
+	if (tableSet != NULL) {
+		NSUInteger levelCount = tableSet->levelCount;
+		for (NSUInteger level = 1; level <= levelCount; level++) {
+			BOOL needed = ((level < levelCount)
+						   ? ((diceCount & ((NSUInteger) 1 << level)) != 0)
+						   : ((diceCount >> levelCount) != 0));
+			if (   needed
+				&& tableSet->tables[level] == NULL)
+				tableSet->tables[level] = SA_DiceSumTableCreate(dieSize, (NSUInteger) 1 << level);
+		}
+	}
+
+	pthread_mutex_unlock(&_tableSetsLock);
+
+	return tableSet;
+}
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+NSInteger SA_DiceSumSamplerSumOfDice(SA_DiceRNG *rng,
+									 NSUInteger dieSize,
+									 NSUInteger count) {
+	if (dieSize == 1)
+		return (NSInteger) count;
+
+	// Each die is counted from 0 (and 1 is added for each at the end).
+	NSUInteger sum = 0;
+
+	SA_DiceSumTableSet *tableSet = ((count >= SAMPLING_THRESHOLD)
+									? SA_DiceSumTableSetForDieSize(dieSize, count)
+									: NULL);
+	if (   tableSet == NULL
+		|| tableSet->levelCount == 0) {
+		for (NSUInteger i = 0; i < count; i++)
+			sum += (NSUInteger) SA_DiceRNGUniform(rng, dieSize);
+		return (NSInteger) (sum + count);
+	}
+
+	// The dice are divided into chunks of 2^levelCount dice, and whatever is
+	// left over is divided into chunks of each power of two in its binary
+	// representation.
+	NSUInteger levelCount = tableSet->levelCount;
+	const SA_DiceSumTable *largestTable = tableSet->tables[levelCount];
+	for (NSUInteger i = 0; i < (count >> levelCount); i++)
+		sum += SA_DiceSumTableSample(largestTable, rng);
+	for (NSUInteger level = 1; level < levelCount; level++) {
+		if ((count & ((NSUInteger) 1 << level)) != 0)
+			sum += SA_DiceSumTableSample(tableSet->tables[level], rng);
+	}
+	if ((count & 1) != 0)
+		sum += (NSUInteger) SA_DiceRNGUniform(rng, dieSize);
+
+	return (NSInteger) (sum + count);
+}
+
+NSInteger SA_DiceSumSamplerSumOfFudgeDice(SA_DiceRNG *rng,
+										  NSUInteger count) {
+	// A Fudge die is a d3, relabeled as −1, 0, and 1.
+	return SA_DiceSumSamplerSumOfDice(rng, 3, count) - (2 * (NSInteger) count);
+}
+
+NSUInteger SA_DiceSumSamplerWordCount(NSUInteger dieSize,
+									  NSUInteger count) {
+	if (dieSize <= 1)
+		return 0;
+
+	NSUInteger levelCount = SA_DiceSumSamplerLevelCount(dieSize);
+	if (   count < SAMPLING_THRESHOLD
+		|| levelCount == 0)
+		return count;
+
+	// Two words for each chunk (see SA_DiceSumSamplerSumOfDice()), and one
+	// for the odd die, if any.
+	NSUInteger lesserLevels = count & (((NSUInteger) 1 << levelCount) - 2);
+	return ((2 * (count >> levelCount))
+			+ (2 * (NSUInteger) __builtin_popcountl(lesserLevels))
+			+ (count & 1));
+}
@@ -0,0 +1,196 @@
+//
+//  main.m
+//  sa_dice_archive_check
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+/*
+ sa_dice_archive_check checks that decoding an expression archive (see
+ SA_DiceExpressionArchive.h) is safe, whatever the bytes: archives are read
+ from roll history files, which may be corrupt (or tampered with).
+
+ USAGE:
+	sa_dice_archive_check
+
+ For each roll string of a built-in corpus, the roll string is parsed,
+ evaluated, and archived, and then:
+
+ 1. The archive is decoded, and the decoded expression must format exactly
+ as the original does.
+
+ 2. The archive is corrupted in every way of each of these kinds, and each
+ corrupted archive is decoded (and, if it decodes, formatted): every
+ truncation; every byte replaced by each of a set of values (including every
+ value just past the end of each enumeration of node attributes); and a huge
+ varint (as a malformed explosion count, or roll count, would be) inserted at
+ every position.
+
+ A corrupted archive may fail to decode (its expression is nil), or decode to
+ some other expression; but every decoded expression must have node
+ attributes within their enumerations, and no more than
+ SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT rolls (and must format without
+ crashing). The number of archives checked, and of failures, are written to
+ standard output; the exit status is 1 if there were any failures.
+
+ Build by compiling this file together with the library’s sources, e.g.:
+	clang -fobjc-arc -framework Foundation -I.. ../*.m main.m -o sa_dice_archive_check
+ */
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceExpression.h"
+#import "SA_DiceExpressionArchive.h"
+#import "SA_DiceFormatter.h"
+#import "SA_DiceParser.h"
+#import "SA_DiceRollBuffer.h"
+
+#import <stdio.h>
+
+/***********************/
+#pragma mark Definitions
+/***********************/
+
+typedef struct {
+	NSUInteger archiveCount;
+	NSUInteger decodedCount;
+	NSUInteger failureCount;
+} SA_DiceArchiveCheckTally;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+// Counts the rolls of the given expression and its sub-expressions, and
+// checks their node attributes; returns NO if any attribute is out of range.
+static BOOL SA_DiceArchiveCheckExpression(SA_DiceExpression *expression,
+										  NSUInteger *rollCount) {
+	if (expression == nil)
+		return YES;
+
+	if (   expression.type > SA_DiceExpressionTerm_VALUE
+		|| expression.operator > SA_DiceExpressionOperator_TIMES
+		|| expression.rollCommand > SA_DiceExpressionRollCommand_SUM_EXPLODING
+		|| expression.dieType > SA_DiceExpressionDice_FUDGE
+		|| expression.rollModifier > SA_DiceExpressionRollModifier_KEEP_LOWEST)
+		return NO;
+
+	*rollCount += expression.rolls.count;
+
+	return (   SA_DiceArchiveCheckExpression(expression.leftOperand, rollCount)
+			&& SA_DiceArchiveCheckExpression(expression.rightOperand, rollCount)
+			&& SA_DiceArchiveCheckExpression(expression.dieCount, rollCount)
+			&& SA_DiceArchiveCheckExpression(expression.dieSize, rollCount));
+}
+
+// Decodes the given (possibly corrupted) bytes, and checks the decoded
+// expression (if any).
+static void SA_DiceArchiveCheckBytes(NSData *bytes,
+									 SA_DiceFormatter *formatter,
+									 NSString *description,
+									 SA_DiceArchiveCheckTally *tally) {
+	tally->archiveCount++;
+
+	SA_DiceExpressionArchive *archive = [[SA_DiceExpressionArchive alloc] initWithData:bytes];
+	SA_DiceExpression *expression = archive.expression;
+	if (expression == nil)
+		return;
+	tally->decodedCount++;
+
+	NSUInteger rollCount = 0;
+	if (   !SA_DiceArchiveCheckExpression(expression, &rollCount)
+		|| rollCount > SA_DICE_EXPRESSION_ARCHIVE_MAX_ROLL_COUNT) {
+		printf("FAIL: %s decoded to an invalid expression\n", description.UTF8String);
+		tally->failureCount++;
+		return;
+	}
+
+	[formatter stringFromExpression:expression];
+}
+
+/******************/
+#pragma mark - Main
+/******************/
+
+int main(int argc, char * const argv[]) {
+	@autoreleasepool {
+		NSArray <NSString *> *corpus = @[ @"1d20+5", @"4d6k3", @"2d20l1", @"4e6", @"10e10+2e4", @"4dF+2", @"4d4d4", @"2*1d4-3", @"1d0", @"fish" ];
+
+		// Every value just past the end of each enumeration of node
+		// attributes, and a few others.
+		const uint8_t replacementValues[] = {
+			0x00, 0x01, 0x02,
+			SA_DiceExpressionTerm_VALUE + 1,
+			SA_DiceExpressionOperator_TIMES + 1,
+			SA_DiceExpressionRollCommand_SUM_EXPLODING + 1,
+			SA_DiceExpressionDice_FUDGE + 1,
+			SA_DiceExpressionRollModifier_KEEP_LOWEST + 1,
+			0x7F, 0x80, 0xFE, 0xFF
+		};
+
+		// The largest varint that decodes (2^63 - 1).
+		const uint8_t hugeVarint[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F };
+
+		SA_DiceParser *parser = [SA_DiceParser parserWithBehavior:SA_DiceParserBehaviorLegacy];
+		SA_DiceEvaluator *evaluator = [SA_DiceEvaluator new];
+		SA_DiceFormatter *formatter = [SA_DiceFormatter formatterWithBehavior:SA_DiceFormatterBehaviorLegacy];
+
+		SA_DiceArchiveCheckTally tally = { 0 };
+		for (NSString *rollString in corpus) {
+			SA_DiceExpression *result = [evaluator resultOfExpression:[parser expressionForString:rollString]];
+			if (result == nil)
+				continue;
+			NSData *data = [SA_DiceExpressionArchive archiveWithExpression:result].data;
+			const uint8_t *bytes = data.bytes;
+			NSUInteger length = data.length;
+
+			// The intact archive.
+			tally.archiveCount++;
+			NSString *expected = [formatter stringFromExpression:result];
+			NSString *decoded = [formatter stringFromExpression:[[SA_DiceExpressionArchive alloc] initWithData:data].expression];
+			if (![decoded isEqualToString:expected]) {
+				printf("FAIL: “%s” decoded as “%s” (expected “%s”)\n", rollString.UTF8String, decoded.UTF8String, expected.UTF8String);
+				tally.failureCount++;
+			}
+
+			for (NSUInteger i = 0; i < length; i++) {
+				@autoreleasepool {
+					SA_DiceArchiveCheckBytes([NSData dataWithBytes:bytes
+															length:i],
+											 formatter,
+											 [NSString stringWithFormat:@"“%@” truncated to %lu bytes", rollString, (unsigned long) i],
+											 &tally);
+
+					for (NSUInteger j = 0; j < sizeof(replacementValues); j++) {
+						if (bytes[i] == replacementValues[j])
+							continue;
+
+						NSMutableData *corrupted = [data mutableCopy];
+						((uint8_t *) corrupted.mutableBytes)[i] = replacementValues[j];
+						SA_DiceArchiveCheckBytes(corrupted,
+												 formatter,
+												 [NSString stringWithFormat:@"“%@” with byte %lu set to 0x%02X", rollString, (unsigned long) i, replacementValues[j]],
+												 &tally);
+					}
+
+					NSMutableData *corrupted = [data mutableCopy];
+					[corrupted replaceBytesInRange:NSMakeRange(i, 0)
+										 withBytes:hugeVarint
+											length:sizeof(hugeVarint)];
+					SA_DiceArchiveCheckBytes(corrupted,
+											 formatter,
+											 [NSString stringWithFormat:@"“%@” with a huge varint at byte %lu", rollString, (unsigned long) i],
+											 &tally);
+				}
+			}
+		}
+
+		printf("%lu archives checked (%lu decoded), %lu failures\n",
+			   (unsigned long) tally.archiveCount,
+			   (unsigned long) tally.decodedCount,
+			   (unsigned long) tally.failureCount);
+
+		return (tally.failureCount > 0) ? 1 : 0;
+	}
+}
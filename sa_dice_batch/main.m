@@ -0,0 +1,379 @@
+//
+//  main.m
+//  sa_dice_batch
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+/*
+ sa_dice_batch reads die roll strings, one per line (each optionally followed
+ by a label, separated by a semicolon, as in “4d6+2d4+3+20;Hasan_the_Great”),
+ from a file or from standard input, and writes the formatted result of each,
+ one per line, in the same order, to standard output. When done, it reports
+ the number of lines processed, and the throughput, to standard error.
+
+ USAGE:
+	sa_dice_batch [-f legacy|simple] [-j threads] [file]
+
+ -f		The formatter behavior (see SA_DiceFormatter.h). The default is legacy.
+ -j		The number of threads for each of the parsing, evaluating, and
+		formatting stages. The default is one per three active cores.
+ file	The file to read (if omitted, or “-”, standard input is read).
+
+ Parsing (and compiling), evaluating, and formatting run as concurrent
+ pipeline stages, connected by bounded queues; lines travel through the
+ pipeline in batches. The number of batches in flight at once is bounded
+ (so memory use does not grow with the size of the input), and the writer
+ puts finished batches back in input order.
+
+ Build by compiling this file together with the library’s sources, e.g.:
+	clang -fobjc-arc -framework Foundation -I.. ../*.m main.m -o sa_dice_batch
+ */
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceExpression.h"
+#import "SA_DiceExpressionCache.h"
+#import "SA_DiceFormatter.h"
+#import "SA_DiceParser.h"
+#import "SA_DiceProgram.h"
+
+#import <stdio.h>
+#import <time.h>
+#import <unistd.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+// Lines per batch, and the largest number of batches in flight at once.
+#define BATCH_SIZE			256
+#define MAX_BATCHES_IN_FLIGHT	64
+
+// Capacity of each queue between stages (in batches).
+#define QUEUE_CAPACITY		16
+
+/********************************************/
+#pragma mark - SA_DiceBatch class declaration
+/********************************************/
+
+// A batch of lines, and the results of each stage for each line.
+@interface SA_DiceBatch : NSObject
+
+@property NSUInteger sequenceNumber;
+
+@property NSMutableArray <NSString *> *rollStrings;
+@property NSMutableArray *labels;				// NSString, or NSNull
+@property NSMutableArray *expressions;			// SA_DiceProgram, then SA_DiceExpression
+@property NSMutableArray <NSString *> *outputLines;
+
+@end
+
+@implementation SA_DiceBatch
+
+-(instancetype) init {
+	if (!(self = [super init]))
+		return nil;
+
+	_rollStrings = [NSMutableArray arrayWithCapacity:BATCH_SIZE];
+	_labels = [NSMutableArray arrayWithCapacity:BATCH_SIZE];
+
+	return self;
+}
+
+@end
+
+/*************************************************/
+#pragma mark - SA_DiceBatchQueue class declaration
+/*************************************************/
+
+// A bounded, blocking, multi-producer multi-consumer queue of batches.
+@interface SA_DiceBatchQueue : NSObject
+
+-(instancetype) initWithCapacity:(NSUInteger)capacity;
+
+// Blocks while the queue is full.
+-(void) push:(SA_DiceBatch *)batch;
+
+// Blocks while the queue is empty; returns nil once the queue is empty and
+// closed.
+-(SA_DiceBatch *) pop;
+
+// Signals that nothing more will be pushed.
+-(void) close;
+
+@end
+
+@implementation SA_DiceBatchQueue {
+	NSCondition *_condition;
+	NSMutableArray <SA_DiceBatch *> *_batches;
+	NSUInteger _capacity;
+	BOOL _closed;
+}
+
+-(instancetype) initWithCapacity:(NSUInteger)capacity {
+	if (!(self = [super init]))
+		return nil;
+
+	_condition = [NSCondition new];
+	_batches = [NSMutableArray arrayWithCapacity:capacity];
+	_capacity = capacity;
+
+	return self;
+}
+
+-(void) push:(SA_DiceBatch *)batch {
+	[_condition lock];
+	while (_batches.count >= _capacity)
+		[_condition wait];
+	[_batches addObject:batch];
+	[_condition broadcast];
+	[_condition unlock];
+}
+
+-(SA_DiceBatch *) pop {
+	[_condition lock];
+	while (   _batches.count == 0
+		   && !_closed)
+		[_condition wait];
+	SA_DiceBatch *batch = _batches.firstObject;
+	if (batch != nil)
+		[_batches removeObjectAtIndex:0];
+	[_condition broadcast];
+	[_condition unlock];
+
+	return batch;
+}
+
+-(void) close {
+	[_condition lock];
+	_closed = YES;
+	[_condition broadcast];
+	[_condition unlock];
+}
+
+@end
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+static double SA_DiceBatchCurrentTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) now.tv_sec + ((double) now.tv_nsec / 1e9);
+}
+
+static void SA_DiceBatchPrintUsage(void) {
+	fprintf(stderr, "usage: sa_dice_batch [-f legacy|simple] [-j threads] [file]\n");
+}
+
+// Runs the given number of workers for a stage; each pops batches from the
+// input queue, processes them, and pushes them to the output queue. When the
+// last worker finishes, the output queue is closed.
+static void SA_DiceBatchStartStage(NSUInteger workerCount,
+								   SA_DiceBatchQueue *input,
+								   SA_DiceBatchQueue *output,
+								   void (^process)(SA_DiceBatch *batch)) {
+	dispatch_group_t group = dispatch_group_create();
+	for (NSUInteger i = 0; i < workerCount; i++) {
+		NSThread *thread = [[NSThread alloc] initWithBlock:^{
+			SA_DiceBatch *batch;
+			while ((batch = [input pop]) != nil) {
+				@autoreleasepool {
+					process(batch);
+				}
+				[output push:batch];
+			}
+			dispatch_group_leave(group);
+		}];
+		dispatch_group_enter(group);
+		[thread start];
+	}
+
+	dispatch_group_notify(group, dispatch_get_global_queue(QOS_CLASS_DEFAULT, 0), ^{
+		[output close];
+	});
+}
+
+/******************/
+#pragma mark - Main
+/******************/
+
+int main(int argc, char * const argv[]) {
+	@autoreleasepool {
+		SA_DiceFormatterBehavior formatterBehavior = SA_DiceFormatterBehaviorLegacy;
+		NSUInteger workerCount = MAX(NSProcessInfo.processInfo.activeProcessorCount / 3, 1);
+
+		int option;
+		while ((option = getopt(argc, argv, "f:j:")) != -1) {
+			switch (option) {
+				case 'f':
+					if (strcmp(optarg, "legacy") == 0) {
+						formatterBehavior = SA_DiceFormatterBehaviorLegacy;
+					} else if (strcmp(optarg, "simple") == 0) {
+						formatterBehavior = SA_DiceFormatterBehaviorSimple;
+					} else {
+						SA_DiceBatchPrintUsage();
+						return 1;
+					}
+					break;
+				case 'j':
+					workerCount = (NSUInteger) MAX(atol(optarg), 1);
+					break;
+				default:
+					SA_DiceBatchPrintUsage();
+					return 1;
+			}
+		}
+
+		FILE *inputFile = stdin;
+		if (   optind < argc
+			&& strcmp(argv[optind], "-") != 0) {
+			inputFile = fopen(argv[optind], "r");
+			if (inputFile == NULL) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+
+		// Parsers, evaluators, and formatters may be shared between threads
+		// (see README.md).
+		SA_DiceParser *parser = [SA_DiceParser parserWithBehavior:SA_DiceParserBehaviorLegacy];
+		SA_DiceEvaluator *evaluator = [SA_DiceEvaluator new];
+		SA_DiceFormatter *formatter = [SA_DiceFormatter formatterWithBehavior:formatterBehavior];
+		SA_DiceExpressionCache *cache = [SA_DiceExpressionCache sharedCache];
+
+		SA_DiceBatchQueue *parseQueue = [[SA_DiceBatchQueue alloc] initWithCapacity:QUEUE_CAPACITY];
+		SA_DiceBatchQueue *evaluateQueue = [[SA_DiceBatchQueue alloc] initWithCapacity:QUEUE_CAPACITY];
+		SA_DiceBatchQueue *formatQueue = [[SA_DiceBatchQueue alloc] initWithCapacity:QUEUE_CAPACITY];
+		SA_DiceBatchQueue *writeQueue = [[SA_DiceBatchQueue alloc] initWithCapacity:QUEUE_CAPACITY];
+
+		SA_DiceBatchStartStage(workerCount, parseQueue, evaluateQueue, ^(SA_DiceBatch *batch) {
+			batch.expressions = [NSMutableArray arrayWithCapacity:batch.rollStrings.count];
+			for (NSString *rollString in batch.rollStrings)
+				[batch.expressions addObject:[cache programForString:rollString
+															  parser:parser]];
+		});
+		SA_DiceBatchStartStage(workerCount, evaluateQueue, formatQueue, ^(SA_DiceBatch *batch) {
+			for (NSUInteger i = 0; i < batch.expressions.count; i++)
+				batch.expressions[i] = [evaluator resultOfProgram:batch.expressions[i]];
+		});
+		SA_DiceBatchStartStage(workerCount, formatQueue, writeQueue, ^(SA_DiceBatch *batch) {
+			batch.outputLines = [NSMutableArray arrayWithCapacity:batch.expressions.count];
+			for (NSUInteger i = 0; i < batch.expressions.count; i++) {
+				NSString *outputLine = [formatter stringFromExpression:batch.expressions[i]];
+				if (batch.labels[i] != [NSNull null])
+					outputLine = [NSString stringWithFormat:@"(%@) %@", batch.labels[i], outputLine];
+				[batch.outputLines addObject:outputLine];
+			}
+			batch.expressions = nil;
+			batch.rollStrings = nil;
+		});
+
+		// Bounds the number of batches between the reader and the writer.
+		dispatch_semaphore_t batchesInFlight = dispatch_semaphore_create(MAX_BATCHES_IN_FLIGHT);
+
+		// The writer: puts batches back in order (each in-flight batch has a
+		// distinct slot), and writes them out.
+		__block NSUInteger lineCount = 0;
+		dispatch_semaphore_t writerDone = dispatch_semaphore_create(0);
+		NSThread *writer = [[NSThread alloc] initWithBlock:^{
+			NSMutableArray *pendingBatches = [NSMutableArray arrayWithCapacity:MAX_BATCHES_IN_FLIGHT];
+			for (NSUInteger i = 0; i < MAX_BATCHES_IN_FLIGHT; i++)
+				[pendingBatches addObject:[NSNull null]];
+			NSUInteger nextSequenceNumber = 0;
+
+			SA_DiceBatch *batch;
+			while ((batch = [writeQueue pop]) != nil) {
+				pendingBatches[batch.sequenceNumber % MAX_BATCHES_IN_FLIGHT] = batch;
+
+				id nextBatch;
+				while ((nextBatch = pendingBatches[nextSequenceNumber % MAX_BATCHES_IN_FLIGHT]) != [NSNull null]) {
+					@autoreleasepool {
+						for (NSString *outputLine in ((SA_DiceBatch *) nextBatch).outputLines) {
+							fputs(outputLine.UTF8String, stdout);
+							fputc('\n', stdout);
+						}
+					}
+					lineCount += ((SA_DiceBatch *) nextBatch).outputLines.count;
+					pendingBatches[nextSequenceNumber % MAX_BATCHES_IN_FLIGHT] = [NSNull null];
+					nextSequenceNumber++;
+					dispatch_semaphore_signal(batchesInFlight);
+				}
+			}
+
+			fflush(stdout);
+			dispatch_semaphore_signal(writerDone);
+		}];
+		[writer start];
+
+		// The reader (on this thread).
+		double startTime = SA_DiceBatchCurrentTime();
+		NSUInteger byteCount = 0;
+		NSUInteger sequenceNumber = 0;
+		char *line = NULL;
+		size_t lineCapacity = 0;
+		ssize_t lineLength;
+		SA_DiceBatch *batch = nil;
+		while ((lineLength = getline(&line, &lineCapacity, inputFile)) != -1) {
+			@autoreleasepool {
+				byteCount += (NSUInteger) lineLength;
+				while (   lineLength > 0
+					   && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+					lineLength--;
+
+				NSString *lineString = ([[NSString alloc] initWithBytes:line
+																 length:(NSUInteger) lineLength
+															   encoding:NSUTF8StringEncoding]
+										?: [[NSString alloc] initWithBytes:line
+																	length:(NSUInteger) lineLength
+																  encoding:NSISOLatin1StringEncoding]);
+
+				// The label (if any) follows the first semicolon.
+				NSString *rollString = lineString;
+				id label = [NSNull null];
+				NSRange labelDelimiterRange = [lineString rangeOfString:@";"];
+				if (labelDelimiterRange.location != NSNotFound) {
+					rollString = [lineString substringToIndex:labelDelimiterRange.location];
+					NSString *labelString = [lineString substringFromIndex:NSMaxRange(labelDelimiterRange)];
+					if (labelString.length > 0)
+						label = labelString;
+				}
+
+				if (batch == nil) {
+					dispatch_semaphore_wait(batchesInFlight, DISPATCH_TIME_FOREVER);
+					batch = [SA_DiceBatch new];
+					batch.sequenceNumber = sequenceNumber++;
+				}
+				[batch.rollStrings addObject:rollString];
+				[batch.labels addObject:label];
+
+				if (batch.rollStrings.count == BATCH_SIZE) {
+					[parseQueue push:batch];
+					batch = nil;
+				}
+			}
+		}
+		if (batch != nil)
+			[parseQueue push:batch];
+		[parseQueue close];
+
+		free(line);
+		if (inputFile != stdin)
+			fclose(inputFile);
+
+		dispatch_semaphore_wait(writerDone, DISPATCH_TIME_FOREVER);
+		double elapsedTime = SA_DiceBatchCurrentTime() - startTime;
+
+		fprintf(stderr, "%lu lines (%lu bytes) in %.3f s: %.0f lines/s, %.2f MB/s\n",
+				(unsigned long) lineCount,
+				(unsigned long) byteCount,
+				elapsedTime,
+				(elapsedTime > 0.0) ? ((double) lineCount / elapsedTime) : 0.0,
+				(elapsedTime > 0.0) ? ((double) byteCount / elapsedTime / 1e6) : 0.0);
+	}
+
+	return 0;
+}
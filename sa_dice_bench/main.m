@@ -0,0 +1,570 @@
+//
+//  main.m
+//  sa_dice_bench
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+/*
+ sa_dice_bench measures the throughput and latency of parsing
+ (-[SA_DiceParser expressionForString:]), evaluating (-[SA_DiceEvaluator
+ resultOfExpression:]), and formatting (-[SA_DiceFormatter
+ stringFromExpression:]), each separately and all three together (“end to
+ end”), over a corpus of roll strings.
+
+ USAGE:
+	sa_dice_bench [-n rounds] [-w rounds] [-o text|json] [-b baseline.json] [corpus]
+
+ -n			The number of measured rounds over the corpus. The default is 200.
+ -w			The number of warm-up rounds (not measured). The default is 2.
+ -o			The output format. The default is text.
+ -b			A previous run’s JSON output, to compare this run to (the text
+			output then also shows the change in throughput and p99 latency).
+ corpus		A file of roll strings, one per line, each optionally followed by a
+			category, separated by a semicolon (as in “4d6k3;keep”); strings
+			without a category are in the category “custom”. If omitted, the
+			built-in corpus is used.
+
+ The built-in corpus has the categories “short” (typical chat-bot rolls),
+ “chained” (long sums), “nested” (roll commands as die counts, as in
+ “4d4d4d4”), “keep”, “exploding”, “fudge”, and “error” (strings that fail to
+ parse or to evaluate). Each operation is benchmarked for each category, and
+ for the whole corpus (“all”).
+
+ For each benchmark, the output gives the number of operations measured,
+ operations per second, the 50th, 99th, and 99.9th percentile latency (in
+ nanoseconds), and the number of memory allocations per operation. Each
+ operation is timed individually, including the release of everything it
+ created. (Allocations are counted only on macOS, via malloc_logger, and on
+ glibc systems, by wrapping malloc(); elsewhere, they are reported as
+ unavailable.)
+
+ The JSON output is meant to be kept, and compared (with -b) to that of
+ another build; benchmarks are matched by name (e.g., “parse/short”).
+
+ Build by compiling this file together with the library’s sources, e.g.:
+	clang -O2 -fobjc-arc -framework Foundation -I.. ../*.m main.m -o sa_dice_bench
+ */
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceExpression.h"
+#import "SA_DiceFormatter.h"
+#import "SA_DiceParser.h"
+
+#import <pthread.h>
+#import <stdio.h>
+#import <stdlib.h>
+#import <time.h>
+#import <unistd.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+#define DEFAULT_ROUND_COUNT			200
+#define DEFAULT_WARM_UP_ROUND_COUNT	2
+
+// Incremented whenever the meaning of the JSON output changes.
+#define OUTPUT_FORMAT_VERSION		1
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+typedef NS_ENUM(NSUInteger, SA_DiceBenchOperation) {
+	SA_DiceBenchOperation_PARSE,
+	SA_DiceBenchOperation_EVALUATE,
+	SA_DiceBenchOperation_FORMAT,
+	SA_DiceBenchOperation_END_TO_END
+};
+
+typedef NS_ENUM(NSUInteger, SA_DiceBenchOutputFormat) {
+	SA_DiceBenchOutputFormat_TEXT,
+	SA_DiceBenchOutputFormat_JSON
+};
+
+typedef struct {
+	NSUInteger operationCount;
+	double operationsPerSecond;
+	uint64_t p50Latency;
+	uint64_t p99Latency;
+	uint64_t p999Latency;
+	double allocationsPerOperation;
+} SA_DiceBenchMeasurement;
+
+/*********************************/
+#pragma mark - Allocation counting
+/*********************************/
+
+// Allocations are counted only on the thread that runs the benchmarks (so
+// that the counter need not be atomic, and so that the allocations of other
+// threads do not disturb the count).
+static pthread_t SA_DiceBenchThread;
+static volatile uint64_t SA_DiceBenchAllocationCount = 0;
+
+static inline void SA_DiceBenchCountAllocation(void) {
+	if (pthread_equal(pthread_self(), SA_DiceBenchThread))
+		SA_DiceBenchAllocationCount++;
+}
+
+#if defined(__APPLE__)
+
+// libmalloc calls this (if set) on every allocation and deallocation; it is
+// what malloc stack logging uses.
+typedef void (SA_DiceBenchMallocLogger)(uint32_t type,
+										uintptr_t arg1,
+										uintptr_t arg2,
+										uintptr_t arg3,
+										uintptr_t result,
+										uint32_t numHotFramesToSkip);
+extern SA_DiceBenchMallocLogger *malloc_logger;
+
+#define MALLOC_LOG_TYPE_ALLOCATE	2
+
+static void SA_DiceBenchLogMalloc(uint32_t type,
+								  uintptr_t arg1,
+								  uintptr_t arg2,
+								  uintptr_t arg3,
+								  uintptr_t result,
+								  uint32_t numHotFramesToSkip) {
+	if (type & MALLOC_LOG_TYPE_ALLOCATE)
+		SA_DiceBenchCountAllocation();
+}
+
+static BOOL SA_DiceBenchStartCountingAllocations(void) {
+	SA_DiceBenchThread = pthread_self();
+	malloc_logger = SA_DiceBenchLogMalloc;
+	return YES;
+}
+
+#elif defined(__GLIBC__)
+
+// glibc’s allocator is reachable under these names, so malloc() and company
+// may be wrapped simply by defining them here.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) {
+	SA_DiceBenchCountAllocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	SA_DiceBenchCountAllocation();
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+	SA_DiceBenchCountAllocation();
+	return __libc_realloc(pointer, size);
+}
+
+static BOOL SA_DiceBenchStartCountingAllocations(void) {
+	SA_DiceBenchThread = pthread_self();
+	return YES;
+}
+
+#else
+
+static BOOL SA_DiceBenchStartCountingAllocations(void) {
+	return NO;
+}
+
+#endif
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+static uint64_t SA_DiceBenchCurrentTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t) now.tv_sec * 1000000000) + (uint64_t) now.tv_nsec;
+}
+
+static int SA_DiceBenchCompareLatencies(const void *a, const void *b) {
+	uint64_t left = *(const uint64_t *) a;
+	uint64_t right = *(const uint64_t *) b;
+	return (left > right) - (left < right);
+}
+
+// The given (sorted) latencies’ percentile, by the nearest-rank method.
+static uint64_t SA_DiceBenchPercentile(const uint64_t *latencies,
+									   NSUInteger count,
+									   double percentile) {
+	if (count == 0)
+		return 0;
+
+	NSUInteger rank = (NSUInteger) ceil(percentile * (double) count);
+	return latencies[MIN(MAX(rank, 1), count) - 1];
+}
+
+static void SA_DiceBenchPrintUsage(void) {
+	fprintf(stderr, "usage: sa_dice_bench [-n rounds] [-w rounds] [-o text|json] [-b baseline.json] [corpus]\n");
+}
+
+static NSString *SA_DiceBenchOperationName(SA_DiceBenchOperation operation) {
+	switch (operation) {
+		case SA_DiceBenchOperation_PARSE:
+			return @"parse";
+		case SA_DiceBenchOperation_EVALUATE:
+			return @"evaluate";
+		case SA_DiceBenchOperation_FORMAT:
+			return @"format";
+		case SA_DiceBenchOperation_END_TO_END:
+		default:
+			return @"end-to-end";
+	}
+}
+
+/********************/
+#pragma mark - Corpus
+/********************/
+
+// Appends a sum of ‘count’ copies of ‘term’ to the given array.
+static void SA_DiceBenchAddChainedSum(NSMutableArray <NSString *> *rollStrings,
+									  NSString *term,
+									  NSUInteger count) {
+	NSMutableString *rollString = [NSMutableString stringWithString:term];
+	for (NSUInteger i = 1; i < count; i++) {
+		[rollString appendString:((i % 3 == 2) ? @"-" : @"+")];
+		[rollString appendString:term];
+	}
+	[rollStrings addObject:rollString];
+}
+
+// The built-in corpus: category names, and their roll strings (in the order
+// in which the categories are to be reported).
+static void SA_DiceBenchDefaultCorpus(NSMutableArray <NSString *> *categories,
+									  NSMutableDictionary <NSString *, NSMutableArray <NSString *> *> *corpus) {
+	[categories addObjectsFromArray:@[ @"short", @"chained", @"nested", @"keep", @"exploding", @"fudge", @"error" ]];
+	for (NSString *category in categories)
+		corpus[category] = [NSMutableArray array];
+
+	[corpus[@"short"] addObjectsFromArray:@[ @"1d20", @"d20+5", @"2d6", @"3d6+2", @"1d100", @"4d6+2d4+3", @"1d8+1d6+4", @"10", @"2*1d4", @"1d20-2" ]];
+
+	SA_DiceBenchAddChainedSum(corpus[@"chained"], @"1d6", 16);
+	SA_DiceBenchAddChainedSum(corpus[@"chained"], @"2d8+3", 32);
+	SA_DiceBenchAddChainedSum(corpus[@"chained"], @"1d20", 64);
+	SA_DiceBenchAddChainedSum(corpus[@"chained"], @"7", 128);
+
+	[corpus[@"nested"] addObjectsFromArray:@[ @"4d4d4", @"4d4d4d4", @"1d6d6d6d6", @"2d4d6", @"1d20d20", @"3d4d4+2d4d4" ]];
+
+	[corpus[@"keep"] addObjectsFromArray:@[ @"4d6k3", @"2d20k1", @"2d20l1", @"10d10k5+10d10l5", @"8d6k3*2", @"4d6k3+4d6k3+4d6k3+4d6k3+4d6k3+4d6k3" ]];
+
+	[corpus[@"exploding"] addObjectsFromArray:@[ @"1e6", @"4e6", @"10e10", @"3e2", @"2e4+1d6", @"5e6k3" ]];
+
+	[corpus[@"fudge"] addObjectsFromArray:@[ @"4dF", @"4dF+2", @"10dF", @"4dF+4dF-4dF", @"1dF" ]];
+
+	[corpus[@"error"] addObjectsFromArray:@[ @"", @"d", @"4d", @"1d0", @"2d6k9", @"3++4", @"fish", @"1000000000d6", @"1d1000000000000", @"4d6k-1", @"9223372036854775807+1" ]];
+}
+
+// Reads a corpus file (see the usage notes above). Returns NO if the file
+// cannot be read.
+static BOOL SA_DiceBenchReadCorpus(NSString *path,
+								   NSMutableArray <NSString *> *categories,
+								   NSMutableDictionary <NSString *, NSMutableArray <NSString *> *> *corpus) {
+	NSString *contents = [NSString stringWithContentsOfFile:path
+												   encoding:NSUTF8StringEncoding
+													  error:NULL];
+	if (contents == nil)
+		return NO;
+
+	[contents enumerateLinesUsingBlock:^(NSString *line, BOOL *stop) {
+		NSString *rollString = line;
+		NSString *category = @"custom";
+		NSRange categoryDelimiterRange = [line rangeOfString:@";"];
+		if (categoryDelimiterRange.location != NSNotFound) {
+			rollString = [line substringToIndex:categoryDelimiterRange.location];
+			NSString *categoryString = [line substringFromIndex:NSMaxRange(categoryDelimiterRange)];
+			if (categoryString.length > 0)
+				category = categoryString;
+		}
+
+		if (corpus[category] == nil) {
+			[categories addObject:category];
+			corpus[category] = [NSMutableArray array];
+		}
+		[corpus[category] addObject:rollString];
+	}];
+
+	return YES;
+}
+
+/*************************/
+#pragma mark - Measurement
+/*************************/
+
+// Performs the given operation on each of the given roll strings, the given
+// number of times (after the given number of unmeasured rounds), and returns
+// the measurements.
+static SA_DiceBenchMeasurement SA_DiceBenchMeasure(SA_DiceBenchOperation operation,
+												   NSArray <NSString *> *rollStrings,
+												   NSUInteger roundCount,
+												   NSUInteger warmUpRoundCount,
+												   SA_DiceParser *parser,
+												   SA_DiceEvaluator *evaluator,
+												   SA_DiceFormatter *formatter) {
+	NSUInteger count = rollStrings.count;
+	NSUInteger operationCount = count * roundCount;
+
+	// The evaluation and formatting benchmarks start from expressions
+	// parsed in advance. (Evaluation does not modify its input, so the same
+	// expressions may be evaluated any number of times; formatting, however,
+	// gets a fresh result for each operation, since a result tree caches the
+	// views of its sub-expressions once they have been created.)
+	NSMutableArray <SA_DiceExpression *> *expressions = [NSMutableArray arrayWithCapacity:count];
+	for (NSString *rollString in rollStrings)
+		[expressions addObject:[parser expressionForString:rollString]];
+
+	uint64_t *latencies = malloc(MAX(operationCount, 1) * sizeof(uint64_t));
+	NSUInteger latencyCount = 0;
+	uint64_t totalLatency = 0;
+	uint64_t allocationCount = 0;
+
+	for (NSUInteger round = 0; round < warmUpRoundCount + roundCount; round++) {
+		BOOL measured = (round >= warmUpRoundCount);
+		@autoreleasepool {
+			for (NSUInteger i = 0; i < count; i++) {
+				SA_DiceExpression *result = ((operation == SA_DiceBenchOperation_FORMAT)
+											 ? [evaluator resultOfExpression:expressions[i]]
+											 : nil);
+
+				uint64_t allocationsBefore = SA_DiceBenchAllocationCount;
+				uint64_t startTime = SA_DiceBenchCurrentTime();
+				@autoreleasepool {
+					switch (operation) {
+						case SA_DiceBenchOperation_PARSE: {
+							[parser expressionForString:rollStrings[i]];
+							break;
+						}
+						case SA_DiceBenchOperation_EVALUATE: {
+							[evaluator resultOfExpression:expressions[i]];
+							break;
+						}
+						case SA_DiceBenchOperation_FORMAT: {
+							[formatter stringFromExpression:result];
+							result = nil;
+							break;
+						}
+						case SA_DiceBenchOperation_END_TO_END:
+						default: {
+							[formatter stringFromExpression:[evaluator resultOfExpression:[parser expressionForString:rollStrings[i]]]];
+							break;
+						}
+					}
+				}
+				uint64_t latency = SA_DiceBenchCurrentTime() - startTime;
+				uint64_t allocations = SA_DiceBenchAllocationCount - allocationsBefore;
+
+				if (measured) {
+					latencies[latencyCount++] = latency;
+					totalLatency += latency;
+					allocationCount += allocations;
+				}
+			}
+		}
+	}
+
+	qsort(latencies, latencyCount, sizeof(uint64_t), SA_DiceBenchCompareLatencies);
+
+	SA_DiceBenchMeasurement measurement = {
+		.operationCount = latencyCount,
+		.operationsPerSecond = ((totalLatency > 0) ? ((double) latencyCount / ((double) totalLatency / 1e9)) : 0.0),
+		.p50Latency = SA_DiceBenchPercentile(latencies, latencyCount, 0.5),
+		.p99Latency = SA_DiceBenchPercentile(latencies, latencyCount, 0.99),
+		.p999Latency = SA_DiceBenchPercentile(latencies, latencyCount, 0.999),
+		.allocationsPerOperation = ((latencyCount > 0) ? ((double) allocationCount / (double) latencyCount) : 0.0)
+	};
+
+	free(latencies);
+
+	return measurement;
+}
+
+/********************/
+#pragma mark - Output
+/********************/
+
+// The change from the baseline value to the given one, as a signed percentage
+// string (or blank, if there is no baseline value).
+static NSString *SA_DiceBenchChange(double value,
+									NSNumber *baselineValue) {
+	if (   baselineValue == nil
+		|| baselineValue.doubleValue == 0.0)
+		return @"";
+
+	return [NSString stringWithFormat:@"%+.1f%%", ((value / baselineValue.doubleValue) - 1.0) * 100.0];
+}
+
+static void SA_DiceBenchPrintText(NSArray <NSDictionary *> *benchmarks,
+								  NSDictionary <NSString *, NSDictionary *> *baseline) {
+	printf("%-24s %10s %12s %10s %10s %10s %10s",
+		   "benchmark", "ops", "ops/s", "p50 ns", "p99 ns", "p999 ns", "allocs/op");
+	if (baseline != nil)
+		printf(" %10s %10s", "Δ ops/s", "Δ p99");
+	printf("\n");
+
+	for (NSDictionary *benchmark in benchmarks) {
+		NSNumber *allocationsPerOperation = benchmark[@"allocationsPerOperation"];
+		printf("%-24s %10lu %12.0f %10llu %10llu %10llu %10s",
+			   [benchmark[@"name"] UTF8String],
+			   [benchmark[@"operationCount"] unsignedLongValue],
+			   [benchmark[@"operationsPerSecond"] doubleValue],
+			   [benchmark[@"p50Nanoseconds"] unsignedLongLongValue],
+			   [benchmark[@"p99Nanoseconds"] unsignedLongLongValue],
+			   [benchmark[@"p999Nanoseconds"] unsignedLongLongValue],
+			   ((allocationsPerOperation != (id) [NSNull null])
+				? [NSString stringWithFormat:@"%.1f", allocationsPerOperation.doubleValue].UTF8String
+				: "n/a"));
+		if (baseline != nil) {
+			NSDictionary *baselineBenchmark = baseline[benchmark[@"name"]];
+			printf(" %10s %10s",
+				   SA_DiceBenchChange([benchmark[@"operationsPerSecond"] doubleValue], baselineBenchmark[@"operationsPerSecond"]).UTF8String,
+				   SA_DiceBenchChange([benchmark[@"p99Nanoseconds"] doubleValue], baselineBenchmark[@"p99Nanoseconds"]).UTF8String);
+		}
+		printf("\n");
+	}
+}
+
+// Reads a previous run’s JSON output; returns its benchmarks, by name (or nil,
+// if the file cannot be read or is not such output).
+static NSDictionary <NSString *, NSDictionary *> *SA_DiceBenchReadBaseline(NSString *path) {
+	NSData *data = [NSData dataWithContentsOfFile:path];
+	if (data == nil)
+		return nil;
+
+	NSDictionary *output = [NSJSONSerialization JSONObjectWithData:data
+														   options:0
+															 error:NULL];
+	if (   ![output isKindOfClass:[NSDictionary class]]
+		|| ![output[@"benchmarks"] isKindOfClass:[NSArray class]])
+		return nil;
+
+	NSMutableDictionary *baseline = [NSMutableDictionary dictionary];
+	for (NSDictionary *benchmark in output[@"benchmarks"]) {
+		if (   [benchmark isKindOfClass:[NSDictionary class]]
+			&& [benchmark[@"name"] isKindOfClass:[NSString class]])
+			baseline[benchmark[@"name"]] = benchmark;
+	}
+
+	return baseline;
+}
+
+/******************/
+#pragma mark - Main
+/******************/
+
+int main(int argc, char * const argv[]) {
+	@autoreleasepool {
+		NSUInteger roundCount = DEFAULT_ROUND_COUNT;
+		NSUInteger warmUpRoundCount = DEFAULT_WARM_UP_ROUND_COUNT;
+		SA_DiceBenchOutputFormat outputFormat = SA_DiceBenchOutputFormat_TEXT;
+		NSString *baselinePath = nil;
+
+		int option;
+		while ((option = getopt(argc, argv, "n:w:o:b:")) != -1) {
+			switch (option) {
+				case 'n':
+					roundCount = (NSUInteger) MAX(atol(optarg), 1);
+					break;
+				case 'w':
+					warmUpRoundCount = (NSUInteger) MAX(atol(optarg), 0);
+					break;
+				case 'o':
+					if (strcmp(optarg, "text") == 0) {
+						outputFormat = SA_DiceBenchOutputFormat_TEXT;
+					} else if (strcmp(optarg, "json") == 0) {
+						outputFormat = SA_DiceBenchOutputFormat_JSON;
+					} else {
+						SA_DiceBenchPrintUsage();
+						return 1;
+					}
+					break;
+				case 'b':
+					baselinePath = @(optarg);
+					break;
+				default:
+					SA_DiceBenchPrintUsage();
+					return 1;
+			}
+		}
+
+		NSMutableArray <NSString *> *categories = [NSMutableArray array];
+		NSMutableDictionary <NSString *, NSMutableArray <NSString *> *> *corpus = [NSMutableDictionary dictionary];
+		if (optind < argc) {
+			if (!SA_DiceBenchReadCorpus(@(argv[optind]), categories, corpus)) {
+				fprintf(stderr, "%s: cannot read corpus\n", argv[optind]);
+				return 1;
+			}
+		} else {
+			SA_DiceBenchDefaultCorpus(categories, corpus);
+		}
+
+		NSDictionary <NSString *, NSDictionary *> *baseline = nil;
+		if (baselinePath != nil) {
+			baseline = SA_DiceBenchReadBaseline(baselinePath);
+			if (baseline == nil) {
+				fprintf(stderr, "%s: cannot read baseline\n", baselinePath.UTF8String);
+				return 1;
+			}
+		}
+
+		NSMutableArray <NSString *> *allRollStrings = [NSMutableArray array];
+		for (NSString *category in categories)
+			[allRollStrings addObjectsFromArray:corpus[category]];
+
+		SA_DiceParser *parser = [SA_DiceParser parserWithBehavior:SA_DiceParserBehaviorLegacy];
+		SA_DiceEvaluator *evaluator = [SA_DiceEvaluator new];
+		SA_DiceFormatter *formatter = [SA_DiceFormatter formatterWithBehavior:SA_DiceFormatterBehaviorLegacy];
+
+		BOOL countingAllocations = SA_DiceBenchStartCountingAllocations();
+
+		NSMutableArray <NSDictionary *> *benchmarks = [NSMutableArray array];
+		for (SA_DiceBenchOperation operation = SA_DiceBenchOperation_PARSE; operation <= SA_DiceBenchOperation_END_TO_END; operation++) {
+			for (NSUInteger i = 0; i <= categories.count; i++) {
+				NSString *category = (i < categories.count) ? categories[i] : @"all";
+				NSArray <NSString *> *rollStrings = (i < categories.count) ? corpus[category] : allRollStrings;
+
+				SA_DiceBenchMeasurement measurement = SA_DiceBenchMeasure(operation, rollStrings, roundCount, warmUpRoundCount,
+																		  parser, evaluator, formatter);
+
+				[benchmarks addObject:@{
+					@"name"						: [NSString stringWithFormat:@"%@/%@", SA_DiceBenchOperationName(operation), category],
+					@"operation"				: SA_DiceBenchOperationName(operation),
+					@"category"					: category,
+					@"operationCount"			: @(measurement.operationCount),
+					@"operationsPerSecond"		: @(measurement.operationsPerSecond),
+					@"p50Nanoseconds"			: @(measurement.p50Latency),
+					@"p99Nanoseconds"			: @(measurement.p99Latency),
+					@"p999Nanoseconds"			: @(measurement.p999Latency),
+					@"allocationsPerOperation"	: (countingAllocations
+												   ? (id) @(measurement.allocationsPerOperation)
+												   : (id) [NSNull null])
+				}];
+			}
+		}
+
+		if (outputFormat == SA_DiceBenchOutputFormat_JSON) {
+			NSDictionary *output = @{
+				@"formatVersion"	: @(OUTPUT_FORMAT_VERSION),
+				@"date"				: [[NSISO8601DateFormatter new] stringFromDate:[NSDate date]],
+				@"roundCount"		: @(roundCount),
+				@"warmUpRoundCount"	: @(warmUpRoundCount),
+				@"benchmarks"		: benchmarks
+			};
+			NSData *data = [NSJSONSerialization dataWithJSONObject:output
+														   options:(NSJSONWritingPrettyPrinted | NSJSONWritingSortedKeys)
+															 error:NULL];
+			fwrite(data.bytes, 1, data.length, stdout);
+			fputc('\n', stdout);
+		} else {
+			SA_DiceBenchPrintText(benchmarks, baseline);
+		}
+	}
+
+	return 0;
+}
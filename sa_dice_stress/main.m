@@ -0,0 +1,355 @@
+//
+//  main.m
+//  sa_dice_stress
+//
+//  Copyright 2016-2021 Said Achmiz.
+//  See LICENSE and README.md for more info.
+
+/*
+ sa_dice_stress checks that one evaluator, shared by many threads, gives
+ correct results, and keeps to its limits, while those limits are changed
+ under it.
+
+ USAGE:
+	sa_dice_stress [-j threads] [-n evaluations]
+
+ -j		The number of evaluating threads. The default is one per active core
+		(and at least 4).
+ -n		The number of evaluations per thread. The default is 2000.
+
+ The evaluating threads all evaluate roll strings of a built-in corpus (each
+ compiled once, and shared), with one evaluator; meanwhile, another thread
+ keeps switching the evaluator among a set of configurations (of maxDieCount,
+ maxCost, and sumsOnly). The evaluator is auditing (see
+ -[SA_DiceEvaluator startAuditingWithKey:handler:]), so that the position of
+ the generator at the start of each evaluation is known.
+
+ An evaluation is checked if the configuration did not change while it ran
+ (so that the limits that applied when it began are known). For each checked
+ evaluation:
+
+ 1. It must have failed with SA_DiceExpressionError_COST_EXCESSIVE if, and
+ only if, the cost estimator (with the same limits) says that its worst-case
+ cost exceeds maxCost.
+
+ 2. Each roll command (whose die count and die size are valid) must have
+ failed with SA_DiceExpressionError_DIE_COUNT_EXCESSIVE if, and only if, its
+ die count exceeds maxDieCount.
+
+ 3. Each roll command with a result (other than one whose rolls are kept or
+ dropped by a roll modifier) must have rolls if, and only if, sumsOnly is
+ off.
+
+ 4. Once all the threads are done, it is replayed (on one thread, with
+ another evaluator, configured as it was), and the replay must format
+ exactly as it did.
+
+ The number of evaluations, of checked evaluations, and of failures are
+ written to standard output (failures are described as they are found);
+ the exit status is 1 if there were any failures, or if no evaluation could
+ be checked.
+
+ Build by compiling this file together with the library’s sources, e.g.:
+	clang -fobjc-arc -framework Foundation -I.. ../*.m main.m -o sa_dice_stress
+ */
+
+#import <Foundation/Foundation.h>
+
+#import "SA_DiceCostEstimator.h"
+#import "SA_DiceEvaluator.h"
+#import "SA_DiceExpression.h"
+#import "SA_DiceFormatter.h"
+#import "SA_DiceParser.h"
+#import "SA_DiceProgram.h"
+
+#import <stdatomic.h>
+#import <stdio.h>
+#import <unistd.h>
+
+/**************************/
+#pragma mark Defined values
+/**************************/
+
+#define DEFAULT_EVALUATION_COUNT	2000
+#define MIN_DEFAULT_THREAD_COUNT	4
+
+// How long the configuration stays the same between switches (in
+// microseconds).
+#define CONFIGURATION_INTERVAL		200
+
+/*************************/
+#pragma mark - Definitions
+/*************************/
+
+typedef struct {
+	NSUInteger maxDieCount;
+	NSUInteger maxCost;
+	BOOL sumsOnly;
+} SA_DiceStressConfiguration;
+
+static const SA_DiceStressConfiguration SA_DiceStressConfigurations[] = {
+	{ 1000, 1000000, NO },
+	{ 50, 1000000, NO },
+	{ 1000, 300, NO },
+	{ 1000, 1000000, YES },
+	{ 50, 300, YES }
+};
+
+#define CONFIGURATION_COUNT (sizeof(SA_DiceStressConfigurations) / sizeof(SA_DiceStressConfiguration))
+
+/***************************************************/
+#pragma mark - SA_DiceStressRecord class declaration
+/***************************************************/
+
+// A checked evaluation, kept to be replayed.
+@interface SA_DiceStressRecord : NSObject
+
+@property NSUInteger programIndex;
+@property NSUInteger configurationIndex;
+@property SA_DiceRNGPosition position;
+@property NSString *output;
+
+@end
+
+@implementation SA_DiceStressRecord
+@end
+
+/**************************/
+#pragma mark - Shared state
+/**************************/
+
+// Incremented (to an odd number) before the configuration is switched, and
+// again (to an even number) after; an evaluation that sees the same even
+// number before and after it ran ran entirely under one configuration.
+static _Atomic(uint64_t) SA_DiceStressConfigurationSequence = 0;
+static _Atomic(NSUInteger) SA_DiceStressConfigurationIndex = 0;
+
+static _Atomic(NSUInteger) SA_DiceStressFailureCount = 0;
+
+// Set once all the evaluating threads are done.
+static atomic_bool SA_DiceStressDone = NO;
+
+// Set by the audit handler (which is called on the evaluating thread, before
+// the evaluation returns).
+static _Thread_local SA_DiceRNGPosition SA_DiceStressAuditPosition;
+
+/***********************/
+#pragma mark - Functions
+/***********************/
+
+static void SA_DiceStressPrintUsage(void) {
+	fprintf(stderr, "usage: sa_dice_stress [-j threads] [-n evaluations]\n");
+}
+
+static void SA_DiceStressFail(NSString *rollString,
+							  NSString *problem) {
+	atomic_fetch_add(&SA_DiceStressFailureCount, 1);
+	printf("FAIL: “%s”: %s\n", rollString.UTF8String, problem.UTF8String);
+}
+
+static void SA_DiceStressConfigure(SA_DiceEvaluator *evaluator,
+								   const SA_DiceStressConfiguration *configuration) {
+	evaluator.maxDieCount = configuration->maxDieCount;
+	evaluator.maxCost = configuration->maxCost;
+	evaluator.sumsOnly = configuration->sumsOnly;
+}
+
+// Checks the limits (see above) at the given node of a result tree, and its
+// sub-expressions; returns a description of the first problem found, or nil.
+static NSString *SA_DiceStressCheckNode(SA_DiceExpression *node,
+										const SA_DiceStressConfiguration *configuration,
+										BOOL rollsKept) {
+	if (node == nil)
+		return nil;
+
+	BOOL modifier = (node.type == SA_DiceExpressionTerm_ROLL_MODIFIER);
+	NSString *problem = (SA_DiceStressCheckNode(node.leftOperand, configuration, modifier)
+						 ?: SA_DiceStressCheckNode(node.rightOperand, configuration, modifier)
+						 ?: SA_DiceStressCheckNode(node.dieCount, configuration, NO)
+						 ?: SA_DiceStressCheckNode(node.dieSize, configuration, NO));
+	if (problem != nil)
+		return problem;
+
+	if (node.type != SA_DiceExpressionTerm_ROLL_COMMAND)
+		return nil;
+
+	SA_DiceExpression *dieCount = node.dieCount;
+	if (   dieCount.result != nil
+		&& dieCount.errorBitMask == 0
+		&& node.dieSize.errorBitMask == 0) {
+		BOOL excessive = (dieCount.result.integerValue > (NSInteger) configuration->maxDieCount);
+		BOOL failed = ((node.errorBitMask & SA_DiceExpressionError_DIE_COUNT_EXCESSIVE) != 0);
+		if (excessive != failed)
+			return [NSString stringWithFormat:@"%@ rolls %ld dice, with maxDieCount %lu, but %@",
+					node.inputString,
+					(long) dieCount.result.integerValue,
+					(unsigned long) configuration->maxDieCount,
+					(failed ? @"failed" : @"did not fail")];
+	}
+
+	if (   node.result != nil
+		&& !rollsKept
+		&& ((node.rolls != nil) == configuration->sumsOnly))
+		return [NSString stringWithFormat:@"%@ %@ rolls, with sumsOnly %@",
+				node.inputString,
+				((node.rolls != nil) ? @"has" : @"has no"),
+				(configuration->sumsOnly ? @"on" : @"off")];
+
+	return nil;
+}
+
+/******************/
+#pragma mark - Main
+/******************/
+
+int main(int argc, char * const argv[]) {
+	@autoreleasepool {
+		NSUInteger threadCount = MAX(NSProcessInfo.processInfo.activeProcessorCount, MIN_DEFAULT_THREAD_COUNT);
+		NSUInteger evaluationCount = DEFAULT_EVALUATION_COUNT;
+
+		int option;
+		while ((option = getopt(argc, argv, "j:n:")) != -1) {
+			switch (option) {
+				case 'j':
+					threadCount = (NSUInteger) MAX(atol(optarg), 1);
+					break;
+				case 'n':
+					evaluationCount = (NSUInteger) MAX(atol(optarg), 1);
+					break;
+				default:
+					SA_DiceStressPrintUsage();
+					return 1;
+			}
+		}
+
+		// Roll strings near each of the limits: some exceed maxDieCount (in
+		// some configurations), and some exceed maxCost; and some keep rolls,
+		// explode, nest, or roll Fudge dice.
+		NSArray <NSString *> *corpus = @[ @"1d20+5", @"4d6k3", @"20d6", @"60d6", @"200d6", @"100d10", @"3e6", @"4d4d4", @"40d6k10+2d20l1", @"8dF", @"2d6*10-3", @"1d6d6d6" ];
+
+		SA_DiceParser *parser = [SA_DiceParser parserWithBehavior:SA_DiceParserBehaviorLegacy];
+		SA_DiceFormatter *formatter = [SA_DiceFormatter formatterWithBehavior:SA_DiceFormatterBehaviorLegacy];
+
+		// The programs, and whether each should fail for its cost under each
+		// configuration.
+		NSMutableArray <SA_DiceProgram *> *programs = [NSMutableArray arrayWithCapacity:corpus.count];
+		BOOL *costExcessive = calloc(corpus.count * CONFIGURATION_COUNT, sizeof(BOOL));
+		SA_DiceCostEstimator *estimator = [SA_DiceCostEstimator new];
+		for (NSUInteger i = 0; i < corpus.count; i++) {
+			SA_DiceExpression *expression = [parser expressionForString:corpus[i]];
+			SA_DiceProgram *program = [[SA_DiceProgram alloc] initWithExpression:expression];
+			[programs addObject:program];
+
+			for (NSUInteger j = 0; j < CONFIGURATION_COUNT; j++) {
+				estimator.maxDieCount = SA_DiceStressConfigurations[j].maxDieCount;
+				estimator.sumsOnly = SA_DiceStressConfigurations[j].sumsOnly;
+				costExcessive[(i * CONFIGURATION_COUNT) + j] = (   !program.isConstant
+																&& ![estimator isExpression:expression
+																			   withinBudget:SA_DiceStressConfigurations[j].maxCost]);
+			}
+		}
+
+		SA_DiceEvaluator *evaluator = [SA_DiceEvaluator new];
+		SA_DiceStressConfigure(evaluator, &SA_DiceStressConfigurations[0]);
+		[evaluator startAuditingWithKey:SA_DiceRNGSystemEntropySeed()
+								handler:^(NSString *inputString, SA_DiceRNGPosition position) {
+			SA_DiceStressAuditPosition = position;
+		}];
+
+		// The configuration switcher.
+		dispatch_semaphore_t switcherDone = dispatch_semaphore_create(0);
+		NSThread *switcher = [[NSThread alloc] initWithBlock:^{
+			NSUInteger index = 0;
+			while (!atomic_load(&SA_DiceStressDone)) {
+				index = (index + 1) % CONFIGURATION_COUNT;
+				atomic_fetch_add(&SA_DiceStressConfigurationSequence, 1);
+				SA_DiceStressConfigure(evaluator, &SA_DiceStressConfigurations[index]);
+				atomic_store(&SA_DiceStressConfigurationIndex, index);
+				atomic_fetch_add(&SA_DiceStressConfigurationSequence, 1);
+				usleep(CONFIGURATION_INTERVAL);
+			}
+			dispatch_semaphore_signal(switcherDone);
+		}];
+		[switcher start];
+
+		// The evaluating threads.
+		NSMutableArray <NSMutableArray <SA_DiceStressRecord *> *> *records = [NSMutableArray arrayWithCapacity:threadCount];
+		dispatch_semaphore_t workersDone = dispatch_semaphore_create(0);
+		for (NSUInteger t = 0; t < threadCount; t++) {
+			NSMutableArray <SA_DiceStressRecord *> *threadRecords = [NSMutableArray arrayWithCapacity:evaluationCount];
+			[records addObject:threadRecords];
+
+			NSThread *worker = [[NSThread alloc] initWithBlock:^{
+				for (NSUInteger i = 0; i < evaluationCount; i++) {
+					@autoreleasepool {
+						NSUInteger programIndex = (t + i) % programs.count;
+
+						uint64_t sequence = atomic_load(&SA_DiceStressConfigurationSequence);
+						NSUInteger configurationIndex = atomic_load(&SA_DiceStressConfigurationIndex);
+						SA_DiceExpression *result = [evaluator resultOfProgram:programs[programIndex]];
+						if (   sequence % 2 != 0
+							|| atomic_load(&SA_DiceStressConfigurationSequence) != sequence)
+							continue;
+
+						NSString *rollString = corpus[programIndex];
+						const SA_DiceStressConfiguration *configuration = &SA_DiceStressConfigurations[configurationIndex];
+
+						BOOL expectedCostExcessive = costExcessive[(programIndex * CONFIGURATION_COUNT) + configurationIndex];
+						BOOL failedForCost = ((result.errorBitMask & SA_DiceExpressionError_COST_EXCESSIVE) != 0);
+						if (failedForCost != expectedCostExcessive) {
+							SA_DiceStressFail(rollString, [NSString stringWithFormat:@"with maxCost %lu, %@ for its cost",
+														   (unsigned long) configuration->maxCost,
+														   (failedForCost ? @"failed" : @"did not fail")]);
+						} else if (!failedForCost) {
+							NSString *problem = SA_DiceStressCheckNode(result, configuration, NO);
+							if (problem != nil)
+								SA_DiceStressFail(rollString, problem);
+						}
+
+						SA_DiceStressRecord *record = [SA_DiceStressRecord new];
+						record.programIndex = programIndex;
+						record.configurationIndex = configurationIndex;
+						record.position = SA_DiceStressAuditPosition;
+						record.output = [formatter stringFromExpression:result];
+						[threadRecords addObject:record];
+					}
+				}
+				dispatch_semaphore_signal(workersDone);
+			}];
+			[worker start];
+		}
+
+		for (NSUInteger t = 0; t < threadCount; t++)
+			dispatch_semaphore_wait(workersDone, DISPATCH_TIME_FOREVER);
+		atomic_store(&SA_DiceStressDone, YES);
+		dispatch_semaphore_wait(switcherDone, DISPATCH_TIME_FOREVER);
+
+		// Replay every checked evaluation, on this thread alone.
+		SA_DiceEvaluator *replayEvaluator = [SA_DiceEvaluator new];
+		NSUInteger checkedCount = 0;
+		for (NSArray <SA_DiceStressRecord *> *threadRecords in records) {
+			for (SA_DiceStressRecord *record in threadRecords) {
+				@autoreleasepool {
+					checkedCount++;
+					SA_DiceStressConfigure(replayEvaluator, &SA_DiceStressConfigurations[record.configurationIndex]);
+					SA_DiceExpression *replay = [replayEvaluator replayResultOfProgram:programs[record.programIndex]
+																		  fromPosition:record.position];
+					NSString *output = [formatter stringFromExpression:replay];
+					if (![output isEqualToString:record.output])
+						SA_DiceStressFail(corpus[record.programIndex], [NSString stringWithFormat:@"gave “%@”, but replayed as “%@”", record.output, output]);
+				}
+			}
+		}
+
+		free(costExcessive);
+
+		NSUInteger failureCount = atomic_load(&SA_DiceStressFailureCount);
+		printf("%lu evaluations on %lu threads (%lu checked), %lu failures\n",
+			   (unsigned long) (threadCount * evaluationCount),
+			   (unsigned long) threadCount,
+			   (unsigned long) checkedCount,
+			   (unsigned long) failureCount);
+
+		return (failureCount > 0 || checkedCount == 0) ? 1 : 0;
+	}
+}